@@ -0,0 +1,502 @@
+/*
+ * Driver benchmark on the simulated chip.
+ *
+ * Runs standard workloads through the public API and prints one JSON object per
+ * workload with bus bytes, transactions, transport calls, delay time and simulated latency.
+ *
+ * Build: cc -O2 -I. -Isim w25qxx.c w25qxx_array.c sim/w25q_sim.c bench/w25q_bench.c -o w25q_bench
+ * Usage: ./w25q_bench [-m MODEL|all] [-c BUS_HZ] [-s] [-k] [-o CALL_NS]
+ *        -s uses the scatter-gather transport instead of the plain transfer function
+ *        -k sends Write Enable and the following command with one chain call
+ *        -o charges CALL_NS of host time to every transport call
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "w25qxx_array.h"
+#include "w25q_sim.h"
+
+static const char *model_names[] = {
+    "W25Q10", "W25Q20", "W25Q40", "W25Q80", "W25Q16",
+    "W25Q32", "W25Q64", "W25Q128", "W25Q256", "W25Q512"
+};
+
+struct bench_ctx {
+    struct w25q_sim sim;
+    struct w25q_flash flash;
+    const struct w25q_sim_port *port;
+    const char *model;
+    unsigned long long t0;
+    unsigned long long delay_calls0;
+    unsigned long long delay_ns0;
+    struct w25q_sim_stats stats0;
+};
+
+static unsigned char buf[4096];
+static unsigned rng_state = 12345;
+static unsigned long call_ns;           // -o: host time per transport call
+static int use_chain;                   // -k: chain Write Enable with the command
+
+static unsigned bench_rand(void) {
+    rng_state = rng_state * 1103515245u + 12345u;
+    return rng_state >> 8;
+}
+
+static void bench_begin(struct bench_ctx *ctx) {
+
+    ctx->t0 = w25q_sim_now_ns();
+    w25q_sim_delay_stats(&ctx->delay_calls0, &ctx->delay_ns0);
+    ctx->stats0 = ctx->sim.stats;
+
+}
+
+static void bench_end(struct bench_ctx *ctx, const char *workload, unsigned ops, unsigned long payload) {
+
+    unsigned long long calls, ns;
+    unsigned long long elapsed = w25q_sim_now_ns() - ctx->t0;
+
+    w25q_sim_delay_stats(&calls, &ns);
+    printf("{\"model\":\"%s\",\"workload\":\"%s\",\"ops\":%u,\"payload_bytes\":%lu,"
+           "\"bus_bytes\":%llu,\"transactions\":%llu,\"spi_calls\":%llu,\"busy_polls\":%llu,"
+           "\"delay_calls\":%llu,\"delay_us\":%.3f,\"sim_us\":%.3f,\"us_per_op\":%.3f}\n",
+           ctx->model, workload, ops, payload,
+           ctx->sim.stats.bus_bytes - ctx->stats0.bus_bytes,
+           ctx->sim.stats.transfers - ctx->stats0.transfers,
+           ctx->sim.stats.calls - ctx->stats0.calls,
+           ctx->sim.stats.busy_polls - ctx->stats0.busy_polls,
+           calls - ctx->delay_calls0, (ns - ctx->delay_ns0) / 1e3,
+           elapsed / 1e3, ops ? elapsed / 1e3 / ops : 0.0);
+
+}
+
+/* Workloads */
+
+static void bench_seq_read(struct bench_ctx *ctx) {
+
+    const unsigned ops = 256;
+
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        w25q_read(&ctx->flash, i * 256, buf, 256);
+    }
+    bench_end(ctx, "seq_read", ops, ops * 256UL);
+
+}
+
+static void bench_read_modes(struct bench_ctx *ctx) {
+
+    static const char *names[] = {"seq_read_standard", "seq_read_fast", "seq_read_dual_output",
+                                  "seq_read_quad_output", "seq_read_quad_io"};
+    const unsigned ops = 256;
+
+    w25q_set_xfer(&ctx->flash, ctx->port->xfer);
+    for (int mode = W25Q_READ_MODE_STANDARD; mode <= W25Q_READ_MODE_QUAD_IO; mode++) {
+        if (!w25q_set_read_mode(&ctx->flash, (enum w25q_read_mode_t)mode)) {
+            fprintf(stderr, "%s: cannot select %s\n", ctx->model, names[mode]);
+            continue;
+        }
+        bench_begin(ctx);
+        for (unsigned i = 0; i < ops; i++) {
+            w25q_read(&ctx->flash, i * 256, buf, 256);
+        }
+        bench_end(ctx, names[mode], ops, ops * 256UL);
+    }
+    w25q_set_read_mode(&ctx->flash, W25Q_READ_MODE_STANDARD);
+    w25q_set_xfer(&ctx->flash, NULL);
+
+}
+
+static void bench_rand_read(struct bench_ctx *ctx) {
+
+    const unsigned ops = 256;
+    unsigned long bytes = (unsigned long)ctx->flash.size * 256;
+
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        unsigned address = bench_rand() % (bytes - 64);
+        w25q_read(&ctx->flash, address, buf, 64);
+    }
+    bench_end(ctx, "rand_read", ops, ops * 64UL);
+
+}
+
+static void bench_cached_read(struct bench_ctx *ctx) {
+
+    static unsigned long arena[16 * (256 + sizeof(unsigned long) + 1) / sizeof(unsigned long) + 1];
+    const unsigned ops = 256;
+
+    // Config/index style access: a few hot pages read over and over
+    w25q_cache_attach(&ctx->flash, arena, sizeof(arena), 256);
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        w25q_read(&ctx->flash, (bench_rand() % 8) * 256 + 16, buf, 64);
+    }
+    bench_end(ctx, "cached_read", ops, ops * 64UL);
+    w25q_cache_detach(&ctx->flash);
+
+}
+
+static void bench_small_write(struct bench_ctx *ctx) {
+
+    const unsigned ops = 32 * 16;
+    char data[10] = "forkbomb";
+
+    w25q_erase(&ctx->flash, 0, 4096);
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        w25q_write(&ctx->flash, i * 8, data, 8);
+    }
+    bench_end(ctx, "small_write", ops, ops * 8UL);
+
+}
+
+static void bench_small_write_buffered(struct bench_ctx *ctx) {
+
+    static struct w25q_write_buffer wbuf;
+    const unsigned ops = 32 * 16;
+    char data[10] = "forkbomb";
+
+    w25q_erase(&ctx->flash, 0, 4096);
+    w25q_set_write_buffer(&ctx->flash, &wbuf, 0, 0);
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        w25q_write(&ctx->flash, i * 8, data, 8);
+    }
+    w25q_flush(&ctx->flash);
+    bench_end(ctx, "small_write_buffered", ops, ops * 8UL);
+    w25q_set_write_buffer(&ctx->flash, NULL, 0, 0);
+
+}
+
+static void bench_page_write(struct bench_ctx *ctx) {
+
+    const unsigned ops = 16;
+
+    for (unsigned i = 0; i < 256; i++) {
+        buf[i] = (unsigned char)i;
+    }
+    w25q_erase(&ctx->flash, 4096, 8192);
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        w25q_write(&ctx->flash, 4096 + i * 256, buf, 256);
+    }
+    bench_end(ctx, "page_write", ops, ops * 256UL);
+
+}
+
+static void bench_update(struct bench_ctx *ctx) {
+
+    static unsigned char sector[4096];
+    const unsigned ops = 16;
+    unsigned char record[10];
+
+    // A config record whose flags are cleared one by one
+    memset(record, 0xff, sizeof(record));
+    w25q_erase(&ctx->flash, 8192, 12288);
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        record[i / 8] &= ~(1u << (i % 8));
+        w25q_update(&ctx->flash, 8192 + 100, record, sizeof(record), sector);
+    }
+    bench_end(ctx, "update_clear_bits", ops, ops * sizeof(record));
+
+}
+
+static void bench_range_erase(struct bench_ctx *ctx) {
+
+    unsigned long end = 65536UL * 2;
+    unsigned long bytes = (unsigned long)ctx->flash.size * 256;
+
+    if (end > bytes) {
+        end = bytes;
+    }
+    bench_begin(ctx);
+    w25q_erase(&ctx->flash, 0, end);
+    bench_end(ctx, "range_erase", 1, end);
+
+}
+
+static void bench_range_erase_skip_blank(struct bench_ctx *ctx) {
+
+    unsigned long end = 65536UL * 2;
+    unsigned long bytes = (unsigned long)ctx->flash.size * 256;
+
+    if (end > bytes) {
+        end = bytes;
+    }
+    // Re-erasing the range just erased: only blank checks are left
+    w25q_set_erase_skip_blank(&ctx->flash, 1);
+    bench_begin(ctx);
+    w25q_erase(&ctx->flash, 0, end);
+    bench_end(ctx, "range_erase_skip_blank", 1, end);
+    w25q_set_erase_skip_blank(&ctx->flash, 0);
+
+}
+
+static void bench_async_erase(struct bench_ctx *ctx) {
+
+    unsigned polls = 0;
+
+    // The application does 100us of work between two polls
+    w25q_set_clock(&ctx->flash, ctx->port->clock);
+    bench_begin(ctx);
+    if (w25q_submit_erase(&ctx->flash, 0, 65536, NULL, NULL)) {
+        while (w25q_poll(&ctx->flash)) {
+            ctx->port->delay_us(100);
+            polls++;
+        }
+    }
+    bench_end(ctx, "async_range_erase", polls, 65536);
+    w25q_set_clock(&ctx->flash, NULL);
+
+}
+
+static void bench_read_during_erase(struct bench_ctx *ctx) {
+
+    const unsigned ops = 16;
+
+    // Latency of reads issued while a sector erase runs in the background
+    w25q_set_read_priority(&ctx->flash, W25Q_READ_PRIORITY_HIGH);
+    w25q_submit_erase(&ctx->flash, 0, 4096, NULL, NULL);
+    bench_begin(ctx);
+    for (unsigned i = 0; i < ops; i++) {
+        w25q_read(&ctx->flash, 65536 + i * 256, buf, 256);
+    }
+    bench_end(ctx, "read_during_erase", ops, ops * 256UL);
+    while (w25q_poll(&ctx->flash)) {
+        ctx->port->delay_us(100);
+    }
+    w25q_set_read_priority(&ctx->flash, W25Q_READ_PRIORITY_NORMAL);
+
+}
+
+static void bench_erase_all(struct bench_ctx *ctx) {
+
+    bench_begin(ctx);
+    w25q_erase_all(&ctx->flash);
+    bench_end(ctx, "erase_all", 1, (unsigned long)ctx->flash.size * 256);
+
+}
+
+/* Striped arrays of 1, 2 and 4 chips of the same model */
+
+struct bench_array_ctx {
+    struct w25q_sim sim[4];
+    struct w25q_flash flash[4];
+    struct w25q_array array;
+    char model[16];
+    unsigned long long t0;
+    unsigned long long delay_calls0;
+    unsigned long long delay_ns0;
+    struct w25q_sim_stats stats0;
+};
+
+static struct w25q_sim_stats bench_array_stats(struct bench_array_ctx *ctx) {
+
+    struct w25q_sim_stats sum;
+
+    memset(&sum, 0, sizeof(sum));
+    for (unsigned i = 0; i < ctx->array.count; i++) {
+        sum.bus_bytes += ctx->sim[i].stats.bus_bytes;
+        sum.transfers += ctx->sim[i].stats.transfers;
+        sum.calls += ctx->sim[i].stats.calls;
+        sum.busy_polls += ctx->sim[i].stats.busy_polls;
+    }
+    return sum;
+
+}
+
+static void bench_array_begin(struct bench_array_ctx *ctx) {
+
+    ctx->t0 = w25q_sim_now_ns();
+    w25q_sim_delay_stats(&ctx->delay_calls0, &ctx->delay_ns0);
+    ctx->stats0 = bench_array_stats(ctx);
+
+}
+
+static void bench_array_end(struct bench_array_ctx *ctx, const char *workload, unsigned ops, unsigned long payload) {
+
+    unsigned long long calls, ns;
+    unsigned long long elapsed = w25q_sim_now_ns() - ctx->t0;
+    struct w25q_sim_stats stats = bench_array_stats(ctx);
+
+    w25q_sim_delay_stats(&calls, &ns);
+    printf("{\"model\":\"%s\",\"workload\":\"%s\",\"ops\":%u,\"payload_bytes\":%lu,"
+           "\"bus_bytes\":%llu,\"transactions\":%llu,\"spi_calls\":%llu,\"busy_polls\":%llu,"
+           "\"delay_calls\":%llu,\"delay_us\":%.3f,\"sim_us\":%.3f,\"us_per_op\":%.3f}\n",
+           ctx->model, workload, ops, payload,
+           stats.bus_bytes - ctx->stats0.bus_bytes,
+           stats.transfers - ctx->stats0.transfers,
+           stats.calls - ctx->stats0.calls,
+           stats.busy_polls - ctx->stats0.busy_polls,
+           calls - ctx->delay_calls0, (ns - ctx->delay_ns0) / 1e3,
+           elapsed / 1e3, ops ? elapsed / 1e3 / ops : 0.0);
+
+}
+
+static int bench_array(enum w25q_id_t model, unsigned long bus_hz, unsigned count) {
+
+    static struct bench_array_ctx ctx;
+    struct w25q_flash *chips[4];
+    const unsigned pages = 256;
+    unsigned created = 0;
+    unsigned long erase_size;
+    int ret = 1;
+
+    snprintf(ctx.model, sizeof(ctx.model), "%sx%u", model_names[model - W25Q10_ID], count);
+    for (; created < count; created++) {
+        const struct w25q_sim_port *port;
+
+        if (!w25q_sim_init(&ctx.sim[created], model, NULL)) {
+            goto out;
+        }
+        w25q_sim_set_bus_clock(&ctx.sim[created], bus_hz);
+        ctx.sim[created].call_ns = call_ns;
+        port = w25q_sim_attach(&ctx.sim[created], created);
+        if (w25q_mount(&ctx.flash[created], port->spi_send, port->delay) == NULL) {
+            created++;
+            goto out;
+        }
+        w25q_set_delay_us(&ctx.flash[created], port->delay_us);
+        w25q_set_clock(&ctx.flash[created], port->clock);
+        if (use_chain) {
+            w25q_set_spi_chain(&ctx.flash[created], port->spi_chain);
+        }
+        chips[created] = &ctx.flash[created];
+    }
+
+    // Page stripes for writes: consecutive pages go to different chips
+    if (!w25q_array_init(&ctx.array, chips, count, 256)) {
+        goto out;
+    }
+    memset(buf, 0x5a, sizeof(buf));
+    bench_array_begin(&ctx);
+    for (unsigned i = 0; i < pages; i += 16) {
+        if (!w25q_array_write(&ctx.array, i * 256, buf, 4096)) {
+            goto out;
+        }
+    }
+    bench_array_end(&ctx, "array_page_write", pages, pages * 256UL);
+
+    // Sector stripes for erases, over at most half of the array
+    if (!w25q_array_init(&ctx.array, chips, count, 4096)) {
+        goto out;
+    }
+    erase_size = ctx.array.size / 2 < 64 * 4096UL ? ctx.array.size / 2 : 64 * 4096UL;
+    erase_size -= erase_size % ctx.array.erase_size;
+    bench_array_begin(&ctx);
+    if (!w25q_array_erase(&ctx.array, 0, erase_size)) {
+        goto out;
+    }
+    bench_array_end(&ctx, "array_range_erase", 1, erase_size);
+    ret = 0;
+
+out:
+    if (ret) {
+        fprintf(stderr, "%s: array benchmark failed\n", ctx.model);
+    }
+    while (created > 0) {
+        w25q_sim_deinit(&ctx.sim[--created]);
+    }
+    return ret;
+
+}
+
+static int bench_model(enum w25q_id_t model, unsigned long bus_hz, int use_sg) {
+
+    struct bench_ctx ctx;
+    const struct w25q_sim_port *port;
+
+    ctx.model = model_names[model - W25Q10_ID];
+    if (!w25q_sim_init(&ctx.sim, model, NULL)) {
+        fprintf(stderr, "%s: cannot create simulated chip\n", ctx.model);
+        return 1;
+    }
+    w25q_sim_set_bus_clock(&ctx.sim, bus_hz);
+    ctx.sim.call_ns = call_ns;
+    port = w25q_sim_attach(&ctx.sim, 0);
+    ctx.port = port;
+    if (w25q_mount(&ctx.flash, port->spi_send, port->delay) == NULL) {
+        fprintf(stderr, "%s: mount failed\n", ctx.model);
+        w25q_sim_deinit(&ctx.sim);
+        return 1;
+    }
+    w25q_set_delay_us(&ctx.flash, port->delay_us);
+    if (use_sg) {
+        w25q_set_spi_sg(&ctx.flash, port->spi_sg);
+    }
+    if (use_chain) {
+        w25q_set_spi_chain(&ctx.flash, port->spi_chain);
+    }
+
+    bench_seq_read(&ctx);
+    bench_read_modes(&ctx);
+    bench_rand_read(&ctx);
+    bench_cached_read(&ctx);
+    bench_small_write(&ctx);
+    bench_small_write_buffered(&ctx);
+    bench_page_write(&ctx);
+    bench_update(&ctx);
+    bench_range_erase(&ctx);
+    bench_range_erase_skip_blank(&ctx);
+    bench_async_erase(&ctx);
+    bench_read_during_erase(&ctx);
+    bench_erase_all(&ctx);
+
+    w25q_sim_deinit(&ctx.sim);
+
+    // Every chip of the array holds its own RAM image
+    if (model <= W25Q128_ID) {
+        for (unsigned count = 1; count <= 4; count *= 2) {
+            if (bench_array(model, bus_hz, count)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+
+}
+
+int main(int argc, char **argv) {
+
+    const char *model = "W25Q128";
+    unsigned long bus_hz = W25Q_SIM_DEFAULT_BUS_HZ;
+    int use_sg = 0;
+    int ret = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            model = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            bus_hz = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            use_sg = 1;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            use_chain = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            call_ns = strtoul(argv[++i], NULL, 0);
+        } else {
+            fprintf(stderr, "usage: %s [-m MODEL|all] [-c BUS_HZ] [-s] [-k] [-o CALL_NS]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (int id = W25Q10_ID; id <= W25Q512_ID; id++) {
+        if (strcmp(model, "all") == 0 || strcmp(model, model_names[id - W25Q10_ID]) == 0) {
+            ret |= bench_model((enum w25q_id_t)id, bus_hz, use_sg);
+            if (strcmp(model, "all") != 0) {
+                return ret;
+            }
+        }
+    }
+    if (strcmp(model, "all") != 0) {
+        fprintf(stderr, "unknown model %s\n", model);
+        return 2;
+    }
+
+    return ret;
+
+}
@@ -8,7 +8,7 @@ struct w25q_flash flash;
 // Sample Data
 char data[10] = "forkbomb";
 
-char sample_buf[270];
+char sample_buf[257];
 
 /* */
 extern "C" {
@@ -22,6 +22,10 @@ extern "C" {
     void spi_flash_delay(unsigned time) {
         delay(time);
     }
+
+    void spi_flash_delay_us(unsigned time) {
+        delayMicroseconds(time);
+    }
     
 }
 void setup() {
@@ -34,22 +38,24 @@ void setup() {
     delay(2000);
     // Setup Chip
     w25q_mount(&flash, spi_flash_transfer, spi_flash_delay);
+    w25q_set_delay_us(&flash, spi_flash_delay_us);
     Serial.println("");
     Serial.printf("Chip Model: %x\n", flash.model);
-    Serial.printf("Chip Size: %u pages\n", flash.size);
+    Serial.printf("Chip Size: %lu pages\n", flash.size);
     Serial.println("Erasing the first sector...");
     w25q_erase(&flash, 0, 4095);
     Serial.println("Done erasing the first sector, now reading");
-    w25q_read(&flash, 0, sample_buf, 260);
-    Serial.printf("Data: \n%s\n", &sample_buf[4]);
+    w25q_read(&flash, 0, sample_buf, 256);
+    sample_buf[256] = '\0';
+    Serial.printf("Data: \n%s\n", sample_buf);
     Serial.println("Writing data to the first page");
     for (unsigned i = 0; i < 32; i++) {
         w25q_write(&flash, i * 8, data, 8);
     }
     Serial.println("Done writing, now reading data.");
-    w25q_read(&flash, 0, sample_buf, 260);
-    sample_buf[260] = '\0';
-    Serial.printf("Data: \n%s\n", &sample_buf[4]);
+    w25q_read(&flash, 0, sample_buf, 256);
+    sample_buf[256] = '\0';
+    Serial.printf("Data: \n%s\n", sample_buf);
 }
 
 void loop() {
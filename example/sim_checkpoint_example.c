@@ -0,0 +1,163 @@
+/*
+ * Memory map checkpoints on a simulated chip.
+ *
+ * Allocates and frees runs of sectors through w25q_checkpoint_mark, as a file system would, then
+ * simulates a reset: the chip is mounted again with an empty memory map, which is restored from
+ * the checkpoint region and compared with the allocations still held. Repeated over several resets.
+ *
+ * Build: cc -DW25Q_MEMORY_MANAGEMENT -I. -Isim w25qxx.c w25qxx_checkpoint.c sim/w25q_sim.c example/sim_checkpoint_example.c -o sim_checkpoint_example
+ * Usage: ./sim_checkpoint_example
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "w25qxx_checkpoint.h"
+#include "w25q_sim.h"
+
+#define FIRST_SECTOR 16
+#define FILES 64
+#define RESETS 8
+#define OPERATIONS 1000
+
+struct file {
+    unsigned first;
+    unsigned count;                     // 0 when the slot is unused
+};
+
+static struct w25q_sim sim;
+static struct w25q_flash flash;
+static struct w25q_memory_map map;
+static struct w25q_checkpoint checkpoint;
+static const struct w25q_sim_port *port;
+static unsigned long arena[256];
+static struct file files[FILES];
+static unsigned long seed = 1;
+
+static unsigned next_random(unsigned range) {
+
+    seed = seed * 1103515245 + 12345;
+    return (unsigned)(seed >> 16) % range;
+
+}
+
+/**
+ * @brief Mount the chip with an empty memory map, as after a reset
+*/
+static int mount(void) {
+
+    memset(&flash, 0, sizeof(flash));
+    if (w25q_mount(&flash, port->spi_send, port->delay) == NULL) {
+        printf("mount failed\n");
+        return 0;
+    }
+    w25q_set_delay_us(&flash, port->delay_us);
+    w25q_set_clock(&flash, port->clock);
+    if (sizeof(arena) < W25Q_MEM_ARENA_SIZE(flash.size / 16) || !w25q_mem_attach(&flash, &map, arena, sizeof(arena))) {
+        printf("memory map too small\n");
+        return 0;
+    }
+    if (!w25q_checkpoint_init(&checkpoint, &flash, FIRST_SECTOR, w25q_checkpoint_slot_sectors(map.size) + 1)) {
+        printf("checkpoint init failed\n");
+        return 0;
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Compare the memory map with the checkpoint region and the files still allocated
+*/
+static int check_map(void) {
+
+    unsigned region_end = FIRST_SECTOR + 2 * checkpoint.slot_sectors;
+    unsigned used = 0;
+
+    for (unsigned sector = 0; sector < map.size; sector++) {
+        unsigned char expected = sector >= FIRST_SECTOR && sector < region_end;
+
+        for (unsigned i = 0; i < FILES && !expected; i++) {
+            expected = files[i].count != 0 && sector >= files[i].first && sector < files[i].first + files[i].count;
+        }
+        if (w25q_mem_check_sector(&flash, sector) != expected) {
+            printf("sector %u %s\n", sector, expected ? "lost" : "leaked");
+            return 1;
+        }
+        used += expected;
+    }
+    return used != map.used;
+
+}
+
+int main(void) {
+
+    unsigned long long restore_bytes = 0;
+    unsigned long checkpoints = 0, entries = 0;
+    int failures = 0;
+
+    if (!w25q_sim_init(&sim, W25Q16_ID, NULL)) {
+        printf("cannot create simulated chip\n");
+        return 1;
+    }
+    port = w25q_sim_attach(&sim, 0);
+    if (!mount()) {
+        return 1;
+    }
+    // A new chip has no checkpoint, its map starts empty
+    if (w25q_checkpoint_restore(&checkpoint) || !w25q_checkpoint_write(&checkpoint)) {
+        printf("first checkpoint failed\n");
+        return 1;
+    }
+
+    for (unsigned reset = 0; reset < RESETS; reset++) {
+        unsigned long long bus_bytes;
+
+        for (unsigned n = 0; n < OPERATIONS; n++) {
+            struct file *file = &files[next_random(FILES)];
+
+            if (file->count != 0) {
+                if (!w25q_checkpoint_mark(&checkpoint, file->first, file->count, 0)) {
+                    printf("free failed\n");
+                    return 1;
+                }
+                file->count = 0;
+            } else {
+                unsigned count = next_random(8) ? 1 + next_random(4) : 8 + next_random(24);
+                unsigned first = w25q_mem_find_free_run(&flash, 0, count);
+
+                if (first == W25Q_MEM_NONE) {
+                    continue;
+                }
+                if (!w25q_checkpoint_mark(&checkpoint, first, count, 1)) {
+                    printf("allocation failed\n");
+                    return 1;
+                }
+                file->first = first;
+                file->count = count;
+            }
+        }
+
+        checkpoints += checkpoint.checkpoints;
+        entries += checkpoint.entries;
+        if (!mount()) {
+            return 1;
+        }
+        bus_bytes = sim.stats.bus_bytes;
+        if (!w25q_checkpoint_restore(&checkpoint)) {
+            printf("reset %u: restore failed\n", reset);
+            return 1;
+        }
+        restore_bytes += sim.stats.bus_bytes - bus_bytes;
+        if (check_map()) {
+            printf("reset %u: map differs\n", reset);
+            failures++;
+        }
+    }
+
+    printf("%u resets: %lu checkpoints, %lu log entries, %u of %u sectors used, %llu bus bytes per restore\n",
+           RESETS, checkpoints, entries, map.used, map.size, restore_bytes / RESETS);
+    w25q_sim_deinit(&sim);
+    return failures ? 1 : 0;
+
+}
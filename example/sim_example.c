@@ -0,0 +1,157 @@
+/*
+ * Host-side example running the driver against the simulated chip.
+ *
+ * Runs every Winbond model, then parts that other vendors could ship: mounted from SFDP alone,
+ * with short parameter tables and without the 4-byte address instruction table.
+ *
+ * Build: cc -I. -Isim w25qxx.c sim/w25q_sim.c example/sim_example.c -o sim_example
+ * Usage: ./sim_example [image file]
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "w25q_sim.h"
+
+static const char *model_names[] = {
+    "W25Q10", "W25Q20", "W25Q40", "W25Q80", "W25Q16",
+    "W25Q32", "W25Q64", "W25Q128", "W25Q256", "W25Q512"
+};
+
+// Sample Data
+static char data[10] = "forkbomb";
+
+static unsigned char sample_buf[256];
+
+/**
+ * @brief Simulated part described by its SFDP tables
+*/
+struct sfdp_part {
+    const char *name;
+    enum w25q_id_t model;
+    unsigned char manufacturer_id;
+    unsigned char bfpt_dwords;
+    unsigned char table_4b;
+};
+
+static const struct sfdp_part sfdp_parts[] = {
+    {"W25Q256, 9-DWORD BFPT, no 4-byte table", W25Q256_ID, W25Q_PRODUCER_ID, 9, 0},
+    {"other 32 MB, 9-DWORD BFPT, no 4-byte table", W25Q256_ID, 0xc2, 9, 0},
+    {"other 32 MB, full tables", W25Q256_ID, 0xc2, 16, 1},
+    {"other 8 MB, 9-DWORD BFPT", W25Q64_ID, 0xc2, 9, 0}
+};
+
+/**
+ * @brief Mount a part from SFDP, erase a sector and the whole chip, write and read back
+*/
+static int check_sfdp_part(const struct sfdp_part *part) {
+
+    struct w25q_sim sim;
+    struct w25q_flash flash;
+    const struct w25q_sim_port *port;
+    int failures = 0;
+
+    if (!w25q_sim_init(&sim, part->model, NULL)) {
+        printf("%s: cannot create simulated chip\n", part->name);
+        return 1;
+    }
+    sim.manufacturer_id = part->manufacturer_id;
+    sim.sfdp_bfpt_dwords = part->bfpt_dwords;
+    sim.sfdp_4b_table = part->table_4b;
+    port = w25q_sim_attach(&sim, 0);
+    if (w25q_mount(&flash, port->spi_send, port->delay) == NULL || !flash.sfdp) {
+        printf("%s: mount failed\n", part->name);
+        w25q_sim_deinit(&sim);
+        return 1;
+    }
+    w25q_set_delay_us(&flash, port->delay_us);
+
+    memset(sample_buf, 0, sizeof(sample_buf));
+    if (!w25q_erase(&flash, 0, 4095) || !w25q_write(&flash, 0, sample_buf, sizeof(sample_buf))) {
+        printf("%s: sector erase or write failed\n", part->name);
+        failures++;
+    }
+    if (!w25q_erase_all(&flash) || !w25q_read(&flash, 0, sample_buf, sizeof(sample_buf))) {
+        printf("%s: chip erase failed\n", part->name);
+        failures++;
+    }
+    for (unsigned i = 0; i < sizeof(sample_buf); i++) {
+        if (sample_buf[i] != 0xff) {
+            printf("%s: not erased at %u\n", part->name, i);
+            failures++;
+            break;
+        }
+    }
+    printf("%-44s %6u pages  %s\n", part->name, (unsigned)flash.size, failures ? "FAILED" : "ok");
+
+    w25q_sim_deinit(&sim);
+    return failures;
+
+}
+
+int main(int argc, char **argv) {
+
+    int failures = 0;
+
+    for (int id = W25Q10_ID; id <= W25Q512_ID; id++) {
+        struct w25q_sim sim;
+        struct w25q_flash flash;
+        const struct w25q_sim_port *port;
+        unsigned long long t0, t_erase, t_write, t_read;
+
+        if (!w25q_sim_init(&sim, (enum w25q_id_t)id, argc > 1 ? argv[1] : NULL)) {
+            printf("%s: cannot create simulated chip\n", model_names[id - W25Q10_ID]);
+            return 1;
+        }
+        port = w25q_sim_attach(&sim, 0);
+        w25q_sim_reset_stats(&sim);
+
+        if (w25q_mount(&flash, port->spi_send, port->delay) == NULL) {
+            printf("%s: mount failed\n", model_names[id - W25Q10_ID]);
+            failures++;
+            w25q_sim_deinit(&sim);
+            continue;
+        }
+        w25q_set_delay_us(&flash, port->delay_us);
+        w25q_set_spi_sg(&flash, port->spi_sg);
+
+        t0 = w25q_sim_now_ns();
+        w25q_erase(&flash, 0, 4095);
+        t_erase = w25q_sim_now_ns();
+        for (unsigned i = 0; i < 32; i++) {
+            w25q_write(&flash, i * 8, data, 8);
+        }
+        t_write = w25q_sim_now_ns();
+        w25q_read(&flash, 0, sample_buf, 256);
+        t_read = w25q_sim_now_ns();
+
+        for (unsigned i = 0; i < 256; i++) {
+            if (sample_buf[i] != (unsigned char)data[i % 8]) {
+                failures++;
+                printf("%s: data mismatch at %u\n", model_names[id - W25Q10_ID], i);
+                break;
+            }
+        }
+
+        // An MCU reset during a continuous Quad I/O read: the remount must still identify the part
+        sim.continuous = flash.address_bytes;
+        if (w25q_mount(&flash, port->spi_send, port->delay) == NULL || flash.model != (enum w25q_id_t)id) {
+            printf("%s: remount in continuous read mode failed\n", model_names[id - W25Q10_ID]);
+            failures++;
+        }
+
+        printf("%-8s %6u pages  erase %8.3f ms  write %8.3f ms  read %8.3f ms\n",
+               model_names[id - W25Q10_ID], (unsigned)flash.size,
+               (t_erase - t0) / 1e6, (t_write - t_erase) / 1e6, (t_read - t_write) / 1e6);
+
+        w25q_sim_deinit(&sim);
+    }
+
+    for (unsigned i = 0; i < sizeof(sfdp_parts) / sizeof(sfdp_parts[0]); i++) {
+        failures += check_sfdp_part(&sfdp_parts[i]);
+    }
+
+    return failures ? 1 : 0;
+
+}
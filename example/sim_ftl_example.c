@@ -0,0 +1,138 @@
+/*
+ * Flash translation layer on a simulated chip.
+ *
+ * Rewrites logical pages over and over, most writes going to a small hot set, so garbage
+ * collection and wear leveling have to run. The application services the layer between writes.
+ * After that the layer is remounted and every page must hold the last version written to it.
+ *
+ * Build: cc -I. -Isim w25qxx.c w25qxx_ftl.c sim/w25q_sim.c example/sim_ftl_example.c -o sim_ftl_example
+ * Usage: ./sim_ftl_example
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "w25qxx_ftl.h"
+#include "w25q_sim.h"
+
+#define FIRST_SECTOR 16
+#define SECTORS 32
+#define SPARE_SECTORS 4
+#define WRITES 20000
+#define HOT_PAGES 16
+
+static struct w25q_sim sim;
+static struct w25q_flash flash;
+static struct w25q_ftl ftl;
+static const struct w25q_sim_port *port;
+static unsigned long arena[4096];
+static unsigned versions[SECTORS * W25Q_FTL_PAGES_PER_SECTOR];
+
+/**
+ * @brief Page contents: page number and version, then bytes derived from both
+*/
+static void make_page(unsigned page, unsigned version, unsigned char *buffer) {
+
+    buffer[0] = page & 0xff;
+    buffer[1] = (page >> 8) & 0xff;
+    buffer[2] = version & 0xff;
+    buffer[3] = (version >> 8) & 0xff;
+    for (unsigned i = 4; i < 256; i++) {
+        buffer[i] = (unsigned char)(page * 7 + version * 13 + i);
+    }
+
+}
+
+/**
+ * @brief Check every logical page against the last version written, unwritten pages read as 0xff
+*/
+static int check_pages(const char *when) {
+
+    unsigned char expected[256], buffer[256];
+    int failures = 0;
+
+    for (unsigned page = 0; page < ftl.pages; page++) {
+        if (versions[page] == 0) {
+            memset(expected, 0xff, sizeof(expected));
+        } else {
+            make_page(page, versions[page], expected);
+        }
+        if (!w25q_ftl_read(&ftl, page, buffer) || memcmp(buffer, expected, sizeof(buffer)) != 0) {
+            printf("%s: page %u wrong\n", when, page);
+            failures++;
+        }
+    }
+    return failures;
+
+}
+
+int main(void) {
+
+    unsigned char buffer[256];
+    unsigned long seed = 1;
+    unsigned long erases, relocations, min_erases = ~0UL, max_erases = 0;
+    int failures = 0;
+
+    if (!w25q_sim_init(&sim, W25Q16_ID, NULL)) {
+        printf("cannot create simulated chip\n");
+        return 1;
+    }
+    port = w25q_sim_attach(&sim, 0);
+    if (w25q_mount(&flash, port->spi_send, port->delay) == NULL) {
+        printf("mount failed\n");
+        return 1;
+    }
+    w25q_set_delay_us(&flash, port->delay_us);
+    w25q_set_clock(&flash, port->clock);
+
+    if (sizeof(arena) < w25q_ftl_arena_size(SECTORS, SPARE_SECTORS) ||
+        !w25q_ftl_mount(&ftl, &flash, FIRST_SECTOR, SECTORS, SPARE_SECTORS, arena, sizeof(arena))) {
+        printf("ftl mount failed\n");
+        return 1;
+    }
+    // The extra spares let the idle time keep a sector ready for the writes
+    ftl.gc_free_target = 2;
+    for (unsigned n = 0; n < WRITES; n++) {
+        unsigned page;
+
+        seed = seed * 1103515245 + 12345;
+        page = (unsigned)(seed >> 16) % (n % 4 == 0 ? ftl.pages : HOT_PAGES);
+        make_page(page, ++versions[page], buffer);
+        if (!w25q_ftl_write(&ftl, page, buffer)) {
+            printf("write %u failed\n", n);
+            return 1;
+        }
+        // Idle time between writes, long enough for a sector erase now and then
+        for (unsigned step = 0; step < 2 && w25q_ftl_service(&ftl); step++) {
+            port->delay_us(10000);
+        }
+    }
+    failures += check_pages("before remount");
+
+    // Let the background erase finish, then everything must survive a remount
+    while (w25q_ftl_service(&ftl)) {
+        port->delay_us(10000);
+    }
+    erases = ftl.erases;
+    relocations = ftl.relocations;
+    if (!w25q_ftl_mount(&ftl, &flash, FIRST_SECTOR, SECTORS, SPARE_SECTORS, arena, sizeof(arena))) {
+        printf("ftl remount failed\n");
+        return 1;
+    }
+    failures += check_pages("after remount");
+
+    for (unsigned sector = 0; sector < SECTORS; sector++) {
+        if (ftl.info[sector].erase_count < min_erases) {
+            min_erases = ftl.info[sector].erase_count;
+        }
+        if (ftl.info[sector].erase_count > max_erases) {
+            max_erases = ftl.info[sector].erase_count;
+        }
+    }
+    printf("%u writes over %u pages: %lu erases, %lu pages relocated, erase counts %lu-%lu\n",
+           WRITES, ftl.pages, erases, relocations, min_erases, max_erases);
+    w25q_sim_deinit(&sim);
+    return failures ? 1 : 0;
+
+}
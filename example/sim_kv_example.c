@@ -0,0 +1,153 @@
+/*
+ * Key-value store on a simulated chip.
+ *
+ * Sets, updates and deletes settings under a few hundred keys, servicing the store now and then so
+ * old sectors get compacted. The store is then remounted: every key must read back its last value,
+ * deleted keys must be gone.
+ *
+ * Build: cc -I. -Isim w25qxx.c w25qxx_kv.c sim/w25q_sim.c example/sim_kv_example.c -o sim_kv_example
+ * Usage: ./sim_kv_example
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "w25qxx_kv.h"
+#include "w25q_sim.h"
+
+#define FIRST_SECTOR 16
+#define SECTORS 16
+#define KEYS 300
+#define OPERATIONS 20000
+
+static struct w25q_sim sim;
+static struct w25q_flash flash;
+static struct w25q_kv kv;
+static const struct w25q_sim_port *port;
+static unsigned long arena[2048];
+static unsigned versions[KEYS];         // Last version stored, 0 when the key is deleted or never set
+static unsigned long seed = 1;
+
+static unsigned next_random(unsigned range) {
+
+    seed = seed * 1103515245 + 12345;
+    return (unsigned)(seed >> 16) % range;
+
+}
+
+static unsigned make_key(unsigned n, char *key) {
+    return (unsigned)sprintf(key, "setting/%u", n);
+}
+
+/**
+ * @brief Value of a key at a version, from 1 to 100 bytes
+*/
+static unsigned make_value(unsigned n, unsigned version, unsigned char *value) {
+
+    unsigned size = 1 + (n * 31 + version * 17) % 100;
+
+    for (unsigned i = 0; i < size; i++) {
+        value[i] = (unsigned char)(n + version * 3 + i);
+    }
+    return size;
+
+}
+
+/**
+ * @brief Check every key against the last value stored
+*/
+static int check_keys(const char *when) {
+
+    char key[32];
+    unsigned char expected[W25Q_KV_MAX_RECORD], value[W25Q_KV_MAX_RECORD];
+    unsigned size, count = 0;
+    int failures = 0;
+
+    for (unsigned n = 0; n < KEYS; n++) {
+        unsigned found = w25q_kv_get(&kv, key, make_key(n, key), value, sizeof(value), &size);
+
+        if (versions[n] == 0) {
+            if (found) {
+                printf("%s: %s should be deleted\n", when, key);
+                failures++;
+            }
+            continue;
+        }
+        count++;
+        if (!found || size != make_value(n, versions[n], expected) || memcmp(value, expected, size) != 0) {
+            printf("%s: %s wrong\n", when, key);
+            failures++;
+        }
+    }
+    if (kv.count != count) {
+        printf("%s: %u keys, expected %u\n", when, kv.count, count);
+        failures++;
+    }
+    return failures;
+
+}
+
+int main(void) {
+
+    char key[32];
+    unsigned char value[W25Q_KV_MAX_RECORD];
+    unsigned long compactions, relocated;
+    int failures = 0;
+
+    if (!w25q_sim_init(&sim, W25Q16_ID, NULL)) {
+        printf("cannot create simulated chip\n");
+        return 1;
+    }
+    port = w25q_sim_attach(&sim, 0);
+    if (w25q_mount(&flash, port->spi_send, port->delay) == NULL) {
+        printf("mount failed\n");
+        return 1;
+    }
+    w25q_set_delay_us(&flash, port->delay_us);
+    w25q_set_clock(&flash, port->clock);
+
+    if (sizeof(arena) < w25q_kv_arena_size(SECTORS, KEYS) ||
+        !w25q_kv_mount(&kv, &flash, FIRST_SECTOR, SECTORS, arena, sizeof(arena))) {
+        printf("kv mount failed\n");
+        return 1;
+    }
+    for (unsigned op = 0; op < OPERATIONS; op++) {
+        unsigned n = next_random(KEYS);
+        unsigned key_len = make_key(n, key);
+
+        // One operation in eight deletes a key
+        if (next_random(8) == 0) {
+            if (w25q_kv_delete(&kv, key, key_len) != (versions[n] != 0)) {
+                printf("delete %s failed\n", key);
+                return 1;
+            }
+            versions[n] = 0;
+        } else {
+            versions[n]++;
+            if (!w25q_kv_set(&kv, key, key_len, value, make_value(n, versions[n], value))) {
+                printf("set %s failed\n", key);
+                return 1;
+            }
+        }
+        if (op % 16 == 15) {
+            w25q_kv_service(&kv);
+        }
+    }
+    failures += check_keys("before remount");
+
+    // Everything must survive a remount
+    compactions = kv.compactions;
+    relocated = kv.relocated;
+    if (!w25q_kv_mount(&kv, &flash, FIRST_SECTOR, SECTORS, arena, sizeof(arena))) {
+        printf("kv remount failed\n");
+        return 1;
+    }
+    failures += check_keys("after remount");
+
+    printf("%u operations on %u keys: %u kept, %lu sectors compacted, %lu records relocated\n",
+           OPERATIONS, KEYS, kv.count, compactions, relocated);
+    w25q_sim_deinit(&sim);
+    return failures ? 1 : 0;
+
+}
@@ -0,0 +1,179 @@
+/*
+ * Circular record log on a simulated chip.
+ *
+ * Appends numbered records of varying size, a third of them as large as allowed, until the log has
+ * wrapped several times, flushes, remounts, appends a few more with write verification on and walks
+ * the log both ways: the records must come back in order, without gaps, ending with the last one
+ * appended. Runs with staging rings of 1, 2 and 8 pages.
+ *
+ * Build: cc -I. -Isim w25qxx.c w25qxx_log.c sim/w25q_sim.c example/sim_log_example.c -o sim_log_example
+ * Usage: ./sim_log_example
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "w25qxx_log.h"
+#include "w25q_sim.h"
+
+#define FIRST_SECTOR 16
+// Record 20003 is short, so it goes into the page the remount left partly filled
+#define RECORDS 20002
+#define MORE_RECORDS 4
+#define LAST_RECORD (RECORDS + MORE_RECORDS)
+
+struct config {
+    unsigned sectors;
+    unsigned erase_ahead;
+    unsigned pages;
+};
+
+static const struct config configs[] = {
+    {6, 1, 1}, {10, 2, 1}, {20, 1, 1}, {20, 1, 2}, {64, 2, 8}
+};
+
+static unsigned char arena[8 * 264];
+
+/**
+ * @brief Record n: its number, then bytes derived from it
+*/
+static unsigned make_record(unsigned long n, unsigned char *record) {
+
+    unsigned size = n % 3 ? 4 + (unsigned)(n * 37 % (n % 5 ? 20 : 200)) : W25Q_LOG_MAX_RECORD;
+
+    record[0] = n & 0xff;
+    record[1] = (n >> 8) & 0xff;
+    record[2] = (n >> 16) & 0xff;
+    record[3] = (n >> 24) & 0xff;
+    for (unsigned i = 4; i < size; i++) {
+        record[i] = (unsigned char)(n + i);
+    }
+    return size;
+
+}
+
+static unsigned long record_number(const unsigned char *record) {
+    return record[0] | (record[1] << 8) | ((unsigned long)record[2] << 16) | ((unsigned long)record[3] << 24);
+}
+
+/**
+ * @brief Check one record read back
+*/
+static int check_record(const void *data, unsigned size, unsigned long n) {
+
+    unsigned char expected[256];
+
+    return record_number((const unsigned char *)data) == n && size == make_record(n, expected) &&
+           memcmp(data, expected, size) == 0;
+
+}
+
+static int run(const struct config *config) {
+
+    struct w25q_sim sim;
+    struct w25q_flash flash;
+    struct w25q_log log;
+    struct w25q_log_cursor cursor;
+    const struct w25q_sim_port *port;
+    unsigned char record[256];
+    const void *data;
+    unsigned size, arena_size = w25q_log_arena_size(config->pages);
+    unsigned long n, oldest, count = 0;
+    int failures = 0;
+
+    if (!w25q_sim_init(&sim, W25Q16_ID, NULL)) {
+        printf("cannot create simulated chip\n");
+        return 1;
+    }
+    port = w25q_sim_attach(&sim, 0);
+    if (w25q_mount(&flash, port->spi_send, port->delay) == NULL) {
+        printf("mount failed\n");
+        return 1;
+    }
+    w25q_set_delay_us(&flash, port->delay_us);
+    w25q_set_clock(&flash, port->clock);
+
+    if (!w25q_log_mount(&log, &flash, FIRST_SECTOR, config->sectors, config->erase_ahead, arena, arena_size)) {
+        printf("log mount failed\n");
+        return 1;
+    }
+    for (n = 1; n <= RECORDS; n++) {
+        if (!w25q_log_append(&log, record, make_record(n, record))) {
+            printf("append %lu failed\n", n);
+            return 1;
+        }
+        if (n % 16 == 0) {
+            w25q_log_service(&log);
+        }
+    }
+    w25q_log_flush(&log);
+
+    // Everything must survive a remount
+    if (!w25q_log_mount(&log, &flash, FIRST_SECTOR, config->sectors, config->erase_ahead, arena, arena_size)) {
+        printf("log remount failed\n");
+        return 1;
+    }
+    w25q_set_write_verify(&flash, 1);
+    for (n = RECORDS + 1; n <= LAST_RECORD; n++) {
+        if (!w25q_log_append(&log, record, make_record(n, record))) {
+            printf("append %lu after remount failed\n", n);
+            return 1;
+        }
+    }
+    if (!w25q_log_flush(&log)) {
+        printf("flush after remount failed\n");
+        failures++;
+    }
+    w25q_log_first(&log, &cursor);
+    if (!w25q_log_next(&log, &cursor, &data, &size)) {
+        printf("log empty\n");
+        return 1;
+    }
+    oldest = record_number((const unsigned char *)data);
+    for (n = oldest; ; n++) {
+        if (!check_record(data, size, n)) {
+            printf("forward: record %lu wrong\n", n);
+            failures++;
+            break;
+        }
+        count++;
+        if (!w25q_log_next(&log, &cursor, &data, &size)) {
+            break;
+        }
+    }
+    if (n != LAST_RECORD) {
+        printf("forward: last record %lu, expected %u\n", n, LAST_RECORD);
+        failures++;
+    }
+
+    w25q_log_last(&log, &cursor);
+    for (n = LAST_RECORD; w25q_log_prev(&log, &cursor, &data, &size); n--) {
+        if (!check_record(data, size, n)) {
+            printf("reverse: record %lu wrong\n", n);
+            failures++;
+            break;
+        }
+    }
+    if (n + 1 != oldest) {
+        printf("reverse: stopped at %lu, expected %lu\n", n + 1, oldest);
+        failures++;
+    }
+
+    printf("%2u sectors, erase ahead %u, %u staging pages: records %lu-%u kept (%lu), %lu erase waits\n",
+           config->sectors, config->erase_ahead, config->pages, oldest, LAST_RECORD, count, log.erase_waits);
+    w25q_sim_deinit(&sim);
+    return failures;
+
+}
+
+int main(void) {
+
+    int failures = 0;
+
+    for (unsigned i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        failures += run(&configs[i]);
+    }
+    return failures ? 1 : 0;
+
+}
@@ -0,0 +1,173 @@
+/*
+ * Several threads sharing one simulated chip through the command queue.
+ *
+ * Each client thread appends 16-byte records to a page it shares with the other clients and
+ * reads them back, thread 0 also erases a scratch sector now and then. A service thread runs
+ * the queue. All simulator calls happen under the flash lock.
+ *
+ * Build: cc -pthread -I. -Isim w25qxx.c sim/w25q_sim.c example/sim_queue_example.c -o sim_queue_example
+ * Usage: ./sim_queue_example
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "w25q_sim.h"
+
+#define CLIENTS 4
+#define RECORDS 64
+#define RECORD_SIZE 16
+#define SCRATCH_SECTOR 0x10000
+
+static struct w25q_sim sim;
+static struct w25q_flash flash;
+static struct w25q_queue queue;
+static const struct w25q_sim_port *port;
+static pthread_mutex_t flash_mutex;
+static int clients_running = CLIENTS;
+static int failures;
+
+struct client {
+    unsigned id;
+    sem_t done;
+};
+
+static void lock(void *arg) {
+    pthread_mutex_lock((pthread_mutex_t *)arg);
+}
+
+static void unlock(void *arg) {
+    pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+static void request_done(struct w25q_flash *f, unsigned char result, void *context) {
+
+    (void)f;
+    (void)result;
+    sem_post(&((struct client *)context)->done);
+
+}
+
+/**
+ * @brief Queue one request and wait for its callback
+*/
+static unsigned char run(struct client *client, enum w25q_request_t kind, unsigned address, void *buffer,
+                         unsigned size) {
+
+    struct w25q_request request;
+
+    memset(&request, 0, sizeof(request));
+    request.kind = kind;
+    request.address = address;
+    request.buffer = buffer;
+    request.size = size;
+    request.done = request_done;
+    request.context = client;
+    if (!w25q_queue_submit(&flash, &request)) {
+        return 0;
+    }
+    sem_wait(&client->done);
+    return request.result;
+
+}
+
+static void *client_main(void *arg) {
+
+    struct client *client = (struct client *)arg;
+    unsigned char record[RECORD_SIZE], check[RECORD_SIZE];
+
+    for (unsigned i = 0; i < RECORDS; i++) {
+        // Records of all clients interleave, CLIENTS of them share a 64-byte slot
+        unsigned address = (i * CLIENTS + client->id) * RECORD_SIZE;
+
+        memset(record, (int)(client->id * RECORDS + i), sizeof(record));
+        if (!run(client, W25Q_REQUEST_WRITE, address, record, sizeof(record)) ||
+            !run(client, W25Q_REQUEST_READ, address, check, sizeof(check)) ||
+            memcmp(record, check, sizeof(record)) != 0) {
+            __sync_fetch_and_add(&failures, 1);
+            printf("client %u: record %u mismatch\n", client->id, i);
+        }
+        if (client->id == 0 && i % 16 == 0 && !run(client, W25Q_REQUEST_ERASE, SCRATCH_SECTOR, NULL, 4096)) {
+            __sync_fetch_and_add(&failures, 1);
+        }
+    }
+    __sync_fetch_and_sub(&clients_running, 1);
+    return NULL;
+
+}
+
+int main(void) {
+
+    pthread_mutexattr_t attr;
+    pthread_t threads[CLIENTS];
+    struct client clients[CLIENTS];
+    unsigned long long t0, transfers0;
+    unsigned char image[CLIENTS * RECORDS * RECORD_SIZE];
+
+    if (!w25q_sim_init(&sim, W25Q16_ID, NULL)) {
+        printf("cannot create simulated chip\n");
+        return 1;
+    }
+    port = w25q_sim_attach(&sim, 0);
+    if (w25q_mount(&flash, port->spi_send, port->delay) == NULL) {
+        printf("mount failed\n");
+        return 1;
+    }
+    w25q_set_delay_us(&flash, port->delay_us);
+    w25q_set_clock(&flash, port->clock);
+    w25q_set_spi_sg(&flash, port->spi_sg);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&flash_mutex, &attr);
+    w25q_set_lock(&flash, lock, unlock, &flash_mutex);
+    w25q_set_queue(&flash, &queue);
+
+    t0 = w25q_sim_now_ns();
+    transfers0 = sim.stats.transfers;
+    for (unsigned i = 0; i < CLIENTS; i++) {
+        clients[i].id = i;
+        sem_init(&clients[i].done, 0, 0);
+        pthread_create(&threads[i], NULL, client_main, &clients[i]);
+    }
+
+    // Service loop, the simulated time only moves under the lock
+    while (1) {
+        if (!w25q_queue_service(&flash)) {
+            if (__sync_add_and_fetch(&clients_running, 0) == 0) {
+                break;
+            }
+            sched_yield();
+        }
+        pthread_mutex_lock(&flash_mutex);
+        port->delay_us(W25Q_POLL_MIN_US);
+        pthread_mutex_unlock(&flash_mutex);
+    }
+    for (unsigned i = 0; i < CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Every record must be in place
+    w25q_read(&flash, 0, image, sizeof(image));
+    for (unsigned i = 0; i < CLIENTS * RECORDS; i++) {
+        if (image[i * RECORD_SIZE] != (unsigned char)((i % CLIENTS) * RECORDS + i / CLIENTS)) {
+            failures++;
+            printf("record %u lost\n", i);
+            break;
+        }
+    }
+
+    printf("%u requests  %llu transactions  %lu merged reads  %lu batched writes  %.3f ms\n",
+           CLIENTS * RECORDS * 2 + RECORDS / 16, sim.stats.transfers - transfers0, queue.merged_reads,
+           queue.batched_writes, (w25q_sim_now_ns() - t0) / 1e6);
+
+    w25q_sim_deinit(&sim);
+    return failures ? 1 : 0;
+
+}
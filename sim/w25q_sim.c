@@ -0,0 +1,972 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "w25q_sim.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Status register bits */
+#define SIM_SR1_BUSY 0x01
+#define SIM_SR1_WEL 0x02
+#define SIM_SR2_QE 0x02
+#define SIM_SR2_SUS 0x80
+
+/* Writable status register bits */
+#define SIM_SR1_MASK 0xfc
+#define SIM_SR2_MASK 0x7b
+
+/* 4-byte address opcodes and their 3-byte address counterparts */
+static const unsigned char sim_opcodes_4b[][2] = {
+    {W25Q_READ_DATA_4B, W25Q_READ_DATA},
+    {W25Q_FAST_READ_4B, W25Q_FAST_READ},
+    {W25Q_FAST_READ_DUAL_OUTPUT_4B, W25Q_FAST_READ_DUAL_OUTPUT},
+    {W25Q_FAST_READ_QUAD_OUTPUT_4B, W25Q_FAST_READ_QUAD_OUTPUT},
+    {W25Q_FAST_READ_QUAD_IO_4B, W25Q_FAST_READ_QUAD_IO},
+    {W25Q_PAGE_PROGRAM_4B, W25Q_PAGE_PROGRAM},
+    {W25Q_SECTOR_ERASE_4B, W25Q_SECTOR_ERASE},
+    {W25Q_64K_BLK_ERASE_4B, W25Q_64K_BLK_ERASE}
+};
+
+/* Virtual clock shared by every simulated chip */
+static unsigned long long sim_now_ns;
+static unsigned long long sim_delay_calls;
+static unsigned long long sim_delay_ns;
+
+static struct w25q_sim *sim_slots[W25Q_SIM_MAX_CHIPS];
+
+/* Helper functions */
+
+static void sim_update(struct w25q_sim *sim) {
+
+    if ((sim->status[0] & SIM_SR1_BUSY) && sim_now_ns >= sim->busy_until_ns) {
+        sim->status[0] &= ~(SIM_SR1_BUSY | SIM_SR1_WEL);
+    }
+
+}
+
+static void sim_clock(struct w25q_sim *sim, unsigned long long clocks) {
+
+    unsigned long long ns = clocks * 1000000000ULL / sim->bus_hz;
+
+    sim_now_ns += ns;
+    sim->stats.bus_ns += ns;
+
+}
+
+/**
+ * @brief Account for one call of a transport function
+*/
+static void sim_call(struct w25q_sim *sim) {
+
+    sim->stats.calls++;
+    sim_now_ns += sim->call_ns;
+
+}
+
+static void sim_start_busy(struct w25q_sim *sim, unsigned long long us) {
+
+    sim->status[0] |= SIM_SR1_BUSY;
+    sim->busy_opcode = sim->opcode;
+    sim->busy_until_ns = sim_now_ns + us * 1000ULL;
+
+}
+
+static void sim_erase(struct w25q_sim *sim, unsigned block_size, unsigned long us) {
+
+    unsigned long start = (sim->address % sim->size) & ~(unsigned long)(block_size - 1);
+
+    memset(&sim->image[start], 0xff, block_size);
+    sim->busy_start = start;
+    sim->busy_size = block_size;
+    sim->stats.erases++;
+    sim_start_busy(sim, us);
+
+}
+
+/**
+ * @brief Map an opcode to its 3-byte address form
+ * 
+ * @param[out] address_bytes Address length of the command
+*/
+static unsigned char sim_decode_opcode(const struct w25q_sim *sim, unsigned char opcode, unsigned char *address_bytes) {
+
+    *address_bytes = sim->address_4b ? 4 : 3;
+    for (unsigned i = 0; i < sizeof(sim_opcodes_4b) / sizeof(sim_opcodes_4b[0]); i++) {
+        if (sim_opcodes_4b[i][0] == opcode) {
+            *address_bytes = 4;
+            return sim_opcodes_4b[i][1];
+        }
+    }
+    return opcode;
+
+}
+
+/**
+ * @brief Encode a duration as an SFDP count and unit, rounding up
+ *
+ * @param[in] us Duration
+ * @param[in] count_bits Width of the count field, the 2-bit unit field follows (1 bit when units[2] is 0)
+ * @param[in] units Unit for each value of the unit field, in us
+*/
+static unsigned long sim_sfdp_time(unsigned long us, unsigned count_bits, const unsigned long *units) {
+
+    unsigned long max_count = 1UL << count_bits;
+    unsigned unit = 0;
+
+    while (unit < 3 && units[unit + 1] != 0 && (us + units[unit] - 1) / units[unit] > max_count) {
+        unit++;
+    }
+    unsigned long count = (us + units[unit] - 1) / units[unit];
+    if (count == 0) {
+        count = 1;
+    }
+    if (count > max_count) {
+        count = max_count;
+    }
+    return (count - 1) | ((unsigned long)unit << count_bits);
+
+}
+
+/**
+ * @brief Build the SFDP area: header, Basic Flash Parameter Table (JESD216B) at 0x80 and, above 16 MB,
+ * the 4-Byte Address Instruction Table at 0xc0
+*/
+static void sim_build_sfdp(struct w25q_sim *sim) {
+
+    static const unsigned long erase_units[] = {1000, 16000, 128000, 1000000};
+    static const unsigned long program_units[] = {8, 64, 0, 0};
+    static const unsigned long byte_units[] = {1, 8, 0, 0};
+    static const unsigned long chip_units[] = {16000, 256000, 4000000, 64000000};
+    static const unsigned char header[16] = {
+        'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xff,
+        0x00, 0x06, 0x01, 16, 0x80, 0x00, 0x00, 0xff
+    };
+    unsigned char large = sim->size > 16UL * 1024 * 1024;
+    unsigned char *bfpt = &sim->sfdp[0x80];
+    const unsigned multiplier = 2;      // Max is 6x typical
+
+    memset(sim->sfdp, 0xff, sizeof(sim->sfdp));
+    memcpy(sim->sfdp, header, sizeof(header));
+    sim->sfdp[11] = sim->sfdp_bfpt_dwords;
+
+    // 4K erase 0x20, 1-1-2, 1-2-2, 1-4-4 and 1-1-4 reads, 3 or 4 address bytes above 16 MB
+    w25q_put_le32(&bfpt[0], 0xff300001UL | (0x20UL << 8) | (1UL << 16) | (1UL << 20) | (1UL << 21) |
+                            (1UL << 22) | (large ? 1UL << 17 : 0));
+    w25q_put_le32(&bfpt[4], sim->size * 8 - 1);
+    // 1-4-4: 0xeb, 2 mode + 4 dummy clocks; 1-1-4: 0x6b, 8 dummy clocks
+    w25q_put_le32(&bfpt[8], 0x6b080000UL | 0xeb00UL | (2UL << 5) | 4);
+    // 1-1-2: 0x3b, 8 dummy clocks; 1-2-2: 0xbb, 4 mode clocks
+    w25q_put_le32(&bfpt[12], 0xbb800000UL | 0x3b00UL | 8);
+    w25q_put_le32(&bfpt[16], 0xffffffeeUL);
+    w25q_put_le32(&bfpt[20], 0x0000ffffUL);
+    w25q_put_le32(&bfpt[24], 0x0000ffffUL);
+    // Erase types 4K 0x20, 32K 0x52, 64K 0xd8
+    w25q_put_le32(&bfpt[28], 0x520f200cUL);
+    w25q_put_le32(&bfpt[32], 0x0000d810UL);
+    w25q_put_le32(&bfpt[36], multiplier | (sim_sfdp_time(sim->timing.sector_erase_us, 5, erase_units) << 4) |
+                             (sim_sfdp_time(sim->timing.blk32_erase_us, 5, erase_units) << 11) |
+                             (sim_sfdp_time(sim->timing.blk64_erase_us, 5, erase_units) << 18));
+    // 256-byte pages
+    w25q_put_le32(&bfpt[40], multiplier | (8UL << 4) |
+                             (sim_sfdp_time(sim->timing.page_program_us, 5, program_units) << 8) |
+                             (sim_sfdp_time(sim->timing.byte_program_us, 4, byte_units) << 14) |
+                             (sim_sfdp_time((sim->timing.byte_program_next_ns + 999) / 1000, 4, byte_units) << 19) |
+                             (sim_sfdp_time(sim->timing.chip_erase_us, 5, chip_units) << 24));
+    // Suspend 0x75, resume 0x7a
+    w25q_put_le32(&bfpt[44], 0x00000000UL);
+    w25q_put_le32(&bfpt[48], 0x757a757aUL);
+    w25q_put_le32(&bfpt[52], 0x00000004UL);
+    // QE is bit 1 of status register 2, written with 0x31
+    w25q_put_le32(&bfpt[56], 5UL << 20);
+    // Enter 4-Byte Address Mode 0xb7, exit 0xe9
+    w25q_put_le32(&bfpt[60], large ? (1UL << 24) | (1UL << 14) : 0);
+
+    if (large && sim->sfdp_4b_table) {
+        static const unsigned char ait_header[8] = {0x84, 0x00, 0x01, 2, 0xc0, 0x00, 0x00, 0xff};
+        sim->sfdp[6] = 1;
+        memcpy(&sim->sfdp[16], ait_header, sizeof(ait_header));
+        // 0x13, 0x0c, 0x3c, 0x6c, 0xec, 0x12, 4K erase 0x21 and 64K erase 0xdc
+        w25q_put_le32(&sim->sfdp[0xc0], 0x00000a77UL);
+        w25q_put_le32(&sim->sfdp[0xc4], 0xffdcff21UL);
+    }
+
+}
+
+/**
+ * @brief Check whether a busy chip takes an Erase/Program Suspend
+*/
+static unsigned char sim_can_suspend(const struct w25q_sim *sim) {
+
+    if (sim->status[1] & SIM_SR2_SUS) {
+        return 0;
+    }
+    if (sim->resumed_ns && sim_now_ns - sim->resumed_ns < sim->timing.resume_to_suspend_us * 1000ULL) {
+        return 0;
+    }
+    return sim->busy_opcode == W25Q_PAGE_PROGRAM || sim->busy_opcode == W25Q_SECTOR_ERASE ||
+           sim->busy_opcode == W25Q_32K_BLK_ERASE || sim->busy_opcode == W25Q_64K_BLK_ERASE;
+
+}
+
+/**
+ * @brief Check whether a write command is allowed while an operation is suspended
+ * 
+ * Only a page program outside the block of a suspended erase is.
+*/
+static unsigned char sim_suspend_allows(const struct w25q_sim *sim) {
+
+    unsigned long base;
+
+    switch (sim->opcode) {
+        case W25Q_PAGE_PROGRAM:
+            if (sim->suspended_opcode == W25Q_PAGE_PROGRAM) {
+                return 0;
+            }
+            base = (sim->address % sim->size) & ~0xffUL;
+            return base < sim->suspended_start || base >= sim->suspended_start + sim->suspended_size;
+        case W25Q_WRITE_STATUS_REG_1:
+        case W25Q_WRITE_STATUS_REG_2:
+        case W25Q_SECTOR_ERASE:
+        case W25Q_32K_BLK_ERASE:
+        case W25Q_64K_BLK_ERASE:
+        case W25Q_CHIP_ERASE:
+        case 0x60:
+            return 0;
+        default:
+            return 1;
+    }
+
+}
+
+/**
+ * @brief Start a transaction (chip select asserted)
+*/
+static void sim_begin(struct w25q_sim *sim) {
+
+    sim_update(sim);
+    sim->pos = 0;
+    sim->address = 0;
+    sim->page_bytes = 0;
+    sim->accepted = 0;
+    sim->stats.transfers++;
+
+}
+
+/**
+ * @brief Clock one byte through the chip
+ *
+ * @return Byte driven by the chip
+*/
+static unsigned char sim_byte(struct w25q_sim *sim, unsigned char tx) {
+
+    unsigned char rx = 0xff;
+    unsigned pos = sim->pos++;
+    // In continuous read mode a single-line transaction is clocked in as a Quad I/O address with
+    // IO1-3 idle high, so M4 comes from IO0 at the first mode clock: a 1 ends the mode
+    unsigned mode_clock = sim->continuous * 2u;
+    unsigned char leave = sim->continuous && pos == mode_clock / 8 && (tx & (0x80 >> (mode_clock % 8)));
+
+    sim_clock(sim, 8);
+    sim->stats.bus_bytes++;
+
+    if (pos == 0) {
+        sim->opcode = sim_decode_opcode(sim, tx, &sim->address_bytes);
+        sim->accepted = 1;
+        if (tx == W25Q_READ_SFDP) {
+            sim->address_bytes = 3;
+            sim_build_sfdp(sim);
+        }
+        // In deep power-down and during tDP/tRES1 the chip only waits for Release Power-Down
+        if (sim->power_down || sim_now_ns < sim->ready_ns) {
+            if (!sim->power_down || tx != W25Q_RELEASE_POWER_DOWN || sim_now_ns < sim->ready_ns) {
+                sim->accepted = 0;
+                sim->stats.rejected++;
+            }
+            return rx;
+        }
+        // In continuous read mode the chip takes these bits as a quad address
+        if (sim->continuous) {
+            sim->accepted = 0;
+            sim->stats.rejected++;
+            if (leave) {
+                sim->continuous = 0;
+            }
+            return rx;
+        }
+        // A busy chip only answers status reads
+        if (sim->status[0] & SIM_SR1_BUSY) {
+            if (tx == W25Q_READ_STATUS_REG_1 || tx == W25Q_READ_STATUS_REG_2) {
+                sim->stats.busy_polls++;
+            } else if (tx == W25Q_ERASE_PROGRAM_SUSPEND && sim_can_suspend(sim)) {
+                // Executed at chip select release
+            } else {
+                sim->accepted = 0;
+                sim->stats.rejected++;
+            }
+        }
+        return rx;
+    }
+
+    if (!sim->accepted) {
+        if (leave) {
+            sim->continuous = 0;
+        }
+        return rx;
+    }
+
+    switch (sim->opcode) {
+        case W25Q_READ_JEDEC_ID:
+            if (pos == 1) {
+                rx = sim->manufacturer_id;
+            } else if (pos == 2) {
+                rx = (sim->model >> 8) & 0xff;
+            } else if (pos == 3) {
+                rx = sim->model & 0xff;
+            }
+            break;
+        case W25Q_READ_STATUS_REG_1:
+            rx = sim->status[0];
+            break;
+        case W25Q_READ_STATUS_REG_2:
+            rx = sim->status[1];
+            break;
+        case W25Q_READ_DATA:
+            if (pos <= sim->address_bytes) {
+                sim->address = (sim->address << 8) | tx;
+            } else {
+                rx = sim->image[sim->address % sim->size];
+                sim->address++;
+            }
+            break;
+        case W25Q_FAST_READ:
+            if (pos <= sim->address_bytes) {
+                sim->address = (sim->address << 8) | tx;
+            } else if (pos >= sim->address_bytes + 2u) {
+                rx = sim->image[sim->address % sim->size];
+                sim->address++;
+            }
+            break;
+        case W25Q_READ_SFDP:
+            if (pos <= 3) {
+                sim->address = (sim->address << 8) | tx;
+            } else if (pos >= 5) {
+                rx = sim->sfdp[sim->address & 0xff];
+                sim->address++;
+            }
+            break;
+        case W25Q_WRITE_STATUS_REG_1:
+        case W25Q_WRITE_STATUS_REG_2:
+            if (pos <= 2) {
+                sim->page[pos - 1] = tx;
+                sim->page_bytes = pos;
+            }
+            break;
+        case W25Q_PAGE_PROGRAM:
+            if (pos <= sim->address_bytes) {
+                sim->address = (sim->address << 8) | tx;
+                if (pos == sim->address_bytes) {
+                    memset(sim->page, 0xff, sizeof(sim->page));
+                }
+            } else {
+                // Data past the page end wraps to the beginning of the page
+                sim->page[(sim->address + pos - 1 - sim->address_bytes) & 0xff] &= tx;
+                sim->page_bytes++;
+            }
+            break;
+        case W25Q_SECTOR_ERASE:
+        case W25Q_32K_BLK_ERASE:
+        case W25Q_64K_BLK_ERASE:
+            if (pos <= sim->address_bytes) {
+                sim->address = (sim->address << 8) | tx;
+            }
+            break;
+        default:
+            break;
+    }
+
+    return rx;
+
+}
+
+/**
+ * @brief Finish a transaction (chip select released), executing write commands
+*/
+static void sim_end(struct w25q_sim *sim) {
+
+    unsigned char wel = sim->status[0] & SIM_SR1_WEL;
+
+    if (!sim->accepted || sim->pos == 0) {
+        return;
+    }
+    if ((sim->status[1] & SIM_SR2_SUS) && !sim_suspend_allows(sim)) {
+        sim->stats.rejected++;
+        return;
+    }
+
+    switch (sim->opcode) {
+        case W25Q_ERASE_PROGRAM_SUSPEND:
+            if (!(sim->status[0] & SIM_SR1_BUSY)) {
+                break;
+            }
+            // The array stays busy for tSUS before reads are accepted
+            sim->suspended_opcode = sim->busy_opcode;
+            sim->suspended_start = sim->busy_start;
+            sim->suspended_size = sim->busy_size;
+            sim->suspended_ns = sim->busy_until_ns - sim_now_ns;
+            sim->busy_opcode = 0;
+            sim->busy_until_ns = sim_now_ns + sim->timing.suspend_us * 1000ULL;
+            sim->status[1] |= SIM_SR2_SUS;
+            break;
+        case W25Q_ERASE_PROGRAM_RESUME:
+            if (!(sim->status[1] & SIM_SR2_SUS)) {
+                break;
+            }
+            sim->status[1] &= ~SIM_SR2_SUS;
+            sim->status[0] |= SIM_SR1_BUSY;
+            sim->busy_opcode = sim->suspended_opcode;
+            sim->busy_start = sim->suspended_start;
+            sim->busy_size = sim->suspended_size;
+            sim->busy_until_ns = sim_now_ns + sim->suspended_ns;
+            sim->resumed_ns = sim_now_ns;
+            break;
+        case W25Q_WRITE_ENABLE:
+            sim->status[0] |= SIM_SR1_WEL;
+            break;
+        case W25Q_WRITE_DISABLE:
+            sim->status[0] &= ~SIM_SR1_WEL;
+            break;
+        case W25Q_VOLATILE_SR_WRITE_ENABLE:
+            sim->sr_volatile = 1;
+            return;
+        case W25Q_WRITE_STATUS_REG_1:
+        case W25Q_WRITE_STATUS_REG_2:
+            if (!wel && !sim->sr_volatile) {
+                sim->stats.rejected++;
+                break;
+            }
+            if (sim->opcode == W25Q_WRITE_STATUS_REG_1) {
+                sim->status[0] = (sim->status[0] & ~SIM_SR1_MASK) | (sim->page[0] & SIM_SR1_MASK);
+                if (sim->page_bytes == 2) {
+                    sim->status[1] = (sim->status[1] & ~SIM_SR2_MASK) | (sim->page[1] & SIM_SR2_MASK);
+                }
+            } else {
+                sim->status[1] = (sim->status[1] & ~SIM_SR2_MASK) | (sim->page[0] & SIM_SR2_MASK);
+            }
+            if (sim->sr_volatile) {
+                sim->status[0] &= ~SIM_SR1_WEL;
+            } else {
+                sim_start_busy(sim, sim->timing.status_write_us);
+            }
+            break;
+        case W25Q_ENTER_4B_ADDRESS_MODE:
+            sim->address_4b = 1;
+            break;
+        case W25Q_EXIT_4B_ADDRESS_MODE:
+            sim->address_4b = 0;
+            break;
+        case W25Q_POWER_DOWN:
+            sim->power_down = 1;
+            sim->power_down_since_ns = sim_now_ns;
+            sim->ready_ns = sim_now_ns + sim->timing.power_down_us * 1000ULL;
+            sim->stats.power_downs++;
+            break;
+        case W25Q_RELEASE_POWER_DOWN:
+            if (sim->power_down) {
+                sim->power_down = 0;
+                sim->stats.power_down_ns += sim_now_ns - sim->power_down_since_ns;
+                sim->ready_ns = sim_now_ns + sim->timing.release_power_down_us * 1000ULL;
+            }
+            break;
+        case W25Q_ENABLE_RESET:
+            break;
+        case W25Q_RESET:
+            sim->status[0] = 0;
+            sim->status[1] &= ~SIM_SR2_SUS;
+            sim->address_4b = 0;
+            sim->busy_opcode = 0;
+            break;
+        case W25Q_PAGE_PROGRAM:
+            if (!wel || sim->pos < sim->address_bytes + 2u) {
+                break;
+            }
+            {
+                unsigned long base = (sim->address % sim->size) & ~0xffUL;
+                unsigned bytes = sim->page_bytes > 256 ? 256 : sim->page_bytes;
+                unsigned long long us;
+
+                // Programming only clears bits
+                for (unsigned i = 0; i < 256; i++) {
+                    sim->image[base + i] &= sim->page[i];
+                }
+                sim->busy_start = base;
+                sim->busy_size = 256;
+                us = sim->timing.byte_program_us +
+                     ((unsigned long long)(bytes - 1) * sim->timing.byte_program_next_ns) / 1000;
+                if (us > sim->timing.page_program_us) {
+                    us = sim->timing.page_program_us;
+                }
+                sim->stats.page_programs++;
+                sim_start_busy(sim, us);
+            }
+            break;
+        case W25Q_SECTOR_ERASE:
+            if (wel && sim->pos > sim->address_bytes) {
+                sim_erase(sim, 4096, sim->timing.sector_erase_us);
+            }
+            break;
+        case W25Q_32K_BLK_ERASE:
+            if (wel && sim->pos > sim->address_bytes) {
+                sim_erase(sim, 32768, sim->timing.blk32_erase_us);
+            }
+            break;
+        case W25Q_64K_BLK_ERASE:
+            if (wel && sim->pos > sim->address_bytes) {
+                sim_erase(sim, 65536, sim->timing.blk64_erase_us);
+            }
+            break;
+        case W25Q_CHIP_ERASE:
+        case 0x60:
+            if (wel) {
+                memset(sim->image, 0xff, sim->size);
+                sim->stats.erases++;
+                sim_start_busy(sim, sim->timing.chip_erase_us);
+            }
+            break;
+        default:
+            break;
+    }
+    sim->sr_volatile = 0;
+
+    // Write-type commands without WEL are dropped by the chip
+    if (!wel && (sim->opcode == W25Q_PAGE_PROGRAM || sim->opcode == W25Q_SECTOR_ERASE ||
+                 sim->opcode == W25Q_32K_BLK_ERASE || sim->opcode == W25Q_64K_BLK_ERASE ||
+                 sim->opcode == W25Q_CHIP_ERASE || sim->opcode == 0x60)) {
+        sim->stats.rejected++;
+    }
+
+}
+
+static void sim_spi_transfer(struct w25q_sim *sim, void *data_in, void *data_out, unsigned size) {
+
+    unsigned char *rx = (unsigned char *)data_in;
+    const unsigned char *tx = (const unsigned char *)data_out;
+
+    if (sim == NULL) {
+        memset(rx, 0xff, size);
+        return;
+    }
+
+    sim_call(sim);
+    sim_begin(sim);
+    // rx and tx usually point to the same buffer, read each byte before overwriting it
+    for (unsigned i = 0; i < size; i++) {
+        unsigned char byte = tx[i];
+        rx[i] = sim_byte(sim, byte);
+    }
+    sim_end(sim);
+
+}
+
+/**
+ * @brief Run one scatter-gather transaction
+*/
+static void sim_transaction(struct w25q_sim *sim, const struct w25q_segment *segments, unsigned count) {
+
+    if (sim == NULL) {
+        for (unsigned i = 0; i < count; i++) {
+            if (segments[i].rx != NULL) {
+                memset(segments[i].rx, 0xff, segments[i].size);
+            }
+        }
+        return;
+    }
+
+    sim_begin(sim);
+    for (unsigned i = 0; i < count; i++) {
+        const unsigned char *tx = (const unsigned char *)segments[i].tx;
+        unsigned char *rx = (unsigned char *)segments[i].rx;
+
+        for (unsigned j = 0; j < segments[i].size; j++) {
+            unsigned char byte = sim_byte(sim, tx != NULL ? tx[j] : 0xff);
+            if (rx != NULL) {
+                rx[j] = byte;
+            }
+        }
+    }
+    sim_end(sim);
+
+}
+
+static void sim_spi_sg(struct w25q_sim *sim, const struct w25q_segment *segments, unsigned count) {
+
+    if (sim != NULL) {
+        sim_call(sim);
+    }
+    sim_transaction(sim, segments, count);
+
+}
+
+static void sim_spi_chain(struct w25q_sim *sim, const struct w25q_transaction *transactions, unsigned count) {
+
+    if (sim != NULL) {
+        sim_call(sim);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        sim_transaction(sim, transactions[i].segments, transactions[i].count);
+    }
+
+}
+
+/**
+ * @brief Multi-line transaction
+*/
+static void sim_xfer(struct w25q_sim *sim, const struct w25q_xfer *xfer) {
+
+    unsigned char single = xfer->opcode_lines <= 1 && xfer->address_lines <= 1 && xfer->mode_lines == 0 &&
+                           xfer->data_lines <= 1 && (xfer->dummy_cycles & 7) == 0 && xfer->opcode_lines;
+    unsigned char address_bytes;
+    unsigned char opcode = sim != NULL ? sim_decode_opcode(sim, xfer->opcode, &address_bytes) : 0;
+    unsigned char ok = 1;
+    unsigned char *rx = (unsigned char *)xfer->rx;
+    unsigned long long clocks = 0;
+
+    if (sim == NULL) {
+        if (rx != NULL) {
+            memset(rx, 0xff, xfer->data_size);
+        }
+        return;
+    }
+    sim_call(sim);
+
+    // Plain SPI commands go through the byte decoder
+    if (single && !sim->continuous) {
+        const unsigned char *tx = (const unsigned char *)xfer->tx;
+
+        sim_begin(sim);
+        sim_byte(sim, xfer->opcode);
+        for (unsigned i = xfer->address_bytes; i > 0; i--) {
+            sim_byte(sim, (xfer->address >> ((i - 1) * 8)) & 0xff);
+        }
+        for (unsigned i = 0; i < xfer->dummy_cycles / 8u; i++) {
+            sim_byte(sim, 0xff);
+        }
+        for (unsigned i = 0; i < xfer->data_size; i++) {
+            unsigned char byte = sim_byte(sim, tx != NULL ? tx[i] : 0xff);
+            if (rx != NULL) {
+                rx[i] = byte;
+            }
+        }
+        sim_end(sim);
+        return;
+    }
+
+    sim_update(sim);
+    sim->stats.transfers++;
+    if (xfer->opcode_lines) {
+        clocks += 8 / xfer->opcode_lines;
+        sim->stats.bus_bytes++;
+    }
+    if (xfer->address_bytes) {
+        clocks += xfer->address_bytes * 8u / (xfer->address_lines ? xfer->address_lines : 1);
+    }
+    if (xfer->mode_lines) {
+        clocks += 8 / xfer->mode_lines;
+        sim->stats.bus_bytes++;
+    }
+    clocks += xfer->dummy_cycles;
+    clocks += (unsigned long long)xfer->data_size * 8 / (xfer->data_lines ? xfer->data_lines : 1);
+    sim->stats.bus_bytes += xfer->address_bytes + xfer->data_size;
+    sim_clock(sim, clocks);
+
+    // Continuous read mode: no opcode, the previous Quad I/O read continues
+    if (xfer->opcode_lines == 0) {
+        ok = sim->continuous != 0;
+        opcode = W25Q_FAST_READ_QUAD_IO;
+        address_bytes = sim->continuous;
+    } else if (sim->continuous) {
+        ok = 0;
+    }
+    if (xfer->address_bytes != address_bytes) {
+        ok = 0;
+    }
+    if ((sim->status[0] & SIM_SR1_BUSY) || sim->power_down || sim_now_ns < sim->ready_ns) {
+        ok = 0;
+    }
+
+    switch (opcode) {
+        case W25Q_FAST_READ_DUAL_OUTPUT:
+            ok = ok && xfer->address_lines == 1 && xfer->data_lines == 2 && xfer->dummy_cycles == 8;
+            break;
+        case W25Q_FAST_READ_QUAD_OUTPUT:
+            ok = ok && (sim->status[1] & SIM_SR2_QE) && xfer->address_lines == 1 && xfer->data_lines == 4 &&
+                 xfer->dummy_cycles == 8;
+            break;
+        case W25Q_FAST_READ_QUAD_IO:
+            ok = ok && (sim->status[1] & SIM_SR2_QE) && xfer->address_lines == 4 && xfer->mode_lines == 4 &&
+                 xfer->data_lines == 4 && xfer->dummy_cycles == 4;
+            // M5-4 = 10 keeps the chip in continuous read mode
+            if (ok) {
+                sim->continuous = (xfer->mode & 0x30) == 0x20 ? address_bytes : 0;
+            }
+            break;
+        default:
+            ok = 0;
+            break;
+    }
+
+    if (!ok) {
+        sim->stats.rejected++;
+        if (rx != NULL) {
+            memset(rx, 0xff, xfer->data_size);
+        }
+        return;
+    }
+    for (unsigned i = 0; rx != NULL && i < xfer->data_size; i++) {
+        rx[i] = sim->image[(xfer->address + i) % sim->size];
+    }
+
+}
+
+static void sim_delay(unsigned t) {
+
+    sim_delay_calls++;
+    sim_delay_ns += (unsigned long long)t * 1000000ULL;
+    sim_now_ns += (unsigned long long)t * 1000000ULL;
+
+}
+
+static void sim_delay_us(unsigned t) {
+
+    sim_delay_calls++;
+    sim_delay_ns += (unsigned long long)t * 1000ULL;
+    sim_now_ns += (unsigned long long)t * 1000ULL;
+
+}
+
+static unsigned long sim_clock_us(void) {
+    return (unsigned long)(sim_now_ns / 1000ULL);
+}
+
+/* One set of transfer functions per chip select slot */
+#define W25Q_SIM_SLOT(n) \
+    static void sim_spi_transfer_##n(void *data_in, void *data_out, unsigned size) { \
+        sim_spi_transfer(sim_slots[n], data_in, data_out, size); \
+    } \
+    static void sim_spi_sg_##n(const struct w25q_segment *segments, unsigned count) { \
+        sim_spi_sg(sim_slots[n], segments, count); \
+    } \
+    static void sim_xfer_##n(const struct w25q_xfer *xfer) { \
+        sim_xfer(sim_slots[n], xfer); \
+    } \
+    static void sim_spi_chain_##n(const struct w25q_transaction *transactions, unsigned count) { \
+        sim_spi_chain(sim_slots[n], transactions, count); \
+    }
+
+W25Q_SIM_SLOT(0)
+W25Q_SIM_SLOT(1)
+W25Q_SIM_SLOT(2)
+W25Q_SIM_SLOT(3)
+
+static const struct w25q_sim_port sim_ports[W25Q_SIM_MAX_CHIPS] = {
+    {sim_spi_transfer_0, sim_spi_sg_0, sim_delay, sim_delay_us, sim_xfer_0, sim_clock_us, sim_spi_chain_0},
+    {sim_spi_transfer_1, sim_spi_sg_1, sim_delay, sim_delay_us, sim_xfer_1, sim_clock_us, sim_spi_chain_1},
+    {sim_spi_transfer_2, sim_spi_sg_2, sim_delay, sim_delay_us, sim_xfer_2, sim_clock_us, sim_spi_chain_2},
+    {sim_spi_transfer_3, sim_spi_sg_3, sim_delay, sim_delay_us, sim_xfer_3, sim_clock_us, sim_spi_chain_3}
+};
+
+/* Simulator functions */
+
+unsigned char w25q_sim_init(struct w25q_sim *sim, enum w25q_id_t model, const char *image_path) {
+
+    unsigned long size = 131072;
+
+    if (sim == NULL || model < W25Q10_ID || model > W25Q512_ID) {
+        return 0;
+    }
+
+    memset(sim, 0, sizeof(*sim));
+    for (int id = W25Q10_ID; id < (int)model; id++) {
+        size *= 2;
+    }
+    sim->model = model;
+    sim->size = size;
+    sim->fd = -1;
+    sim->manufacturer_id = W25Q_PRODUCER_ID;
+    sim->sfdp_bfpt_dwords = 16;
+    sim->sfdp_4b_table = 1;
+    sim->bus_hz = W25Q_SIM_DEFAULT_BUS_HZ;
+
+    // Typical values from the W25Qxx datasheets, chip erase scales with density
+    sim->timing.byte_program_us = 30;
+    sim->timing.byte_program_next_ns = 2500;
+    sim->timing.page_program_us = 700;
+    sim->timing.sector_erase_us = 45000;
+    sim->timing.blk32_erase_us = 120000;
+    sim->timing.blk64_erase_us = 150000;
+    sim->timing.chip_erase_us = (size >> 20) ? (size >> 20) * 2500000UL : 500000UL;
+    sim->timing.status_write_us = 10000;
+    sim->timing.suspend_us = 20;
+    sim->timing.resume_to_suspend_us = 20;
+    sim->timing.power_down_us = 3;
+    sim->timing.release_power_down_us = 3;
+
+    if (image_path == NULL) {
+        sim->image = (unsigned char *)malloc(size);
+        if (sim->image == NULL) {
+            return 0;
+        }
+        memset(sim->image, 0xff, size);
+        return 1;
+    }
+
+    {
+        struct stat st;
+        unsigned char erased[4096];
+        unsigned long len;
+        int fd = open(image_path, O_RDWR | O_CREAT, 0644);
+
+        if (fd < 0) {
+            return 0;
+        }
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return 0;
+        }
+        // Extend short images with erased bytes
+        memset(erased, 0xff, sizeof(erased));
+        for (len = (unsigned long)st.st_size; len < size; ) {
+            unsigned long chunk = size - len > sizeof(erased) ? sizeof(erased) : size - len;
+            if (pwrite(fd, erased, chunk, (off_t)len) != (ssize_t)chunk) {
+                close(fd);
+                return 0;
+            }
+            len += chunk;
+        }
+        sim->image = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (sim->image == MAP_FAILED) {
+            sim->image = NULL;
+            close(fd);
+            return 0;
+        }
+        sim->fd = fd;
+    }
+
+    return 1;
+
+}
+
+void w25q_sim_deinit(struct w25q_sim *sim) {
+
+    for (unsigned i = 0; i < W25Q_SIM_MAX_CHIPS; i++) {
+        if (sim_slots[i] == sim) {
+            sim_slots[i] = NULL;
+        }
+    }
+    if (sim->image == NULL) {
+        return;
+    }
+    if (sim->fd >= 0) {
+        munmap(sim->image, sim->size);
+        close(sim->fd);
+        sim->fd = -1;
+    } else {
+        free(sim->image);
+    }
+    sim->image = NULL;
+
+}
+
+const struct w25q_sim_port * w25q_sim_attach(struct w25q_sim *sim, unsigned slot) {
+
+    if (slot >= W25Q_SIM_MAX_CHIPS) {
+        return NULL;
+    }
+    sim_slots[slot] = sim;
+    return &sim_ports[slot];
+
+}
+
+void w25q_sim_set_bus_clock(struct w25q_sim *sim, unsigned long hz) {
+
+    if (hz != 0) {
+        sim->bus_hz = hz;
+    }
+
+}
+
+unsigned long long w25q_sim_now_ns(void) {
+    return sim_now_ns;
+}
+
+void w25q_sim_delay_stats(unsigned long long *calls, unsigned long long *ns) {
+
+    if (calls != NULL) {
+        *calls = sim_delay_calls;
+    }
+    if (ns != NULL) {
+        *ns = sim_delay_ns;
+    }
+
+}
+
+/**
+ * @brief Move a time stamp to the time base starting now, times already past become 0
+*/
+static void sim_rebase(unsigned long long *ns) {
+    *ns = *ns > sim_now_ns ? *ns - sim_now_ns : 0;
+}
+
+void w25q_sim_reset_stats(struct w25q_sim *sim) {
+
+    // Keep pending operations, power transitions and the resume guard relative to the new time base.
+    // Deep power-down time is counted from here, chips keeping their stats book the time so far
+    for (unsigned i = 0; i < W25Q_SIM_MAX_CHIPS; i++) {
+        struct w25q_sim *s = sim_slots[i];
+
+        if (s == NULL) {
+            continue;
+        }
+        if (s != sim && s->power_down) {
+            s->stats.power_down_ns += sim_now_ns - s->power_down_since_ns;
+        }
+        sim_rebase(&s->busy_until_ns);
+        sim_rebase(&s->ready_ns);
+        sim_rebase(&s->power_down_since_ns);
+        sim_rebase(&s->resumed_ns);
+    }
+    sim_now_ns = 0;
+    sim_delay_calls = 0;
+    sim_delay_ns = 0;
+    if (sim != NULL) {
+        memset(&sim->stats, 0, sizeof(sim->stats));
+    }
+
+}
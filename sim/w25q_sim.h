@@ -0,0 +1,191 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _W25Q_SIM_H_
+#define _W25Q_SIM_H_
+
+#include "w25qxx.h"
+
+/* Host-side W25Qxx simulator (Linux) */
+
+/* Number of chips that can be attached at the same time */
+#define W25Q_SIM_MAX_CHIPS 4
+
+/* Default SPI clock, same as the Arduino example */
+#define W25Q_SIM_DEFAULT_BUS_HZ 1000000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Datasheet timing used by the simulated chip (typical values)
+*/
+struct w25q_sim_timing {
+    unsigned byte_program_us;       // tBP1, first byte of a page program
+    unsigned byte_program_next_ns;  // tBP2, each additional byte
+    unsigned page_program_us;       // tPP, upper bound of a page program
+    unsigned sector_erase_us;       // tSE
+    unsigned blk32_erase_us;        // tBE1
+    unsigned blk64_erase_us;        // tBE2
+    unsigned long chip_erase_us;    // tCE
+    unsigned status_write_us;       // tW
+    unsigned suspend_us;            // tSUS, Suspend until the chip is ready for reads
+    unsigned resume_to_suspend_us;  // tRS, minimum time from a Resume to the next Suspend
+    unsigned power_down_us;         // tDP, Power-Down until the chip can be woken
+    unsigned release_power_down_us; // tRES1, Release Power-Down until the chip accepts commands
+};
+
+/**
+ * @brief Per-chip bus and array activity counters
+*/
+struct w25q_sim_stats {
+    unsigned long long transfers;       // Chip-select cycles
+    unsigned long long calls;           // Transport function calls
+    unsigned long long bus_bytes;       // Bytes clocked on the bus
+    unsigned long long bus_ns;          // Time spent clocking bytes
+    unsigned long long busy_polls;      // Status reads answered with BUSY set
+    unsigned long long rejected;        // Commands ignored (busy or WEL clear)
+    unsigned long long page_programs;
+    unsigned long long erases;
+    unsigned long long power_downs;
+    unsigned long long power_down_ns;   // Time spent in deep power-down
+};
+
+/**
+ * @brief Simulated chip instance
+*/
+struct w25q_sim {
+    enum w25q_id_t model;
+    unsigned char *image;
+    unsigned long size;                 // Bytes
+    int fd;                             // Backing file, -1 for RAM images
+    unsigned long bus_hz;
+    unsigned long call_ns;              // Host time per transport call (driver entry, DMA setup), 0 by default
+    struct w25q_sim_timing timing;
+    struct w25q_sim_stats stats;
+
+    /* Chip state */
+    unsigned char status[3];
+    unsigned long long busy_until_ns;
+    unsigned char sr_volatile;          // Next status write is volatile (0x50)
+    unsigned char continuous;           // Continuous read mode: address bytes of the next transaction, 0 when off
+    unsigned char address_4b;           // 4-Byte Address Mode (ADS)
+    unsigned char sfdp[256];            // SFDP area, built from the model and timing on each Read SFDP
+    unsigned char manufacturer_id;      // Returned by Read JEDEC ID, W25Q_PRODUCER_ID by default
+    unsigned char sfdp_bfpt_dwords;     // Length of the basic parameter table, 9 to 16 (default)
+    unsigned char sfdp_4b_table;        // Publish the 4-byte address instruction table above 16 MB, 1 by default
+    unsigned char power_down;           // Deep power-down, only Release Power-Down is decoded
+    unsigned long long power_down_since_ns;
+    unsigned long long ready_ns;        // Commands before this time are ignored (tDP, tRES1)
+
+    /* Program/erase in progress and the one on hold after an Erase/Program Suspend */
+    unsigned char busy_opcode;
+    unsigned long busy_start;
+    unsigned long busy_size;
+    unsigned char suspended_opcode;
+    unsigned long suspended_start;
+    unsigned long suspended_size;
+    unsigned long long suspended_ns;    // Time left on the suspended operation
+    unsigned long long resumed_ns;
+
+    /* Decoder state for the current transaction */
+    unsigned char opcode;               // 3-byte address form of the opcode
+    unsigned char address_bytes;
+    unsigned pos;
+    unsigned address;
+    unsigned char page[256];
+    unsigned page_bytes;
+    unsigned char accepted;
+};
+
+/**
+ * @brief Functions to hand to w25q_mount for an attached chip
+*/
+struct w25q_sim_port {
+    w25q_spi_transfer_fn spi_send;
+    w25q_spi_sg_fn spi_sg;
+    w25q_delay_fn delay;
+    w25q_delay_us_fn delay_us;
+    w25q_xfer_fn xfer;
+    w25q_clock_fn clock;
+    w25q_spi_chain_fn spi_chain;
+};
+
+/**
+ * @brief Create a simulated chip
+ *
+ * @param[out] sim Simulator instance
+ * @param[in] model Chip model to emulate
+ * @param[in] image_path Backing image file, mmap'd and created (erased) when missing. NULL for a RAM image.
+ *
+ * @return 1 on success, 0 on failure
+ *
+ * @note Change manufacturer_id and the sfdp_ fields before mounting to emulate parts of other vendors
+ *       or with shorter SFDP tables.
+*/
+unsigned char w25q_sim_init(struct w25q_sim *sim, enum w25q_id_t model, const char *image_path);
+
+/**
+ * @brief Release the image of a simulated chip
+*/
+void w25q_sim_deinit(struct w25q_sim *sim);
+
+/**
+ * @brief Connect a simulated chip to a chip select slot
+ *
+ * @param[in] sim Simulator instance, NULL to detach the slot
+ * @param[in] slot Slot number, less than W25Q_SIM_MAX_CHIPS
+ *
+ * @return Transfer/delay functions bound to the slot, NULL when the slot is invalid
+*/
+const struct w25q_sim_port * w25q_sim_attach(struct w25q_sim *sim, unsigned slot);
+
+/**
+ * @brief Set the simulated SPI clock
+*/
+void w25q_sim_set_bus_clock(struct w25q_sim *sim, unsigned long hz);
+
+/**
+ * @brief Current virtual time in nanoseconds, shared by all simulated chips
+*/
+unsigned long long w25q_sim_now_ns(void);
+
+/**
+ * @brief Total number of delay calls and the virtual time they consumed
+*/
+void w25q_sim_delay_stats(unsigned long long *calls, unsigned long long *ns);
+
+/**
+ * @brief Reset the virtual clock, delay counters and the chip counters
+ *
+ * @param[in] sim Chip whose counters are cleared, may be NULL
+*/
+void w25q_sim_reset_stats(struct w25q_sim *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
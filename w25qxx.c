@@ -25,28 +25,288 @@ SOFTWARE.
 #include "w25qxx.h"
 #include "string.h"
 
+#if defined(__ARM_FEATURE_CRC32) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_acle.h>
+#define W25Q_CRC32_ARM
+#endif
+
 #ifndef NULL
 #define NULL 0
 #endif
 
 #ifdef W25Q_MEMORY_MANAGEMENT
-unsigned char w25q_mem_mark_sector(struct w25q_flash *flash, unsigned short sector, unsigned char used) {
+
+/**
+ * @brief Index of the lowest set bit, value must not be 0
+*/
+static unsigned w25q_mem_ctz(unsigned long value) {
+
+    #if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctzl(value);
+    #else
+    unsigned n = 0;
+
+    while (!(value & 1)) {
+        value >>= 1;
+        n++;
+    }
+    return n;
+    #endif
+
+}
+
+static unsigned w25q_mem_popcount(unsigned long value) {
+
+    #if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_popcountl(value);
+    #else
+    unsigned n = 0;
+
+    for (; value != 0; value &= value - 1) {
+        n++;
+    }
+    return n;
+    #endif
+
+}
+
+/**
+ * @brief Set or clear the bits of mask in one mapping word and refresh its summary bit
+*/
+static void w25q_mem_update(struct w25q_memory_map *map, unsigned word, unsigned long mask, unsigned char used) {
+
+    unsigned long old = map->mapping[word];
+    unsigned long bit = 1UL << (word % W25Q_MEM_WORD_BITS);
+
+    if (used) {
+        map->mapping[word] = old | mask;
+        map->used += w25q_mem_popcount(mask & ~old);
+    } else {
+        map->mapping[word] = old & ~mask;
+        map->used -= w25q_mem_popcount(mask & old);
+    }
+    if (map->mapping[word] == ~0UL) {
+        map->summary[word / W25Q_MEM_WORD_BITS] &= ~bit;
+    } else {
+        map->summary[word / W25Q_MEM_WORD_BITS] |= bit;
+    }
+
+}
+
+unsigned char w25q_mem_attach(struct w25q_flash *flash, struct w25q_memory_map *map, void *arena,
+                              unsigned arena_size) {
+
+    unsigned sectors = (unsigned)(flash->size / 16);
+    unsigned words = W25Q_MEM_WORDS(sectors);
+
+    if (map == NULL || arena == NULL || sectors == 0 || arena_size < W25Q_MEM_ARENA_SIZE(sectors)) {
+        return 0;
+    }
+    map->mapping = (unsigned long *)arena;
+    map->summary = map->mapping + words;
+    map->size = sectors;
+    map->used = 0;
+    memset(map->mapping, 0, words * sizeof(unsigned long));
+    memset(map->summary, 0, W25Q_MEM_WORDS(words) * sizeof(unsigned long));
+    for (unsigned i = 0; i < words; i++) {
+        map->summary[i / W25Q_MEM_WORD_BITS] |= 1UL << (i % W25Q_MEM_WORD_BITS);
+    }
+    // Padding past the last sector reads as used and is not counted
+    if (sectors % W25Q_MEM_WORD_BITS != 0) {
+        w25q_mem_update(map, words - 1, ~0UL << (sectors % W25Q_MEM_WORD_BITS), 1);
+        map->used = 0;
+    }
+    flash->mem_map = map;
+    return 1;
+
+}
+
+unsigned char w25q_mem_mark_sector(struct w25q_flash *flash, unsigned sector, unsigned char used) {
 
     struct w25q_memory_map *map = flash->mem_map;
-    unsigned short byte_num = sector / 8;
-    unsigned char bit_num = sector % 8;
 
-    if (sector >= map->size) {
+    if (map == NULL || sector >= map->size) {
         return 0;
-    } else {
-        if (used) {
-            map->mapping[byte_num] |= (1 << bit_num);
-        } else {
-            map->mapping[byte_num] &= ~(1 << bit_num);
-        }
     }
+    w25q_mem_update(map, sector / W25Q_MEM_WORD_BITS, 1UL << (sector % W25Q_MEM_WORD_BITS), used);
     return 1;
     
+}
+
+unsigned char w25q_mem_mark_range(struct w25q_flash *flash, unsigned first, unsigned count, unsigned char used) {
+
+    struct w25q_memory_map *map = flash->mem_map;
+
+    if (map == NULL || first >= map->size || count > map->size - first) {
+        return 0;
+    }
+    while (count > 0) {
+        unsigned bit = first % W25Q_MEM_WORD_BITS;
+        unsigned n = W25Q_MEM_WORD_BITS - bit;
+        unsigned long mask;
+
+        if (n > count) {
+            n = count;
+        }
+        mask = (n == W25Q_MEM_WORD_BITS) ? ~0UL : ((1UL << n) - 1) << bit;
+        w25q_mem_update(map, first / W25Q_MEM_WORD_BITS, mask, used);
+        first += n;
+        count -= n;
+    }
+    return 1;
+
+}
+
+unsigned char w25q_mem_check_sector(struct w25q_flash *flash, unsigned sector) {
+
+    struct w25q_memory_map *map = flash->mem_map;
+
+    if (map == NULL || sector >= map->size) {
+        return 0;
+    }
+    return (map->mapping[sector / W25Q_MEM_WORD_BITS] >> (sector % W25Q_MEM_WORD_BITS)) & 1;
+
+}
+
+unsigned w25q_mem_find_free(struct w25q_flash *flash, unsigned from) {
+
+    struct w25q_memory_map *map = flash->mem_map;
+    unsigned word, summary_words;
+    unsigned long bits;
+
+    if (map == NULL || from >= map->size) {
+        return W25Q_MEM_NONE;
+    }
+    word = from / W25Q_MEM_WORD_BITS;
+    bits = ~map->mapping[word] & (~0UL << (from % W25Q_MEM_WORD_BITS));
+    if (bits != 0) {
+        return word * W25Q_MEM_WORD_BITS + w25q_mem_ctz(bits);
+    }
+
+    // Next word with a free sector, from the summary
+    word++;
+    summary_words = W25Q_MEM_WORDS(W25Q_MEM_WORDS(map->size));
+    for (unsigned s = word / W25Q_MEM_WORD_BITS; s < summary_words; s++) {
+        bits = map->summary[s];
+        if (s == word / W25Q_MEM_WORD_BITS) {
+            bits &= ~0UL << (word % W25Q_MEM_WORD_BITS);
+        }
+        if (bits != 0) {
+            word = s * W25Q_MEM_WORD_BITS + w25q_mem_ctz(bits);
+            return word * W25Q_MEM_WORD_BITS + w25q_mem_ctz(~map->mapping[word]);
+        }
+    }
+    return W25Q_MEM_NONE;
+
+}
+
+unsigned w25q_mem_find_free_run(struct w25q_flash *flash, unsigned from, unsigned count) {
+
+    struct w25q_memory_map *map = flash->mem_map;
+    unsigned start;
+
+    if (map == NULL || count == 0) {
+        return W25Q_MEM_NONE;
+    }
+    start = w25q_mem_find_free(flash, from);
+    while (start != W25Q_MEM_NONE && count <= map->size - start) {
+        unsigned end = start + count;
+        unsigned pos = start;
+
+        // First used sector before the end of the candidate run
+        while (pos < end) {
+            unsigned long bits = map->mapping[pos / W25Q_MEM_WORD_BITS] & (~0UL << (pos % W25Q_MEM_WORD_BITS));
+
+            if (bits != 0) {
+                unsigned used = (pos & ~(unsigned)(W25Q_MEM_WORD_BITS - 1)) + w25q_mem_ctz(bits);
+
+                if (used < end) {
+                    pos = used;
+                    break;
+                }
+            }
+            pos = (pos | (unsigned)(W25Q_MEM_WORD_BITS - 1)) + 1;
+        }
+        if (pos >= end) {
+            return start;
+        }
+        start = w25q_mem_find_free(flash, pos + 1);
+    }
+    return W25Q_MEM_NONE;
+
+}
+
+unsigned w25q_mem_alloc(struct w25q_flash *flash, unsigned count) {
+
+    unsigned sector = w25q_mem_find_free_run(flash, 0, count);
+
+    if (sector != W25Q_MEM_NONE) {
+        w25q_mem_mark_range(flash, sector, count, 1);
+    }
+    return sector;
+
+}
+
+/**
+ * @brief Append a decimal number to a string
+ * 
+ * @return End of the string
+*/
+static char * w25q_debug_number(char *p, unsigned long value) {
+
+    char digits[10];
+    unsigned count = 0;
+
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        *p++ = digits[--count];
+    }
+    *p = '\0';
+    return p;
+
+}
+
+static char * w25q_debug_text(char *p, const char *text) {
+
+    while (*text != '\0') {
+        *p++ = *text++;
+    }
+    *p = '\0';
+    return p;
+
+}
+
+void w25q_debug_mem_summary(struct w25q_flash *flash, w25q_debug_printer printer) {
+
+    char line[80];
+    char *p;
+    unsigned used;
+    unsigned sectors = (unsigned)(flash->size / 16);
+
+    p = w25q_debug_text(line, "W25Q flash: ");
+    p = w25q_debug_number(p, flash->size * 256);
+    p = w25q_debug_text(p, " bytes, ");
+    p = w25q_debug_number(p, sectors);
+    w25q_debug_text(p, " sectors\n");
+    printer(line);
+
+    if (flash->mem_map == NULL) {
+        printer("No memory map attached\n");
+        return;
+    }
+    used = flash->mem_map->used;
+    p = w25q_debug_text(line, "Mapped sectors: ");
+    p = w25q_debug_number(p, flash->mem_map->size);
+    p = w25q_debug_text(p, ", used: ");
+    p = w25q_debug_number(p, used);
+    p = w25q_debug_text(p, ", free: ");
+    p = w25q_debug_number(p, flash->mem_map->size - used);
+    w25q_debug_text(p, "\n");
+    printer(line);
+
 }
 #endif
 
@@ -59,6 +319,430 @@ static void set_dummy_bytes(void *p, unsigned size) {
     }
 }
 
+/**
+ * @brief Typical and maximum operation times (W25Qxx datasheets)
+*/
+static const struct w25q_timing w25q_default_timing[W25Q_OP_COUNT] = {
+    {700, 3000},                // Page program
+    {45000, 400000},            // 4KB sector erase
+    {120000, 1600000},          // 32KB block erase
+    {150000, 2000000},          // 64KB block erase
+    {0, 0},                     // Chip erase, depends on density
+    {10000, 15000}              // Write status register
+};
+
+/**
+ * @brief Erase size (log2) of each erase operation
+*/
+static const unsigned char w25q_erase_shift[W25Q_OP_64K_BLK_ERASE + 1] = {0, 12, 15, 16};
+
+/**
+ * @brief Read command layout for each read mode
+*/
+static const struct w25q_read_cmd {
+    unsigned char opcode;
+    unsigned char opcode_4b;            // Same read with a 4-byte address
+    unsigned char address_lines;
+    unsigned char mode_lines;
+    unsigned char dummy_cycles;
+    unsigned char data_lines;
+} w25q_read_cmds[] = {
+    {W25Q_READ_DATA, W25Q_READ_DATA_4B, 1, 0, 0, 1},
+    {W25Q_FAST_READ, W25Q_FAST_READ_4B, 1, 0, 8, 1},
+    {W25Q_FAST_READ_DUAL_OUTPUT, W25Q_FAST_READ_DUAL_OUTPUT_4B, 1, 0, 8, 2},
+    {W25Q_FAST_READ_QUAD_OUTPUT, W25Q_FAST_READ_QUAD_OUTPUT_4B, 1, 0, 8, 4},
+    {W25Q_FAST_READ_QUAD_IO, W25Q_FAST_READ_QUAD_IO_4B, 4, 4, 4, 4}
+};
+
+/* CRC-32 (IEEE 802.3, reflected 0xedb88320) tables, row k advances a byte through k more zero bytes */
+static const unsigned long w25q_crc32_table[W25Q_CRC32_SLICES][256] = {
+    {
+        0x00000000UL, 0x77073096UL, 0xee0e612cUL, 0x990951baUL, 0x076dc419UL, 0x706af48fUL,
+        0xe963a535UL, 0x9e6495a3UL, 0x0edb8832UL, 0x79dcb8a4UL, 0xe0d5e91eUL, 0x97d2d988UL,
+        0x09b64c2bUL, 0x7eb17cbdUL, 0xe7b82d07UL, 0x90bf1d91UL, 0x1db71064UL, 0x6ab020f2UL,
+        0xf3b97148UL, 0x84be41deUL, 0x1adad47dUL, 0x6ddde4ebUL, 0xf4d4b551UL, 0x83d385c7UL,
+        0x136c9856UL, 0x646ba8c0UL, 0xfd62f97aUL, 0x8a65c9ecUL, 0x14015c4fUL, 0x63066cd9UL,
+        0xfa0f3d63UL, 0x8d080df5UL, 0x3b6e20c8UL, 0x4c69105eUL, 0xd56041e4UL, 0xa2677172UL,
+        0x3c03e4d1UL, 0x4b04d447UL, 0xd20d85fdUL, 0xa50ab56bUL, 0x35b5a8faUL, 0x42b2986cUL,
+        0xdbbbc9d6UL, 0xacbcf940UL, 0x32d86ce3UL, 0x45df5c75UL, 0xdcd60dcfUL, 0xabd13d59UL,
+        0x26d930acUL, 0x51de003aUL, 0xc8d75180UL, 0xbfd06116UL, 0x21b4f4b5UL, 0x56b3c423UL,
+        0xcfba9599UL, 0xb8bda50fUL, 0x2802b89eUL, 0x5f058808UL, 0xc60cd9b2UL, 0xb10be924UL,
+        0x2f6f7c87UL, 0x58684c11UL, 0xc1611dabUL, 0xb6662d3dUL, 0x76dc4190UL, 0x01db7106UL,
+        0x98d220bcUL, 0xefd5102aUL, 0x71b18589UL, 0x06b6b51fUL, 0x9fbfe4a5UL, 0xe8b8d433UL,
+        0x7807c9a2UL, 0x0f00f934UL, 0x9609a88eUL, 0xe10e9818UL, 0x7f6a0dbbUL, 0x086d3d2dUL,
+        0x91646c97UL, 0xe6635c01UL, 0x6b6b51f4UL, 0x1c6c6162UL, 0x856530d8UL, 0xf262004eUL,
+        0x6c0695edUL, 0x1b01a57bUL, 0x8208f4c1UL, 0xf50fc457UL, 0x65b0d9c6UL, 0x12b7e950UL,
+        0x8bbeb8eaUL, 0xfcb9887cUL, 0x62dd1ddfUL, 0x15da2d49UL, 0x8cd37cf3UL, 0xfbd44c65UL,
+        0x4db26158UL, 0x3ab551ceUL, 0xa3bc0074UL, 0xd4bb30e2UL, 0x4adfa541UL, 0x3dd895d7UL,
+        0xa4d1c46dUL, 0xd3d6f4fbUL, 0x4369e96aUL, 0x346ed9fcUL, 0xad678846UL, 0xda60b8d0UL,
+        0x44042d73UL, 0x33031de5UL, 0xaa0a4c5fUL, 0xdd0d7cc9UL, 0x5005713cUL, 0x270241aaUL,
+        0xbe0b1010UL, 0xc90c2086UL, 0x5768b525UL, 0x206f85b3UL, 0xb966d409UL, 0xce61e49fUL,
+        0x5edef90eUL, 0x29d9c998UL, 0xb0d09822UL, 0xc7d7a8b4UL, 0x59b33d17UL, 0x2eb40d81UL,
+        0xb7bd5c3bUL, 0xc0ba6cadUL, 0xedb88320UL, 0x9abfb3b6UL, 0x03b6e20cUL, 0x74b1d29aUL,
+        0xead54739UL, 0x9dd277afUL, 0x04db2615UL, 0x73dc1683UL, 0xe3630b12UL, 0x94643b84UL,
+        0x0d6d6a3eUL, 0x7a6a5aa8UL, 0xe40ecf0bUL, 0x9309ff9dUL, 0x0a00ae27UL, 0x7d079eb1UL,
+        0xf00f9344UL, 0x8708a3d2UL, 0x1e01f268UL, 0x6906c2feUL, 0xf762575dUL, 0x806567cbUL,
+        0x196c3671UL, 0x6e6b06e7UL, 0xfed41b76UL, 0x89d32be0UL, 0x10da7a5aUL, 0x67dd4accUL,
+        0xf9b9df6fUL, 0x8ebeeff9UL, 0x17b7be43UL, 0x60b08ed5UL, 0xd6d6a3e8UL, 0xa1d1937eUL,
+        0x38d8c2c4UL, 0x4fdff252UL, 0xd1bb67f1UL, 0xa6bc5767UL, 0x3fb506ddUL, 0x48b2364bUL,
+        0xd80d2bdaUL, 0xaf0a1b4cUL, 0x36034af6UL, 0x41047a60UL, 0xdf60efc3UL, 0xa867df55UL,
+        0x316e8eefUL, 0x4669be79UL, 0xcb61b38cUL, 0xbc66831aUL, 0x256fd2a0UL, 0x5268e236UL,
+        0xcc0c7795UL, 0xbb0b4703UL, 0x220216b9UL, 0x5505262fUL, 0xc5ba3bbeUL, 0xb2bd0b28UL,
+        0x2bb45a92UL, 0x5cb36a04UL, 0xc2d7ffa7UL, 0xb5d0cf31UL, 0x2cd99e8bUL, 0x5bdeae1dUL,
+        0x9b64c2b0UL, 0xec63f226UL, 0x756aa39cUL, 0x026d930aUL, 0x9c0906a9UL, 0xeb0e363fUL,
+        0x72076785UL, 0x05005713UL, 0x95bf4a82UL, 0xe2b87a14UL, 0x7bb12baeUL, 0x0cb61b38UL,
+        0x92d28e9bUL, 0xe5d5be0dUL, 0x7cdcefb7UL, 0x0bdbdf21UL, 0x86d3d2d4UL, 0xf1d4e242UL,
+        0x68ddb3f8UL, 0x1fda836eUL, 0x81be16cdUL, 0xf6b9265bUL, 0x6fb077e1UL, 0x18b74777UL,
+        0x88085ae6UL, 0xff0f6a70UL, 0x66063bcaUL, 0x11010b5cUL, 0x8f659effUL, 0xf862ae69UL,
+        0x616bffd3UL, 0x166ccf45UL, 0xa00ae278UL, 0xd70dd2eeUL, 0x4e048354UL, 0x3903b3c2UL,
+        0xa7672661UL, 0xd06016f7UL, 0x4969474dUL, 0x3e6e77dbUL, 0xaed16a4aUL, 0xd9d65adcUL,
+        0x40df0b66UL, 0x37d83bf0UL, 0xa9bcae53UL, 0xdebb9ec5UL, 0x47b2cf7fUL, 0x30b5ffe9UL,
+        0xbdbdf21cUL, 0xcabac28aUL, 0x53b39330UL, 0x24b4a3a6UL, 0xbad03605UL, 0xcdd70693UL,
+        0x54de5729UL, 0x23d967bfUL, 0xb3667a2eUL, 0xc4614ab8UL, 0x5d681b02UL, 0x2a6f2b94UL,
+        0xb40bbe37UL, 0xc30c8ea1UL, 0x5a05df1bUL, 0x2d02ef8dUL
+    },
+#if W25Q_CRC32_SLICES == 8
+    {
+        0x00000000UL, 0x191b3141UL, 0x32366282UL, 0x2b2d53c3UL, 0x646cc504UL, 0x7d77f445UL,
+        0x565aa786UL, 0x4f4196c7UL, 0xc8d98a08UL, 0xd1c2bb49UL, 0xfaefe88aUL, 0xe3f4d9cbUL,
+        0xacb54f0cUL, 0xb5ae7e4dUL, 0x9e832d8eUL, 0x87981ccfUL, 0x4ac21251UL, 0x53d92310UL,
+        0x78f470d3UL, 0x61ef4192UL, 0x2eaed755UL, 0x37b5e614UL, 0x1c98b5d7UL, 0x05838496UL,
+        0x821b9859UL, 0x9b00a918UL, 0xb02dfadbUL, 0xa936cb9aUL, 0xe6775d5dUL, 0xff6c6c1cUL,
+        0xd4413fdfUL, 0xcd5a0e9eUL, 0x958424a2UL, 0x8c9f15e3UL, 0xa7b24620UL, 0xbea97761UL,
+        0xf1e8e1a6UL, 0xe8f3d0e7UL, 0xc3de8324UL, 0xdac5b265UL, 0x5d5daeaaUL, 0x44469febUL,
+        0x6f6bcc28UL, 0x7670fd69UL, 0x39316baeUL, 0x202a5aefUL, 0x0b07092cUL, 0x121c386dUL,
+        0xdf4636f3UL, 0xc65d07b2UL, 0xed705471UL, 0xf46b6530UL, 0xbb2af3f7UL, 0xa231c2b6UL,
+        0x891c9175UL, 0x9007a034UL, 0x179fbcfbUL, 0x0e848dbaUL, 0x25a9de79UL, 0x3cb2ef38UL,
+        0x73f379ffUL, 0x6ae848beUL, 0x41c51b7dUL, 0x58de2a3cUL, 0xf0794f05UL, 0xe9627e44UL,
+        0xc24f2d87UL, 0xdb541cc6UL, 0x94158a01UL, 0x8d0ebb40UL, 0xa623e883UL, 0xbf38d9c2UL,
+        0x38a0c50dUL, 0x21bbf44cUL, 0x0a96a78fUL, 0x138d96ceUL, 0x5ccc0009UL, 0x45d73148UL,
+        0x6efa628bUL, 0x77e153caUL, 0xbabb5d54UL, 0xa3a06c15UL, 0x888d3fd6UL, 0x91960e97UL,
+        0xded79850UL, 0xc7cca911UL, 0xece1fad2UL, 0xf5facb93UL, 0x7262d75cUL, 0x6b79e61dUL,
+        0x4054b5deUL, 0x594f849fUL, 0x160e1258UL, 0x0f152319UL, 0x243870daUL, 0x3d23419bUL,
+        0x65fd6ba7UL, 0x7ce65ae6UL, 0x57cb0925UL, 0x4ed03864UL, 0x0191aea3UL, 0x188a9fe2UL,
+        0x33a7cc21UL, 0x2abcfd60UL, 0xad24e1afUL, 0xb43fd0eeUL, 0x9f12832dUL, 0x8609b26cUL,
+        0xc94824abUL, 0xd05315eaUL, 0xfb7e4629UL, 0xe2657768UL, 0x2f3f79f6UL, 0x362448b7UL,
+        0x1d091b74UL, 0x04122a35UL, 0x4b53bcf2UL, 0x52488db3UL, 0x7965de70UL, 0x607eef31UL,
+        0xe7e6f3feUL, 0xfefdc2bfUL, 0xd5d0917cUL, 0xcccba03dUL, 0x838a36faUL, 0x9a9107bbUL,
+        0xb1bc5478UL, 0xa8a76539UL, 0x3b83984bUL, 0x2298a90aUL, 0x09b5fac9UL, 0x10aecb88UL,
+        0x5fef5d4fUL, 0x46f46c0eUL, 0x6dd93fcdUL, 0x74c20e8cUL, 0xf35a1243UL, 0xea412302UL,
+        0xc16c70c1UL, 0xd8774180UL, 0x9736d747UL, 0x8e2de606UL, 0xa500b5c5UL, 0xbc1b8484UL,
+        0x71418a1aUL, 0x685abb5bUL, 0x4377e898UL, 0x5a6cd9d9UL, 0x152d4f1eUL, 0x0c367e5fUL,
+        0x271b2d9cUL, 0x3e001cddUL, 0xb9980012UL, 0xa0833153UL, 0x8bae6290UL, 0x92b553d1UL,
+        0xddf4c516UL, 0xc4eff457UL, 0xefc2a794UL, 0xf6d996d5UL, 0xae07bce9UL, 0xb71c8da8UL,
+        0x9c31de6bUL, 0x852aef2aUL, 0xca6b79edUL, 0xd37048acUL, 0xf85d1b6fUL, 0xe1462a2eUL,
+        0x66de36e1UL, 0x7fc507a0UL, 0x54e85463UL, 0x4df36522UL, 0x02b2f3e5UL, 0x1ba9c2a4UL,
+        0x30849167UL, 0x299fa026UL, 0xe4c5aeb8UL, 0xfdde9ff9UL, 0xd6f3cc3aUL, 0xcfe8fd7bUL,
+        0x80a96bbcUL, 0x99b25afdUL, 0xb29f093eUL, 0xab84387fUL, 0x2c1c24b0UL, 0x350715f1UL,
+        0x1e2a4632UL, 0x07317773UL, 0x4870e1b4UL, 0x516bd0f5UL, 0x7a468336UL, 0x635db277UL,
+        0xcbfad74eUL, 0xd2e1e60fUL, 0xf9ccb5ccUL, 0xe0d7848dUL, 0xaf96124aUL, 0xb68d230bUL,
+        0x9da070c8UL, 0x84bb4189UL, 0x03235d46UL, 0x1a386c07UL, 0x31153fc4UL, 0x280e0e85UL,
+        0x674f9842UL, 0x7e54a903UL, 0x5579fac0UL, 0x4c62cb81UL, 0x8138c51fUL, 0x9823f45eUL,
+        0xb30ea79dUL, 0xaa1596dcUL, 0xe554001bUL, 0xfc4f315aUL, 0xd7626299UL, 0xce7953d8UL,
+        0x49e14f17UL, 0x50fa7e56UL, 0x7bd72d95UL, 0x62cc1cd4UL, 0x2d8d8a13UL, 0x3496bb52UL,
+        0x1fbbe891UL, 0x06a0d9d0UL, 0x5e7ef3ecUL, 0x4765c2adUL, 0x6c48916eUL, 0x7553a02fUL,
+        0x3a1236e8UL, 0x230907a9UL, 0x0824546aUL, 0x113f652bUL, 0x96a779e4UL, 0x8fbc48a5UL,
+        0xa4911b66UL, 0xbd8a2a27UL, 0xf2cbbce0UL, 0xebd08da1UL, 0xc0fdde62UL, 0xd9e6ef23UL,
+        0x14bce1bdUL, 0x0da7d0fcUL, 0x268a833fUL, 0x3f91b27eUL, 0x70d024b9UL, 0x69cb15f8UL,
+        0x42e6463bUL, 0x5bfd777aUL, 0xdc656bb5UL, 0xc57e5af4UL, 0xee530937UL, 0xf7483876UL,
+        0xb809aeb1UL, 0xa1129ff0UL, 0x8a3fcc33UL, 0x9324fd72UL
+    },
+    {
+        0x00000000UL, 0x01c26a37UL, 0x0384d46eUL, 0x0246be59UL, 0x0709a8dcUL, 0x06cbc2ebUL,
+        0x048d7cb2UL, 0x054f1685UL, 0x0e1351b8UL, 0x0fd13b8fUL, 0x0d9785d6UL, 0x0c55efe1UL,
+        0x091af964UL, 0x08d89353UL, 0x0a9e2d0aUL, 0x0b5c473dUL, 0x1c26a370UL, 0x1de4c947UL,
+        0x1fa2771eUL, 0x1e601d29UL, 0x1b2f0bacUL, 0x1aed619bUL, 0x18abdfc2UL, 0x1969b5f5UL,
+        0x1235f2c8UL, 0x13f798ffUL, 0x11b126a6UL, 0x10734c91UL, 0x153c5a14UL, 0x14fe3023UL,
+        0x16b88e7aUL, 0x177ae44dUL, 0x384d46e0UL, 0x398f2cd7UL, 0x3bc9928eUL, 0x3a0bf8b9UL,
+        0x3f44ee3cUL, 0x3e86840bUL, 0x3cc03a52UL, 0x3d025065UL, 0x365e1758UL, 0x379c7d6fUL,
+        0x35dac336UL, 0x3418a901UL, 0x3157bf84UL, 0x3095d5b3UL, 0x32d36beaUL, 0x331101ddUL,
+        0x246be590UL, 0x25a98fa7UL, 0x27ef31feUL, 0x262d5bc9UL, 0x23624d4cUL, 0x22a0277bUL,
+        0x20e69922UL, 0x2124f315UL, 0x2a78b428UL, 0x2bbade1fUL, 0x29fc6046UL, 0x283e0a71UL,
+        0x2d711cf4UL, 0x2cb376c3UL, 0x2ef5c89aUL, 0x2f37a2adUL, 0x709a8dc0UL, 0x7158e7f7UL,
+        0x731e59aeUL, 0x72dc3399UL, 0x7793251cUL, 0x76514f2bUL, 0x7417f172UL, 0x75d59b45UL,
+        0x7e89dc78UL, 0x7f4bb64fUL, 0x7d0d0816UL, 0x7ccf6221UL, 0x798074a4UL, 0x78421e93UL,
+        0x7a04a0caUL, 0x7bc6cafdUL, 0x6cbc2eb0UL, 0x6d7e4487UL, 0x6f38fadeUL, 0x6efa90e9UL,
+        0x6bb5866cUL, 0x6a77ec5bUL, 0x68315202UL, 0x69f33835UL, 0x62af7f08UL, 0x636d153fUL,
+        0x612bab66UL, 0x60e9c151UL, 0x65a6d7d4UL, 0x6464bde3UL, 0x662203baUL, 0x67e0698dUL,
+        0x48d7cb20UL, 0x4915a117UL, 0x4b531f4eUL, 0x4a917579UL, 0x4fde63fcUL, 0x4e1c09cbUL,
+        0x4c5ab792UL, 0x4d98dda5UL, 0x46c49a98UL, 0x4706f0afUL, 0x45404ef6UL, 0x448224c1UL,
+        0x41cd3244UL, 0x400f5873UL, 0x4249e62aUL, 0x438b8c1dUL, 0x54f16850UL, 0x55330267UL,
+        0x5775bc3eUL, 0x56b7d609UL, 0x53f8c08cUL, 0x523aaabbUL, 0x507c14e2UL, 0x51be7ed5UL,
+        0x5ae239e8UL, 0x5b2053dfUL, 0x5966ed86UL, 0x58a487b1UL, 0x5deb9134UL, 0x5c29fb03UL,
+        0x5e6f455aUL, 0x5fad2f6dUL, 0xe1351b80UL, 0xe0f771b7UL, 0xe2b1cfeeUL, 0xe373a5d9UL,
+        0xe63cb35cUL, 0xe7fed96bUL, 0xe5b86732UL, 0xe47a0d05UL, 0xef264a38UL, 0xeee4200fUL,
+        0xeca29e56UL, 0xed60f461UL, 0xe82fe2e4UL, 0xe9ed88d3UL, 0xebab368aUL, 0xea695cbdUL,
+        0xfd13b8f0UL, 0xfcd1d2c7UL, 0xfe976c9eUL, 0xff5506a9UL, 0xfa1a102cUL, 0xfbd87a1bUL,
+        0xf99ec442UL, 0xf85cae75UL, 0xf300e948UL, 0xf2c2837fUL, 0xf0843d26UL, 0xf1465711UL,
+        0xf4094194UL, 0xf5cb2ba3UL, 0xf78d95faUL, 0xf64fffcdUL, 0xd9785d60UL, 0xd8ba3757UL,
+        0xdafc890eUL, 0xdb3ee339UL, 0xde71f5bcUL, 0xdfb39f8bUL, 0xddf521d2UL, 0xdc374be5UL,
+        0xd76b0cd8UL, 0xd6a966efUL, 0xd4efd8b6UL, 0xd52db281UL, 0xd062a404UL, 0xd1a0ce33UL,
+        0xd3e6706aUL, 0xd2241a5dUL, 0xc55efe10UL, 0xc49c9427UL, 0xc6da2a7eUL, 0xc7184049UL,
+        0xc25756ccUL, 0xc3953cfbUL, 0xc1d382a2UL, 0xc011e895UL, 0xcb4dafa8UL, 0xca8fc59fUL,
+        0xc8c97bc6UL, 0xc90b11f1UL, 0xcc440774UL, 0xcd866d43UL, 0xcfc0d31aUL, 0xce02b92dUL,
+        0x91af9640UL, 0x906dfc77UL, 0x922b422eUL, 0x93e92819UL, 0x96a63e9cUL, 0x976454abUL,
+        0x9522eaf2UL, 0x94e080c5UL, 0x9fbcc7f8UL, 0x9e7eadcfUL, 0x9c381396UL, 0x9dfa79a1UL,
+        0x98b56f24UL, 0x99770513UL, 0x9b31bb4aUL, 0x9af3d17dUL, 0x8d893530UL, 0x8c4b5f07UL,
+        0x8e0de15eUL, 0x8fcf8b69UL, 0x8a809decUL, 0x8b42f7dbUL, 0x89044982UL, 0x88c623b5UL,
+        0x839a6488UL, 0x82580ebfUL, 0x801eb0e6UL, 0x81dcdad1UL, 0x8493cc54UL, 0x8551a663UL,
+        0x8717183aUL, 0x86d5720dUL, 0xa9e2d0a0UL, 0xa820ba97UL, 0xaa6604ceUL, 0xaba46ef9UL,
+        0xaeeb787cUL, 0xaf29124bUL, 0xad6fac12UL, 0xacadc625UL, 0xa7f18118UL, 0xa633eb2fUL,
+        0xa4755576UL, 0xa5b73f41UL, 0xa0f829c4UL, 0xa13a43f3UL, 0xa37cfdaaUL, 0xa2be979dUL,
+        0xb5c473d0UL, 0xb40619e7UL, 0xb640a7beUL, 0xb782cd89UL, 0xb2cddb0cUL, 0xb30fb13bUL,
+        0xb1490f62UL, 0xb08b6555UL, 0xbbd72268UL, 0xba15485fUL, 0xb853f606UL, 0xb9919c31UL,
+        0xbcde8ab4UL, 0xbd1ce083UL, 0xbf5a5edaUL, 0xbe9834edUL
+    },
+    {
+        0x00000000UL, 0xb8bc6765UL, 0xaa09c88bUL, 0x12b5afeeUL, 0x8f629757UL, 0x37def032UL,
+        0x256b5fdcUL, 0x9dd738b9UL, 0xc5b428efUL, 0x7d084f8aUL, 0x6fbde064UL, 0xd7018701UL,
+        0x4ad6bfb8UL, 0xf26ad8ddUL, 0xe0df7733UL, 0x58631056UL, 0x5019579fUL, 0xe8a530faUL,
+        0xfa109f14UL, 0x42acf871UL, 0xdf7bc0c8UL, 0x67c7a7adUL, 0x75720843UL, 0xcdce6f26UL,
+        0x95ad7f70UL, 0x2d111815UL, 0x3fa4b7fbUL, 0x8718d09eUL, 0x1acfe827UL, 0xa2738f42UL,
+        0xb0c620acUL, 0x087a47c9UL, 0xa032af3eUL, 0x188ec85bUL, 0x0a3b67b5UL, 0xb28700d0UL,
+        0x2f503869UL, 0x97ec5f0cUL, 0x8559f0e2UL, 0x3de59787UL, 0x658687d1UL, 0xdd3ae0b4UL,
+        0xcf8f4f5aUL, 0x7733283fUL, 0xeae41086UL, 0x525877e3UL, 0x40edd80dUL, 0xf851bf68UL,
+        0xf02bf8a1UL, 0x48979fc4UL, 0x5a22302aUL, 0xe29e574fUL, 0x7f496ff6UL, 0xc7f50893UL,
+        0xd540a77dUL, 0x6dfcc018UL, 0x359fd04eUL, 0x8d23b72bUL, 0x9f9618c5UL, 0x272a7fa0UL,
+        0xbafd4719UL, 0x0241207cUL, 0x10f48f92UL, 0xa848e8f7UL, 0x9b14583dUL, 0x23a83f58UL,
+        0x311d90b6UL, 0x89a1f7d3UL, 0x1476cf6aUL, 0xaccaa80fUL, 0xbe7f07e1UL, 0x06c36084UL,
+        0x5ea070d2UL, 0xe61c17b7UL, 0xf4a9b859UL, 0x4c15df3cUL, 0xd1c2e785UL, 0x697e80e0UL,
+        0x7bcb2f0eUL, 0xc377486bUL, 0xcb0d0fa2UL, 0x73b168c7UL, 0x6104c729UL, 0xd9b8a04cUL,
+        0x446f98f5UL, 0xfcd3ff90UL, 0xee66507eUL, 0x56da371bUL, 0x0eb9274dUL, 0xb6054028UL,
+        0xa4b0efc6UL, 0x1c0c88a3UL, 0x81dbb01aUL, 0x3967d77fUL, 0x2bd27891UL, 0x936e1ff4UL,
+        0x3b26f703UL, 0x839a9066UL, 0x912f3f88UL, 0x299358edUL, 0xb4446054UL, 0x0cf80731UL,
+        0x1e4da8dfUL, 0xa6f1cfbaUL, 0xfe92dfecUL, 0x462eb889UL, 0x549b1767UL, 0xec277002UL,
+        0x71f048bbUL, 0xc94c2fdeUL, 0xdbf98030UL, 0x6345e755UL, 0x6b3fa09cUL, 0xd383c7f9UL,
+        0xc1366817UL, 0x798a0f72UL, 0xe45d37cbUL, 0x5ce150aeUL, 0x4e54ff40UL, 0xf6e89825UL,
+        0xae8b8873UL, 0x1637ef16UL, 0x048240f8UL, 0xbc3e279dUL, 0x21e91f24UL, 0x99557841UL,
+        0x8be0d7afUL, 0x335cb0caUL, 0xed59b63bUL, 0x55e5d15eUL, 0x47507eb0UL, 0xffec19d5UL,
+        0x623b216cUL, 0xda874609UL, 0xc832e9e7UL, 0x708e8e82UL, 0x28ed9ed4UL, 0x9051f9b1UL,
+        0x82e4565fUL, 0x3a58313aUL, 0xa78f0983UL, 0x1f336ee6UL, 0x0d86c108UL, 0xb53aa66dUL,
+        0xbd40e1a4UL, 0x05fc86c1UL, 0x1749292fUL, 0xaff54e4aUL, 0x322276f3UL, 0x8a9e1196UL,
+        0x982bbe78UL, 0x2097d91dUL, 0x78f4c94bUL, 0xc048ae2eUL, 0xd2fd01c0UL, 0x6a4166a5UL,
+        0xf7965e1cUL, 0x4f2a3979UL, 0x5d9f9697UL, 0xe523f1f2UL, 0x4d6b1905UL, 0xf5d77e60UL,
+        0xe762d18eUL, 0x5fdeb6ebUL, 0xc2098e52UL, 0x7ab5e937UL, 0x680046d9UL, 0xd0bc21bcUL,
+        0x88df31eaUL, 0x3063568fUL, 0x22d6f961UL, 0x9a6a9e04UL, 0x07bda6bdUL, 0xbf01c1d8UL,
+        0xadb46e36UL, 0x15080953UL, 0x1d724e9aUL, 0xa5ce29ffUL, 0xb77b8611UL, 0x0fc7e174UL,
+        0x9210d9cdUL, 0x2aacbea8UL, 0x38191146UL, 0x80a57623UL, 0xd8c66675UL, 0x607a0110UL,
+        0x72cfaefeUL, 0xca73c99bUL, 0x57a4f122UL, 0xef189647UL, 0xfdad39a9UL, 0x45115eccUL,
+        0x764dee06UL, 0xcef18963UL, 0xdc44268dUL, 0x64f841e8UL, 0xf92f7951UL, 0x41931e34UL,
+        0x5326b1daUL, 0xeb9ad6bfUL, 0xb3f9c6e9UL, 0x0b45a18cUL, 0x19f00e62UL, 0xa14c6907UL,
+        0x3c9b51beUL, 0x842736dbUL, 0x96929935UL, 0x2e2efe50UL, 0x2654b999UL, 0x9ee8defcUL,
+        0x8c5d7112UL, 0x34e11677UL, 0xa9362eceUL, 0x118a49abUL, 0x033fe645UL, 0xbb838120UL,
+        0xe3e09176UL, 0x5b5cf613UL, 0x49e959fdUL, 0xf1553e98UL, 0x6c820621UL, 0xd43e6144UL,
+        0xc68bceaaUL, 0x7e37a9cfUL, 0xd67f4138UL, 0x6ec3265dUL, 0x7c7689b3UL, 0xc4caeed6UL,
+        0x591dd66fUL, 0xe1a1b10aUL, 0xf3141ee4UL, 0x4ba87981UL, 0x13cb69d7UL, 0xab770eb2UL,
+        0xb9c2a15cUL, 0x017ec639UL, 0x9ca9fe80UL, 0x241599e5UL, 0x36a0360bUL, 0x8e1c516eUL,
+        0x866616a7UL, 0x3eda71c2UL, 0x2c6fde2cUL, 0x94d3b949UL, 0x090481f0UL, 0xb1b8e695UL,
+        0xa30d497bUL, 0x1bb12e1eUL, 0x43d23e48UL, 0xfb6e592dUL, 0xe9dbf6c3UL, 0x516791a6UL,
+        0xccb0a91fUL, 0x740cce7aUL, 0x66b96194UL, 0xde0506f1UL
+    },
+    {
+        0x00000000UL, 0x3d6029b0UL, 0x7ac05360UL, 0x47a07ad0UL, 0xf580a6c0UL, 0xc8e08f70UL,
+        0x8f40f5a0UL, 0xb220dc10UL, 0x30704bc1UL, 0x0d106271UL, 0x4ab018a1UL, 0x77d03111UL,
+        0xc5f0ed01UL, 0xf890c4b1UL, 0xbf30be61UL, 0x825097d1UL, 0x60e09782UL, 0x5d80be32UL,
+        0x1a20c4e2UL, 0x2740ed52UL, 0x95603142UL, 0xa80018f2UL, 0xefa06222UL, 0xd2c04b92UL,
+        0x5090dc43UL, 0x6df0f5f3UL, 0x2a508f23UL, 0x1730a693UL, 0xa5107a83UL, 0x98705333UL,
+        0xdfd029e3UL, 0xe2b00053UL, 0xc1c12f04UL, 0xfca106b4UL, 0xbb017c64UL, 0x866155d4UL,
+        0x344189c4UL, 0x0921a074UL, 0x4e81daa4UL, 0x73e1f314UL, 0xf1b164c5UL, 0xccd14d75UL,
+        0x8b7137a5UL, 0xb6111e15UL, 0x0431c205UL, 0x3951ebb5UL, 0x7ef19165UL, 0x4391b8d5UL,
+        0xa121b886UL, 0x9c419136UL, 0xdbe1ebe6UL, 0xe681c256UL, 0x54a11e46UL, 0x69c137f6UL,
+        0x2e614d26UL, 0x13016496UL, 0x9151f347UL, 0xac31daf7UL, 0xeb91a027UL, 0xd6f18997UL,
+        0x64d15587UL, 0x59b17c37UL, 0x1e1106e7UL, 0x23712f57UL, 0x58f35849UL, 0x659371f9UL,
+        0x22330b29UL, 0x1f532299UL, 0xad73fe89UL, 0x9013d739UL, 0xd7b3ade9UL, 0xead38459UL,
+        0x68831388UL, 0x55e33a38UL, 0x124340e8UL, 0x2f236958UL, 0x9d03b548UL, 0xa0639cf8UL,
+        0xe7c3e628UL, 0xdaa3cf98UL, 0x3813cfcbUL, 0x0573e67bUL, 0x42d39cabUL, 0x7fb3b51bUL,
+        0xcd93690bUL, 0xf0f340bbUL, 0xb7533a6bUL, 0x8a3313dbUL, 0x0863840aUL, 0x3503adbaUL,
+        0x72a3d76aUL, 0x4fc3fedaUL, 0xfde322caUL, 0xc0830b7aUL, 0x872371aaUL, 0xba43581aUL,
+        0x9932774dUL, 0xa4525efdUL, 0xe3f2242dUL, 0xde920d9dUL, 0x6cb2d18dUL, 0x51d2f83dUL,
+        0x167282edUL, 0x2b12ab5dUL, 0xa9423c8cUL, 0x9422153cUL, 0xd3826fecUL, 0xeee2465cUL,
+        0x5cc29a4cUL, 0x61a2b3fcUL, 0x2602c92cUL, 0x1b62e09cUL, 0xf9d2e0cfUL, 0xc4b2c97fUL,
+        0x8312b3afUL, 0xbe729a1fUL, 0x0c52460fUL, 0x31326fbfUL, 0x7692156fUL, 0x4bf23cdfUL,
+        0xc9a2ab0eUL, 0xf4c282beUL, 0xb362f86eUL, 0x8e02d1deUL, 0x3c220dceUL, 0x0142247eUL,
+        0x46e25eaeUL, 0x7b82771eUL, 0xb1e6b092UL, 0x8c869922UL, 0xcb26e3f2UL, 0xf646ca42UL,
+        0x44661652UL, 0x79063fe2UL, 0x3ea64532UL, 0x03c66c82UL, 0x8196fb53UL, 0xbcf6d2e3UL,
+        0xfb56a833UL, 0xc6368183UL, 0x74165d93UL, 0x49767423UL, 0x0ed60ef3UL, 0x33b62743UL,
+        0xd1062710UL, 0xec660ea0UL, 0xabc67470UL, 0x96a65dc0UL, 0x248681d0UL, 0x19e6a860UL,
+        0x5e46d2b0UL, 0x6326fb00UL, 0xe1766cd1UL, 0xdc164561UL, 0x9bb63fb1UL, 0xa6d61601UL,
+        0x14f6ca11UL, 0x2996e3a1UL, 0x6e369971UL, 0x5356b0c1UL, 0x70279f96UL, 0x4d47b626UL,
+        0x0ae7ccf6UL, 0x3787e546UL, 0x85a73956UL, 0xb8c710e6UL, 0xff676a36UL, 0xc2074386UL,
+        0x4057d457UL, 0x7d37fde7UL, 0x3a978737UL, 0x07f7ae87UL, 0xb5d77297UL, 0x88b75b27UL,
+        0xcf1721f7UL, 0xf2770847UL, 0x10c70814UL, 0x2da721a4UL, 0x6a075b74UL, 0x576772c4UL,
+        0xe547aed4UL, 0xd8278764UL, 0x9f87fdb4UL, 0xa2e7d404UL, 0x20b743d5UL, 0x1dd76a65UL,
+        0x5a7710b5UL, 0x67173905UL, 0xd537e515UL, 0xe857cca5UL, 0xaff7b675UL, 0x92979fc5UL,
+        0xe915e8dbUL, 0xd475c16bUL, 0x93d5bbbbUL, 0xaeb5920bUL, 0x1c954e1bUL, 0x21f567abUL,
+        0x66551d7bUL, 0x5b3534cbUL, 0xd965a31aUL, 0xe4058aaaUL, 0xa3a5f07aUL, 0x9ec5d9caUL,
+        0x2ce505daUL, 0x11852c6aUL, 0x562556baUL, 0x6b457f0aUL, 0x89f57f59UL, 0xb49556e9UL,
+        0xf3352c39UL, 0xce550589UL, 0x7c75d999UL, 0x4115f029UL, 0x06b58af9UL, 0x3bd5a349UL,
+        0xb9853498UL, 0x84e51d28UL, 0xc34567f8UL, 0xfe254e48UL, 0x4c059258UL, 0x7165bbe8UL,
+        0x36c5c138UL, 0x0ba5e888UL, 0x28d4c7dfUL, 0x15b4ee6fUL, 0x521494bfUL, 0x6f74bd0fUL,
+        0xdd54611fUL, 0xe03448afUL, 0xa794327fUL, 0x9af41bcfUL, 0x18a48c1eUL, 0x25c4a5aeUL,
+        0x6264df7eUL, 0x5f04f6ceUL, 0xed242adeUL, 0xd044036eUL, 0x97e479beUL, 0xaa84500eUL,
+        0x4834505dUL, 0x755479edUL, 0x32f4033dUL, 0x0f942a8dUL, 0xbdb4f69dUL, 0x80d4df2dUL,
+        0xc774a5fdUL, 0xfa148c4dUL, 0x78441b9cUL, 0x4524322cUL, 0x028448fcUL, 0x3fe4614cUL,
+        0x8dc4bd5cUL, 0xb0a494ecUL, 0xf704ee3cUL, 0xca64c78cUL
+    },
+    {
+        0x00000000UL, 0xcb5cd3a5UL, 0x4dc8a10bUL, 0x869472aeUL, 0x9b914216UL, 0x50cd91b3UL,
+        0xd659e31dUL, 0x1d0530b8UL, 0xec53826dUL, 0x270f51c8UL, 0xa19b2366UL, 0x6ac7f0c3UL,
+        0x77c2c07bUL, 0xbc9e13deUL, 0x3a0a6170UL, 0xf156b2d5UL, 0x03d6029bUL, 0xc88ad13eUL,
+        0x4e1ea390UL, 0x85427035UL, 0x9847408dUL, 0x531b9328UL, 0xd58fe186UL, 0x1ed33223UL,
+        0xef8580f6UL, 0x24d95353UL, 0xa24d21fdUL, 0x6911f258UL, 0x7414c2e0UL, 0xbf481145UL,
+        0x39dc63ebUL, 0xf280b04eUL, 0x07ac0536UL, 0xccf0d693UL, 0x4a64a43dUL, 0x81387798UL,
+        0x9c3d4720UL, 0x57619485UL, 0xd1f5e62bUL, 0x1aa9358eUL, 0xebff875bUL, 0x20a354feUL,
+        0xa6372650UL, 0x6d6bf5f5UL, 0x706ec54dUL, 0xbb3216e8UL, 0x3da66446UL, 0xf6fab7e3UL,
+        0x047a07adUL, 0xcf26d408UL, 0x49b2a6a6UL, 0x82ee7503UL, 0x9feb45bbUL, 0x54b7961eUL,
+        0xd223e4b0UL, 0x197f3715UL, 0xe82985c0UL, 0x23755665UL, 0xa5e124cbUL, 0x6ebdf76eUL,
+        0x73b8c7d6UL, 0xb8e41473UL, 0x3e7066ddUL, 0xf52cb578UL, 0x0f580a6cUL, 0xc404d9c9UL,
+        0x4290ab67UL, 0x89cc78c2UL, 0x94c9487aUL, 0x5f959bdfUL, 0xd901e971UL, 0x125d3ad4UL,
+        0xe30b8801UL, 0x28575ba4UL, 0xaec3290aUL, 0x659ffaafUL, 0x789aca17UL, 0xb3c619b2UL,
+        0x35526b1cUL, 0xfe0eb8b9UL, 0x0c8e08f7UL, 0xc7d2db52UL, 0x4146a9fcUL, 0x8a1a7a59UL,
+        0x971f4ae1UL, 0x5c439944UL, 0xdad7ebeaUL, 0x118b384fUL, 0xe0dd8a9aUL, 0x2b81593fUL,
+        0xad152b91UL, 0x6649f834UL, 0x7b4cc88cUL, 0xb0101b29UL, 0x36846987UL, 0xfdd8ba22UL,
+        0x08f40f5aUL, 0xc3a8dcffUL, 0x453cae51UL, 0x8e607df4UL, 0x93654d4cUL, 0x58399ee9UL,
+        0xdeadec47UL, 0x15f13fe2UL, 0xe4a78d37UL, 0x2ffb5e92UL, 0xa96f2c3cUL, 0x6233ff99UL,
+        0x7f36cf21UL, 0xb46a1c84UL, 0x32fe6e2aUL, 0xf9a2bd8fUL, 0x0b220dc1UL, 0xc07ede64UL,
+        0x46eaaccaUL, 0x8db67f6fUL, 0x90b34fd7UL, 0x5bef9c72UL, 0xdd7beedcUL, 0x16273d79UL,
+        0xe7718facUL, 0x2c2d5c09UL, 0xaab92ea7UL, 0x61e5fd02UL, 0x7ce0cdbaUL, 0xb7bc1e1fUL,
+        0x31286cb1UL, 0xfa74bf14UL, 0x1eb014d8UL, 0xd5ecc77dUL, 0x5378b5d3UL, 0x98246676UL,
+        0x852156ceUL, 0x4e7d856bUL, 0xc8e9f7c5UL, 0x03b52460UL, 0xf2e396b5UL, 0x39bf4510UL,
+        0xbf2b37beUL, 0x7477e41bUL, 0x6972d4a3UL, 0xa22e0706UL, 0x24ba75a8UL, 0xefe6a60dUL,
+        0x1d661643UL, 0xd63ac5e6UL, 0x50aeb748UL, 0x9bf264edUL, 0x86f75455UL, 0x4dab87f0UL,
+        0xcb3ff55eUL, 0x006326fbUL, 0xf135942eUL, 0x3a69478bUL, 0xbcfd3525UL, 0x77a1e680UL,
+        0x6aa4d638UL, 0xa1f8059dUL, 0x276c7733UL, 0xec30a496UL, 0x191c11eeUL, 0xd240c24bUL,
+        0x54d4b0e5UL, 0x9f886340UL, 0x828d53f8UL, 0x49d1805dUL, 0xcf45f2f3UL, 0x04192156UL,
+        0xf54f9383UL, 0x3e134026UL, 0xb8873288UL, 0x73dbe12dUL, 0x6eded195UL, 0xa5820230UL,
+        0x2316709eUL, 0xe84aa33bUL, 0x1aca1375UL, 0xd196c0d0UL, 0x5702b27eUL, 0x9c5e61dbUL,
+        0x815b5163UL, 0x4a0782c6UL, 0xcc93f068UL, 0x07cf23cdUL, 0xf6999118UL, 0x3dc542bdUL,
+        0xbb513013UL, 0x700de3b6UL, 0x6d08d30eUL, 0xa65400abUL, 0x20c07205UL, 0xeb9ca1a0UL,
+        0x11e81eb4UL, 0xdab4cd11UL, 0x5c20bfbfUL, 0x977c6c1aUL, 0x8a795ca2UL, 0x41258f07UL,
+        0xc7b1fda9UL, 0x0ced2e0cUL, 0xfdbb9cd9UL, 0x36e74f7cUL, 0xb0733dd2UL, 0x7b2fee77UL,
+        0x662adecfUL, 0xad760d6aUL, 0x2be27fc4UL, 0xe0beac61UL, 0x123e1c2fUL, 0xd962cf8aUL,
+        0x5ff6bd24UL, 0x94aa6e81UL, 0x89af5e39UL, 0x42f38d9cUL, 0xc467ff32UL, 0x0f3b2c97UL,
+        0xfe6d9e42UL, 0x35314de7UL, 0xb3a53f49UL, 0x78f9ececUL, 0x65fcdc54UL, 0xaea00ff1UL,
+        0x28347d5fUL, 0xe368aefaUL, 0x16441b82UL, 0xdd18c827UL, 0x5b8cba89UL, 0x90d0692cUL,
+        0x8dd55994UL, 0x46898a31UL, 0xc01df89fUL, 0x0b412b3aUL, 0xfa1799efUL, 0x314b4a4aUL,
+        0xb7df38e4UL, 0x7c83eb41UL, 0x6186dbf9UL, 0xaada085cUL, 0x2c4e7af2UL, 0xe712a957UL,
+        0x15921919UL, 0xdececabcUL, 0x585ab812UL, 0x93066bb7UL, 0x8e035b0fUL, 0x455f88aaUL,
+        0xc3cbfa04UL, 0x089729a1UL, 0xf9c19b74UL, 0x329d48d1UL, 0xb4093a7fUL, 0x7f55e9daUL,
+        0x6250d962UL, 0xa90c0ac7UL, 0x2f987869UL, 0xe4c4abccUL
+    },
+    {
+        0x00000000UL, 0xa6770bb4UL, 0x979f1129UL, 0x31e81a9dUL, 0xf44f2413UL, 0x52382fa7UL,
+        0x63d0353aUL, 0xc5a73e8eUL, 0x33ef4e67UL, 0x959845d3UL, 0xa4705f4eUL, 0x020754faUL,
+        0xc7a06a74UL, 0x61d761c0UL, 0x503f7b5dUL, 0xf64870e9UL, 0x67de9cceUL, 0xc1a9977aUL,
+        0xf0418de7UL, 0x56368653UL, 0x9391b8ddUL, 0x35e6b369UL, 0x040ea9f4UL, 0xa279a240UL,
+        0x5431d2a9UL, 0xf246d91dUL, 0xc3aec380UL, 0x65d9c834UL, 0xa07ef6baUL, 0x0609fd0eUL,
+        0x37e1e793UL, 0x9196ec27UL, 0xcfbd399cUL, 0x69ca3228UL, 0x582228b5UL, 0xfe552301UL,
+        0x3bf21d8fUL, 0x9d85163bUL, 0xac6d0ca6UL, 0x0a1a0712UL, 0xfc5277fbUL, 0x5a257c4fUL,
+        0x6bcd66d2UL, 0xcdba6d66UL, 0x081d53e8UL, 0xae6a585cUL, 0x9f8242c1UL, 0x39f54975UL,
+        0xa863a552UL, 0x0e14aee6UL, 0x3ffcb47bUL, 0x998bbfcfUL, 0x5c2c8141UL, 0xfa5b8af5UL,
+        0xcbb39068UL, 0x6dc49bdcUL, 0x9b8ceb35UL, 0x3dfbe081UL, 0x0c13fa1cUL, 0xaa64f1a8UL,
+        0x6fc3cf26UL, 0xc9b4c492UL, 0xf85cde0fUL, 0x5e2bd5bbUL, 0x440b7579UL, 0xe27c7ecdUL,
+        0xd3946450UL, 0x75e36fe4UL, 0xb044516aUL, 0x16335adeUL, 0x27db4043UL, 0x81ac4bf7UL,
+        0x77e43b1eUL, 0xd19330aaUL, 0xe07b2a37UL, 0x460c2183UL, 0x83ab1f0dUL, 0x25dc14b9UL,
+        0x14340e24UL, 0xb2430590UL, 0x23d5e9b7UL, 0x85a2e203UL, 0xb44af89eUL, 0x123df32aUL,
+        0xd79acda4UL, 0x71edc610UL, 0x4005dc8dUL, 0xe672d739UL, 0x103aa7d0UL, 0xb64dac64UL,
+        0x87a5b6f9UL, 0x21d2bd4dUL, 0xe47583c3UL, 0x42028877UL, 0x73ea92eaUL, 0xd59d995eUL,
+        0x8bb64ce5UL, 0x2dc14751UL, 0x1c295dccUL, 0xba5e5678UL, 0x7ff968f6UL, 0xd98e6342UL,
+        0xe86679dfUL, 0x4e11726bUL, 0xb8590282UL, 0x1e2e0936UL, 0x2fc613abUL, 0x89b1181fUL,
+        0x4c162691UL, 0xea612d25UL, 0xdb8937b8UL, 0x7dfe3c0cUL, 0xec68d02bUL, 0x4a1fdb9fUL,
+        0x7bf7c102UL, 0xdd80cab6UL, 0x1827f438UL, 0xbe50ff8cUL, 0x8fb8e511UL, 0x29cfeea5UL,
+        0xdf879e4cUL, 0x79f095f8UL, 0x48188f65UL, 0xee6f84d1UL, 0x2bc8ba5fUL, 0x8dbfb1ebUL,
+        0xbc57ab76UL, 0x1a20a0c2UL, 0x8816eaf2UL, 0x2e61e146UL, 0x1f89fbdbUL, 0xb9fef06fUL,
+        0x7c59cee1UL, 0xda2ec555UL, 0xebc6dfc8UL, 0x4db1d47cUL, 0xbbf9a495UL, 0x1d8eaf21UL,
+        0x2c66b5bcUL, 0x8a11be08UL, 0x4fb68086UL, 0xe9c18b32UL, 0xd82991afUL, 0x7e5e9a1bUL,
+        0xefc8763cUL, 0x49bf7d88UL, 0x78576715UL, 0xde206ca1UL, 0x1b87522fUL, 0xbdf0599bUL,
+        0x8c184306UL, 0x2a6f48b2UL, 0xdc27385bUL, 0x7a5033efUL, 0x4bb82972UL, 0xedcf22c6UL,
+        0x28681c48UL, 0x8e1f17fcUL, 0xbff70d61UL, 0x198006d5UL, 0x47abd36eUL, 0xe1dcd8daUL,
+        0xd034c247UL, 0x7643c9f3UL, 0xb3e4f77dUL, 0x1593fcc9UL, 0x247be654UL, 0x820cede0UL,
+        0x74449d09UL, 0xd23396bdUL, 0xe3db8c20UL, 0x45ac8794UL, 0x800bb91aUL, 0x267cb2aeUL,
+        0x1794a833UL, 0xb1e3a387UL, 0x20754fa0UL, 0x86024414UL, 0xb7ea5e89UL, 0x119d553dUL,
+        0xd43a6bb3UL, 0x724d6007UL, 0x43a57a9aUL, 0xe5d2712eUL, 0x139a01c7UL, 0xb5ed0a73UL,
+        0x840510eeUL, 0x22721b5aUL, 0xe7d525d4UL, 0x41a22e60UL, 0x704a34fdUL, 0xd63d3f49UL,
+        0xcc1d9f8bUL, 0x6a6a943fUL, 0x5b828ea2UL, 0xfdf58516UL, 0x3852bb98UL, 0x9e25b02cUL,
+        0xafcdaab1UL, 0x09baa105UL, 0xfff2d1ecUL, 0x5985da58UL, 0x686dc0c5UL, 0xce1acb71UL,
+        0x0bbdf5ffUL, 0xadcafe4bUL, 0x9c22e4d6UL, 0x3a55ef62UL, 0xabc30345UL, 0x0db408f1UL,
+        0x3c5c126cUL, 0x9a2b19d8UL, 0x5f8c2756UL, 0xf9fb2ce2UL, 0xc813367fUL, 0x6e643dcbUL,
+        0x982c4d22UL, 0x3e5b4696UL, 0x0fb35c0bUL, 0xa9c457bfUL, 0x6c636931UL, 0xca146285UL,
+        0xfbfc7818UL, 0x5d8b73acUL, 0x03a0a617UL, 0xa5d7ada3UL, 0x943fb73eUL, 0x3248bc8aUL,
+        0xf7ef8204UL, 0x519889b0UL, 0x6070932dUL, 0xc6079899UL, 0x304fe870UL, 0x9638e3c4UL,
+        0xa7d0f959UL, 0x01a7f2edUL, 0xc400cc63UL, 0x6277c7d7UL, 0x539fdd4aUL, 0xf5e8d6feUL,
+        0x647e3ad9UL, 0xc209316dUL, 0xf3e12bf0UL, 0x55962044UL, 0x90311ecaUL, 0x3646157eUL,
+        0x07ae0fe3UL, 0xa1d90457UL, 0x579174beUL, 0xf1e67f0aUL, 0xc00e6597UL, 0x66796e23UL,
+        0xa3de50adUL, 0x05a95b19UL, 0x34414184UL, 0x92364a30UL
+    },
+    {
+        0x00000000UL, 0xccaa009eUL, 0x4225077dUL, 0x8e8f07e3UL, 0x844a0efaUL, 0x48e00e64UL,
+        0xc66f0987UL, 0x0ac50919UL, 0xd3e51bb5UL, 0x1f4f1b2bUL, 0x91c01cc8UL, 0x5d6a1c56UL,
+        0x57af154fUL, 0x9b0515d1UL, 0x158a1232UL, 0xd92012acUL, 0x7cbb312bUL, 0xb01131b5UL,
+        0x3e9e3656UL, 0xf23436c8UL, 0xf8f13fd1UL, 0x345b3f4fUL, 0xbad438acUL, 0x767e3832UL,
+        0xaf5e2a9eUL, 0x63f42a00UL, 0xed7b2de3UL, 0x21d12d7dUL, 0x2b142464UL, 0xe7be24faUL,
+        0x69312319UL, 0xa59b2387UL, 0xf9766256UL, 0x35dc62c8UL, 0xbb53652bUL, 0x77f965b5UL,
+        0x7d3c6cacUL, 0xb1966c32UL, 0x3f196bd1UL, 0xf3b36b4fUL, 0x2a9379e3UL, 0xe639797dUL,
+        0x68b67e9eUL, 0xa41c7e00UL, 0xaed97719UL, 0x62737787UL, 0xecfc7064UL, 0x205670faUL,
+        0x85cd537dUL, 0x496753e3UL, 0xc7e85400UL, 0x0b42549eUL, 0x01875d87UL, 0xcd2d5d19UL,
+        0x43a25afaUL, 0x8f085a64UL, 0x562848c8UL, 0x9a824856UL, 0x140d4fb5UL, 0xd8a74f2bUL,
+        0xd2624632UL, 0x1ec846acUL, 0x9047414fUL, 0x5ced41d1UL, 0x299dc2edUL, 0xe537c273UL,
+        0x6bb8c590UL, 0xa712c50eUL, 0xadd7cc17UL, 0x617dcc89UL, 0xeff2cb6aUL, 0x2358cbf4UL,
+        0xfa78d958UL, 0x36d2d9c6UL, 0xb85dde25UL, 0x74f7debbUL, 0x7e32d7a2UL, 0xb298d73cUL,
+        0x3c17d0dfUL, 0xf0bdd041UL, 0x5526f3c6UL, 0x998cf358UL, 0x1703f4bbUL, 0xdba9f425UL,
+        0xd16cfd3cUL, 0x1dc6fda2UL, 0x9349fa41UL, 0x5fe3fadfUL, 0x86c3e873UL, 0x4a69e8edUL,
+        0xc4e6ef0eUL, 0x084cef90UL, 0x0289e689UL, 0xce23e617UL, 0x40ace1f4UL, 0x8c06e16aUL,
+        0xd0eba0bbUL, 0x1c41a025UL, 0x92cea7c6UL, 0x5e64a758UL, 0x54a1ae41UL, 0x980baedfUL,
+        0x1684a93cUL, 0xda2ea9a2UL, 0x030ebb0eUL, 0xcfa4bb90UL, 0x412bbc73UL, 0x8d81bcedUL,
+        0x8744b5f4UL, 0x4beeb56aUL, 0xc561b289UL, 0x09cbb217UL, 0xac509190UL, 0x60fa910eUL,
+        0xee7596edUL, 0x22df9673UL, 0x281a9f6aUL, 0xe4b09ff4UL, 0x6a3f9817UL, 0xa6959889UL,
+        0x7fb58a25UL, 0xb31f8abbUL, 0x3d908d58UL, 0xf13a8dc6UL, 0xfbff84dfUL, 0x37558441UL,
+        0xb9da83a2UL, 0x7570833cUL, 0x533b85daUL, 0x9f918544UL, 0x111e82a7UL, 0xddb48239UL,
+        0xd7718b20UL, 0x1bdb8bbeUL, 0x95548c5dUL, 0x59fe8cc3UL, 0x80de9e6fUL, 0x4c749ef1UL,
+        0xc2fb9912UL, 0x0e51998cUL, 0x04949095UL, 0xc83e900bUL, 0x46b197e8UL, 0x8a1b9776UL,
+        0x2f80b4f1UL, 0xe32ab46fUL, 0x6da5b38cUL, 0xa10fb312UL, 0xabcaba0bUL, 0x6760ba95UL,
+        0xe9efbd76UL, 0x2545bde8UL, 0xfc65af44UL, 0x30cfafdaUL, 0xbe40a839UL, 0x72eaa8a7UL,
+        0x782fa1beUL, 0xb485a120UL, 0x3a0aa6c3UL, 0xf6a0a65dUL, 0xaa4de78cUL, 0x66e7e712UL,
+        0xe868e0f1UL, 0x24c2e06fUL, 0x2e07e976UL, 0xe2ade9e8UL, 0x6c22ee0bUL, 0xa088ee95UL,
+        0x79a8fc39UL, 0xb502fca7UL, 0x3b8dfb44UL, 0xf727fbdaUL, 0xfde2f2c3UL, 0x3148f25dUL,
+        0xbfc7f5beUL, 0x736df520UL, 0xd6f6d6a7UL, 0x1a5cd639UL, 0x94d3d1daUL, 0x5879d144UL,
+        0x52bcd85dUL, 0x9e16d8c3UL, 0x1099df20UL, 0xdc33dfbeUL, 0x0513cd12UL, 0xc9b9cd8cUL,
+        0x4736ca6fUL, 0x8b9ccaf1UL, 0x8159c3e8UL, 0x4df3c376UL, 0xc37cc495UL, 0x0fd6c40bUL,
+        0x7aa64737UL, 0xb60c47a9UL, 0x3883404aUL, 0xf42940d4UL, 0xfeec49cdUL, 0x32464953UL,
+        0xbcc94eb0UL, 0x70634e2eUL, 0xa9435c82UL, 0x65e95c1cUL, 0xeb665bffUL, 0x27cc5b61UL,
+        0x2d095278UL, 0xe1a352e6UL, 0x6f2c5505UL, 0xa386559bUL, 0x061d761cUL, 0xcab77682UL,
+        0x44387161UL, 0x889271ffUL, 0x825778e6UL, 0x4efd7878UL, 0xc0727f9bUL, 0x0cd87f05UL,
+        0xd5f86da9UL, 0x19526d37UL, 0x97dd6ad4UL, 0x5b776a4aUL, 0x51b26353UL, 0x9d1863cdUL,
+        0x1397642eUL, 0xdf3d64b0UL, 0x83d02561UL, 0x4f7a25ffUL, 0xc1f5221cUL, 0x0d5f2282UL,
+        0x079a2b9bUL, 0xcb302b05UL, 0x45bf2ce6UL, 0x89152c78UL, 0x50353ed4UL, 0x9c9f3e4aUL,
+        0x121039a9UL, 0xdeba3937UL, 0xd47f302eUL, 0x18d530b0UL, 0x965a3753UL, 0x5af037cdUL,
+        0xff6b144aUL, 0x33c114d4UL, 0xbd4e1337UL, 0x71e413a9UL, 0x7b211ab0UL, 0xb78b1a2eUL,
+        0x39041dcdUL, 0xf5ae1d53UL, 0x2c8e0fffUL, 0xe0240f61UL, 0x6eab0882UL, 0xa201081cUL,
+        0xa8c40105UL, 0x646e019bUL, 0xeae10678UL, 0x264b06e6UL
+    },
+#endif
+};
+
+/**
+ * @brief Delay for at least the given time
+ * 
+ * @return Time actually waited in us
+*/
+static unsigned w25q_delay_us(struct w25q_flash *flash, unsigned us) {
+
+    if (us == 0) {
+        return 0;
+    }
+    if (us >= W25Q_RESUME_TO_SUSPEND_US) {
+        flash->resume_guard = 0;
+    }
+    if (flash->spi_delay_us_func != NULL) {
+        flash->spi_delay_us_func(us);
+        return us;
+    }
+    // Millisecond-only platforms
+    flash->spi_delay_func((us + 999) / 1000);
+    return ((us + 999) / 1000) * 1000;
+
+}
+
 /**
  * @brief Check parameters passed from the user
 */
@@ -67,20 +751,15 @@ static
 #endif
 unsigned char w25q_check_param(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
 
-    unsigned int page_num;
+    unsigned long capacity;
 
     // Do instance & address & buffer checking
     if (flash == NULL) {
         return 0;
     }
-    page_num = (address & 0xffffff00) >> 8;
-    // Check start address
-    if (page_num >= flash->size) {
-        return 0;
-    }
-    // Check end address
-    page_num = ((address + buffer_size) & 0xffffff00) >> 8;
-    if (page_num > flash->size) {
+    capacity = flash->size * 256;
+    // Check start and end address
+    if ((unsigned long)address >= capacity || buffer_size > capacity - address) {
         return 0;
     }
     if (buffer == NULL) {
@@ -91,369 +770,3087 @@ unsigned char w25q_check_param(struct w25q_flash *flash, unsigned address, void
 
 }
 
+/* Instrumentation, empty unless W25Q_STATS is defined */
+
+static unsigned long w25q_stat_now(struct w25q_flash *flash) {
+#ifdef W25Q_STATS
+    return flash->clock != NULL ? flash->clock() : 0;
+#else
+    (void)flash;
+    return 0;
+#endif
+}
+
 /**
- * @brief Read SPI flash's status registers
- * @param[in] flash SPI flash instance
- * @param[out] buffer Buffer to store status data. Must be at least 3 bytes long.
- *                    Returned data begins at buffer[0] with length = 2.
- * 
+ * @brief Count an operation without tracing it, following transactions count toward it
 */
-#ifndef TEST
-static 
+static void w25q_stat_count(struct w25q_flash *flash, enum w25q_stat_t op, unsigned long size) {
+#ifdef W25Q_STATS
+    flash->stat_op = op;
+    flash->stats.op[op].calls++;
+    flash->stats.op[op].bytes += size;
+#else
+    (void)flash;
+    (void)op;
+    (void)size;
 #endif
-void w25q_read_status_regs(struct w25q_flash *flash, void *buffer) {
+}
 
-    unsigned char *result_buffer = (unsigned char *)buffer;
-    set_dummy_bytes(result_buffer, 3);
+/**
+ * @brief Count an operation and fire the start trace, following transactions count toward it
+*/
+static void w25q_stat_begin(struct w25q_flash *flash, enum w25q_stat_t op, unsigned long address, unsigned long size) {
+#ifdef W25Q_STATS
+    w25q_stat_count(flash, op, size);
+    if (flash->trace != NULL) {
+        flash->trace(flash, op, W25Q_TRACE_START, address, size, flash->trace_context);
+    }
+#else
+    (void)flash;
+    (void)op;
+    (void)address;
+    (void)size;
+#endif
+}
 
-    // Get the first status reg data
-    result_buffer[0] = W25Q_READ_STATUS_REG_1;
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(result_buffer, result_buffer, 2);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    result_buffer[0] = result_buffer[1];
+/**
+ * @brief Record the latency of an operation and fire the end trace
+ * 
+ * @param[in] measured 0 when the latency is not known
+*/
+static void w25q_stat_end(struct w25q_flash *flash, enum w25q_stat_t op, unsigned long address,
+                          unsigned long latency_us, unsigned char measured) {
+#ifdef W25Q_STATS
+    struct w25q_op_stats *stats = &flash->stats.op[op];
 
-    // Get the second status reg datav
-    result_buffer[1] = W25Q_READ_STATUS_REG_2;
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(&result_buffer[1], &result_buffer[1], 2);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    result_buffer[1] = result_buffer[2];
+    if (measured) {
+        unsigned bucket = 0;
 
+        for (unsigned long v = latency_us; v != 0 && bucket < W25Q_STATS_BUCKETS - 1; v >>= 1) {
+            bucket++;
+        }
+        stats->histogram[bucket]++;
+        if (stats->completed == 0 || latency_us < stats->min_us) {
+            stats->min_us = latency_us;
+        }
+        if (latency_us > stats->max_us) {
+            stats->max_us = latency_us;
+        }
+        stats->completed++;
+        stats->total_us += latency_us;
+    }
+    if (flash->trace != NULL) {
+        flash->trace(flash, op, W25Q_TRACE_END, address, measured ? latency_us : 0, flash->trace_context);
+    }
+#else
+    (void)flash;
+    (void)op;
+    (void)address;
+    (void)latency_us;
+    (void)measured;
+#endif
 }
 
 /**
- * @brief Enable data writes
+ * @brief The running program/erase was seen to end
  * 
- * @param[in] flash SPI flash instance
+ * @param[in] waited_us Time since the wait started, used without a clock function
 */
-#ifndef TEST
-static 
+static void w25q_stat_busy_done(struct w25q_flash *flash, unsigned long waited_us) {
+#ifdef W25Q_STATS
+    if (flash->busy_op < W25Q_OP_COUNT) {
+        if (flash->clock != NULL) {
+            w25q_stat_end(flash, (enum w25q_stat_t)flash->busy_op, flash->busy_address,
+                          flash->clock() - flash->busy_since, 1);
+        } else {
+            w25q_stat_end(flash, (enum w25q_stat_t)flash->busy_op, flash->busy_address, waited_us, waited_us != 0);
+        }
+    }
+#else
+    (void)flash;
+    (void)waited_us;
 #endif
-void w25q_write_enable(struct w25q_flash *flash) {
-
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    unsigned char cmd = W25Q_WRITE_ENABLE;
-    flash->spi_send(&cmd, &cmd, 1);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
+}
 
+static void w25q_stat_transaction(struct w25q_flash *flash) {
+#ifdef W25Q_STATS
+    flash->stats.op[flash->stat_op].transactions++;
+#else
+    (void)flash;
+#endif
 }
 
 /**
- * @brief Disable data writes
+ * @brief Count a status read made while waiting for the running operation
  * 
- * @param[in] flash SPI flash instance
+ * @param[in] waited_us Time blocked since the previous call, 0 outside w25q_wait_until_available
 */
-#ifndef TEST
-static 
+static void w25q_stat_poll(struct w25q_flash *flash, unsigned waited_us) {
+#ifdef W25Q_STATS
+    if (flash->busy_op < W25Q_OP_COUNT) {
+        flash->stats.op[flash->busy_op].polls++;
+        flash->stats.op[flash->busy_op].wait_us += waited_us;
+    }
+#else
+    (void)flash;
+    (void)waited_us;
 #endif
-void w25q_write_disable(struct w25q_flash *flash) {
+}
+
+/**
+ * @brief Change the power state, adding the time spent in the previous one
+*/
+static void w25q_power_enter(struct w25q_flash *flash, enum w25q_power_t state) {
 
-    unsigned char cmd = W25Q_WRITE_DISABLE;
+    if (flash->clock != NULL) {
+        unsigned long now = flash->clock();
 
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(&cmd, &cmd, 1);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
+        flash->power_time_us[flash->power_state] += now - flash->power_changed;
+        flash->power_changed = now;
+    }
+    flash->power_state = state;
 
 }
 
 /**
- * @brief Enable volatile SR write
+ * @brief Record an operation the chip has just started
  * 
  * @param[in] flash SPI flash instance
+ * @param[in] op Operation
+ * @param[in] address Page/block the operation works on
+ * @param[in] expect_us Expected duration, 0 for the typical time of the operation
 */
-#ifndef TEST
-static 
-#endif
-void w25q_sr_write_enable(struct w25q_flash *flash) {
+static void w25q_op_started(struct w25q_flash *flash, enum w25q_op_t op, unsigned long address, unsigned expect_us) {
+
+    flash->busy_op = op;
+    flash->busy_address = address;
+    flash->busy_expect_us = expect_us ? expect_us : flash->timing[op].typ_us;
+    if (flash->clock != NULL) {
+        flash->busy_since = flash->clock();
+    }
+    w25q_power_enter(flash, W25Q_POWER_ACTIVE);
 
-    unsigned char cmd  = W25Q_VOLATILE_SR_WRITE_ENABLE;
+}
 
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(&cmd, &cmd, 1);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
+/**
+ * @brief Mark the running program/erase as finished
+*/
+static void w25q_op_finished(struct w25q_flash *flash, unsigned long waited_us) {
+
+    w25q_stat_busy_done(flash, waited_us);
+    flash->busy_op = W25Q_OP_NONE;
+    w25q_power_enter(flash, W25Q_POWER_STANDBY);
 
 }
 
 /**
- * @brief Read SPI flash JEDEC ID
+ * @brief Fill in the opcode and address of a command
  * 
  * @param[in] flash SPI flash instance
- * @param[out] buffer JEDEC ID buffer. Its size must be at least 4 bytes.
- *                  Returned value begins at data[1];
+ * @param[out] cmd Command buffer, at least 5 bytes
+ * @param[in] opcode Opcode with a 3-byte address
+ * @param[in] opcode_4b Same command with a 4-byte address
+ * @param[in] address Address
+ * 
+ * @return Command length
 */
-#ifndef TEST
-static 
-#endif
-void w25q_read_jedec(struct w25q_flash *flash, void *buffer) {
+static unsigned w25q_command_header(struct w25q_flash *flash, unsigned char *cmd, unsigned char opcode,
+                                    unsigned char opcode_4b, unsigned long address) {
 
-    unsigned char *return_data = (unsigned char *)buffer;
-    set_dummy_bytes(return_data, 4);
+    unsigned i;
 
-    return_data[0] = W25Q_READ_JEDEC_ID;
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(return_data, return_data, 4);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
+    cmd[0] = flash->address_mode == W25Q_ADDRESS_4B_OPCODES ? opcode_4b : opcode;
+    for (i = 1; i <= flash->address_bytes; i++) {
+        cmd[i] = (address >> ((flash->address_bytes - i) * 8)) & 0xff;
+    }
+    return i;
 
 }
 
 /**
- * Wait until the flash finish the last operation
- * @param[in] flash SPI Flash instance
+ * @brief Find the cache entry holding a line
+ * 
+ * @return Entry index, cache->lines when not cached
 */
-#ifndef TEST
-static 
-#endif
-void w25q_wait_until_available(struct w25q_flash *flash) {
+static unsigned w25q_cache_find(const struct w25q_cache *cache, unsigned long line) {
 
-    unsigned char status_data[3];
+    unsigned i;
 
-    while (1) {
-        w25q_read_status_regs(flash, (void *)status_data);
-        if ((status_data[0] & 0x1) == 0) {
+    for (i = 0; i < cache->lines; i++) {
+        if (cache->tags[i] == line) {
             break;
         }
-        flash->spi_delay_func(W25Q_DELAY_TIME);
     }
+    return i;
+
 }
 
 /**
- * @brief Program data to a page
- * @param[in] flash SPI flash instance
- * @param[in] buffer Data buffer, first 4 bytes must be empty for hardware instruction
- * @param[in] buffer_size Buffer size
- * 
- * @return Number of bytes get written in the operation
+ * @brief Pick the entry to replace (CLOCK)
 */
-#ifndef TEST
-static 
-#endif
-unsigned short w25q_page_program(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+static unsigned w25q_cache_victim(struct w25q_cache *cache) {
 
-    unsigned char *buf = (unsigned char *)buffer;
+    while (cache->tags[cache->hand] != W25Q_CACHE_INVALID && cache->referenced[cache->hand]) {
+        cache->referenced[cache->hand] = 0;
+        cache->hand = (cache->hand + 1) % cache->lines;
+    }
+    {
+        unsigned victim = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->lines;
+        return victim;
+    }
 
-    /* Should we wait here for the chip to complete previous instructions? */
-    w25q_wait_until_available(flash);
+}
 
-    w25q_write_enable(flash);
+/**
+ * @brief Apply a page program to the cached lines, programming only clears bits
+*/
+static void w25q_cache_program(struct w25q_flash *flash, unsigned long address, const unsigned char *data, unsigned size) {
 
-    /* Take min between buffer size and un-programmed bytes in the page */
-    unsigned limit;
-    if (buffer_size - 4 <= 256 - (address & 0xff)) {
-        limit = buffer_size;
-    } else {
-        limit = 256 - (address & 0xff) + 4;
-    }
+    struct w25q_cache *cache = &flash->cache;
+    unsigned long end = address + size;
 
-    buf[0] = W25Q_PAGE_PROGRAM;
-    /* Still, just support 3-byte addressing */
-    buf[1] = (address >> 16) & 0xff;
-    buf[2] = (address >> 8) & 0xff;
-    buf[3] = address & 0xff;
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(buf, buf, limit);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
+    for (unsigned i = 0; i < cache->lines; i++) {
+        unsigned long start, stop;
 
-    w25q_write_disable(flash);
+        if (cache->tags[i] == W25Q_CACHE_INVALID) {
+            continue;
+        }
+        start = cache->tags[i] * cache->line_size;
+        stop = start + cache->line_size;
+        if (stop <= address || start >= end) {
+            continue;
+        }
+        if (start < address) {
+            start = address;
+        }
+        if (stop > end) {
+            stop = end;
+        }
+        for (unsigned long a = start; a < stop; a++) {
+            cache->data[i * cache->line_size + (a & (cache->line_size - 1))] &= data[a - address];
+        }
+    }
 
-    return (limit - 4) & 0x1ff;
 }
 
 /**
- * @brief Erase a flash sector
- * 
- * @param[in] flash SPI flash instance
- * @param[in] address sector address.
+ * @brief Invalidate the cached lines of an erased range
 */
-#ifndef TEST
-static 
-#endif
-unsigned char w25q_sector_erase(struct w25q_flash *flash, unsigned address) {
+static void w25q_cache_erase(struct w25q_flash *flash, unsigned long address, unsigned long size) {
 
-    unsigned sector_num = (address >> 12) & 0xfffff;
-    unsigned char cmd[4];
+    struct w25q_cache *cache = &flash->cache;
+    unsigned long first, last;
 
-    if (sector_num >= flash->size) {
-        return 0;
+    if (cache->lines == 0) {
+        return;
+    }
+    first = address / cache->line_size;
+    last = (address + size - 1) / cache->line_size;
+    for (unsigned i = 0; i < cache->lines; i++) {
+        if (cache->tags[i] != W25Q_CACHE_INVALID && cache->tags[i] >= first && cache->tags[i] <= last) {
+            cache->tags[i] = W25Q_CACHE_INVALID;
+        }
     }
 
-    cmd[0] = W25Q_SECTOR_ERASE;
-    cmd[1] = (address >> 16) & 0xff;
-    cmd[2] = (address >> 8) & 0xf0;
-    cmd[3] = 0;
+}
 
-    w25q_wait_until_available(flash);
-    w25q_write_enable(flash);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(&cmd, &cmd, 4);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    w25q_wait_until_available(flash);
+/**
+ * @brief Send Release Power-Down and wait until the chip accepts commands
+*/
+static void w25q_power_wake(struct w25q_flash *flash) {
 
-    return 1;
-}
+    unsigned char cmd = W25Q_RELEASE_POWER_DOWN;
+    unsigned guard = W25Q_POWER_DOWN_US;
 
-#ifndef TEST
+    // The chip needs tDP to settle in deep power-down before it can be woken, a clock reading can
+    // be up to 1 us ahead of the real time passed
+    if (flash->clock != NULL) {
+        unsigned long since = flash->clock() - flash->power_changed;
+        guard = since <= W25Q_POWER_DOWN_US ? W25Q_POWER_DOWN_US + 1 - since : 0;
+    }
+    if (guard) {
+        w25q_delay_us(flash, guard);
+    }
+    flash->spi_send(&cmd, &cmd, 1);
+    w25q_delay_us(flash, W25Q_RELEASE_POWER_DOWN_US);
+    w25q_power_enter(flash, W25Q_POWER_STANDBY);
+
+}
+
+/**
+ * @brief Called before every transaction, wakes the chip when needed
+*/
+static void w25q_power_access(struct w25q_flash *flash) {
+
+    flash->power_idle_armed = 0;
+    if (flash->power_state == W25Q_POWER_DEEP_DOWN) {
+        w25q_power_wake(flash);
+    }
+
+}
+
+/**
+ * @brief Leave continuous read mode
+ * 
+ * Sends a Quad I/O read without opcode whose mode bits differ from W25Q_CONTINUOUS_READ_MODE,
+ * so the chip expects an opcode again.
+*/
+static void w25q_exit_continuous(struct w25q_flash *flash) {
+
+    const struct w25q_read_cmd *rc = &w25q_read_cmds[W25Q_READ_MODE_QUAD_IO];
+    struct w25q_xfer xfer;
+
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.address_bytes = flash->address_bytes;
+    xfer.address_lines = rc->address_lines;
+    xfer.mode = 0xff;
+    xfer.mode_lines = rc->mode_lines;
+    xfer.dummy_cycles = flash->read_dummy[W25Q_READ_MODE_QUAD_IO];
+    xfer.data_lines = rc->data_lines;
+    w25q_power_access(flash);
+    flash->xfer(&xfer);
+    w25q_stat_transaction(flash);
+    flash->read_continuous = 0;
+
+}
+
+/**
+ * @brief Run one SPI transaction (one chip select cycle)
+ * 
+ * Without a scatter-gather function the segments are staged in a local buffer, so their total size
+ * must not exceed W25Q_BOUNCE_SIZE unless the transaction is a single in-place segment.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] segments Transaction segments
+ * @param[in] count Number of segments
+*/
+static void w25q_transfer(struct w25q_flash *flash, const struct w25q_segment *segments, unsigned count) {
+
+    unsigned char bounce[W25Q_BOUNCE_SIZE];
+    unsigned total = 0;
+
+    w25q_power_access(flash);
+    if (flash->read_continuous) {
+        w25q_exit_continuous(flash);
+    }
+    w25q_stat_transaction(flash);
+    if (flash->spi_sg != NULL) {
+        flash->spi_sg(segments, count);
+        return;
+    }
+    if (count == 1 && segments[0].tx == segments[0].rx) {
+        flash->spi_send(segments[0].rx, segments[0].rx, segments[0].size);
+        return;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if (segments[i].tx != NULL) {
+            memcpy(&bounce[total], segments[i].tx, segments[i].size);
+        } else {
+            set_dummy_bytes(&bounce[total], segments[i].size);
+        }
+        total += segments[i].size;
+    }
+    flash->spi_send(bounce, bounce, total);
+    total = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (segments[i].rx != NULL) {
+            memcpy(segments[i].rx, &bounce[total], segments[i].size);
+        }
+        total += segments[i].size;
+    }
+
+}
+
+/**
+ * @brief Send a single-line command, one chip select cycle
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in,out] buffer Command bytes, replaced by the bytes received
+ * @param[in] size Buffer size
+*/
+static void w25q_command(struct w25q_flash *flash, void *buffer, unsigned size) {
+
+    struct w25q_segment segment = {buffer, buffer, size};
+
+    w25q_transfer(flash, &segment, 1);
+
+}
+
+/**
+ * @brief Run transactions back to back, in one transport call when a chain function is set
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] transactions Transactions, nothing received is looked at before the last one ends
+ * @param[in] count Number of transactions
+*/
+static void w25q_chain(struct w25q_flash *flash, const struct w25q_transaction *transactions, unsigned count) {
+
+    if (flash->spi_chain == NULL) {
+        for (unsigned i = 0; i < count; i++) {
+            w25q_transfer(flash, transactions[i].segments, transactions[i].count);
+        }
+        return;
+    }
+
+    w25q_power_access(flash);
+    if (flash->read_continuous) {
+        w25q_exit_continuous(flash);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        w25q_stat_transaction(flash);
+    }
+    flash->spi_chain(transactions, count);
+
+}
+
+/**
+ * @brief Send Write Enable followed by a write command
+ * 
+ * No Write Disable afterwards, the chip clears WEL when the program/erase/status write ends.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] segments Segments of the write command transaction
+ * @param[in] count Number of segments
+*/
+static void w25q_write_command(struct w25q_flash *flash, const struct w25q_segment *segments, unsigned count) {
+
+    static const unsigned char write_enable = W25Q_WRITE_ENABLE;
+    const struct w25q_segment enable = {&write_enable, NULL, 1};
+    struct w25q_transaction chain[2];
+
+    chain[0].segments = &enable;
+    chain[0].count = 1;
+    chain[1].segments = segments;
+    chain[1].count = count;
+    w25q_chain(flash, chain, 2);
+
+}
+
+/**
+ * @brief Enter deep power-down when nothing is pending on the chip
+ * 
+ * @return 1 when the chip is powered down, 0 otherwise
+*/
+static unsigned char w25q_power_down_now(struct w25q_flash *flash) {
+
+    unsigned char cmd = W25Q_POWER_DOWN;
+
+    if (flash->power_state == W25Q_POWER_DEEP_DOWN) {
+        return 1;
+    }
+    if (flash->busy_op != W25Q_OP_NONE || flash->suspended_op != W25Q_OP_NONE ||
+        flash->async.kind != W25Q_ASYNC_IDLE) {
+        return 0;
+    }
+    if (flash->queue != NULL && (flash->queue->head != NULL || flash->queue->active != NULL)) {
+        return 0;
+    }
+    // Leaves continuous read mode first
+    w25q_command(flash, &cmd, 1);
+    w25q_power_enter(flash, W25Q_POWER_DEEP_DOWN);
+    return 1;
+
+}
+
+/**
+ * @brief Power down an idle chip once the idle timeout has passed
+*/
+static void w25q_power_idle(struct w25q_flash *flash) {
+
+    if (!flash->power_down || flash->power_state != W25Q_POWER_STANDBY) {
+        return;
+    }
+    if (flash->power_idle_us != 0) {
+        unsigned long now = flash->clock();
+
+        // The countdown starts at the first check without a transaction since
+        if (!flash->power_idle_armed) {
+            flash->power_idle_armed = 1;
+            flash->power_idle_since = now;
+            return;
+        }
+        if (now - flash->power_idle_since < flash->power_idle_us) {
+            return;
+        }
+    }
+    w25q_power_down_now(flash);
+
+}
+
+static void w25q_lock(struct w25q_flash *flash) {
+    if (flash != NULL) {
+        if (flash->lock != NULL) {
+            flash->lock(flash->lock_arg);
+        }
+        flash->lock_depth++;
+    }
+}
+
+static void w25q_unlock(struct w25q_flash *flash) {
+    if (flash != NULL) {
+        // Leaving the outermost API call
+        if (--flash->lock_depth == 0) {
+            w25q_power_idle(flash);
+        }
+        if (flash->lock != NULL) {
+            flash->unlock(flash->lock_arg);
+        }
+    }
+}
+
+/**
+ * @brief Read SPI flash's status registers
+ * @param[in] flash SPI flash instance
+ * @param[out] buffer Buffer to store status data. Must be at least 3 bytes long.
+ *                    Returned data begins at buffer[0] with length = 2.
+ * 
+*/
+#ifndef TEST
+static 
+#endif
+void w25q_read_status_regs(struct w25q_flash *flash, void *buffer) {
+
+    unsigned char *result_buffer = (unsigned char *)buffer;
+    #ifdef W25Q_STATS
+    enum w25q_stat_t stat_op = flash->stat_op;
+    #endif
+
+    w25q_stat_count(flash, W25Q_STAT_STATUS_POLL, 2);
+    set_dummy_bytes(result_buffer, 3);
+
+    // Get the first status reg data
+    result_buffer[0] = W25Q_READ_STATUS_REG_1;
+    w25q_command(flash, result_buffer, 2);
+    result_buffer[0] = result_buffer[1];
+
+    // Get the second status reg datav
+    result_buffer[1] = W25Q_READ_STATUS_REG_2;
+    w25q_command(flash, &result_buffer[1], 2);
+    result_buffer[1] = result_buffer[2];
+    #ifdef W25Q_STATS
+    flash->stat_op = stat_op;
+    #endif
+
+}
+
+/**
+ * @brief Read status register 1, enough to follow BUSY
+*/
+static unsigned char w25q_read_status_1(struct w25q_flash *flash) {
+
+    unsigned char cmd[2] = {W25Q_READ_STATUS_REG_1, 0xff};
+    #ifdef W25Q_STATS
+    enum w25q_stat_t stat_op = flash->stat_op;
+    #endif
+
+    w25q_stat_count(flash, W25Q_STAT_STATUS_POLL, 1);
+    w25q_command(flash, cmd, 2);
+    #ifdef W25Q_STATS
+    flash->stat_op = stat_op;
+    #endif
+    return cmd[1];
+
+}
+
+/**
+ * @brief Read SPI flash JEDEC ID
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[out] buffer JEDEC ID buffer. Its size must be at least 4 bytes.
+ *                  Returned value begins at data[1];
+*/
+#ifndef TEST
+static 
+#endif
+void w25q_read_jedec(struct w25q_flash *flash, void *buffer) {
+
+    unsigned char *return_data = (unsigned char *)buffer;
+    set_dummy_bytes(return_data, 4);
+
+    return_data[0] = W25Q_READ_JEDEC_ID;
+    w25q_command(flash, return_data, 4);
+
+}
+
+/**
+ * Wait until the flash finish the last operation
+ * 
+ * The first poll is issued after the typical time of the pending operation, then
+ * the interval grows from a fraction of the typical time until the datasheet maximum
+ * has passed.
+ * 
+ * @param[in] flash SPI Flash instance
+ * 
+ * @return 1 when the chip is available, 0 on timeout
+*/
+#ifndef TEST
+static 
+#endif
+unsigned char w25q_wait_until_available(struct w25q_flash *flash) {
+
+    unsigned elapsed, interval, cap, timeout;
+    unsigned slept = 0;
+
+    if (flash->busy_op == W25Q_OP_NONE) {
+        return 1;
+    }
+
+    if (flash->busy_op < W25Q_OP_COUNT) {
+        // Part of the expected time may already have passed
+        elapsed = flash->clock != NULL ? flash->clock() - flash->busy_since : 0;
+        if (elapsed < flash->busy_expect_us) {
+            slept = w25q_delay_us(flash, flash->busy_expect_us - elapsed);
+            elapsed += slept;
+        }
+        interval = flash->busy_expect_us >> W25Q_POLL_FIRST_SHIFT;
+        cap = flash->timing[flash->busy_op].typ_us >> W25Q_POLL_CAP_SHIFT;
+        timeout = flash->timing[flash->busy_op].max_us;
+    } else {
+        // Unknown operation, poll from the start and allow for a chip erase
+        elapsed = 0;
+        interval = W25Q_POLL_MIN_US;
+        cap = flash->timing[W25Q_OP_CHIP_ERASE].typ_us >> W25Q_POLL_CAP_SHIFT;
+        timeout = flash->timing[W25Q_OP_CHIP_ERASE].max_us;
+    }
+    if (interval < W25Q_POLL_MIN_US) {
+        interval = W25Q_POLL_MIN_US;
+    }
+
+    while (1) {
+        unsigned char sr1 = w25q_read_status_1(flash);
+
+        w25q_stat_poll(flash, slept);
+        if ((sr1 & W25Q_SR1_BUSY) == 0) {
+            w25q_op_finished(flash, elapsed);
+            return 1;
+        }
+        if (elapsed >= timeout) {
+            return 0;
+        }
+        slept = w25q_delay_us(flash, interval);
+        elapsed += slept;
+        if (interval < cap) {
+            interval *= 2;
+        }
+    }
+}
+
+/**
+ * @brief Start programming a page, the chip must be idle
+ * 
+ * @return Number of bytes sent to the page
+*/
+static unsigned short w25q_page_program_start(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size) {
+
+    unsigned char cmd[5];
+    struct w25q_segment segments[2];
+
+    /* Take min between buffer size and un-programmed bytes in the page */
+    unsigned limit;
+    if (buffer_size <= 256 - (address & 0xff)) {
+        limit = buffer_size;
+    } else {
+        limit = 256 - (address & 0xff);
+    }
+
+    w25q_stat_begin(flash, W25Q_STAT_PAGE_PROGRAM, address, limit);
+
+    segments[0].tx = cmd;
+    segments[0].rx = NULL;
+    segments[0].size = w25q_command_header(flash, cmd, W25Q_PAGE_PROGRAM, W25Q_PAGE_PROGRAM_4B, address);
+    segments[1].tx = buffer;
+    segments[1].rx = NULL;
+    segments[1].size = limit;
+    w25q_write_command(flash, segments, 2);
+    w25q_cache_program(flash, address, (const unsigned char *)buffer, limit);
+
+    // Short programs finish early: about 1/16 of tPP to start, then proportional to the length
+    {
+        unsigned typ = flash->timing[W25Q_OP_PAGE_PROGRAM].typ_us;
+        unsigned expect = (typ >> 4) + typ * limit / 256;
+        w25q_op_started(flash, W25Q_OP_PAGE_PROGRAM, address, expect < typ ? expect : typ);
+    }
+
+    return limit & 0x1ff;
+}
+
+/**
+ * @brief Program data to a page
+ * @param[in] flash SPI flash instance
+ * @param[in] buffer Data buffer
+ * @param[in] buffer_size Buffer size, bytes past the end of the page are not programmed
+ * 
+ * @return Number of bytes get written in the operation, 0 on timeout
+*/
+#ifndef TEST
+static 
+#endif
+unsigned short w25q_page_program(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size) {
+
+    unsigned short limit;
+
+    if (!w25q_wait_until_available(flash)) {
+        return 0;
+    }
+    limit = w25q_page_program_start(flash, address, buffer, buffer_size);
+    if (!w25q_wait_until_available(flash)) {
+        return 0;
+    }
+
+    return limit;
+}
+
+/**
+ * @brief Start erasing a sector or block, the chip must be idle
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] op W25Q_OP_SECTOR_ERASE, W25Q_OP_32K_BLK_ERASE or W25Q_OP_64K_BLK_ERASE
+ * @param[in] address Address inside the sector/block
+ * 
+ * @return 1 on success, 0 on invalid address or unsupported erase size
+*/
+static unsigned char w25q_block_erase_start(struct w25q_flash *flash, enum w25q_op_t op, unsigned address) {
+
+    unsigned char cmd[5];
+    struct w25q_segment segment;
+
+    if ((unsigned long)address >= flash->size * 256 || flash->erase_opcode[op] == 0) {
+        return 0;
+    }
+    address &= ~((1u << w25q_erase_shift[op]) - 1);
+
+    // erase_opcode already matches the address mode
+    segment.tx = cmd;
+    segment.rx = NULL;
+    segment.size = w25q_command_header(flash, cmd, flash->erase_opcode[op], flash->erase_opcode[op], address);
+
+    w25q_stat_begin(flash, (enum w25q_stat_t)op, address, 1UL << w25q_erase_shift[op]);
+    w25q_write_command(flash, &segment, 1);
+    w25q_cache_erase(flash, address, 1UL << w25q_erase_shift[op]);
+    w25q_op_started(flash, op, address, 0);
+
+    return 1;
+
+}
+
+/**
+ * @brief Erase a sector or block
+ * 
+ * @return 1 on success, 0 on failure or timeout
+*/
+#ifndef TEST
 static 
 #endif
-unsigned char w25q_32k_blk_erase(struct w25q_flash *flash, unsigned address) {
+unsigned char w25q_block_erase(struct w25q_flash *flash, enum w25q_op_t op, unsigned address) {
+
+    if (!w25q_wait_until_available(flash)) {
+        return 0;
+    }
+    if (!w25q_block_erase_start(flash, op, address)) {
+        return 0;
+    }
+
+    return w25q_wait_until_available(flash);
+
+}
+
+/**
+ * @brief Start a chip erase, the chip must be idle
+*/
+static void w25q_chip_erase_start(struct w25q_flash *flash) {
+
+    unsigned char cmd = W25Q_CHIP_ERASE;
+    struct w25q_segment segment = {&cmd, NULL, 1};
+
+    w25q_stat_begin(flash, W25Q_STAT_CHIP_ERASE, 0, (unsigned long)flash->size * 256);
+    w25q_write_command(flash, &segment, 1);
+    w25q_cache_invalidate(flash);
+    w25q_op_started(flash, W25Q_OP_CHIP_ERASE, 0, 0);
+
+}
+
+/**
+ * @brief Pick the next erase of a range
+ * 
+ * A block erase is used when it is aligned, fits in the range and is not slower than covering
+ * the block with the next smaller erase.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] address Current address, 4KB-aligned
+ * @param[in] end_address End of the range (exclusive), 4KB-aligned
+*/
+static enum w25q_op_t w25q_erase_step(struct w25q_flash *flash, unsigned long address, unsigned long end_address) {
+
+    unsigned long best_cost[W25Q_OP_64K_BLK_ERASE + 1];
+    enum w25q_op_t op;
+
+    // Cheapest way to clear one sector, one 32KB block and one 64KB block
+    best_cost[W25Q_OP_SECTOR_ERASE] = flash->timing[W25Q_OP_SECTOR_ERASE].typ_us;
+    for (op = W25Q_OP_32K_BLK_ERASE; op <= W25Q_OP_64K_BLK_ERASE; op++) {
+        unsigned long split = best_cost[op - 1] << (w25q_erase_shift[op] - w25q_erase_shift[op - 1]);
+        best_cost[op] = split;
+        if (flash->erase_opcode[op] != 0 && flash->timing[op].typ_us <= split) {
+            best_cost[op] = flash->timing[op].typ_us;
+        }
+    }
+
+    for (op = W25Q_OP_64K_BLK_ERASE; op > W25Q_OP_SECTOR_ERASE; op--) {
+        unsigned long block = 1UL << w25q_erase_shift[op];
+        if (flash->erase_opcode[op] != 0 && (address & (block - 1)) == 0 && end_address - address >= block &&
+            flash->timing[op].typ_us == best_cost[op]) {
+            return op;
+        }
+    }
+    return W25Q_OP_SECTOR_ERASE;
+
+}
+
+/**
+ * @brief Finish the asynchronous request and notify the caller
+*/
+static void w25q_async_complete(struct w25q_flash *flash, unsigned char result) {
+
+    w25q_complete_fn done = flash->async.done;
+    void *context = flash->async.context;
+
+    flash->async.kind = W25Q_ASYNC_IDLE;
+    if (done != NULL) {
+        done(flash, result, context);
+    }
+
+}
+
+/**
+ * @brief Block until the asynchronous request in progress is finished and the chip is idle
+ * 
+ * A blocking write or erase that timed out leaves busy_op set with no request pending, so the
+ * chip is waited for in any case.
+ * 
+ * @return 0 when the chip timed out or a suspended operation could not be resumed
+*/
+static unsigned char w25q_async_drain(struct w25q_flash *flash) {
+
+    if (flash->suspended_op != W25Q_OP_NONE && !w25q_resume(flash)) {
+        return 0;
+    }
+    while (flash->async.kind != W25Q_ASYNC_IDLE) {
+        if (!w25q_wait_until_available(flash)) {
+            w25q_async_complete(flash, 0);
+            return 0;
+        }
+        w25q_poll(flash);
+    }
+    return w25q_wait_until_available(flash);
+
+}
+
+/**
+ * @brief Accept an asynchronous request and start its first operation
+*/
+static unsigned char w25q_async_submit(struct w25q_flash *flash, enum w25q_async_t kind, unsigned long address,
+                                       unsigned long end, const void *source, w25q_complete_fn done, void *context) {
+
+    struct w25q_async *req = &flash->async;
+
+    if (req->kind != W25Q_ASYNC_IDLE) {
+        return 0;
+    }
+    req->kind = kind;
+    req->address = address;
+    req->end = end;
+    req->source = (const unsigned char *)source;
+    req->done = done;
+    req->context = context;
+    w25q_poll(flash);
+    return 1;
+
+}
+
+/**
+ * @brief Read data with the selected read command, the chip must be idle or suspended
+*/
+static void w25q_read_data(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+
+    unsigned char *buf = (unsigned char *)buffer;
+    const struct w25q_read_cmd *rc = &w25q_read_cmds[flash->read_mode];
+    unsigned char cmd[6];
+    struct w25q_segment segments[2];
+    unsigned chunk;
+    unsigned long start;
+
+    if (buffer_size == 0) {
+        return;
+    }
+    w25q_stat_begin(flash, W25Q_STAT_READ, address, buffer_size);
+    start = w25q_stat_now(flash);
+
+    if (flash->xfer != NULL) {
+        struct w25q_xfer xfer;
+
+        memset(&xfer, 0, sizeof(xfer));
+        xfer.opcode = flash->address_mode == W25Q_ADDRESS_4B_OPCODES ? rc->opcode_4b : rc->opcode;
+        // Back-to-back Quad I/O reads skip the opcode
+        xfer.opcode_lines = flash->read_continuous ? 0 : 1;
+        xfer.address = address;
+        xfer.address_bytes = flash->address_bytes;
+        xfer.address_lines = rc->address_lines;
+        xfer.mode = W25Q_CONTINUOUS_READ_MODE;
+        xfer.mode_lines = rc->mode_lines;
+        xfer.dummy_cycles = flash->read_dummy[flash->read_mode];
+        xfer.data_lines = rc->data_lines;
+        xfer.rx = buf;
+        xfer.data_size = buffer_size;
+        w25q_power_access(flash);
+        flash->xfer(&xfer);
+        w25q_stat_transaction(flash);
+        flash->read_continuous = rc->mode_lines != 0;
+        w25q_stat_end(flash, W25Q_STAT_READ, xfer.address, w25q_stat_now(flash) - start, flash->clock != NULL);
+        return;
+    }
+
+    segments[0].tx = cmd;
+    segments[0].rx = NULL;
+    segments[1].tx = NULL;
+    while (buffer_size > 0) {
+        segments[0].size = w25q_command_header(flash, cmd, rc->opcode, rc->opcode_4b, address);
+        set_dummy_bytes(&cmd[segments[0].size], flash->read_dummy[flash->read_mode] / 8);
+        segments[0].size += flash->read_dummy[flash->read_mode] / 8;
+        // Without scatter-gather support every command must fit in the bounce buffer
+        chunk = buffer_size;
+        if (flash->spi_sg == NULL && chunk > W25Q_BOUNCE_SIZE - segments[0].size) {
+            chunk = W25Q_BOUNCE_SIZE - segments[0].size;
+        }
+        segments[1].rx = buf;
+        segments[1].size = chunk;
+        w25q_transfer(flash, segments, 2);
+        address += chunk;
+        buf += chunk;
+        buffer_size -= chunk;
+    }
+    w25q_stat_end(flash, W25Q_STAT_READ, address - (unsigned)(buf - (unsigned char *)buffer),
+                  w25q_stat_now(flash) - start, flash->clock != NULL);
+
+}
+
+/**
+ * @brief Check whether a range touches the page/block of a program/erase operation
+*/
+static unsigned char w25q_op_overlaps(enum w25q_op_t op, unsigned long op_address, unsigned long address, unsigned long size) {
+
+    unsigned long op_size = op == W25Q_OP_PAGE_PROGRAM ? 256 : 1UL << w25q_erase_shift[op];
+
+    op_address &= ~(op_size - 1);
+    return address < op_address + op_size && op_address < address + size;
+
+}
+
+/**
+ * @brief Check whether a read would have to wait for the program/erase in progress
+ * 
+ * Mirrors w25q_read_begin: only a read outside the page/block being changed, with a suspendable
+ * operation running or suspended, goes ahead without finishing the asynchronous request first.
+*/
+static unsigned char w25q_read_waits(struct w25q_flash *flash, unsigned long address, unsigned long size) {
+
+    if (flash->suspended_op != W25Q_OP_NONE) {
+        return w25q_op_overlaps(flash->suspended_op, flash->suspended_address, address, size);
+    }
+    if (flash->async.kind == W25Q_ASYNC_IDLE || flash->busy_op == W25Q_OP_NONE) {
+        return 0;
+    }
+    return flash->busy_op > W25Q_OP_64K_BLK_ERASE ||
+           w25q_op_overlaps(flash->busy_op, flash->busy_address, address, size);
+
+}
+
+/**
+ * @brief Get the chip ready for a read
+ * 
+ * Reads are allowed while suspended, except in the page/block being changed. With high read
+ * priority a running program/erase of an asynchronous request is suspended.
+ * 
+ * @return 0 when the caller has to wait for the chip, 1 when it can read, 2 when it can read and
+ *         must resume afterwards
+*/
+static unsigned char w25q_read_begin(struct w25q_flash *flash, unsigned long address, unsigned long size) {
+
+    if (flash->suspended_op != W25Q_OP_NONE) {
+        return !w25q_op_overlaps(flash->suspended_op, flash->suspended_address, address, size);
+    }
+
+    if (flash->async.kind == W25Q_ASYNC_IDLE || flash->read_priority != W25Q_READ_PRIORITY_HIGH) {
+        return 0;
+    }
+    if (flash->busy_op > W25Q_OP_64K_BLK_ERASE && flash->busy_op != W25Q_OP_NONE) {
+        return 0;
+    }
+    if (flash->busy_op != W25Q_OP_NONE &&
+        w25q_op_overlaps(flash->busy_op, flash->busy_address, address, size)) {
+        return 0;
+    }
+
+    if (w25q_suspend(flash)) {
+        return 2;
+    }
+    // Finished in the meantime (or nothing running between two steps of the request)
+    return flash->busy_op == W25Q_OP_NONE;
+
+}
+
+/**
+ * @brief Copy a range from the cache
+ * 
+ * @return 1 when every line was cached, 0 otherwise (nothing is counted then)
+*/
+static unsigned char w25q_cache_read(struct w25q_flash *flash, unsigned long address, unsigned char *buf, unsigned size) {
+
+    struct w25q_cache *cache = &flash->cache;
+    unsigned long first = address / cache->line_size;
+    unsigned long last = (address + size - 1) / cache->line_size;
+
+    for (unsigned long line = first; line <= last; line++) {
+        if (w25q_cache_find(cache, line) == cache->lines) {
+            return 0;
+        }
+    }
+    for (unsigned long line = first; line <= last; line++) {
+        unsigned entry = w25q_cache_find(cache, line);
+        unsigned offset = line == first ? address & (cache->line_size - 1) : 0;
+        unsigned chunk = cache->line_size - offset;
+
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(buf, &cache->data[entry * cache->line_size + offset], chunk);
+        cache->referenced[entry] = 1;
+        cache->hits++;
+        buf += chunk;
+        size -= chunk;
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Read through the cache, filling the missing lines from the chip
+*/
+static void w25q_cache_fill(struct w25q_flash *flash, unsigned long address, unsigned char *buf, unsigned size) {
+
+    struct w25q_cache *cache = &flash->cache;
+
+    while (size > 0) {
+        unsigned long line = address / cache->line_size;
+        unsigned offset = address & (cache->line_size - 1);
+        unsigned chunk = cache->line_size - offset;
+        unsigned entry = w25q_cache_find(cache, line);
+
+        if (chunk > size) {
+            chunk = size;
+        }
+        if (entry == cache->lines) {
+            entry = w25q_cache_victim(cache);
+            w25q_read_data(flash, line * cache->line_size, &cache->data[entry * cache->line_size], cache->line_size);
+            cache->tags[entry] = line;
+            cache->misses++;
+        } else {
+            cache->hits++;
+        }
+        cache->referenced[entry] = 1;
+        memcpy(buf, &cache->data[entry * cache->line_size + offset], chunk);
+        address += chunk;
+        buf += chunk;
+        size -= chunk;
+    }
+
+}
+
+/**
+ * @brief Apply buffered writes to data read from the chip, programming only clears bits
+*/
+static void w25q_wbuf_overlay(struct w25q_flash *flash, unsigned long address, unsigned char *buf, unsigned size) {
+
+    struct w25q_write_buffer *wbuf = flash->wbuf;
+    unsigned long start, end;
+
+    if (wbuf == NULL || wbuf->end == 0) {
+        return;
+    }
+    start = wbuf->page + wbuf->start;
+    end = wbuf->page + wbuf->end;
+    if (start < address) {
+        start = address;
+    }
+    if (end > address + size) {
+        end = address + size;
+    }
+    for (unsigned long a = start; a < end; a++) {
+        buf[a - address] &= wbuf->data[a - wbuf->page];
+    }
+
+}
+
+/**
+ * @brief Drop buffered data of an erased range
+*/
+static void w25q_wbuf_erase(struct w25q_flash *flash, unsigned long address, unsigned long end) {
+
+    struct w25q_write_buffer *wbuf = flash->wbuf;
+
+    if (wbuf == NULL || wbuf->end == 0 || wbuf->page < address || wbuf->page >= end) {
+        return;
+    }
+    memset(&wbuf->data[wbuf->start], 0xff, wbuf->end - wbuf->start);
+    wbuf->start = wbuf->end = 0;
+    wbuf->bytes = 0;
+
+}
+
+/**
+ * @brief Check whether buffered data is older than the age threshold
+*/
+static unsigned char w25q_wbuf_expired(struct w25q_flash *flash) {
+
+    struct w25q_write_buffer *wbuf = flash->wbuf;
+
+    return wbuf != NULL && wbuf->end != 0 && wbuf->flush_age_us != 0 && flash->clock != NULL &&
+           flash->clock() - wbuf->since >= wbuf->flush_age_us;
+
+}
+
+/**
+ * @brief Merge a write that fits in one page into the buffer
+ * 
+ * @return 1 on success, 0 when flushing failed
+*/
+static unsigned char w25q_wbuf_write(struct w25q_flash *flash, unsigned long address, const unsigned char *buf, unsigned size) {
+
+    struct w25q_write_buffer *wbuf = flash->wbuf;
+    unsigned long page = address & ~0xffUL;
+    unsigned offset = address & 0xff;
+
+    if (wbuf->end != 0 && wbuf->page != page && !w25q_flush(flash)) {
+        return 0;
+    }
+    if (wbuf->end == 0) {
+        wbuf->page = page;
+        wbuf->start = offset;
+        wbuf->end = offset + size;
+        if (flash->clock != NULL) {
+            wbuf->since = flash->clock();
+        }
+    }
+    for (unsigned i = 0; i < size; i++) {
+        wbuf->data[offset + i] &= buf[i];
+    }
+    if (offset < wbuf->start) {
+        wbuf->start = offset;
+    }
+    if (offset + size > wbuf->end) {
+        wbuf->end = offset + size;
+    }
+    wbuf->bytes += size;
+
+    if (wbuf->flush_bytes != 0 && wbuf->bytes >= wbuf->flush_bytes) {
+        return w25q_flush(flash);
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Check a range for programmed bits, the chip must be idle or suspended
+*/
+static unsigned char w25q_blank(struct w25q_flash *flash, unsigned long address, unsigned long end) {
+
+    unsigned long words[W25Q_BLANK_CHECK_SIZE / sizeof(unsigned long)];
+
+    while (address < end) {
+        unsigned chunk = end - address < sizeof(words) ? end - address : sizeof(words);
+        unsigned long acc = ~0UL;
+
+        w25q_read_data(flash, address, words, chunk);
+        w25q_wbuf_overlay(flash, address, (unsigned char *)words, chunk);
+        if (chunk < sizeof(words)) {
+            memset((unsigned char *)words + chunk, 0xff, sizeof(words) - chunk);
+        }
+        // Branch-free reduction over the chunk, checked once
+        for (unsigned i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+            acc &= words[i];
+        }
+        if (acc != ~0UL) {
+            return 0;
+        }
+        address += chunk;
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Skip blank sectors and pick the erase for the next non-blank run
+ * 
+ * Only looks up to the end of the current 64K block, the largest erase there is, so one call
+ * blank-checks at most 64 KB.
+ * 
+ * @param[in,out] address Next address to erase, moved past blank sectors
+ * 
+ * @return Operation to erase at *address, W25Q_OP_NONE when the rest of the 64K block is blank
+*/
+static enum w25q_op_t w25q_erase_step_skip(struct w25q_flash *flash, unsigned long *address, unsigned long end) {
+
+    unsigned long run_end, limit = (*address | 0xffffUL) + 1;
+
+    if (limit > end) {
+        limit = end;
+    }
+    while (*address < limit && w25q_blank(flash, *address, *address + 4096)) {
+        *address += 4096;
+    }
+    if (*address >= limit) {
+        return W25Q_OP_NONE;
+    }
+    for (run_end = *address + 4096; run_end < limit && !w25q_blank(flash, run_end, run_end + 4096); run_end += 4096);
+
+    return w25q_erase_step(flash, *address, run_end);
+
+}
+
+/**
+ * @brief Read back a programmed page straight from the chip, not the cache
+ * 
+ * @param[in] gaps 1 when 0xff bytes only fill gaps between writes, they left the old contents and are not compared
+ * @return 1 if the chip holds the data, 0 otherwise
+*/
+static unsigned char w25q_program_verify(struct w25q_flash *flash, unsigned address, const unsigned char *src,
+                                         unsigned size, unsigned char gaps) {
+
+    unsigned char check[W25Q_VERIFY_CHUNK];
+
+    for (unsigned done = 0; done < size; ) {
+        unsigned chunk = size - done < sizeof(check) ? size - done : sizeof(check);
+
+        w25q_read_data(flash, address + done, check, chunk);
+        for (unsigned i = 0; i < chunk; i++) {
+            if (check[i] != src[done + i] && !(gaps && src[done + i] == 0xff)) {
+                return 0;
+            }
+        }
+        done += chunk;
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Program a page and read it back when write verification is on
+ * 
+ * @return Number of bytes written, 0 on timeout or verification failure
+*/
+static unsigned short w25q_page_program_checked(struct w25q_flash *flash, unsigned address, const void *buffer,
+                                                unsigned buffer_size) {
+
+    unsigned short programmed = w25q_page_program(flash, address, buffer, buffer_size);
+
+    if (programmed == 0 || !flash->write_verify) {
+        return programmed;
+    }
+    return w25q_program_verify(flash, address, (const unsigned char *)buffer, programmed, 0) ? programmed : 0;
+
+}
+
+/**
+ * @brief Read from the SFDP area (always 3-byte address and 8 dummy clocks)
+*/
+static void w25q_sfdp_read(struct w25q_flash *flash, unsigned long address, void *buffer, unsigned size) {
+
+    unsigned char cmd[5];
+    struct w25q_segment segments[2];
+
+    cmd[0] = W25Q_READ_SFDP;
+    cmd[1] = (address >> 16) & 0xff;
+    cmd[2] = (address >> 8) & 0xff;
+    cmd[3] = address & 0xff;
+    cmd[4] = 0xff;
+    segments[0].tx = cmd;
+    segments[0].rx = NULL;
+    segments[0].size = 5;
+    segments[1].tx = NULL;
+    segments[1].rx = buffer;
+    segments[1].size = size;
+    w25q_transfer(flash, segments, 2);
+
+}
+
+/**
+ * @brief Chip erase time from the density, about 2.5s per MB and at least 0.5s
+*/
+static void w25q_chip_erase_timing(struct w25q_flash *flash) {
+
+    flash->timing[W25Q_OP_CHIP_ERASE].typ_us = flash->size >= 4096 ? (unsigned)(flash->size / 4096) * 2500000u : 500000u;
+    flash->timing[W25Q_OP_CHIP_ERASE].max_us = flash->timing[W25Q_OP_CHIP_ERASE].typ_us * 5;
+
+}
+
+/**
+ * @brief Decode an SFDP duration, (count + 1) * unit
+ * 
+ * @param[in] dword Parameter DWORD
+ * @param[in] shift Position of the count field
+ * @param[in] count_bits Width of the count field, the unit field follows
+ * @param[in] units Unit for each value of the unit field, in us
+*/
+static unsigned long w25q_sfdp_time(unsigned long dword, unsigned shift, unsigned count_bits, const unsigned long *units) {
+
+    unsigned long count = (dword >> shift) & ((1UL << count_bits) - 1);
+
+    return (count + 1) * units[(dword >> (shift + count_bits)) & 3];
+
+}
+
+/**
+ * @brief Store typical/max times, max is 2 * (multiplier + 1) * typical
+*/
+static void w25q_sfdp_timing(struct w25q_flash *flash, enum w25q_op_t op, unsigned long typ_us, unsigned long multiplier) {
+
+    flash->timing[op].typ_us = typ_us;
+    flash->timing[op].max_us = typ_us <= ~0u / (2 * (multiplier + 1)) ? (unsigned)(2 * (multiplier + 1) * typ_us) : ~0u;
+
+}
+
+/**
+ * @brief Check a fast read described by SFDP against the command the driver sends
+ * 
+ * @param[in] params Dummy clocks (bits 4:0), mode clocks (7:5) and opcode (15:8)
+ * @param[in] mode_clocks Mode clocks the driver sends
+*/
+static void w25q_sfdp_read_mode(struct w25q_flash *flash, enum w25q_read_mode_t mode, unsigned long params,
+                                unsigned mode_clocks) {
+
+    unsigned clocks = (params & 0x1f) + ((params >> 5) & 0x7);
+
+    if (((params >> 8) & 0xff) != w25q_read_cmds[mode].opcode || clocks < mode_clocks) {
+        flash->read_modes &= ~(1u << mode);
+        return;
+    }
+    flash->read_dummy[mode] = clocks - mode_clocks;
+
+}
+
+/**
+ * @brief Read the Serial Flash Discoverable Parameters (JESD216)
+ * 
+ * Updates size, erase opcodes and times, program and chip erase times, read modes and the quad
+ * enable requirement from the Basic Flash Parameter Table, and the 4-byte opcodes from the 4-Byte
+ * Address Instruction Table.
+ * 
+ * @param[in] expected_size Size implied by the ID in pages, 0 when the part is unknown
+ * @param[out] address_mode Preferred address mode above 16 MB
+ * 
+ * @return 1 when a valid table was found, the instance is left untouched otherwise
+*/
+static unsigned char w25q_sfdp_probe(struct w25q_flash *flash, unsigned long expected_size,
+                                     enum w25q_address_mode_t *address_mode) {
+
+    static const unsigned long erase_units[] = {1000, 16000, 128000, 1000000};
+    static const unsigned long program_units[] = {8, 64, 8, 64};
+    static const unsigned long chip_units[] = {16000, 256000, 4000000, 64000000};
+    unsigned char header[8];
+    unsigned char table[64];
+    unsigned long dw[17];
+    unsigned long bfpt = 0, ait = 0, density;
+    unsigned bfpt_len = 0, headers;
+    unsigned char erase_4b[4] = {0, 0, 0, 0};
+    unsigned char opcode_3b[W25Q_OP_64K_BLK_ERASE + 1] = {0};
+    unsigned char opcode_4b[W25Q_OP_64K_BLK_ERASE + 1] = {0};
+    unsigned long erase_typ_us[W25Q_OP_64K_BLK_ERASE + 1] = {0};
+    unsigned long ait_support = 0;
+
+    w25q_sfdp_read(flash, 0, header, 8);
+    if (w25q_get_le32(header) != 0x50444653UL) {      // "SFDP"
+        return 0;
+    }
+    headers = header[6] + 1u;
+
+    // Parameter headers: ID LSB, minor, major, length in DWORDs, 24-bit pointer, ID MSB
+    for (unsigned i = 0; i < headers && i < 8; i++) {
+        w25q_sfdp_read(flash, 8 + i * 8, header, 8);
+        if (header[0] == 0x00 && header[7] == 0xff && header[2] == 1 && bfpt == 0) {
+            bfpt = header[4] | ((unsigned long)header[5] << 8) | ((unsigned long)header[6] << 16);
+            bfpt_len = header[3] < 16 ? header[3] : 16;
+        } else if (header[0] == 0x84 && header[7] == 0xff && header[3] >= 2) {
+            ait = header[4] | ((unsigned long)header[5] << 8) | ((unsigned long)header[6] << 16);
+        }
+    }
+    if (bfpt == 0 || bfpt_len < 9) {
+        return 0;
+    }
+    w25q_sfdp_read(flash, bfpt, table, bfpt_len * 4);
+    memset(dw, 0, sizeof(dw));
+    for (unsigned i = 0; i < bfpt_len; i++) {
+        dw[i + 1] = w25q_get_le32(&table[i * 4]);
+    }
+
+    // Density in bits, or 2^N bits
+    if (dw[2] & 0x80000000UL) {
+        if ((dw[2] & 0x7fffffffUL) < 11 || (dw[2] & 0x7fffffffUL) > 34) {
+            return 0;
+        }
+        density = 1UL << ((dw[2] & 0x7fffffffUL) - 11);
+    } else {
+        density = (dw[2] >> 11) + 1;
+    }
+    // A known part must agree with the size its ID implies
+    if (expected_size != 0 && density != expected_size) {
+        return 0;
+    }
+
+    if (ait != 0) {
+        w25q_sfdp_read(flash, ait, table, 8);
+        ait_support = w25q_get_le32(table);
+        memcpy(erase_4b, &table[4], 4);
+    }
+
+    // Erase types: size (2^N bytes) and opcode, times in DWORD 10
+    for (unsigned type = 0; type < 4; type++) {
+        unsigned long erase = dw[8 + type / 2] >> ((type & 1) * 16);
+        enum w25q_op_t op;
+
+        for (op = W25Q_OP_SECTOR_ERASE; op <= W25Q_OP_64K_BLK_ERASE; op++) {
+            if ((erase & 0xff) == w25q_erase_shift[op]) {
+                break;
+            }
+        }
+        if (op > W25Q_OP_64K_BLK_ERASE || ((erase >> 8) & 0xff) == 0) {
+            continue;
+        }
+        opcode_3b[op] = (erase >> 8) & 0xff;
+        if (ait_support & (1UL << (9 + type))) {
+            opcode_4b[op] = erase_4b[type];
+        }
+        if (bfpt_len >= 10) {
+            erase_typ_us[op] = w25q_sfdp_time(dw[10], 4 + type * 7, 5, erase_units);
+        }
+    }
+    if (opcode_3b[W25Q_OP_SECTOR_ERASE] == 0) {
+        return 0;
+    }
+
+    // The table checks out, nothing of the instance was changed before this point. Without the
+    // 4-byte address table the 4-byte erase opcodes keep their Winbond defaults
+    flash->size = density;
+    flash->sfdp = 1;
+    memcpy(flash->erase_opcode_3b, opcode_3b, sizeof(opcode_3b));
+    if (ait != 0) {
+        memcpy(flash->erase_opcode_4b, opcode_4b, sizeof(opcode_4b));
+    }
+    memcpy(flash->erase_opcode, flash->erase_opcode_3b, sizeof(flash->erase_opcode));
+    for (int op = W25Q_OP_SECTOR_ERASE; op <= W25Q_OP_64K_BLK_ERASE; op++) {
+        if (erase_typ_us[op] != 0) {
+            w25q_sfdp_timing(flash, (enum w25q_op_t)op, erase_typ_us[op], dw[10] & 0xf);
+        }
+    }
+
+    // Page program and chip erase times, the chip erase time otherwise follows the density
+    if (bfpt_len >= 11) {
+        w25q_sfdp_timing(flash, W25Q_OP_PAGE_PROGRAM, w25q_sfdp_time(dw[11], 8, 5, program_units), dw[11] & 0xf);
+        w25q_sfdp_timing(flash, W25Q_OP_CHIP_ERASE, w25q_sfdp_time(dw[11], 24, 5, chip_units), dw[10] & 0xf);
+    } else {
+        w25q_chip_erase_timing(flash);
+    }
+
+    // Fast reads: 1-1-2 (DWORD 4), 1-1-4 and 1-4-4 (DWORD 3)
+    flash->read_modes = (1u << W25Q_READ_MODE_STANDARD) | (1u << W25Q_READ_MODE_FAST);
+    if (dw[1] & (1UL << 16)) {
+        flash->read_modes |= 1u << W25Q_READ_MODE_DUAL_OUTPUT;
+        w25q_sfdp_read_mode(flash, W25Q_READ_MODE_DUAL_OUTPUT, dw[4], 0);
+    }
+    if (dw[1] & (1UL << 22)) {
+        flash->read_modes |= 1u << W25Q_READ_MODE_QUAD_OUTPUT;
+        w25q_sfdp_read_mode(flash, W25Q_READ_MODE_QUAD_OUTPUT, dw[3] >> 16, 0);
+    }
+    if (dw[1] & (1UL << 21)) {
+        flash->read_modes |= 1u << W25Q_READ_MODE_QUAD_IO;
+        // The mode byte takes 2 clocks on 4 lines
+        w25q_sfdp_read_mode(flash, W25Q_READ_MODE_QUAD_IO, dw[3], 2);
+    }
+
+    // Quad enable requirement: none, or bit 1 of status register 2 (1, 4, 5, 6), which
+    // w25q_set_quad_enable writes with 31h or the 16-bit 01h; QE in SR1 (2, 3, 7) is not handled
+    if (bfpt_len >= 15) {
+        unsigned qer = (dw[15] >> 20) & 0x7;
+        flash->quad_enable_bit = qer != 0;
+        if (qer == 2 || qer == 3 || qer == 7) {
+            flash->read_modes &= ~((1u << W25Q_READ_MODE_QUAD_OUTPUT) | (1u << W25Q_READ_MODE_QUAD_IO));
+        }
+    }
+
+    // 4-byte addressing: dedicated opcodes when the part lists them, else Enter 4-Byte Address Mode
+    if ((ait_support & 0x41) == 0x41 && flash->erase_opcode_4b[W25Q_OP_SECTOR_ERASE] != 0) {
+        *address_mode = W25Q_ADDRESS_4B_OPCODES;
+        if (!(ait_support & (1UL << 1))) {
+            flash->read_modes &= ~(1u << W25Q_READ_MODE_FAST);
+        }
+        if (!(ait_support & (1UL << 2))) {
+            flash->read_modes &= ~(1u << W25Q_READ_MODE_DUAL_OUTPUT);
+        }
+        if (!(ait_support & (1UL << 4))) {
+            flash->read_modes &= ~(1u << W25Q_READ_MODE_QUAD_OUTPUT);
+        }
+        if (!(ait_support & (1UL << 5))) {
+            flash->read_modes &= ~(1u << W25Q_READ_MODE_QUAD_IO);
+        }
+    } else if (ait != 0 || (bfpt_len >= 16 && (dw[16] & (1UL << 24)))) {
+        *address_mode = W25Q_ADDRESS_4B_MODE;
+    }
+
+    return 1;
+
+}
+
+/* Standard Functions */
+
+struct w25q_flash * w25q_mount(struct w25q_flash *flash, w25q_spi_transfer_fn spi_data_func, w25q_delay_fn delay_fn) {
+    
+    struct w25q_flash *f_instance = flash;
+    unsigned char part_data[4];
+    enum w25q_address_mode_t address_mode = W25Q_ADDRESS_4B_OPCODES;
+    unsigned char known = 0;
+
+    memset(f_instance, 0, sizeof(*f_instance));
+    f_instance->spi_delay_func = delay_fn;
+    f_instance->spi_send = spi_data_func;
+    memcpy(f_instance->timing, w25q_default_timing, sizeof(w25q_default_timing));
+    f_instance->suspended_op = W25Q_OP_NONE;
+    f_instance->address_bytes = 3;
+    f_instance->erase_opcode_3b[W25Q_OP_SECTOR_ERASE] = W25Q_SECTOR_ERASE;
+    f_instance->erase_opcode_3b[W25Q_OP_32K_BLK_ERASE] = W25Q_32K_BLK_ERASE;
+    f_instance->erase_opcode_3b[W25Q_OP_64K_BLK_ERASE] = W25Q_64K_BLK_ERASE;
+    f_instance->erase_opcode_4b[W25Q_OP_SECTOR_ERASE] = W25Q_SECTOR_ERASE_4B;
+    f_instance->erase_opcode_4b[W25Q_OP_64K_BLK_ERASE] = W25Q_64K_BLK_ERASE_4B;
+    memcpy(f_instance->erase_opcode, f_instance->erase_opcode_3b, sizeof(f_instance->erase_opcode));
+    f_instance->read_modes = (1u << (W25Q_READ_MODE_QUAD_IO + 1)) - 1;
+    for (int mode = W25Q_READ_MODE_STANDARD; mode <= W25Q_READ_MODE_QUAD_IO; mode++) {
+        f_instance->read_dummy[mode] = w25q_read_cmds[mode].dummy_cycles;
+    }
+    f_instance->quad_enable_bit = 1;
+    // The previous owner may have left the chip in deep power-down, the first command wakes it
+    f_instance->power_state = W25Q_POWER_DEEP_DOWN;
+
+    // Or in continuous read mode, where the next bits are taken as a Quad I/O address. Continuous
+    // Read Mode Reset: 16 clocks with IO0 high set the mode bits to 11 in either address mode. A
+    // chip in deep power-down ignores it
+    memset(part_data, 0xff, sizeof(part_data));
+    f_instance->spi_send(part_data, part_data, 2);
+
+    w25q_read_jedec(f_instance, (void *)part_data);
+
+    // Check model, Winbond parts double in size with each ID
+    if (part_data[1] == W25Q_PRODUCER_ID) {
+        unsigned long size = W25Q10_SIZE;
+        for (int id = W25Q10_ID; id <= W25Q512_ID; id++, size *= 2) {
+            if (part_data[2] == ((id >> 8) & 0xff) && part_data[3] == (id & 0xff)) {
+                f_instance->model = (enum w25q_id_t)id;
+                f_instance->size = size;
+                w25q_chip_erase_timing(f_instance);
+                known = 1;
+                break;
+            }
+        }
+    }
+    // Anything else must describe itself
+    if (!known) {
+        if (part_data[1] == 0x00 || part_data[1] == 0xff || !w25q_sfdp_probe(f_instance, 0, &address_mode)) {
+            return NULL;
+        }
+        f_instance->model = (enum w25q_id_t)((part_data[2] << 8) | part_data[3]);
+    }
+
+    // The previous owner may have left an operation running
+    f_instance->busy_op = W25Q_OP_UNKNOWN;
+    if (!w25q_wait_until_available(f_instance)) {
+        return NULL;
+    }
+    // Per-chip geometry and timing, when the part has SFDP that matches its ID. A failed probe
+    // changes nothing, the ID-derived values and the 4-byte opcodes stay
+    if (known) {
+        w25q_sfdp_probe(f_instance, f_instance->size, &address_mode);
+    }
+
+    // Above 16 MB prefer the 4-byte opcodes, they work whatever mode the chip is in
+    if (f_instance->size > W25Q128_SIZE && !w25q_set_address_mode(f_instance, address_mode)) {
+        return NULL;
+    }
+#ifdef W25Q_STATS
+    // Count from here, the identification traffic is not an operation
+    memset(&f_instance->stats, 0, sizeof(f_instance->stats));
+    f_instance->stat_op = W25Q_STAT_STATUS_POLL;
+#endif
+    return f_instance;
+
+}
+
+void w25q_set_delay_us(struct w25q_flash *flash, w25q_delay_us_fn delay_us_fn) {
+    flash->spi_delay_us_func = delay_us_fn;
+}
+
+void w25q_set_clock(struct w25q_flash *flash, w25q_clock_fn clock_fn) {
+
+    flash->clock = clock_fn;
+    if (clock_fn != NULL) {
+        flash->busy_since = clock_fn();
+        flash->power_changed = flash->busy_since;
+    }
+
+}
+
+unsigned char w25q_set_timing(struct w25q_flash *flash, enum w25q_op_t op, unsigned typ_us, unsigned max_us) {
+
+    if (flash == NULL || op >= W25Q_OP_COUNT || max_us < typ_us) {
+        return 0;
+    }
+    flash->timing[op].typ_us = typ_us;
+    flash->timing[op].max_us = max_us;
+    return 1;
+
+}
+
+void w25q_set_spi_sg(struct w25q_flash *flash, w25q_spi_sg_fn sg_fn) {
+    flash->spi_sg = sg_fn;
+}
+
+void w25q_set_spi_chain(struct w25q_flash *flash, w25q_spi_chain_fn chain_fn) {
+    flash->spi_chain = chain_fn;
+}
+
+void w25q_set_xfer(struct w25q_flash *flash, w25q_xfer_fn xfer_fn) {
+
+    if (flash->read_continuous) {
+        w25q_exit_continuous(flash);
+    }
+    flash->xfer = xfer_fn;
+    if (xfer_fn == NULL && flash->read_mode >= W25Q_READ_MODE_DUAL_OUTPUT) {
+        flash->read_mode = W25Q_READ_MODE_STANDARD;
+    }
+
+}
+
+static unsigned char w25q_set_read_mode_locked(struct w25q_flash *flash, enum w25q_read_mode_t mode) {
+
+    if (flash == NULL || mode > W25Q_READ_MODE_QUAD_IO || !w25q_async_drain(flash)) {
+        return 0;
+    }
+    if (mode >= W25Q_READ_MODE_DUAL_OUTPUT && flash->xfer == NULL) {
+        return 0;
+    }
+    if ((flash->read_modes & (1u << mode)) == 0) {
+        return 0;
+    }
+    // Without an xfer function the dummy clocks go out as whole bytes
+    if (flash->xfer == NULL && (flash->read_dummy[mode] & 7) != 0) {
+        return 0;
+    }
+    if (flash->read_continuous) {
+        w25q_exit_continuous(flash);
+    }
+    if (mode >= W25Q_READ_MODE_QUAD_OUTPUT && !w25q_set_quad_enable(flash, 1)) {
+        return 0;
+    }
+    flash->read_mode = mode;
+    return 1;
+
+}
+
+unsigned char w25q_set_read_mode(struct w25q_flash *flash, enum w25q_read_mode_t mode) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_set_read_mode_locked(flash, mode);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_set_quad_enable_locked(struct w25q_flash *flash, unsigned char enable) {
+
+    unsigned char status[3];
+    unsigned char cmd[3];
+    unsigned char sr2;
+
+    if (flash == NULL || !w25q_async_drain(flash) || !w25q_wait_until_available(flash)) {
+        return 0;
+    }
+    // Parts without a QE bit always have the quad pins enabled
+    if (!flash->quad_enable_bit) {
+        return 1;
+    }
+    w25q_read_status_regs(flash, status);
+    sr2 = enable ? (status[1] | W25Q_SR2_QE) : (status[1] & ~W25Q_SR2_QE);
+    if (sr2 == status[1]) {
+        return 1;
+    }
+
+    // Write Status Register-2 first, older parts only take the 16-bit Write Status Register
+    for (unsigned attempt = 0; attempt < 2; attempt++) {
+        struct w25q_segment segment = {cmd, NULL, attempt == 0 ? 2 : 3};
+
+        w25q_stat_begin(flash, W25Q_STAT_WRITE_STATUS, 0, segment.size - 1);
+        if (attempt == 0) {
+            cmd[0] = W25Q_WRITE_STATUS_REG_2;
+            cmd[1] = sr2;
+        } else {
+            cmd[0] = W25Q_WRITE_STATUS_REG_1;
+            cmd[1] = status[0];
+            cmd[2] = sr2;
+        }
+        w25q_write_command(flash, &segment, 1);
+        w25q_op_started(flash, W25Q_OP_WRITE_STATUS, 0, 0);
+        if (!w25q_wait_until_available(flash)) {
+            return 0;
+        }
+        w25q_read_status_regs(flash, cmd);
+        if ((cmd[1] & W25Q_SR2_QE) == (sr2 & W25Q_SR2_QE)) {
+            return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+unsigned char w25q_set_quad_enable(struct w25q_flash *flash, unsigned char enable) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_set_quad_enable_locked(flash, enable);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_read_locked(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+
+    unsigned long start = address;
+    unsigned long size = buffer_size;
+    unsigned char cached, ready;
+
+    // Check parameters
+    if (w25q_check_param(flash, address, buffer, buffer_size) == 0)
+        return 0;
+
+    // Large reads stream past the cache instead of flushing it
+    cached = flash->cache.lines != 0 && buffer_size < flash->cache.lines * flash->cache.line_size;
+    if (cached) {
+        if (w25q_cache_read(flash, address, (unsigned char *)buffer, buffer_size)) {
+            w25q_wbuf_overlay(flash, address, (unsigned char *)buffer, buffer_size);
+            return 1;
+        }
+        // Missing lines are read whole
+        start &= ~(unsigned long)(flash->cache.line_size - 1);
+        size = ((address + size + flash->cache.line_size - 1) & ~(unsigned long)(flash->cache.line_size - 1)) - start;
+    }
+
+    ready = w25q_read_begin(flash, start, size);
+    if (!ready && !w25q_async_drain(flash))
+        return 0;
+
+    if (cached) {
+        w25q_cache_fill(flash, address, (unsigned char *)buffer, buffer_size);
+    } else {
+        w25q_read_data(flash, address, buffer, buffer_size);
+    }
+    if (ready == 2) {
+        w25q_resume(flash);
+    }
+    w25q_wbuf_overlay(flash, address, (unsigned char *)buffer, buffer_size);
+    return 1;
+
+}
+
+unsigned char w25q_read(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_read_locked(flash, address, buffer, buffer_size);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_write_locked(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+
+    unsigned char *buf = (unsigned char *)buffer;
+    unsigned short programmed;
+
+    // Check parameters
+    if (w25q_check_param(flash, address, buffer, buffer_size) == 0)
+        return 0;
+    if (w25q_wbuf_expired(flash) && !w25q_flush(flash))
+        return 0;
+
+    for (unsigned programmed_bytes = 0; programmed_bytes < buffer_size; ) {
+        unsigned long target = (unsigned long)address + programmed_bytes;
+        unsigned chunk = 256 - (target & 0xff);
+
+        if (chunk > buffer_size - programmed_bytes) {
+            chunk = buffer_size - programmed_bytes;
+        }
+        // Partial pages go through the write buffer, programs commute so full pages need not wait for it
+        if (flash->wbuf != NULL && chunk < 256) {
+            if (!w25q_wbuf_write(flash, target, &buf[programmed_bytes], chunk)) {
+                return 0;
+            }
+            programmed_bytes += chunk;
+            continue;
+        }
+        if (!w25q_async_drain(flash))
+            return 0;
+        programmed = w25q_page_program_checked(flash, target, &buf[programmed_bytes], chunk);
+        if (programmed == 0) {
+            return 0;
+        }
+        programmed_bytes += programmed;
+    }
+
+    return 1;
+    
+}
+
+unsigned char w25q_write(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_write_locked(flash, address, buffer, buffer_size);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_update_locked(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size,
+                                        void *sector_buf) {
+
+    const unsigned char *src = (const unsigned char *)buffer;
+    unsigned char *sector = (unsigned char *)sector_buf;
+
+    if (w25q_check_param(flash, address, (void *)buffer, buffer_size) == 0 || sector == NULL)
+        return 0;
+
+    while (buffer_size > 0) {
+        unsigned long base = address & ~0xfffUL;
+        unsigned offset = address & 0xfff;
+        unsigned chunk = 4096 - offset < buffer_size ? 4096 - offset : buffer_size;
+        unsigned char erase = 0;
+
+        if (!w25q_read(flash, address, &sector[offset], chunk))
+            return 0;
+        for (unsigned i = 0; i < chunk; i++) {
+            if ((sector[offset + i] & src[i]) != src[i]) {
+                erase = 1;
+                break;
+            }
+        }
+
+        if (!erase) {
+            // Only bits to clear: program the changed bytes of each page
+            for (unsigned i = 0; i < chunk; ) {
+                unsigned page_end = ((offset + i) | 0xff) + 1 - offset;
+                unsigned first, last;
+
+                if (page_end > chunk) {
+                    page_end = chunk;
+                }
+                for (first = i; first < page_end && sector[offset + first] == src[first]; first++);
+                for (last = page_end; last > first && sector[offset + last - 1] == src[last - 1]; last--);
+                if (first < last && !w25q_write(flash, address + first, (void *)&src[first], last - first))
+                    return 0;
+                i = page_end;
+            }
+        } else {
+            // Keep the rest of the sector, erase it and program back the pages holding data
+            if (offset > 0 && !w25q_read(flash, base, sector, offset))
+                return 0;
+            if (offset + chunk < 4096 && !w25q_read(flash, address + chunk, &sector[offset + chunk], 4096 - offset - chunk))
+                return 0;
+            memcpy(&sector[offset], src, chunk);
+            if (!w25q_erase(flash, base, base + 4096))
+                return 0;
+            for (unsigned page = 0; page < 4096; page += 256) {
+                unsigned i;
+
+                for (i = 0; i < 256 && sector[page + i] == 0xff; i++);
+                if (i < 256 && !w25q_write(flash, base + page, &sector[page], 256))
+                    return 0;
+            }
+        }
+
+        address += chunk;
+        src += chunk;
+        buffer_size -= chunk;
+    }
+
+    return 1;
+
+}
+
+unsigned char w25q_update(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size,
+                          void *sector_buf) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_update_locked(flash, address, buffer, buffer_size, sector_buf);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+unsigned w25q_erase_plan(struct w25q_flash *flash, unsigned start_address, unsigned end_address,
+                         struct w25q_erase_op *ops, unsigned max_ops, unsigned long *duration_us) {
+
+    unsigned long address = start_address & ~0xfffUL;
+    unsigned long end = ((unsigned long)end_address + 0xfff) & ~0xfffUL;
+    unsigned long capacity;
+    unsigned long total = 0;
+    unsigned count = 0;
+    enum w25q_op_t op;
+
+    if (flash == NULL || end_address <= start_address) {
+        return 0;
+    }
+    capacity = flash->size * 256;
+    if (end > capacity) {
+        return 0;
+    }
+
+    if (address == 0 && end == capacity) {
+        if (max_ops > 0) {
+            ops[0].op = W25Q_OP_CHIP_ERASE;
+            ops[0].address = 0;
+        }
+        if (duration_us != NULL) {
+            *duration_us = flash->timing[W25Q_OP_CHIP_ERASE].typ_us;
+        }
+        return 1;
+    }
+
+    while (address < end) {
+        op = w25q_erase_step(flash, address, end);
+        if (count < max_ops) {
+            ops[count].op = op;
+            ops[count].address = address;
+        }
+        count++;
+        total += flash->timing[op].typ_us;
+        address += 1UL << w25q_erase_shift[op];
+    }
+    if (duration_us != NULL) {
+        *duration_us = total;
+    }
+    return count;
+
+}
+
+static unsigned char w25q_erase_locked(struct w25q_flash *flash, unsigned start_address, unsigned end_address) {
+    
+    unsigned long address = start_address & ~0xfffUL;
+    unsigned long end = ((unsigned long)end_address + 0xfff) & ~0xfffUL;
+    enum w25q_op_t op;
+
+    if (flash == NULL || end_address <= start_address)
+        return 0;
+
+    if (end > flash->size * 256)
+        return 0;
+
+    if (!w25q_async_drain(flash))
+        return 0;
+
+    if (address == 0 && end == flash->size * 256) {
+        if (flash->erase_skip_blank && w25q_blank(flash, 0, end))
+            return 1;
+        return w25q_erase_all(flash);
+    }
+
+    w25q_wbuf_erase(flash, address, end);
+
+    while (address < end) {
+        if (flash->erase_skip_blank) {
+            if (!w25q_wait_until_available(flash))
+                return 0;
+            op = w25q_erase_step_skip(flash, &address, end);
+            if (op == W25Q_OP_NONE)
+                continue;
+        } else {
+            op = w25q_erase_step(flash, address, end);
+        }
+        if (!w25q_block_erase(flash, op, address)) {
+            return 0;
+        }
+        address += 1UL << w25q_erase_shift[op];
+    }
+
+    return 1;
+}
+
+unsigned char w25q_erase(struct w25q_flash *flash, unsigned start_address, unsigned end_address) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_erase_locked(flash, start_address, end_address);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_erase_all_locked(struct w25q_flash *flash) {
+
+    if (flash == NULL || !w25q_async_drain(flash)) {
+        return 0;
+    }
+    if (!w25q_wait_until_available(flash)) {
+        return 0;
+    }
+    w25q_wbuf_erase(flash, 0, flash->size * 256);
+    w25q_chip_erase_start(flash);
+
+    return w25q_wait_until_available(flash);
+
+}
+
+unsigned char w25q_erase_all(struct w25q_flash *flash) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_erase_all_locked(flash);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_submit_write_locked(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size,
+                                              w25q_complete_fn done, void *context) {
+
+    if (w25q_check_param(flash, address, (void *)buffer, buffer_size) == 0) {
+        return 0;
+    }
+
+    return w25q_async_submit(flash, W25Q_ASYNC_WRITE, address, (unsigned long)address + buffer_size, buffer,
+                             done, context);
+
+}
+
+unsigned char w25q_submit_write(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size,
+                                w25q_complete_fn done, void *context) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_submit_write_locked(flash, address, buffer, buffer_size, done, context);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_submit_erase_locked(struct w25q_flash *flash, unsigned start_address, unsigned end_address,
+                                              w25q_complete_fn done, void *context) {
+
+    unsigned long address = start_address & ~0xfffUL;
+    unsigned long end = ((unsigned long)end_address + 0xfff) & ~0xfffUL;
+
+    if (flash == NULL || end_address <= start_address || end > flash->size * 256) {
+        return 0;
+    }
+    if (address == 0 && end == flash->size * 256) {
+        if (!flash->erase_skip_blank) {
+            return w25q_submit_erase_all(flash, done, context);
+        }
+        // A chip erase cannot be skipped once started, w25q_poll first blank-checks the whole range
+        if (!w25q_async_submit(flash, W25Q_ASYNC_ERASE_ALL, 0, end, NULL, done, context)) {
+            return 0;
+        }
+        w25q_wbuf_erase(flash, 0, end);
+        return 1;
+    }
+
+    if (!w25q_async_submit(flash, W25Q_ASYNC_ERASE, address, end, NULL, done, context)) {
+        return 0;
+    }
+    w25q_wbuf_erase(flash, address, end);
+    return 1;
+
+}
+
+unsigned char w25q_submit_erase(struct w25q_flash *flash, unsigned start_address, unsigned end_address,
+                                w25q_complete_fn done, void *context) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_submit_erase_locked(flash, start_address, end_address, done, context);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_submit_erase_all_locked(struct w25q_flash *flash, w25q_complete_fn done, void *context) {
+
+    if (flash == NULL) {
+        return 0;
+    }
+
+    if (!w25q_async_submit(flash, W25Q_ASYNC_ERASE_ALL, 0, 1, NULL, done, context)) {
+        return 0;
+    }
+    w25q_wbuf_erase(flash, 0, flash->size * 256);
+    return 1;
+
+}
+
+unsigned char w25q_submit_erase_all(struct w25q_flash *flash, w25q_complete_fn done, void *context) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_submit_erase_all_locked(flash, done, context);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_poll_locked(struct w25q_flash *flash) {
+
+    struct w25q_async *req;
+    unsigned char sr1;
+
+    if (flash == NULL) {
+        return 0;
+    }
+    if (flash->async.kind == W25Q_ASYNC_IDLE) {
+        if (w25q_wbuf_expired(flash)) {
+            w25q_flush(flash);
+        }
+        return 0;
+    }
+    req = &flash->async;
+    if (flash->suspended_op != W25Q_OP_NONE) {
+        return 1;
+    }
+
+    if (flash->busy_op != W25Q_OP_NONE) {
+        unsigned long elapsed = flash->clock != NULL ? flash->clock() - flash->busy_since : 0;
+
+        // Not worth a status read before the expected time
+        if (flash->clock != NULL && flash->busy_op < W25Q_OP_COUNT && elapsed < flash->busy_expect_us) {
+            return 1;
+        }
+        sr1 = w25q_read_status_1(flash);
+        w25q_stat_poll(flash, 0);
+        if (sr1 & W25Q_SR1_BUSY) {
+            if (flash->clock != NULL && flash->busy_op < W25Q_OP_COUNT &&
+                elapsed > flash->timing[flash->busy_op].max_us) {
+                w25q_async_complete(flash, 0);
+                return 0;
+            }
+            return 1;
+        }
+        w25q_op_finished(flash, 0);
+    }
+
+    if (req->address >= req->end) {
+        w25q_async_complete(flash, 1);
+        return flash->async.kind != W25Q_ASYNC_IDLE;
+    }
+
+    switch (req->kind) {
+        case W25Q_ASYNC_WRITE:
+            {
+                unsigned short programmed = w25q_page_program_start(flash, req->address, req->source,
+                                                                    req->end - req->address);
+                req->address += programmed;
+                req->source += programmed;
+            }
+            break;
+        case W25Q_ASYNC_ERASE:
+            {
+                enum w25q_op_t op;
+
+                if (flash->erase_skip_blank) {
+                    op = w25q_erase_step_skip(flash, &req->address, req->end);
+                    if (op == W25Q_OP_NONE) {
+                        if (req->address < req->end) {
+                            return 1;
+                        }
+                        w25q_async_complete(flash, 1);
+                        return flash->async.kind != W25Q_ASYNC_IDLE;
+                    }
+                } else {
+                    op = w25q_erase_step(flash, req->address, req->end);
+                }
+                if (!w25q_block_erase_start(flash, op, req->address)) {
+                    w25q_async_complete(flash, 0);
+                    return flash->async.kind != W25Q_ASYNC_IDLE;
+                }
+                req->address += 1UL << w25q_erase_shift[op];
+            }
+            break;
+        default:
+            // A chip erase with blank skipping spans the chip, one 64K block is checked per poll
+            if (req->end - req->address > 1 && w25q_blank(flash, req->address, req->address + 0x10000)) {
+                req->address += 0x10000;
+                break;
+            }
+            w25q_chip_erase_start(flash);
+            req->address = req->end;
+            break;
+    }
+
+    return 1;
+
+}
+
+unsigned char w25q_poll(struct w25q_flash *flash) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_poll_locked(flash);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+unsigned char w25q_finish(struct w25q_flash *flash) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_async_drain(flash);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+void w25q_set_read_priority(struct w25q_flash *flash, enum w25q_read_priority_t priority) {
+    flash->read_priority = priority;
+}
+
+static unsigned char w25q_suspend_locked(struct w25q_flash *flash) {
+
+    unsigned char cmd = W25Q_ERASE_PROGRAM_SUSPEND;
+    unsigned char status[3];
+    unsigned elapsed;
+    unsigned long now = 0;
+
+    if (flash == NULL || flash->suspended_op != W25Q_OP_NONE) {
+        return 0;
+    }
+    // Chip erase and status writes cannot be suspended
+    if (flash->busy_op > W25Q_OP_64K_BLK_ERASE) {
+        return 0;
+    }
+
+    // Respect the minimum time between a Resume and the next Suspend
+    if (flash->resume_guard) {
+        unsigned long since = flash->clock != NULL ? flash->clock() - flash->resumed_at : 0;
+        if (since < W25Q_RESUME_TO_SUSPEND_US) {
+            w25q_delay_us(flash, W25Q_RESUME_TO_SUSPEND_US - since);
+        }
+        flash->resume_guard = 0;
+    }
+
+    w25q_command(flash, &cmd, 1);
+    elapsed = w25q_delay_us(flash, W25Q_SUSPEND_US);
+    while (1) {
+        w25q_read_status_regs(flash, status);
+        if ((status[0] & W25Q_SR1_BUSY) == 0) {
+            break;
+        }
+        if (elapsed >= 4 * W25Q_SUSPEND_US) {
+            return 0;
+        }
+        elapsed += w25q_delay_us(flash, W25Q_POLL_MIN_US);
+    }
+
+    if ((status[1] & W25Q_SR2_SUS) == 0) {
+        // The operation completed before the suspend
+        w25q_op_finished(flash, 0);
+        return 0;
+    }
+
+    flash->suspended_op = flash->busy_op;
+    flash->suspended_address = flash->busy_address;
+    flash->suspended_remaining_us = flash->busy_expect_us;
+    if (flash->clock != NULL) {
+        now = flash->clock();
+        if (now - flash->busy_since < flash->busy_expect_us) {
+            flash->suspended_remaining_us = flash->busy_expect_us - (now - flash->busy_since);
+        } else {
+            flash->suspended_remaining_us = W25Q_POLL_MIN_US;
+        }
+    }
+    flash->busy_op = W25Q_OP_NONE;
+    w25q_power_enter(flash, W25Q_POWER_STANDBY);
+    return 1;
+
+}
+
+unsigned char w25q_suspend(struct w25q_flash *flash) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_suspend_locked(flash);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_resume_locked(struct w25q_flash *flash) {
+
+    unsigned char cmd = W25Q_ERASE_PROGRAM_RESUME;
+
+    if (flash == NULL || flash->suspended_op == W25Q_OP_NONE) {
+        return 0;
+    }
+
+    // A program started during an erase suspend must be done first
+    if (!w25q_wait_until_available(flash)) {
+        return 0;
+    }
+    w25q_command(flash, &cmd, 1);
+    w25q_op_started(flash, flash->suspended_op, flash->suspended_address, flash->suspended_remaining_us);
+    flash->suspended_op = W25Q_OP_NONE;
+    flash->resume_guard = 1;
+    if (flash->clock != NULL) {
+        flash->resumed_at = flash->clock();
+    }
+    return 1;
+
+}
+
+unsigned char w25q_resume(struct w25q_flash *flash) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_resume_locked(flash);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned w25q_cache_attach_locked(struct w25q_flash *flash, void *arena, unsigned arena_size, unsigned line_size) {
+
+    struct w25q_cache *cache = &flash->cache;
+    unsigned lines;
+
+    if (arena == NULL || line_size < 16 || line_size > 4096 || (line_size & (line_size - 1)) != 0) {
+        return 0;
+    }
+    lines = arena_size / (line_size + sizeof(unsigned long) + 1);
+    if (lines == 0) {
+        return 0;
+    }
+
+    // Layout: line data, tags, reference bits
+    cache->data = (unsigned char *)arena;
+    cache->tags = (unsigned long *)(cache->data + lines * line_size);
+    cache->referenced = (unsigned char *)(cache->tags + lines);
+    cache->line_size = line_size;
+    cache->hand = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->lines = lines;
+    w25q_cache_invalidate(flash);
+
+    return lines;
+
+}
+
+unsigned w25q_cache_attach(struct w25q_flash *flash, void *arena, unsigned arena_size, unsigned line_size) {
+
+    unsigned result;
+
+    w25q_lock(flash);
+    result = w25q_cache_attach_locked(flash, arena, arena_size, line_size);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+unsigned w25q_cache_alloc(struct w25q_flash *flash, unsigned lines, unsigned line_size, w25q_memory_allocator allocator) {
+
+    unsigned size = lines * (line_size + sizeof(unsigned long) + 1);
+    void *arena;
+
+    if (allocator == NULL || lines == 0) {
+        return 0;
+    }
+    arena = allocator(size);
+    if (arena == NULL) {
+        return 0;
+    }
+    return w25q_cache_attach(flash, arena, size, line_size);
+
+}
+
+static void * w25q_cache_detach_locked(struct w25q_flash *flash) {
+
+    void *arena = flash->cache.data;
+
+    memset(&flash->cache, 0, sizeof(flash->cache));
+    return arena;
 
-    unsigned sector_num = (address >> 12) & 0xfffff;
-    unsigned char cmd[4];
+}
 
-    if (sector_num >= flash->size) {
-        return 0;
+void * w25q_cache_detach(struct w25q_flash *flash) {
+
+    void *result;
+
+    w25q_lock(flash);
+    result = w25q_cache_detach_locked(flash);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static void w25q_cache_invalidate_locked(struct w25q_flash *flash) {
+
+    for (unsigned i = 0; i < flash->cache.lines; i++) {
+        flash->cache.tags[i] = W25Q_CACHE_INVALID;
+        flash->cache.referenced[i] = 0;
     }
 
-    cmd[0] = W25Q_32K_BLK_ERASE;
-    cmd[1] = (address >> 16) & 0xff;
-    cmd[2] = (address >> 8) & 0;
-    cmd[3] = 0;
+}
+
+void w25q_cache_invalidate(struct w25q_flash *flash) {
+
+    w25q_lock(flash);
+    w25q_cache_invalidate_locked(flash);
+    w25q_unlock(flash);
 
+}
+
+static unsigned char w25q_set_write_buffer_locked(struct w25q_flash *flash, struct w25q_write_buffer *wbuf,
+                                                  unsigned flush_bytes, unsigned long flush_age_us) {
+
+    if (!w25q_flush(flash)) {
+        return 0;
+    }
+    flash->wbuf = wbuf;
+    if (wbuf != NULL) {
+        memset(wbuf->data, 0xff, sizeof(wbuf->data));
+        wbuf->start = wbuf->end = 0;
+        wbuf->bytes = 0;
+        wbuf->flush_bytes = flush_bytes;
+        wbuf->flush_age_us = flush_age_us;
+    }
     return 1;
+
 }
 
-/**
- * @brief Erase a 64KB data block
- * 
- * @param[in] flash SPI flash instance
- * @param[in] address Data block address
-*/
-#ifndef TEST
-static 
-#endif
-unsigned char w25q_64k_blk_erase(struct w25q_flash *flash, unsigned address) {
+unsigned char w25q_set_write_buffer(struct w25q_flash *flash, struct w25q_write_buffer *wbuf,
+                                    unsigned flush_bytes, unsigned long flush_age_us) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_set_write_buffer_locked(flash, wbuf, flush_bytes, flush_age_us);
+    w25q_unlock(flash);
+    return result;
 
-    unsigned sector_num = (address >> 12) & 0xfffff;
-    unsigned char cmd[4];
+}
+
+static unsigned char w25q_flush_locked(struct w25q_flash *flash) {
 
-    if (sector_num >= flash->size) {
+    struct w25q_write_buffer *wbuf = flash->wbuf;
+    unsigned char result;
+
+    if (wbuf == NULL || wbuf->end == 0) {
+        return 1;
+    }
+    if (!w25q_async_drain(flash)) {
         return 0;
     }
+    if (w25q_page_program(flash, wbuf->page + wbuf->start, &wbuf->data[wbuf->start], wbuf->end - wbuf->start) == 0) {
+        return 0;
+    }
+    // The range holds 0xff between buffered writes, and once programmed a retry cannot fix a mismatch
+    result = !flash->write_verify ||
+             w25q_program_verify(flash, wbuf->page + wbuf->start, &wbuf->data[wbuf->start], wbuf->end - wbuf->start, 1);
+    memset(&wbuf->data[wbuf->start], 0xff, wbuf->end - wbuf->start);
+    wbuf->start = wbuf->end = 0;
+    wbuf->bytes = 0;
+    return result;
 
-    cmd[0] = W25Q_64K_BLK_ERASE;
-    cmd[1] = (address >> 16) & 0xff;
-    cmd[2] = 0;
-    cmd[3] = 0;
+}
 
-    w25q_wait_until_available(flash);
-    w25q_write_enable(flash);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(&cmd, &cmd, 4);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    w25q_wait_until_available(flash);
+unsigned char w25q_flush(struct w25q_flash *flash) {
 
-    return 1;
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_flush_locked(flash);
+    w25q_unlock(flash);
+    return result;
 
 }
 
-/* Standard Functions */
+static unsigned char w25q_is_blank_locked(struct w25q_flash *flash, unsigned start_address, unsigned end_address) {
 
-struct w25q_flash * w25q_mount(struct w25q_flash *flash, w25q_spi_transfer_fn spi_data_func, w25q_delay_fn delay_fn) {
-    
-    struct w25q_flash *f_instance = flash;
-    unsigned char part_data[4];
+    unsigned char ready, blank;
 
-    f_instance->spi_delay_func = delay_fn;
-    f_instance->spi_send = spi_data_func;
+    if (flash == NULL || end_address <= start_address || end_address > flash->size * 256) {
+        return 0;
+    }
 
-    w25q_read_jedec(f_instance, (void *)part_data);
-    // Check Manufacturer
-    if (part_data[1] != W25Q_PRODUCER_ID) {     // Wrong part or spi error
-        return NULL;
+    ready = w25q_read_begin(flash, start_address, end_address - start_address);
+    if (!ready && !w25q_async_drain(flash)) {
+        return 0;
     }
+    blank = w25q_blank(flash, start_address, end_address);
+    if (ready == 2) {
+        w25q_resume(flash);
+    }
+    return blank;
 
-    // Check model
-    for (int id = W25Q10_ID, size = W25Q10_SIZE; id <= W25Q512_ID; id++, size *= 2) {
-        if (part_data[2] == ((id >> 8) & 0xff) && part_data[3] == (id & 0xff)) {
-            f_instance->model = (enum w25q_id_t)id;
-            f_instance->size = (enum w25q_size_t)size;
-            return f_instance;
-        }
+}
+
+unsigned char w25q_is_blank(struct w25q_flash *flash, unsigned start_address, unsigned end_address) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_is_blank_locked(flash, start_address, end_address);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+void w25q_set_erase_skip_blank(struct w25q_flash *flash, unsigned char enable) {
+    flash->erase_skip_blank = enable;
+}
+
+unsigned long w25q_get_le32(const unsigned char *p) {
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+void w25q_put_le32(unsigned char *p, unsigned long value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+unsigned long w25q_crc32_update(unsigned long crc, const void *data, unsigned size) {
+
+    const unsigned char *p = (const unsigned char *)data;
+
+    crc = ~crc & 0xffffffffUL;
+#if defined(W25Q_CRC32_ARM)
+    while (size >= 4) {
+        unsigned int word;
+
+        memcpy(&word, p, 4);
+        crc = __crc32w((unsigned int)crc, word);
+        p += 4;
+        size -= 4;
     }
-    
-    // Oops, can't identify the model!
-    return NULL;
+#elif W25Q_CRC32_SLICES == 8
+    // Slice-by-8: eight table lookups per 8 bytes, no dependency between them
+    while (size >= 8) {
+        crc ^= (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) |
+               ((unsigned long)p[3] << 24);
+        crc = w25q_crc32_table[7][crc & 0xff] ^ w25q_crc32_table[6][(crc >> 8) & 0xff] ^
+              w25q_crc32_table[5][(crc >> 16) & 0xff] ^ w25q_crc32_table[4][(crc >> 24) & 0xff] ^
+              w25q_crc32_table[3][p[4]] ^ w25q_crc32_table[2][p[5]] ^
+              w25q_crc32_table[1][p[6]] ^ w25q_crc32_table[0][p[7]];
+        p += 8;
+        size -= 8;
+    }
+#endif
+    while (size-- > 0) {
+        crc = w25q_crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc & 0xffffffffUL;
 
 }
 
-unsigned char w25q_read(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+static unsigned char w25q_crc32_locked(struct w25q_flash *flash, unsigned start_address, unsigned end_address, unsigned long *crc) {
 
-    unsigned char *buf = (unsigned char *)buffer;
+    unsigned char chunk_buf[W25Q_VERIFY_CHUNK];
+    unsigned long value = 0;
 
-    // Check parameters
-    if (w25q_check_param(flash, address, buffer, buffer_size) == 0)
+    if (flash == NULL || crc == NULL || end_address <= start_address) {
         return 0;
+    }
+    for (unsigned long address = start_address; address < end_address; ) {
+        unsigned chunk = end_address - address < sizeof(chunk_buf) ? end_address - address : sizeof(chunk_buf);
 
-    buf[0] = W25Q_READ_DATA;
-    buf[1] = (address >> 16) & 0xff;
-    buf[2] = (address >> 8) & 0xff;
-    buf[3] = address & 0xff;
-    /* Still, 3-byte addressing... */
-    flash->spi_send(buf, buf, buffer_size);
-    printf("%s\n",buf);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
+        if (!w25q_read(flash, address, chunk_buf, chunk)) {
+            return 0;
+        }
+        value = w25q_crc32_update(value, chunk_buf, chunk);
+        address += chunk;
+    }
+    *crc = value;
     return 1;
 
 }
 
-unsigned char w25q_write(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size) {
+unsigned char w25q_crc32(struct w25q_flash *flash, unsigned start_address, unsigned end_address, unsigned long *crc) {
 
-    unsigned char *buf = (unsigned char *)buffer;
-    unsigned char temp_buf[265];
-    unsigned limit;
+    unsigned char result;
 
-    // Check parameters
-    if (w25q_check_param(flash, address, buffer, buffer_size) == 0)
+    w25q_lock(flash);
+    result = w25q_crc32_locked(flash, start_address, end_address, crc);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+static unsigned char w25q_verify_locked(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size) {
+
+    const unsigned char *src = (const unsigned char *)buffer;
+    unsigned char chunk_buf[W25Q_VERIFY_CHUNK];
+
+    if (w25q_check_param(flash, address, (void *)buffer, buffer_size) == 0) {
         return 0;
+    }
+    for (unsigned done = 0; done < buffer_size; ) {
+        unsigned chunk = buffer_size - done < sizeof(chunk_buf) ? buffer_size - done : sizeof(chunk_buf);
 
-    for (unsigned programmed_bytes = 0; programmed_bytes < buffer_size; ) {
-        if (buffer_size - programmed_bytes <= 256) {
-            limit = buffer_size - programmed_bytes;
-        } else {
-            limit = 256;
+        if (!w25q_read(flash, address + done, chunk_buf, chunk) || memcmp(chunk_buf, &src[done], chunk) != 0) {
+            return 0;
         }
-        memcpy(&temp_buf[4], &buf[programmed_bytes], limit);
-        /* Here we should have a function to check potential timeouts */
-        programmed_bytes += w25q_page_program(flash, address + programmed_bytes, temp_buf, limit + 4);
+        done += chunk;
     }
-
     return 1;
-    
+
 }
 
-unsigned char w25q_erase(struct w25q_flash *flash, unsigned start_address, unsigned end_address) {
-    
-    if (end_address <= start_address)
-        return 0;
+unsigned char w25q_verify(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_verify_locked(flash, address, buffer, buffer_size);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+void w25q_set_write_verify(struct w25q_flash *flash, unsigned char enable) {
+    flash->write_verify = enable;
+}
 
-    if ((end_address >> 8) > flash->size)
+static unsigned char w25q_set_address_mode_locked(struct w25q_flash *flash, enum w25q_address_mode_t mode) {
+
+    unsigned char cmd;
+
+    if (flash == NULL || (mode == W25Q_ADDRESS_3B && flash->size > W25Q128_SIZE)) {
+        return 0;
+    }
+    if (!w25q_async_drain(flash) || !w25q_wait_until_available(flash)) {
         return 0;
+    }
 
-    while (start_address < end_address) {
-        w25q_sector_erase(flash, start_address);
-        start_address += 4096;
+    if (mode == W25Q_ADDRESS_4B_MODE && flash->address_mode != W25Q_ADDRESS_4B_MODE) {
+        cmd = W25Q_ENTER_4B_ADDRESS_MODE;
+        w25q_command(flash, &cmd, 1);
+    } else if (mode != W25Q_ADDRESS_4B_MODE && flash->address_mode == W25Q_ADDRESS_4B_MODE) {
+        cmd = W25Q_EXIT_4B_ADDRESS_MODE;
+        w25q_command(flash, &cmd, 1);
+    }
+    // A continuous Quad I/O read was started with the old address length
+    if (flash->read_continuous) {
+        w25q_exit_continuous(flash);
     }
 
+    flash->address_mode = mode;
+    flash->address_bytes = mode == W25Q_ADDRESS_3B ? 3 : 4;
+    memcpy(flash->erase_opcode, mode == W25Q_ADDRESS_4B_OPCODES ? flash->erase_opcode_4b : flash->erase_opcode_3b,
+           sizeof(flash->erase_opcode));
     return 1;
+
 }
 
-unsigned char w25q_erase_all(struct w25q_flash *flash) {
+unsigned char w25q_set_address_mode(struct w25q_flash *flash, enum w25q_address_mode_t mode) {
 
-    unsigned char cmd = W25Q_CHIP_ERASE;
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_set_address_mode_locked(flash, mode);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+/* Power Management Functions */
+
+unsigned char w25q_set_power_down(struct w25q_flash *flash, unsigned char enable, unsigned idle_us) {
+
+    if (flash == NULL || (enable && idle_us != 0 && flash->clock == NULL)) {
+        return 0;
+    }
+    w25q_lock(flash);
+    flash->power_down = enable;
+    flash->power_idle_us = idle_us;
+    flash->power_idle_armed = 0;
+    w25q_unlock(flash);
+    return 1;
+
+}
+
+static unsigned char w25q_power_down_locked(struct w25q_flash *flash) {
+
+    if (flash == NULL || flash->async.kind != W25Q_ASYNC_IDLE || flash->suspended_op != W25Q_OP_NONE) {
+        return 0;
+    }
+    if (!w25q_wait_until_available(flash)) {
+        return 0;
+    }
+    return w25q_power_down_now(flash);
+
+}
+
+unsigned char w25q_power_down(struct w25q_flash *flash) {
+
+    unsigned char result;
+
+    w25q_lock(flash);
+    result = w25q_power_down_locked(flash);
+    w25q_unlock(flash);
+    return result;
+
+}
+
+void w25q_power_time(struct w25q_flash *flash, unsigned long time_us[W25Q_POWER_COUNT]) {
+
+    w25q_lock(flash);
+    // Close the current interval so the copy is up to date
+    w25q_power_enter(flash, flash->power_state);
+    memcpy(time_us, flash->power_time_us, sizeof(flash->power_time_us));
+    w25q_unlock(flash);
+
+}
+
+#ifdef W25Q_STATS
+
+/* Instrumentation Functions */
+
+void w25q_stats_snapshot(struct w25q_flash *flash, struct w25q_stats *stats) {
+
+    w25q_lock(flash);
+    memcpy(stats, &flash->stats, sizeof(*stats));
+    w25q_unlock(flash);
+
+}
+
+void w25q_stats_reset(struct w25q_flash *flash) {
+
+    w25q_lock(flash);
+    memset(&flash->stats, 0, sizeof(flash->stats));
+    w25q_unlock(flash);
+
+}
+
+void w25q_set_trace(struct w25q_flash *flash, w25q_trace_fn trace_fn, void *context) {
+
+    w25q_lock(flash);
+    flash->trace = trace_fn;
+    flash->trace_context = context;
+    w25q_unlock(flash);
+
+}
+
+#endif
+
+/* Multitasking Functions */
+
+void w25q_set_lock(struct w25q_flash *flash, w25q_lock_fn lock_fn, w25q_lock_fn unlock_fn, void *lock) {
+    flash->lock = lock_fn;
+    flash->unlock = unlock_fn;
+    flash->lock_arg = lock;
+}
+
+unsigned char w25q_set_queue(struct w25q_flash *flash, struct w25q_queue *queue) {
+
+    struct w25q_queue *old;
 
     if (flash == NULL) {
         return 0;
     }
-    w25q_write_enable(flash);
-    w25q_wait_until_available(flash);
 
-    flash->spi_delay_func(W25Q_DELAY_TIME);
-    flash->spi_send(&cmd, &cmd, 1);
-    flash->spi_delay_func(W25Q_DELAY_TIME);
+    w25q_lock(flash);
+    old = flash->queue;
+    if (old != NULL && (old->head != NULL || old->active != NULL || old->finished != NULL)) {
+        w25q_unlock(flash);
+        return 0;
+    }
+    if (queue != NULL) {
+        memset(queue, 0, sizeof(*queue));
+    }
+    flash->queue = queue;
+    w25q_unlock(flash);
+    return 1;
+
+}
+
+unsigned char w25q_queue_submit(struct w25q_flash *flash, struct w25q_request *request) {
 
-    w25q_wait_until_available(flash);
-    w25q_write_disable(flash);
+    if (flash == NULL || request == NULL || request->size == 0 || request->kind > W25Q_REQUEST_ERASE) {
+        return 0;
+    }
+    if (request->kind != W25Q_REQUEST_ERASE && request->buffer == NULL) {
+        return 0;
+    }
+    if ((unsigned long)request->address + request->size > flash->size * 256) {
+        return 0;
+    }
 
+    w25q_lock(flash);
+    if (flash->queue == NULL) {
+        w25q_unlock(flash);
+        return 0;
+    }
+    request->next = NULL;
+    if (flash->queue->tail != NULL) {
+        flash->queue->tail->next = request;
+    } else {
+        flash->queue->head = request;
+    }
+    flash->queue->tail = request;
+    w25q_unlock(flash);
     return 1;
 
 }
+
+/**
+ * @brief Move requests to the finished list, their callbacks run at the end of w25q_queue_service
+*/
+static void w25q_queue_finish(struct w25q_queue *queue, struct w25q_request *list, unsigned char result) {
+
+    struct w25q_request **last = &queue->finished;
+
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+    *last = list;
+    for (; list != NULL; list = list->next) {
+        list->result = result;
+    }
+
+}
+
+/**
+ * @brief Completion of the write/erase started for the queue
+*/
+static void w25q_queue_done(struct w25q_flash *flash, unsigned char result, void *context) {
+
+    struct w25q_queue *queue = (struct w25q_queue *)context;
+
+    (void)flash;
+    w25q_queue_finish(queue, queue->active, result);
+    queue->active = NULL;
+
+}
+
+/**
+ * @brief Unlink a waiting request
+ * 
+ * @param[in] prev Request before it, NULL for the head
+*/
+static void w25q_queue_unlink(struct w25q_queue *queue, struct w25q_request *prev, struct w25q_request *request) {
+
+    if (prev != NULL) {
+        prev->next = request->next;
+    } else {
+        queue->head = request->next;
+    }
+    if (queue->tail == request) {
+        queue->tail = prev;
+    }
+    request->next = NULL;
+
+}
+
+/**
+ * @brief Serve the read at the head with every queued read next to it
+ * 
+ * Only the run of reads at the head is searched, so no read passes a write or erase.
+*/
+static void w25q_queue_reads(struct w25q_flash *flash, struct w25q_queue *queue) {
+
+    struct w25q_request *batch = queue->head;
+    struct w25q_request *last = batch;
+    unsigned long start = batch->address;
+    unsigned long end = start + batch->size;
+    unsigned char merged = 1, result;
+
+    w25q_queue_unlink(queue, NULL, batch);
+    if (batch->size > W25Q_QUEUE_MERGE_SIZE) {
+        w25q_queue_finish(queue, batch, w25q_read(flash, batch->address, batch->buffer, batch->size));
+        return;
+    }
+
+    // Grow the range until no waiting read touches it
+    while (merged) {
+        struct w25q_request *prev = NULL, *request = queue->head;
+
+        merged = 0;
+        while (request != NULL && request->kind == W25Q_REQUEST_READ) {
+            struct w25q_request *next = request->next;
+            unsigned long lo = request->address < start ? request->address : start;
+            unsigned long hi = request->address + request->size > end ? request->address + request->size : end;
+
+            if (request->address <= end && request->address + request->size >= start &&
+                hi - lo <= W25Q_QUEUE_MERGE_SIZE && !w25q_read_waits(flash, lo, hi - lo)) {
+                w25q_queue_unlink(queue, prev, request);
+                last->next = request;
+                last = request;
+                start = lo;
+                end = hi;
+                merged = 1;
+                queue->merged_reads++;
+            } else {
+                prev = request;
+            }
+            request = next;
+        }
+    }
+
+    result = w25q_read(flash, start, queue->merge, end - start);
+    for (struct w25q_request *request = batch; result && request != NULL; request = request->next) {
+        memcpy(request->buffer, &queue->merge[request->address - start], request->size);
+    }
+    w25q_queue_finish(queue, batch, result);
+
+}
+
+/**
+ * @brief Start the write at the head, with the writes queued after it to the same page
+*/
+static void w25q_queue_writes(struct w25q_flash *flash, struct w25q_queue *queue) {
+
+    struct w25q_request *batch = queue->head;
+    struct w25q_request *last = batch;
+    unsigned long page = batch->address & ~0xffUL;
+    unsigned start, end;
+
+    w25q_queue_unlink(queue, NULL, batch);
+    queue->active = batch;
+    if (batch->address + batch->size > page + 256) {
+        if (!w25q_submit_write(flash, batch->address, batch->buffer, batch->size, w25q_queue_done, queue)) {
+            w25q_queue_done(flash, 0, queue);
+        }
+        return;
+    }
+
+    // Programming bits to 0 twice is the same as programming their AND once
+    memset(queue->page, 0xff, sizeof(queue->page));
+    start = batch->address & 0xff;
+    end = start + batch->size;
+    memcpy(&queue->page[start], batch->buffer, batch->size);
+    while (queue->head != NULL && queue->head->kind == W25Q_REQUEST_WRITE &&
+           (queue->head->address & ~0xffUL) == page && (queue->head->address & 0xff) + queue->head->size <= 256) {
+        struct w25q_request *request = queue->head;
+        const unsigned char *src = (const unsigned char *)request->buffer;
+        unsigned offset = request->address & 0xff;
+
+        w25q_queue_unlink(queue, NULL, request);
+        for (unsigned i = 0; i < request->size; i++) {
+            queue->page[offset + i] &= src[i];
+        }
+        if (offset < start) {
+            start = offset;
+        }
+        if (offset + request->size > end) {
+            end = offset + request->size;
+        }
+        last->next = request;
+        last = request;
+        queue->batched_writes++;
+    }
+
+    if (!w25q_submit_write(flash, page + start, &queue->page[start], end - start, w25q_queue_done, queue)) {
+        w25q_queue_done(flash, 0, queue);
+    }
+
+}
+
+/**
+ * @brief Start the erase at the head
+*/
+static void w25q_queue_erase(struct w25q_flash *flash, struct w25q_queue *queue) {
+
+    struct w25q_request *request = queue->head;
+
+    w25q_queue_unlink(queue, NULL, request);
+    queue->active = request;
+    // A blank range may complete at once
+    if (!w25q_submit_erase(flash, request->address, request->address + request->size, w25q_queue_done, queue) &&
+        queue->active == request) {
+        w25q_queue_done(flash, 0, queue);
+    }
+
+}
+
+unsigned char w25q_queue_service(struct w25q_flash *flash) {
+
+    struct w25q_queue *queue;
+    struct w25q_request *finished;
+    unsigned char pending;
+
+    if (flash == NULL) {
+        return 0;
+    }
+
+    w25q_lock(flash);
+    queue = flash->queue;
+    if (queue == NULL) {
+        w25q_unlock(flash);
+        return 0;
+    }
+    if (flash->async.kind != W25Q_ASYNC_IDLE) {
+        w25q_poll(flash);
+    }
+    if (queue->head != NULL) {
+        if (flash->async.kind == W25Q_ASYNC_IDLE) {
+            if (queue->head->kind == W25Q_REQUEST_READ) {
+                w25q_queue_reads(flash, queue);
+            } else if (queue->head->kind == W25Q_REQUEST_WRITE) {
+                w25q_queue_writes(flash, queue);
+            } else {
+                w25q_queue_erase(flash, queue);
+            }
+        } else if (queue->head->kind == W25Q_REQUEST_READ && flash->read_priority == W25Q_READ_PRIORITY_HIGH &&
+                   !w25q_read_waits(flash, queue->head->address, queue->head->size)) {
+            // Suspends the program/erase in progress, a read of the page/block being changed waits
+            w25q_queue_reads(flash, queue);
+        }
+    }
+    finished = queue->finished;
+    queue->finished = NULL;
+    pending = queue->head != NULL || queue->active != NULL;
+    w25q_unlock(flash);
+
+    // Callbacks may submit again or release the request
+    while (finished != NULL) {
+        struct w25q_request *request = finished;
+
+        finished = request->next;
+        if (request->done != NULL) {
+            request->done(flash, request->result, request->context);
+        }
+    }
+    return pending;
+
+}
@@ -25,8 +25,17 @@ SOFTWARE.
 #ifndef _W25QXX_H_
 #define _W25QXX_H_
 
-/* SPI delay time in ms*/
-#define W25Q_DELAY_TIME 1
+/* Shortest interval between two BUSY polls, in us */
+#define W25Q_POLL_MIN_US 10
+
+/* Polling backoff: the interval starts at typical time / 2^W25Q_POLL_FIRST_SHIFT after the
+   first poll, doubles on every miss and stops growing at typical time / 2^W25Q_POLL_CAP_SHIFT */
+#define W25Q_POLL_FIRST_SHIFT 3
+#define W25Q_POLL_CAP_SHIFT 2
+
+/* Transfers staged in a local buffer when only the SPI data transfer function is available.
+   Must hold a 5-byte command header and a 256-byte page */
+#define W25Q_BOUNCE_SIZE 264
 
 /* Flash Producer ID */
 #define W25Q_PRODUCER_ID 0xef
@@ -57,16 +66,36 @@ enum w25q_opcode_t {
     W25Q_WRITE_DISABLE = 0x4, 
     W25Q_READ_STATUS_REG_1 = 0x5, 
     W25Q_READ_STATUS_REG_2 = 0x35, 
+    W25Q_WRITE_STATUS_REG_1 = 0x1, 
+    W25Q_WRITE_STATUS_REG_2 = 0x31, 
     W25Q_READ_JEDEC_ID = 0x9f, 
     W25Q_READ_DATA = 0x3, 
+    W25Q_FAST_READ = 0xb, 
+    W25Q_FAST_READ_DUAL_OUTPUT = 0x3b, 
+    W25Q_FAST_READ_QUAD_OUTPUT = 0x6b, 
+    W25Q_FAST_READ_QUAD_IO = 0xeb, 
     W25Q_PAGE_PROGRAM = 0x2, 
     W25Q_ENABLE_RESET = 0x66, 
     W25Q_RESET = 0x99, 
     W25Q_POWER_DOWN = 0xb9, 
+    W25Q_RELEASE_POWER_DOWN = 0xab, 
     W25Q_CHIP_ERASE = 0xc7, 
     W25Q_SECTOR_ERASE = 0x20, 
     W25Q_32K_BLK_ERASE = 0x52, 
-    W25Q_64K_BLK_ERASE = 0xd8
+    W25Q_64K_BLK_ERASE = 0xd8, 
+    W25Q_ERASE_PROGRAM_SUSPEND = 0x75, 
+    W25Q_ERASE_PROGRAM_RESUME = 0x7a, 
+    W25Q_ENTER_4B_ADDRESS_MODE = 0xb7, 
+    W25Q_EXIT_4B_ADDRESS_MODE = 0xe9, 
+    W25Q_READ_DATA_4B = 0x13, 
+    W25Q_FAST_READ_4B = 0xc, 
+    W25Q_FAST_READ_DUAL_OUTPUT_4B = 0x3c, 
+    W25Q_FAST_READ_QUAD_OUTPUT_4B = 0x6c, 
+    W25Q_FAST_READ_QUAD_IO_4B = 0xec, 
+    W25Q_PAGE_PROGRAM_4B = 0x12, 
+    W25Q_SECTOR_ERASE_4B = 0x21, 
+    W25Q_64K_BLK_ERASE_4B = 0xdc, 
+    W25Q_READ_SFDP = 0x5a
     //More need to be added...
 };
 
@@ -79,36 +108,384 @@ enum w25q_size_t {
     W25Q16_SIZE = 8192, 
     W25Q32_SIZE = 16384, 
     W25Q64_SIZE = 32768, 
-    W25Q128_SIZE = 65536
+    W25Q128_SIZE = 65536, 
+    W25Q256_SIZE = 131072, 
+    W25Q512_SIZE = 262144
+};
+
+/* Address width used in commands */
+enum w25q_address_mode_t {
+    W25Q_ADDRESS_3B = 0,                // 3-byte addresses, first 16 MB only
+    W25Q_ADDRESS_4B_OPCODES,            // Dedicated 4-byte address opcodes, no 32K block erase
+    W25Q_ADDRESS_4B_MODE                // Enter 4-Byte Address Mode, standard opcodes take 4-byte addresses
+};
+
+/* Status register bits */
+#define W25Q_SR1_BUSY 0x1
+#define W25Q_SR1_WEL 0x2
+#define W25Q_SR2_QE 0x2
+#define W25Q_SR2_SUS 0x80
+
+/* Erase/Program Suspend: time until the chip accepts reads (tSUS), and minimum time from a Resume to
+   the next Suspend (tRS), in us */
+#define W25Q_SUSPEND_US 20
+#define W25Q_RESUME_TO_SUSPEND_US 20
+
+/* Deep power-down: time to enter it (tDP) and to accept commands after Release Power-Down (tRES1), in us */
+#define W25Q_POWER_DOWN_US 3
+#define W25Q_RELEASE_POWER_DOWN_US 3
+
+/* Mode bits (M5-4 = 10) keeping the chip in continuous read mode after a Quad I/O read */
+#define W25Q_CONTINUOUS_READ_MODE 0x20
+
+/* Read commands */
+enum w25q_read_mode_t {
+    W25Q_READ_MODE_STANDARD = 0,        // 0x03, 1-1-1
+    W25Q_READ_MODE_FAST,                // 0x0B, 1-1-1 with 8 dummy clocks
+    W25Q_READ_MODE_DUAL_OUTPUT,         // 0x3B, 1-1-2
+    W25Q_READ_MODE_QUAD_OUTPUT,         // 0x6B, 1-1-4
+    W25Q_READ_MODE_QUAD_IO              // 0xEB, 1-4-4 with continuous read
+};
+
+/* Program/erase operations tracked by the wait engine */
+enum w25q_op_t {
+    W25Q_OP_PAGE_PROGRAM = 0, 
+    W25Q_OP_SECTOR_ERASE, 
+    W25Q_OP_32K_BLK_ERASE, 
+    W25Q_OP_64K_BLK_ERASE, 
+    W25Q_OP_CHIP_ERASE, 
+    W25Q_OP_WRITE_STATUS, 
+    W25Q_OP_COUNT, 
+    W25Q_OP_NONE = W25Q_OP_COUNT,       // Chip known to be idle
+    W25Q_OP_UNKNOWN                     // Chip state not known yet
+};
+
+/**
+ * @brief Operation timing (Unit: us)
+*/
+struct w25q_timing {
+    unsigned typ_us;        // Typical duration, the first BUSY poll is issued after it
+    unsigned max_us;        // Datasheet maximum, waiting longer than this is a timeout
+};
+
+/**
+ * @brief One step of an erase plan
+*/
+struct w25q_erase_op {
+    enum w25q_op_t op;          // Sector, 32KB block, 64KB block or chip erase
+    unsigned address;
+};
+
+/* How w25q_read treats a program/erase in progress */
+enum w25q_read_priority_t {
+    W25Q_READ_PRIORITY_NORMAL = 0,      // Wait for the operation to finish
+    W25Q_READ_PRIORITY_HIGH             // Suspend the operation, read, then resume it
+};
+
+/* Chip power states, see w25q_set_power_down */
+enum w25q_power_t {
+    W25Q_POWER_STANDBY = 0,             // Idle and powered
+    W25Q_POWER_ACTIVE,                  // Program, erase or status write in progress
+    W25Q_POWER_DEEP_DOWN,               // Deep power-down, only Release Power-Down is accepted
+    W25Q_POWER_COUNT
 };
 
+/* Asynchronous request kinds */
+enum w25q_async_t {
+    W25Q_ASYNC_IDLE = 0, 
+    W25Q_ASYNC_WRITE, 
+    W25Q_ASYNC_ERASE, 
+    W25Q_ASYNC_ERASE_ALL
+};
+
+/* Queued request kinds */
+enum w25q_request_t {
+    W25Q_REQUEST_READ = 0, 
+    W25Q_REQUEST_WRITE, 
+    W25Q_REQUEST_ERASE
+};
+
+/* Instrumented operations, array operations share the w25q_op_t values */
+enum w25q_stat_t {
+    W25Q_STAT_PAGE_PROGRAM = W25Q_OP_PAGE_PROGRAM, 
+    W25Q_STAT_SECTOR_ERASE = W25Q_OP_SECTOR_ERASE, 
+    W25Q_STAT_32K_BLK_ERASE = W25Q_OP_32K_BLK_ERASE, 
+    W25Q_STAT_64K_BLK_ERASE = W25Q_OP_64K_BLK_ERASE, 
+    W25Q_STAT_CHIP_ERASE = W25Q_OP_CHIP_ERASE, 
+    W25Q_STAT_WRITE_STATUS = W25Q_OP_WRITE_STATUS, 
+    W25Q_STAT_READ = W25Q_OP_COUNT, 
+    W25Q_STAT_STATUS_POLL,              // Counted only, no trace and no latency
+    W25Q_STAT_COUNT
+};
+
+/* Trace hook events */
+enum w25q_trace_t {
+    W25Q_TRACE_START = 0,               // Value is the size in bytes
+    W25Q_TRACE_END                      // Value is the latency in us, 0 when unknown
+};
+
+#ifdef W25Q_STATS
+
+/* Latency histogram buckets: bucket 0 counts 0 us, bucket n counts [2^(n-1), 2^n) us, the last one the rest */
+#define W25Q_STATS_BUCKETS 28
+
+/**
+ * @brief Counters of one operation type
+*/
+struct w25q_op_stats {
+    unsigned long calls;
+    unsigned long bytes;
+    unsigned long transactions;         // Chip select cycles, write enables and the like included
+    unsigned long polls;                // Status reads while waiting for this operation
+    unsigned long wait_us;              // Time blocked in w25q_wait_until_available
+    unsigned long completed;            // Operations with a measured latency
+    unsigned long total_us;
+    unsigned long min_us;
+    unsigned long max_us;
+    unsigned long histogram[W25Q_STATS_BUCKETS];
+};
+
+/**
+ * @brief Performance counters of an instance
+*/
+struct w25q_stats {
+    struct w25q_op_stats op[W25Q_STAT_COUNT];
+};
+
+#endif
+
 #ifdef W25Q_MEMORY_MANAGEMENT
 
 /* Extended functionality on flash memory usage management */
 
+/* Bits in a memory map word */
+#define W25Q_MEM_WORD_BITS (8 * sizeof(unsigned long))
+
+/* Words needed for n bits */
+#define W25Q_MEM_WORDS(n) (((n) + W25Q_MEM_WORD_BITS - 1) / W25Q_MEM_WORD_BITS)
+
+/* Arena bytes w25q_mem_attach needs for a chip with the given number of sectors */
+#define W25Q_MEM_ARENA_SIZE(sectors) \
+    ((W25Q_MEM_WORDS(sectors) + W25Q_MEM_WORDS(W25Q_MEM_WORDS(sectors))) * sizeof(unsigned long))
+
+/* No sector found */
+#define W25Q_MEM_NONE 0xffffffffu
+
 /**
  * @brief Memeory mapping representation
+ * 
+ * One bit per sector in mapping, set when the sector is used. Bits past the last sector are set.
+ * Bit i of summary is set while mapping word i still has a free sector, so a free sector is found
+ * with two count-trailing-zeros instead of a scan.
 */
 struct w25q_memory_map {
-    unsigned char *mapping;
-    unsigned short size;
+    unsigned long *mapping;
+    unsigned long *summary;
+    unsigned size;                      // Sectors
+    unsigned used;                      // Sectors marked used
 };
 
 #endif 
 
 
+/**
+ * @brief Multi-line SPI transaction, one chip select cycle
+ * 
+ * Phases are sent in order: opcode, address, mode bits, dummy clocks, data.
+ * A phase with 0 lines (or 0 address bytes) is skipped.
+*/
+struct w25q_xfer {
+    unsigned char opcode;
+    unsigned char opcode_lines;
+    unsigned address;
+    unsigned char address_bytes;
+    unsigned char address_lines;
+    unsigned char mode;                 // Mode bits M7-0
+    unsigned char mode_lines;
+    unsigned char dummy_cycles;
+    unsigned char data_lines;
+    const void *tx;                     // Data to send, NULL for reads
+    void *rx;                           // Data received, NULL for writes
+    unsigned data_size;
+};
+
+/**
+ * @brief Part of an SPI transaction
+ * 
+ * tx == NULL clocks out 0xff, rx == NULL discards the received bytes.
+*/
+struct w25q_segment {
+    const void *tx;
+    void *rx;
+    unsigned size;
+};
+
+/**
+ * @brief One chip select cycle of a command chain
+*/
+struct w25q_transaction {
+    const struct w25q_segment *segments;
+    unsigned count;
+};
+
+struct w25q_flash;
+
 /* User-defined functions */
 typedef void (*w25q_spi_transfer_fn)(void *data_in, void *data_out, unsigned size);      // SPI data transmission function
 typedef void * (*w25q_memory_allocator)(unsigned size);       // Memory allocation function
 typedef void (*w25q_memory_free_fn)(void *p);                        // Memory free function
 typedef void (*w25q_debug_printer)(char *data);                     // Debug print function
-typedef void (*w25q_delay_fn)(unsigned t);                          // Time delay function
+typedef void (*w25q_delay_fn)(unsigned t);                          // Time delay function (ms)
+typedef void (*w25q_delay_us_fn)(unsigned t);                       // Time delay function (us)
+typedef void (*w25q_xfer_fn)(const struct w25q_xfer *xfer);        // Multi-line SPI transaction function
+typedef void (*w25q_spi_sg_fn)(const struct w25q_segment *segments, unsigned count);    // Scatter-gather SPI transaction function
+typedef void (*w25q_spi_chain_fn)(const struct w25q_transaction *transactions, unsigned count);  // Back-to-back SPI transactions
+typedef unsigned long (*w25q_clock_fn)(void);                       // Monotonic time in us
+typedef void (*w25q_complete_fn)(struct w25q_flash *flash, unsigned char result, void *context);  // Request completion callback
+typedef void (*w25q_lock_fn)(void *lock);                           // Recursive lock/unlock function
+typedef void (*w25q_trace_fn)(struct w25q_flash *flash, enum w25q_stat_t op, enum w25q_trace_t event,
+                              unsigned long address, unsigned long value, void *context);    // Trace hook
+
+/* Bytes compared per read in blank checks */
+#define W25Q_BLANK_CHECK_SIZE 256
+
+/* Bytes read per step by w25q_crc32, w25q_verify and write verification */
+#define W25Q_VERIFY_CHUNK 256
+
+/* CRC-32 tables: 8 (slice-by-8, 8 KB) or 1 (byte at a time, 1 KB) */
+#ifndef W25Q_CRC32_SLICES
+#define W25Q_CRC32_SLICES 8
+#endif
+
+/* Bytes read in one transaction for merged queued reads */
+#define W25Q_QUEUE_MERGE_SIZE 256
+
+/* Free read cache entry */
+#define W25Q_CACHE_INVALID (~0UL)
+
+/**
+ * @brief Read cache, all storage comes from a caller-supplied arena
+*/
+struct w25q_cache {
+    unsigned char *data;                // lines * line_size bytes
+    unsigned long *tags;                // Line number held by each entry, W25Q_CACHE_INVALID when free
+    unsigned char *referenced;          // CLOCK reference bits
+    unsigned lines;                     // 0 when no cache is attached
+    unsigned line_size;
+    unsigned hand;
+    unsigned long hits;                 // Line lookups served from the cache
+    unsigned long misses;               // Line lookups that went to the bus
+};
+
+/**
+ * @brief Write-back buffer coalescing small writes to one page
+*/
+struct w25q_write_buffer {
+    unsigned char data[256];
+    unsigned long page;                 // Address of the buffered page
+    unsigned short start;               // Dirty range inside the page, empty when end == 0
+    unsigned short end;
+    unsigned bytes;                     // Bytes written since the last flush
+    unsigned long since;                // Time of the first buffered write, only kept with a clock function
+    unsigned flush_bytes;               // Flush once this many bytes were written, 0 for no limit
+    unsigned long flush_age_us;         // Flush data older than this, 0 for no limit
+};
+
+/**
+ * @brief Request for the command queue, owned by the caller until its callback runs
+*/
+struct w25q_request {
+    enum w25q_request_t kind;
+    unsigned address;
+    void *buffer;                       // Destination of reads, source of writes
+    unsigned size;                      // Bytes, or range length for erases
+    w25q_complete_fn done;              // Called without the lock held, may be NULL
+    void *context;
+    unsigned char result;
+    struct w25q_request *next;
+};
+
+/**
+ * @brief Command queue serializing requests from several tasks
+*/
+struct w25q_queue {
+    struct w25q_request *head;          // Waiting, in submission order
+    struct w25q_request *tail;
+    struct w25q_request *active;        // Requests the write/erase in progress serves
+    struct w25q_request *finished;      // Completed, callbacks not called yet
+    unsigned char page[256];            // Writes batched into one page program
+    unsigned char merge[W25Q_QUEUE_MERGE_SIZE];
+    unsigned long merged_reads;         // Reads served by another request's transaction
+    unsigned long batched_writes;       // Writes programmed together with another request
+};
+
+/**
+ * @brief Asynchronous request in progress
+*/
+struct w25q_async {
+    enum w25q_async_t kind;
+    unsigned long address;              // Next address to program/erase
+    unsigned long end;                  // End of the request (exclusive)
+    const unsigned char *source;        // Next byte to program
+    w25q_complete_fn done;
+    void *context;
+};
 
 struct w25q_flash {
     enum w25q_id_t model;
-    enum w25q_size_t size;
+    unsigned long size;                 // Pages, see enum w25q_size_t
     w25q_spi_transfer_fn spi_send;
+    w25q_spi_sg_fn spi_sg;
+    w25q_spi_chain_fn spi_chain;
     w25q_delay_fn spi_delay_func;
+    w25q_delay_us_fn spi_delay_us_func;
+    struct w25q_timing timing[W25Q_OP_COUNT];
+    enum w25q_op_t busy_op;
+    unsigned busy_expect_us;
+    unsigned long busy_since;           // Start of busy_op, only kept with a clock function
+    unsigned long busy_address;         // Page/block the pending operation works on
+    enum w25q_op_t suspended_op;        // Operation on hold after an Erase/Program Suspend
+    unsigned long suspended_address;
+    unsigned suspended_remaining_us;
+    unsigned long resumed_at;
+    unsigned char resume_guard;         // A Resume was sent less than tRS ago
+    enum w25q_read_priority_t read_priority;
+    w25q_clock_fn clock;
+    struct w25q_async async;
+    unsigned char erase_opcode[W25Q_OP_64K_BLK_ERASE + 1];    // 0 when the erase size is not supported
+    unsigned char erase_opcode_3b[W25Q_OP_64K_BLK_ERASE + 1];  // Erase opcodes for each address mode
+    unsigned char erase_opcode_4b[W25Q_OP_64K_BLK_ERASE + 1];
+    unsigned char read_modes;           // Supported read modes, bit (1 << mode)
+    unsigned char read_dummy[W25Q_READ_MODE_QUAD_IO + 1];      // Dummy clocks of each read mode
+    unsigned char quad_enable_bit;      // 1 when quad reads need SR2.QE, 0 when there is no QE bit
+    unsigned char sfdp;                 // Parameters were read from SFDP
+    w25q_xfer_fn xfer;
+    enum w25q_read_mode_t read_mode;
+    enum w25q_address_mode_t address_mode;
+    unsigned char address_bytes;
+    unsigned char read_continuous;
+    struct w25q_cache cache;
+    struct w25q_write_buffer *wbuf;
+    unsigned char erase_skip_blank;     // Range erases leave blank sectors alone
+    unsigned char write_verify;         // w25q_write reads back each page
+    w25q_lock_fn lock;
+    w25q_lock_fn unlock;
+    void *lock_arg;
+    struct w25q_queue *queue;
+    unsigned lock_depth;                // Nesting of API calls, 0 outside the driver
+    unsigned char power_down;           // Enter deep power-down when idle
+    unsigned power_idle_us;             // Idle time before deep power-down
+    unsigned char power_idle_armed;     // No transaction since power_idle_since
+    unsigned long power_idle_since;
+    enum w25q_power_t power_state;
+    unsigned long power_changed;        // Clock at the last power state change
+    unsigned long power_time_us[W25Q_POWER_COUNT];
+    #ifdef W25Q_STATS
+    struct w25q_stats stats;
+    enum w25q_stat_t stat_op;           // Operation the next transactions count toward
+    w25q_trace_fn trace;
+    void *trace_context;
+    #endif
     #ifdef W25Q_MEMORY_MANAGEMENT
     struct w25q_memory_map *mem_map;
     #endif
@@ -119,6 +496,19 @@ struct w25q_flash {
 #ifdef W25Q_MEMORY_MANAGEMENT
 
 /* Memory Management Functions */
+/**
+ * @brief Attach a memory map covering every sector of the chip, all free
+ * 
+ * @param[in] flash SPI flash instance, mounted
+ * @param[in] map Map to initialize
+ * @param[in] arena Memory for the bitmaps, aligned for unsigned long
+ * @param[in] arena_size Arena size in bytes, at least W25Q_MEM_ARENA_SIZE(sectors)
+ * 
+ * @return 0 When the arena is too small, otherwise 1
+*/
+unsigned char w25q_mem_attach(struct w25q_flash *flash, struct w25q_memory_map *map, void *arena,
+                              unsigned arena_size);
+
 /**
  * @brief Change a sector's status in spi memory mapping
  * @param[in] flash SPI flash instance
@@ -127,12 +517,40 @@ struct w25q_flash {
  * 
  * @return 0 When sector is out of range, otherwise 1
 */
-unsigned char w25q_mem_mark_sector(struct w25q_flash *flash, unsigned short sector, unsigned char used);
+unsigned char w25q_mem_mark_sector(struct w25q_flash *flash, unsigned sector, unsigned char used);
+
+/**
+ * @brief Change the status of a range of sectors, a word at a time
+ * 
+ * @return 0 When the range is out of bounds, otherwise 1
+*/
+unsigned char w25q_mem_mark_range(struct w25q_flash *flash, unsigned first, unsigned count, unsigned char used);
 
 /**
  * @brief Check if a sector is being used
 */
-unsigned char w25q_mem_check_sector(struct w25q_flash *flash, unsigned short sector);
+unsigned char w25q_mem_check_sector(struct w25q_flash *flash, unsigned sector);
+
+/**
+ * @brief Find the first free sector at or after a sector
+ * 
+ * @return Sector number, W25Q_MEM_NONE when there is none
+*/
+unsigned w25q_mem_find_free(struct w25q_flash *flash, unsigned from);
+
+/**
+ * @brief Find the first run of count free sectors starting at or after a sector
+ * 
+ * @return First sector of the run, W25Q_MEM_NONE when there is none
+*/
+unsigned w25q_mem_find_free_run(struct w25q_flash *flash, unsigned from, unsigned count);
+
+/**
+ * @brief Find a run of count free sectors and mark it used
+ * 
+ * @return First sector of the run, W25Q_MEM_NONE when there is none
+*/
+unsigned w25q_mem_alloc(struct w25q_flash *flash, unsigned count);
 
 /**
  * @brief Print SPI flash info and usage (Debugging purpose)
@@ -158,16 +576,298 @@ void w25q_debug_mem_summary(struct w25q_flash *flash, w25q_debug_printer printer
  * @note When calling the function, you can either pass a existing flash instance or a memory allocator. When an 
  * existing instance is given, values will be assigned to that instance and return NULL;
  * The function prefers the existing instance when both arguments are available.
+ * The instance is reset by the call, optional settings must be applied after mounting.
 */
 struct w25q_flash * w25q_mount(struct w25q_flash *flash, w25q_spi_transfer_fn spi_data_func, w25q_delay_fn delay_fn);
+
+/**
+ * @brief Use a microsecond delay function for BUSY polling
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] delay_us_fn Delay function, NULL to fall back to the millisecond delay function
+ * 
+ * @note Without it, every wait is rounded up to whole milliseconds.
+*/
+void w25q_set_delay_us(struct w25q_flash *flash, w25q_delay_us_fn delay_us_fn);
+
+/**
+ * @brief Give the driver a monotonic microsecond clock
+ * 
+ * With a clock, w25q_poll skips status reads until the pending operation is expected to be done
+ * and reports asynchronous requests that exceed the maximum operation time as failed.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] clock_fn Clock function, NULL to disable
+*/
+void w25q_set_clock(struct w25q_flash *flash, w25q_clock_fn clock_fn);
+
+/**
+ * @brief Override the timing of an operation
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] op Operation
+ * @param[in] typ_us Typical duration, used to schedule the first BUSY poll
+ * @param[in] max_us Maximum duration, used as timeout
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_set_timing(struct w25q_flash *flash, enum w25q_op_t op, unsigned typ_us, unsigned max_us);
+/**
+ * @brief Use a scatter-gather SPI transaction function
+ * 
+ * All segments of one call belong to the same chip select cycle. With it, reads land directly in the
+ * caller's buffer and page programs are sent straight from the source buffer.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] sg_fn Transaction function, NULL to stage transfers through the SPI data transfer function
+*/
+void w25q_set_spi_sg(struct w25q_flash *flash, w25q_spi_sg_fn sg_fn);
+
+/**
+ * @brief Use a function that runs a chain of transactions in one call
+ * 
+ * Chip select is released between the transactions and nothing is read back before the last one
+ * ends, as with a DMA linked list or one SPI_IOC_MESSAGE ioctl with cs_change set. The driver
+ * chains Write Enable with the page program, erase or status write that follows it.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] chain_fn Chain function, NULL to send the transactions one by one
+*/
+void w25q_set_spi_chain(struct w25q_flash *flash, w25q_spi_chain_fn chain_fn);
+
+/**
+ * @brief Use a multi-line SPI transaction function for reads
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] xfer_fn Transaction function, NULL to read through the SPI data transfer function only
+*/
+void w25q_set_xfer(struct w25q_flash *flash, w25q_xfer_fn xfer_fn);
+
+/**
+ * @brief Select how addresses are sent
+ * 
+ * Parts larger than 16 MB are mounted with W25Q_ADDRESS_4B_OPCODES, which keeps no state in the chip
+ * and works whatever address mode the chip powered up in. W25Q_ADDRESS_4B_MODE sends Enter 4-Byte
+ * Address Mode (and Exit when switching away) and keeps the 32K block erase.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] mode Address mode
+ * 
+ * @return 1 on success, 0 when the part needs 4-byte addresses or on timeout
+*/
+unsigned char w25q_set_address_mode(struct w25q_flash *flash, enum w25q_address_mode_t mode);
+
+/**
+ * @brief Select the read command used by w25q_read
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] mode Read mode. Dual and quad modes need a transaction function (w25q_set_xfer),
+ *                 quad modes also set the QE bit.
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_set_read_mode(struct w25q_flash *flash, enum w25q_read_mode_t mode);
+
+/**
+ * @brief Set or clear the Quad Enable bit in status register 2 (non-volatile)
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] enable 1 to enable quad I/O, 0 to disable it
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_set_quad_enable(struct w25q_flash *flash, unsigned char enable);
+
+/**
+ * @brief Select whether reads preempt an asynchronous program/erase
+ * 
+ * With W25Q_READ_PRIORITY_HIGH, w25q_read suspends a running page program, sector or block erase
+ * (chip erase cannot be suspended), reads and resumes it, unless the read overlaps the page/block
+ * being changed.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] priority Read priority
+*/
+void w25q_set_read_priority(struct w25q_flash *flash, enum w25q_read_priority_t priority);
+
+/**
+ * @brief Suspend the running page program, sector or block erase
+ * 
+ * Waits tRS after a previous resume and tSUS until the chip accepts reads. While suspended, reads
+ * outside the affected page/block are allowed and asynchronous requests do not progress.
+ * 
+ * @param[in] flash SPI flash instance
+ * 
+ * @return 1 when an operation is suspended, 0 when nothing suspendable is running (or it completed meanwhile)
+*/
+unsigned char w25q_suspend(struct w25q_flash *flash);
+
+/**
+ * @brief Resume a suspended operation
+ * 
+ * @param[in] flash SPI flash instance
+ * 
+ * @return 1 on success, 0 when nothing is suspended
+*/
+unsigned char w25q_resume(struct w25q_flash *flash);
+
+/**
+ * @brief Attach a read cache
+ * 
+ * The arena holds the cached lines and their bookkeeping, line_size + sizeof(unsigned long) + 1 bytes
+ * per line. Programs update cached lines, erases invalidate them, so the cache is always coherent
+ * with the chip as long as all accesses go through this driver. Reads at least as large as the whole
+ * cache bypass it.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] arena Memory for the cache, aligned for unsigned long
+ * @param[in] arena_size Arena size in bytes
+ * @param[in] line_size Cache line size, a power of two from 16 to 4096 (256: page, 4096: sector)
+ * 
+ * @return Number of cache lines, 0 on invalid parameters
+*/
+unsigned w25q_cache_attach(struct w25q_flash *flash, void *arena, unsigned arena_size, unsigned line_size);
+
+/**
+ * @brief Allocate an arena and attach a read cache
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] lines Number of cache lines
+ * @param[in] line_size Cache line size, see w25q_cache_attach
+ * @param[in] allocator Memory allocation function
+ * 
+ * @return Number of cache lines, 0 on failure
+*/
+unsigned w25q_cache_alloc(struct w25q_flash *flash, unsigned lines, unsigned line_size, w25q_memory_allocator allocator);
+
+/**
+ * @brief Detach the read cache
+ * 
+ * @return The arena, so the caller can free it
+*/
+void * w25q_cache_detach(struct w25q_flash *flash);
+
+/**
+ * @brief Drop all cached lines, e.g. after the chip was changed behind the driver's back
+*/
+void w25q_cache_invalidate(struct w25q_flash *flash);
+
+/**
+ * @brief Buffer small writes and program them one page at a time
+ * 
+ * Writes shorter than a page are merged in the buffer until a write goes to another page, the size
+ * or age threshold is reached, or w25q_flush is called. The age is checked by w25q_write and, when
+ * no request is in flight, by w25q_poll; it needs a clock function. Reads see buffered data, erases
+ * drop it.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] wbuf Buffer, NULL to stop buffering
+ * @param[in] flush_bytes Size threshold in bytes, 0 for none
+ * @param[in] flush_age_us Age threshold in us, 0 for none
+ * 
+ * @return 1 on success, 0 when the previous buffer could not be flushed
+*/
+unsigned char w25q_set_write_buffer(struct w25q_flash *flash, struct w25q_write_buffer *wbuf,
+                                    unsigned flush_bytes, unsigned long flush_age_us);
+
+/**
+ * @brief Program the buffered page
+ * 
+ * @param[in] flash SPI flash instance
+ * 
+ * @return 1 on success (or nothing buffered), 0 on timeout
+*/
+unsigned char w25q_flush(struct w25q_flash *flash);
+
+/**
+ * @brief Check whether a range is erased (all 0xff)
+ * 
+ * The range is read W25Q_BLANK_CHECK_SIZE bytes at a time and compared a word at a time, stopping at
+ * the first programmed bit.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] start_address Start of the range
+ * @param[in] end_address End of the range (exclusive)
+ * 
+ * @return 1 when blank, 0 when not blank or on invalid parameters
+*/
+unsigned char w25q_is_blank(struct w25q_flash *flash, unsigned start_address, unsigned end_address);
+
+/**
+ * @brief Skip blank sectors in range erases
+ * 
+ * w25q_erase and w25q_submit_erase then blank-check each sector and only erase the non-blank ones,
+ * still with the largest suitable blocks. Worth it when the bus reads a sector much faster than the
+ * chip erases it (45 ms typical), e.g. when provisioning fresh chips. For w25q_submit_erase each
+ * w25q_poll blank-checks at most one 64K block; a chip-wide request only starts the chip erase once
+ * a block that is not blank was found.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] enable 1 to skip blank sectors
+*/
+void w25q_set_erase_skip_blank(struct w25q_flash *flash, unsigned char enable);
+
+/**
+ * @brief Read a little-endian 32-bit value, as SFDP tables and the on-flash headers store them
+*/
+unsigned long w25q_get_le32(const unsigned char *p);
+
+/**
+ * @brief Store a 32-bit value little-endian
+*/
+void w25q_put_le32(unsigned char *p, unsigned long value);
+
+/**
+ * @brief Update a CRC-32 (IEEE 802.3, as zlib's crc32) with more data
+ * 
+ * Uses the ARMv8 CRC32 instructions when available, slice-by-8 tables otherwise.
+ * 
+ * @param[in] crc CRC of the previous data, 0 to start
+ * @param[in] data Data
+ * @param[in] size Data size
+ * 
+ * @return Updated CRC
+*/
+unsigned long w25q_crc32_update(unsigned long crc, const void *data, unsigned size);
+
+/**
+ * @brief CRC-32 of a flash range, read W25Q_VERIFY_CHUNK bytes at a time
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] start_address Start of the range
+ * @param[in] end_address End of the range (exclusive)
+ * @param[out] crc CRC-32, same as w25q_crc32_update(0, data, size)
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_crc32(struct w25q_flash *flash, unsigned start_address, unsigned end_address, unsigned long *crc);
+
+/**
+ * @brief Compare flash content with a buffer, read W25Q_VERIFY_CHUNK bytes at a time
+ * 
+ * @return 1 when equal, 0 when different or on failure
+*/
+unsigned char w25q_verify(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size);
+
+/**
+ * @brief Read back every page programmed by w25q_write (and w25q_flush)
+ * 
+ * A page that does not match, e.g. because it was not erased, makes the write fail. w25q_flush only
+ * compares the bytes that were written to the buffer and drops the buffer even when they do not
+ * match. Asynchronous writes are not verified, use w25q_verify once they completed.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] enable 1 to verify
+*/
+void w25q_set_write_verify(struct w25q_flash *flash, unsigned char enable);
+
 /**
  * @brief Read bytes starting from a specific address
  * 
  * @param[in] flash SPI flash instance
  * @param[in] address SPI flash address
- * @param[out] buffer Target buffer, must be valid pointer.Its size must be "data size" + 4 for instruction purpose.
- *                    Returned data will be available at buffer[4]
- * @param[in] buffer_size Target buffer size
+ * @param[out] buffer Target buffer, must be valid pointer
+ * @param[in] buffer_size Number of bytes to read
  * 
  * @return 1 on success, 0 on failure
 */
@@ -181,10 +881,46 @@ unsigned char w25q_read(struct w25q_flash *flash, unsigned address, void *buffer
  * @param[in] buffer Source buffer, must be valid pointer
  * @param[in] buffer_size Source buffer size
  * 
- * @return 1 on success, 0 on failure
+ * @return 1 on success, 0 on failure or when the chip does not finish in time
 */
 unsigned char w25q_write(struct w25q_flash *flash, unsigned address, void *buffer, unsigned buffer_size);
 
+/**
+ * @brief Overwrite data, erasing only when needed
+ * 
+ * Each affected sector is read and compared with the new data. When every change only clears bits,
+ * the changed bytes of each page are programmed without an erase. Otherwise the sector is merged in
+ * sector_buf, erased, and the pages that are not blank are programmed again.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] address SPI flash address
+ * @param[in] buffer New data
+ * @param[in] buffer_size New data size
+ * @param[in] sector_buf Scratch buffer of 4096 bytes
+ * 
+ * @return 1 on success, 0 on failure or when the chip does not finish in time
+*/
+unsigned char w25q_update(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size,
+                          void *sector_buf);
+
+/**
+ * @brief Plan the erases covering an address range
+ * 
+ * The range is covered with the mix of 64KB, 32KB and 4KB erases taking the least typical time,
+ * or a single chip erase when it spans the whole device. w25q_erase runs the same plan.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] start_address Start address, rounded down to 4KB
+ * @param[in] end_address End address (exclusive), rounded up to 4KB
+ * @param[out] ops Planned operations, may be NULL when max_ops is 0
+ * @param[in] max_ops Capacity of ops
+ * @param[out] duration_us Estimated duration from typical timings, may be NULL
+ * 
+ * @return Number of operations in the plan (may exceed max_ops), 0 on invalid range
+*/
+unsigned w25q_erase_plan(struct w25q_flash *flash, unsigned start_address, unsigned end_address,
+                         struct w25q_erase_op *ops, unsigned max_ops, unsigned long *duration_us);
+
 /**
  * @brief Erase data on SPI based on given address range
  * 
@@ -192,7 +928,7 @@ unsigned char w25q_write(struct w25q_flash *flash, unsigned address, void *buffe
  * @param[in] start_address Start address, must be 4k-aligned
  * @param[in] end_address End address, must be 4k-aligned
  * 
- * @return 1 on success, 0 on failure
+ * @return 1 on success, 0 on failure or when the chip does not finish in time
 */
 unsigned char w25q_erase(struct w25q_flash *flash, unsigned start_address, unsigned end_address);
 
@@ -201,10 +937,191 @@ unsigned char w25q_erase(struct w25q_flash *flash, unsigned start_address, unsig
  * 
  * @param[in] flash SPI flash instance
  * 
- * @return 1 on success, 0 on failure
+ * @return 1 on success, 0 on failure or when the chip does not finish in time
 */
 unsigned char w25q_erase_all(struct w25q_flash *flash);
 
+/* Asynchronous Functions */
+
+/**
+ * @brief Queue a write without waiting for it
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] address SPI flash address
+ * @param[in] buffer Source buffer, must stay valid until the request completes
+ * @param[in] buffer_size Source buffer size
+ * @param[in] done Completion callback, may be NULL
+ * @param[in] context Callback argument
+ * 
+ * @return 1 when the request is accepted, 0 on invalid parameters or when another request is in progress
+*/
+unsigned char w25q_submit_write(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size,
+                                w25q_complete_fn done, void *context);
+
+/**
+ * @brief Queue a range erase without waiting for it, see w25q_erase
+ * 
+ * @return 1 when the request is accepted, 0 on invalid parameters or when another request is in progress
+*/
+unsigned char w25q_submit_erase(struct w25q_flash *flash, unsigned start_address, unsigned end_address,
+                                w25q_complete_fn done, void *context);
+
+/**
+ * @brief Queue a chip erase without waiting for it
+ * 
+ * @return 1 when the request is accepted, 0 when another request is in progress
+*/
+unsigned char w25q_submit_erase_all(struct w25q_flash *flash, w25q_complete_fn done, void *context);
+
+/**
+ * @brief Advance the asynchronous request, never blocks
+ * 
+ * Reads the status once when the chip may be done and starts the next page program or erase.
+ * The completion callback is called from here.
+ * 
+ * @param[in] flash SPI flash instance
+ * 
+ * @return 1 while the request is in progress, 0 when idle
+ * 
+ * @note Blocking calls (w25q_read, w25q_write, ...) first finish the request in progress.
+*/
+unsigned char w25q_poll(struct w25q_flash *flash);
+
+/**
+ * @brief Block until the asynchronous request in progress is finished and the chip is idle
+ * 
+ * Sleeps with the same timing model as the blocking calls. The completion callback is called
+ * from here when the request was still running.
+ * 
+ * @param[in] flash SPI flash instance
+ * 
+ * @return 1 when idle, 0 when the chip timed out (the request then completes with result 0)
+*/
+unsigned char w25q_finish(struct w25q_flash *flash);
+
+/* Power Management Functions */
+
+/**
+ * @brief Put the chip in deep power-down (0xB9) whenever the instance goes idle
+ * 
+ * The chip is idle when no program/erase, asynchronous request, suspended operation or queued
+ * request is pending. The next API call that needs the bus sends Release Power-Down (0xAB) first
+ * and waits tRES1 once. The idle time is checked when an API call returns, call w25q_poll from
+ * the main loop to power down once the timeout has passed.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] enable 1 to enable, 0 to disable (an already powered down chip stays down until used)
+ * @param[in] idle_us Idle time before powering down, 0 to power down as soon as an API call returns
+ * 
+ * @return 1 on success, 0 when idle_us is not 0 and there is no clock function
+*/
+unsigned char w25q_set_power_down(struct w25q_flash *flash, unsigned char enable, unsigned idle_us);
+
+/**
+ * @brief Enter deep power-down now, after the blocking operation in progress
+ * 
+ * @param[in] flash SPI flash instance
+ * 
+ * @return 1 on success, 0 with an asynchronous request, a suspended operation or queued requests pending
+*/
+unsigned char w25q_power_down(struct w25q_flash *flash);
+
+/**
+ * @brief Get the time spent in each power state, needs a clock function
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[out] time_us Time in each enum w25q_power_t state since the clock was set, in us
+*/
+void w25q_power_time(struct w25q_flash *flash, unsigned long time_us[W25Q_POWER_COUNT]);
+
+#ifdef W25Q_STATS
+
+/* Instrumentation Functions */
+
+/**
+ * @brief Copy the performance counters
+ * 
+ * Latencies (completed, total/min/max, histogram) need a clock function, except for blocking
+ * operations where the time waited is used.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[out] stats Snapshot
+*/
+void w25q_stats_snapshot(struct w25q_flash *flash, struct w25q_stats *stats);
+
+/**
+ * @brief Clear the performance counters
+*/
+void w25q_stats_reset(struct w25q_flash *flash);
+
+/**
+ * @brief Set a hook called when an operation starts and when it is seen to end
+ * 
+ * Called with the lock held, it must not call the driver. Status reads are only counted under
+ * W25Q_STAT_STATUS_POLL: they fire no trace and have no latency.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] trace_fn Hook, NULL to remove it
+ * @param[in] context Hook argument
+*/
+void w25q_set_trace(struct w25q_flash *flash, w25q_trace_fn trace_fn, void *context);
+
+#endif
+
+/* Multitasking Functions */
+
+/**
+ * @brief Set the lock taken by every API function
+ * 
+ * API functions call each other, so the lock must be recursive (a pthread recursive mutex,
+ * an RTOS recursive mutex). Blocking calls keep it while they wait; use the command queue for
+ * long erases shared between tasks.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] lock_fn Lock function, NULL for no locking
+ * @param[in] unlock_fn Unlock function
+ * @param[in] lock Argument of both functions
+*/
+void w25q_set_lock(struct w25q_flash *flash, w25q_lock_fn lock_fn, w25q_lock_fn unlock_fn, void *lock);
+
+/**
+ * @brief Attach a command queue
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] queue Queue storage, must stay valid while attached. NULL detaches it when it is empty.
+ * 
+ * @return 1 on success, 0 when the attached queue still has requests
+*/
+unsigned char w25q_set_queue(struct w25q_flash *flash, struct w25q_queue *queue);
+
+/**
+ * @brief Add a request to the command queue, never blocks on the chip
+ * 
+ * Safe from any task. The request runs from w25q_queue_service and its callback reports the result.
+ * 
+ * @param[in] flash SPI flash instance
+ * @param[in] request Request, kind/address/buffer/size/done/context filled in
+ * 
+ * @return 1 when queued, 0 on invalid parameters or without a queue
+*/
+unsigned char w25q_queue_submit(struct w25q_flash *flash, struct w25q_request *request);
+
+/**
+ * @brief Run the command queue, never blocks
+ * 
+ * Writes and erases are started asynchronously; while one is in progress the queue only collects
+ * requests. When the chip is free, a run of queued reads is merged into one transaction per
+ * contiguous range (up to W25Q_QUEUE_MERGE_SIZE bytes) and consecutive writes to the same page into
+ * one page program. Requests are never reordered past a write or erase.
+ * With W25Q_READ_PRIORITY_HIGH, reads at the head of the queue run during a program or erase, except
+ * reads of the page or block being changed and reads during a chip erase, which wait in the queue.
+ * 
+ * @param[in] flash SPI flash instance
+ * 
+ * @return 1 while requests are queued or in progress, 0 when the queue is empty
+*/
+unsigned char w25q_queue_service(struct w25q_flash *flash);
+
 /* Some temp helper functions */
 
 enum w25q_id_t w25q_check_model(w25q_spi_transfer_fn handler);
@@ -216,23 +1133,13 @@ unsigned char w25q_check_param(struct w25q_flash *flash, unsigned address, void
 
 void w25q_read_status_regs(struct w25q_flash *flash, void *buffer);
 
-void w25q_write_enable(struct w25q_flash *flash);
-
-void w25q_write_disable(struct w25q_flash *flash);
-
-void w25q_sr_write_enable(struct w25q_flash *flash);
-
 void w25q_read_jedec(struct w25q_flash *flash, void *buffer);
 
-void w25q_wait_until_available(struct w25q_flash *flash);
-
-unsigned short w25q_page_program(struct w25q_flash *flash, unsigned address, void *buffer, unsigned char buffer_size);
-
-unsigned char w25q_sector_erase(struct w25q_flash *flash, unsigned address);
+unsigned char w25q_wait_until_available(struct w25q_flash *flash);
 
-unsigned char w25q_32k_blk_erase(struct w25q_flash *flash, unsigned address);
+unsigned short w25q_page_program(struct w25q_flash *flash, unsigned address, const void *buffer, unsigned buffer_size);
 
-unsigned char w25q_64k_blk_erase(struct w25q_flash *flash, unsigned address);
+unsigned char w25q_block_erase(struct w25q_flash *flash, enum w25q_op_t op, unsigned address);
 
 #endif
 
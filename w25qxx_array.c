@@ -0,0 +1,320 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "w25qxx_array.h"
+#include "string.h"
+
+/* Helper functions */
+
+static void w25q_array_done(struct w25q_flash *flash, unsigned char result, void *context) {
+
+    struct w25q_array *array = (struct w25q_array *)context;
+
+    for (unsigned i = 0; i < array->count; i++) {
+        if (array->chips[i] == flash) {
+            array->pending &= ~(1u << i);
+        }
+    }
+    if (!result) {
+        array->failed = 1;
+    }
+
+}
+
+/**
+ * @brief Map an array address to the address on its chip
+*/
+static unsigned long w25q_array_local(const struct w25q_array *array, unsigned long address) {
+
+    unsigned long stripe = address >> array->stripe_shift;
+
+    return ((stripe / array->count) << array->stripe_shift) | (address & ((1UL << array->stripe_shift) - 1));
+
+}
+
+/**
+ * @brief First array address at or after address that is stored on a chip
+*/
+static unsigned long w25q_array_next(const struct w25q_array *array, unsigned chip, unsigned long address) {
+
+    unsigned long stripe = address >> array->stripe_shift;
+    unsigned skip = (chip + array->count - stripe % array->count) % array->count;
+
+    return skip ? (stripe + skip) << array->stripe_shift : address;
+
+}
+
+/**
+ * @brief Range a chip holds of [start, end), in chip addresses
+ * 
+ * Stripes of one chip follow each other on the chip, so any array range is contiguous on every chip.
+ * 
+ * @return 0 when the chip holds no part of the range
+*/
+static unsigned char w25q_array_span(const struct w25q_array *array, unsigned chip, unsigned long start,
+                                     unsigned long end, unsigned long *local_start, unsigned long *local_end) {
+
+    unsigned long first = w25q_array_next(array, chip, start);
+    unsigned long stripe = (end - 1) >> array->stripe_shift;
+    unsigned back = (stripe % array->count + array->count - chip) % array->count;
+    unsigned long last = back ? ((stripe - back) << array->stripe_shift) + (1UL << array->stripe_shift) - 1 : end - 1;
+
+    if (first >= end) {
+        return 0;
+    }
+    *local_start = w25q_array_local(array, first);
+    *local_end = w25q_array_local(array, last) + 1;
+    return 1;
+
+}
+
+/**
+ * @brief Sleep until the first chip in flight may be ready
+ * 
+ * Returns at once when a chip is idle between two operations of its request. With a clock the
+ * elapsed part of each operation is taken into account, otherwise chips are polled every
+ * typical time / 2^W25Q_POLL_FIRST_SHIFT. Without a microsecond delay function on any chip, the
+ * wait is rounded up to whole milliseconds.
+*/
+static void w25q_array_wait(struct w25q_array *array) {
+
+    unsigned shortest = ~0u;
+    w25q_delay_us_fn delay = NULL;
+    w25q_delay_fn delay_ms = NULL;
+
+    for (unsigned i = 0; i < array->count; i++) {
+        struct w25q_flash *flash = array->chips[i];
+        unsigned remaining;
+
+        if (!(array->pending & (1u << i))) {
+            continue;
+        }
+        if (flash->busy_op == W25Q_OP_NONE) {
+            return;
+        }
+        if (flash->busy_op >= W25Q_OP_COUNT) {
+            remaining = W25Q_POLL_MIN_US;
+        } else if (flash->clock != NULL) {
+            unsigned long elapsed = flash->clock() - flash->busy_since;
+            remaining = elapsed < flash->busy_expect_us ? flash->busy_expect_us - (unsigned)elapsed : W25Q_POLL_MIN_US;
+        } else {
+            remaining = flash->busy_expect_us >> W25Q_POLL_FIRST_SHIFT;
+        }
+        if (remaining < shortest) {
+            shortest = remaining < W25Q_POLL_MIN_US ? W25Q_POLL_MIN_US : remaining;
+        }
+        if (flash->spi_delay_us_func != NULL) {
+            delay = flash->spi_delay_us_func;
+        }
+        delay_ms = flash->spi_delay_func;
+    }
+    if (delay != NULL) {
+        delay(shortest);
+    } else if (delay_ms != NULL) {
+        // Millisecond delays only, rather oversleep than spin on status reads
+        delay_ms((shortest + 999) / 1000);
+    }
+
+}
+
+/**
+ * @brief Drive the requests in flight until every chip is done
+*/
+static unsigned char w25q_array_complete(struct w25q_array *array) {
+
+    while (array->pending) {
+        for (unsigned i = 0; i < array->count; i++) {
+            if (array->pending & (1u << i)) {
+                w25q_poll(array->chips[i]);
+            }
+        }
+        w25q_array_wait(array);
+    }
+    return !array->failed;
+
+}
+
+/* Array Functions */
+
+unsigned char w25q_array_init(struct w25q_array *array, struct w25q_flash **chips, unsigned count,
+                              unsigned stripe_size) {
+
+    unsigned long chip_size = ~0UL;
+
+    if (array == NULL || chips == NULL || count == 0 || count > W25Q_ARRAY_MAX_CHIPS) {
+        return 0;
+    }
+    if (stripe_size < 256 || stripe_size > 65536 || (stripe_size & (stripe_size - 1)) != 0) {
+        return 0;
+    }
+
+    memset(array, 0, sizeof(*array));
+    for (unsigned i = 0; i < count; i++) {
+        if (chips[i] == NULL) {
+            return 0;
+        }
+        array->chips[i] = chips[i];
+        if (chips[i]->size * 256 < chip_size) {
+            chip_size = chips[i]->size * 256;
+        }
+    }
+    array->count = count;
+    while ((1UL << array->stripe_shift) < stripe_size) {
+        array->stripe_shift++;
+    }
+    array->size = (chip_size & ~((unsigned long)stripe_size - 1)) * count;
+    // Below 4 KB a chip sector holds stripes from every chip
+    array->erase_size = stripe_size >= 4096 ? 4096 : 4096UL * count;
+
+    return 1;
+
+}
+
+unsigned char w25q_array_read(struct w25q_array *array, unsigned address, void *buffer, unsigned buffer_size) {
+
+    unsigned char *buf = (unsigned char *)buffer;
+    unsigned long end = (unsigned long)address + buffer_size;
+    unsigned long pos = address;
+
+    if (array == NULL || buffer == NULL || buffer_size == 0 || end > array->size) {
+        return 0;
+    }
+
+    while (pos < end) {
+        unsigned long stripe_end = ((pos >> array->stripe_shift) + 1) << array->stripe_shift;
+        unsigned long chunk = (stripe_end < end ? stripe_end : end) - pos;
+        struct w25q_flash *flash = array->chips[(pos >> array->stripe_shift) % array->count];
+
+        if (!w25q_read(flash, w25q_array_local(array, pos), buf, chunk)) {
+            return 0;
+        }
+        buf += chunk;
+        pos += chunk;
+    }
+    return 1;
+
+}
+
+unsigned char w25q_array_write(struct w25q_array *array, unsigned address, const void *buffer, unsigned buffer_size) {
+
+    const unsigned char *buf = (const unsigned char *)buffer;
+    unsigned long end = (unsigned long)address + buffer_size;
+    unsigned long next[W25Q_ARRAY_MAX_CHIPS];
+
+    if (array == NULL || buffer == NULL || buffer_size == 0 || end > array->size) {
+        return 0;
+    }
+
+    array->pending = 0;
+    array->failed = 0;
+    for (unsigned i = 0; i < array->count; i++) {
+        next[i] = w25q_array_next(array, i, address);
+    }
+
+    // Each idle chip gets its next stripe, so every chip programs while the others are busy
+    while (1) {
+        for (unsigned i = 0; i < array->count; i++) {
+            if (array->pending & (1u << i)) {
+                w25q_poll(array->chips[i]);
+            }
+        }
+        for (unsigned i = 0; i < array->count && !array->failed; i++) {
+            unsigned long stripe_end;
+
+            if ((array->pending & (1u << i)) || next[i] >= end) {
+                continue;
+            }
+            stripe_end = ((next[i] >> array->stripe_shift) + 1) << array->stripe_shift;
+            if (stripe_end > end) {
+                stripe_end = end;
+            }
+            array->pending |= 1u << i;
+            if (!w25q_submit_write(array->chips[i], w25q_array_local(array, next[i]), buf + (next[i] - address),
+                                   stripe_end - next[i], w25q_array_done, array)) {
+                array->pending &= ~(1u << i);
+                array->failed = 1;
+            }
+            next[i] = ((next[i] >> array->stripe_shift) + array->count) << array->stripe_shift;
+        }
+        if (!array->pending) {
+            break;
+        }
+        w25q_array_wait(array);
+    }
+    return !array->failed;
+
+}
+
+unsigned char w25q_array_erase(struct w25q_array *array, unsigned start_address, unsigned end_address) {
+
+    unsigned long start, end;
+
+    if (array == NULL || end_address <= start_address) {
+        return 0;
+    }
+    start = start_address - start_address % array->erase_size;
+    end = ((end_address + array->erase_size - 1) / array->erase_size) * array->erase_size;
+    if (end > array->size) {
+        return 0;
+    }
+
+    array->pending = 0;
+    array->failed = 0;
+    for (unsigned i = 0; i < array->count; i++) {
+        unsigned long local_start, local_end;
+
+        if (!w25q_array_span(array, i, start, end, &local_start, &local_end)) {
+            continue;
+        }
+        array->pending |= 1u << i;
+        if (!w25q_submit_erase(array->chips[i], local_start, local_end, w25q_array_done, array)) {
+            array->pending &= ~(1u << i);
+            array->failed = 1;
+        }
+    }
+    return w25q_array_complete(array);
+
+}
+
+unsigned char w25q_array_erase_all(struct w25q_array *array) {
+
+    if (array == NULL) {
+        return 0;
+    }
+
+    array->pending = 0;
+    array->failed = 0;
+    for (unsigned i = 0; i < array->count; i++) {
+        unsigned long local_end = array->size / array->count;
+
+        array->pending |= 1u << i;
+        // Chips larger than their share keep the rest
+        if (!w25q_submit_erase(array->chips[i], 0, local_end, w25q_array_done, array)) {
+            array->pending &= ~(1u << i);
+            array->failed = 1;
+        }
+    }
+    return w25q_array_complete(array);
+
+}
@@ -0,0 +1,105 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _W25QXX_ARRAY_H_
+#define _W25QXX_ARRAY_H_
+
+#include "w25qxx.h"
+
+/* Chips in one array, one bit each in struct w25q_array.pending */
+#define W25Q_ARRAY_MAX_CHIPS 8
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Several mounted chips striped into one address space (RAID-0)
+ * 
+ * Logical stripe n lives on chip n % count at chip address (n / count) * stripe size. Page programs and
+ * erases are started on every chip that has work before waiting for any of them, so program/erase
+ * throughput grows with the chip count.
+*/
+struct w25q_array {
+    struct w25q_flash *chips[W25Q_ARRAY_MAX_CHIPS];
+    unsigned char count;
+    unsigned char stripe_shift;         // log2 of the stripe size
+    unsigned long size;                 // Bytes
+    unsigned long erase_size;           // Smallest erase unit of the array, in bytes
+    unsigned char pending;              // Chips with a request in flight
+    unsigned char failed;               // A request of the current operation failed
+};
+
+/**
+ * @brief Combine mounted chips into an array
+ * 
+ * @param[out] array Array instance
+ * @param[in] chips Mounted chips, idle. The smallest one sets the capacity of every member.
+ * @param[in] count Number of chips, 1 to W25Q_ARRAY_MAX_CHIPS
+ * @param[in] stripe_size Bytes per stripe, a power of 2 from 256 (page) to 65536
+ * 
+ * @return 1 on success, 0 on invalid parameters
+*/
+unsigned char w25q_array_init(struct w25q_array *array, struct w25q_flash **chips, unsigned count,
+                              unsigned stripe_size);
+
+/**
+ * @brief Read from the array
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_array_read(struct w25q_array *array, unsigned address, void *buffer, unsigned buffer_size);
+
+/**
+ * @brief Write to erased array space, programming all chips in parallel
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_array_write(struct w25q_array *array, unsigned address, const void *buffer, unsigned buffer_size);
+
+/**
+ * @brief Erase a range, erasing all chips in parallel
+ * 
+ * The range is widened to array->erase_size: a sector with stripes of 4 KB or more, one sector on every
+ * chip with smaller stripes.
+ * 
+ * @param[in] start_address Start address
+ * @param[in] end_address End address (exclusive)
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_array_erase(struct w25q_array *array, unsigned start_address, unsigned end_address);
+
+/**
+ * @brief Erase every chip of the array at the same time
+ * 
+ * @return 1 on success, 0 on failure
+*/
+unsigned char w25q_array_erase_all(struct w25q_array *array);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,308 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "w25qxx_checkpoint.h"
+#include "string.h"
+
+#ifdef W25Q_MEMORY_MANAGEMENT
+
+/*
+ * Slot layout:
+ * 
+ *   0   magic
+ *   4   sequence number
+ *   8   sectors in the map
+ *   12  CRC-32 of bytes 0-11 and the map
+ *   16  map, one bit per sector, set when used
+ *   log_start  log entries: value and its complement, 0xffffffff pairs when unused
+ * 
+ * Log entry value: bit 31 used, bits 30-16 sector count - 1, bits 15-0 first sector.
+*/
+#define W25Q_CHECKPOINT_MAGIC 0x43353257UL
+#define W25Q_CHECKPOINT_MAP_OFFSET 16
+#define W25Q_CHECKPOINT_ENTRY_SIZE 8
+
+/* Bytes of map or log handled per read/program */
+#define W25Q_CHECKPOINT_CHUNK 256
+
+/* Helper functions */
+
+/**
+ * @brief Offset of the log, the map rounded up to a page
+*/
+static unsigned w25q_checkpoint_log_start(unsigned sectors) {
+    return (W25Q_CHECKPOINT_MAP_OFFSET + (sectors + 7) / 8 + 255) & ~255u;
+}
+
+static unsigned w25q_checkpoint_address(const struct w25q_checkpoint *checkpoint, unsigned char slot,
+                                        unsigned offset) {
+    return (checkpoint->first_sector + slot * checkpoint->slot_sectors) * 4096 + offset;
+}
+
+/**
+ * @brief Clear the map, keeping the region marked used
+*/
+static void w25q_checkpoint_clear(struct w25q_checkpoint *checkpoint) {
+
+    struct w25q_flash *flash = checkpoint->flash;
+
+    w25q_mem_mark_range(flash, 0, flash->mem_map->size, 0);
+    w25q_mem_mark_range(flash, checkpoint->first_sector, 2 * checkpoint->slot_sectors, 1);
+
+}
+
+/**
+ * @brief Load the map of a slot
+ * 
+ * @return 1 when the header and the CRC match, the map is then loaded
+*/
+static unsigned char w25q_checkpoint_load(struct w25q_checkpoint *checkpoint, unsigned char slot,
+                                          const unsigned char *header) {
+
+    struct w25q_flash *flash = checkpoint->flash;
+    unsigned sectors = flash->mem_map->size;
+    unsigned size = (sectors + 7) / 8;
+    unsigned char chunk[W25Q_CHECKPOINT_CHUNK];
+    unsigned long crc = w25q_crc32_update(0, header, 12);
+
+    w25q_mem_mark_range(flash, 0, sectors, 0);
+    for (unsigned offset = 0; offset < size; offset += sizeof(chunk)) {
+        unsigned n = size - offset < sizeof(chunk) ? size - offset : sizeof(chunk);
+
+        if (!w25q_read(flash, w25q_checkpoint_address(checkpoint, slot, W25Q_CHECKPOINT_MAP_OFFSET + offset),
+                       chunk, n)) {
+            return 0;
+        }
+        crc = w25q_crc32_update(crc, chunk, n);
+        for (unsigned i = 0; i < n; i++) {
+            unsigned sector = (offset + i) * 8;
+
+            if (chunk[i] == 0xff && sector + 8 <= sectors) {
+                w25q_mem_mark_range(flash, sector, 8, 1);
+                continue;
+            }
+            for (unsigned bit = 0; bit < 8; bit++) {
+                if (chunk[i] & (1 << bit)) {
+                    w25q_mem_mark_sector(flash, sector + bit, 1);
+                }
+            }
+        }
+    }
+    return crc == w25q_get_le32(&header[12]);
+
+}
+
+/**
+ * @brief Replay the log of the current slot and find its end
+*/
+static unsigned char w25q_checkpoint_replay(struct w25q_checkpoint *checkpoint) {
+
+    struct w25q_flash *flash = checkpoint->flash;
+    unsigned slot_size = checkpoint->slot_sectors * 4096;
+    unsigned char chunk[W25Q_CHECKPOINT_CHUNK];
+
+    for (unsigned offset = checkpoint->log_start; offset < slot_size; offset += sizeof(chunk)) {
+        if (!w25q_read(flash, w25q_checkpoint_address(checkpoint, checkpoint->slot, offset), chunk, sizeof(chunk))) {
+            return 0;
+        }
+        for (unsigned i = 0; i < sizeof(chunk); i += W25Q_CHECKPOINT_ENTRY_SIZE) {
+            unsigned long value = w25q_get_le32(&chunk[i]);
+            unsigned long check = w25q_get_le32(&chunk[i + 4]);
+            unsigned first = value & 0xffff;
+            unsigned count = ((value >> 16) & 0x7fff) + 1;
+
+            checkpoint->log_next = offset + i;
+            if (value == 0xffffffffUL && check == 0xffffffffUL) {
+                return 1;
+            }
+            if ((value ^ check) != 0xffffffffUL ||
+                !w25q_mem_mark_range(flash, first, count, (unsigned char)(value >> 31))) {
+                // Torn entry, entries after it would be lost: start a new checkpoint on the next change
+                checkpoint->log_next = slot_size;
+                return 1;
+            }
+        }
+    }
+    checkpoint->log_next = slot_size;
+    return 1;
+
+}
+
+/* Checkpoint functions */
+
+unsigned w25q_checkpoint_slot_sectors(unsigned sectors) {
+    // Map and at least one page of log
+    return (w25q_checkpoint_log_start(sectors) + 256 + 4095) / 4096;
+}
+
+unsigned char w25q_checkpoint_init(struct w25q_checkpoint *checkpoint, struct w25q_flash *flash,
+                                   unsigned first_sector, unsigned slot_sectors) {
+
+    struct w25q_memory_map *map;
+
+    if (checkpoint == NULL || flash == NULL || flash->mem_map == NULL) {
+        return 0;
+    }
+    map = flash->mem_map;
+    if (map->size > W25Q_CHECKPOINT_MAX_SECTORS || slot_sectors < w25q_checkpoint_slot_sectors(map->size) ||
+        first_sector >= map->size || 2 * slot_sectors > map->size - first_sector) {
+        return 0;
+    }
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->flash = flash;
+    checkpoint->first_sector = first_sector;
+    checkpoint->slot_sectors = slot_sectors;
+    checkpoint->log_start = w25q_checkpoint_log_start(map->size);
+    // No checkpoint yet, the first change writes one
+    checkpoint->log_next = slot_sectors * 4096;
+    w25q_mem_mark_range(flash, first_sector, 2 * slot_sectors, 1);
+    return 1;
+
+}
+
+unsigned char w25q_checkpoint_restore(struct w25q_checkpoint *checkpoint) {
+
+    unsigned char header[2][W25Q_CHECKPOINT_MAP_OFFSET];
+    unsigned char valid[2];
+
+    for (unsigned char slot = 0; slot < 2; slot++) {
+        if (!w25q_read(checkpoint->flash, w25q_checkpoint_address(checkpoint, slot, 0), header[slot],
+                       sizeof(header[slot]))) {
+            return 0;
+        }
+        valid[slot] = w25q_get_le32(header[slot]) == W25Q_CHECKPOINT_MAGIC &&
+                      w25q_get_le32(&header[slot][8]) == checkpoint->flash->mem_map->size;
+    }
+
+    // Newest slot first, the other one when its map is corrupt
+    for (unsigned attempt = 0; attempt < 2; attempt++) {
+        unsigned char slot = w25q_get_le32(&header[1][4]) > w25q_get_le32(&header[0][4]);
+
+        if (!valid[slot]) {
+            slot = !slot;
+        }
+        if (!valid[slot]) {
+            break;
+        }
+        if (w25q_checkpoint_load(checkpoint, slot, header[slot])) {
+            checkpoint->slot = slot;
+            checkpoint->seq = w25q_get_le32(&header[slot][4]);
+            if (!w25q_checkpoint_replay(checkpoint)) {
+                break;
+            }
+            w25q_mem_mark_range(checkpoint->flash, checkpoint->first_sector, 2 * checkpoint->slot_sectors, 1);
+            return 1;
+        }
+        valid[slot] = 0;
+    }
+
+    w25q_checkpoint_clear(checkpoint);
+    checkpoint->seq = 0;
+    checkpoint->log_next = checkpoint->slot_sectors * 4096;
+    return 0;
+
+}
+
+unsigned char w25q_checkpoint_write(struct w25q_checkpoint *checkpoint) {
+
+    struct w25q_flash *flash = checkpoint->flash;
+    struct w25q_memory_map *map = flash->mem_map;
+    unsigned char slot = checkpoint->seq == 0 ? 0 : !checkpoint->slot;
+    unsigned size = (map->size + 7) / 8;
+    unsigned char header[W25Q_CHECKPOINT_MAP_OFFSET];
+    unsigned char chunk[W25Q_CHECKPOINT_CHUNK];
+    unsigned long crc;
+
+    if (!w25q_erase(flash, w25q_checkpoint_address(checkpoint, slot, 0),
+                    w25q_checkpoint_address(checkpoint, slot, checkpoint->slot_sectors * 4096))) {
+        return 0;
+    }
+
+    w25q_put_le32(header, W25Q_CHECKPOINT_MAGIC);
+    w25q_put_le32(&header[4], checkpoint->seq + 1);
+    w25q_put_le32(&header[8], map->size);
+    crc = w25q_crc32_update(0, header, 12);
+    for (unsigned offset = 0; offset < size; offset += sizeof(chunk)) {
+        unsigned n = size - offset < sizeof(chunk) ? size - offset : sizeof(chunk);
+
+        for (unsigned i = 0; i < n; i++) {
+            unsigned sector = (offset + i) * 8;
+
+            chunk[i] = (unsigned char)(map->mapping[sector / W25Q_MEM_WORD_BITS] >> (sector % W25Q_MEM_WORD_BITS));
+        }
+        crc = w25q_crc32_update(crc, chunk, n);
+        if (!w25q_write(flash, w25q_checkpoint_address(checkpoint, slot, W25Q_CHECKPOINT_MAP_OFFSET + offset),
+                        chunk, n)) {
+            return 0;
+        }
+    }
+
+    // The header goes last and makes the checkpoint valid
+    w25q_put_le32(&header[12], crc);
+    if (!w25q_write(flash, w25q_checkpoint_address(checkpoint, slot, 0), header, sizeof(header))) {
+        return 0;
+    }
+    checkpoint->slot = slot;
+    checkpoint->seq++;
+    checkpoint->log_next = checkpoint->log_start;
+    checkpoint->checkpoints++;
+    return 1;
+
+}
+
+unsigned char w25q_checkpoint_mark(struct w25q_checkpoint *checkpoint, unsigned first, unsigned count,
+                                   unsigned char used) {
+
+    struct w25q_flash *flash = checkpoint->flash;
+    unsigned char entry[W25Q_CHECKPOINT_ENTRY_SIZE];
+
+    if (count == 0 || !w25q_mem_mark_range(flash, first, count, used)) {
+        return 0;
+    }
+
+    while (count > 0) {
+        unsigned n = count < W25Q_CHECKPOINT_MAX_RUN ? count : W25Q_CHECKPOINT_MAX_RUN;
+        unsigned long value = first | ((unsigned long)(n - 1) << 16) | (used ? 0x80000000UL : 0);
+
+        if (checkpoint->log_next + sizeof(entry) > checkpoint->slot_sectors * 4096) {
+            // Log full, the new checkpoint already holds this change and the rest of the range
+            return w25q_checkpoint_write(checkpoint);
+        }
+        w25q_put_le32(entry, value);
+        w25q_put_le32(&entry[4], ~value & 0xffffffffUL);
+        if (!w25q_write(flash, w25q_checkpoint_address(checkpoint, checkpoint->slot, checkpoint->log_next),
+                        entry, sizeof(entry))) {
+            return 0;
+        }
+        checkpoint->log_next += sizeof(entry);
+        checkpoint->entries++;
+        first += n;
+        count -= n;
+    }
+    return 1;
+
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _W25QXX_CHECKPOINT_H_
+#define _W25QXX_CHECKPOINT_H_
+
+#include "w25qxx.h"
+
+#ifdef W25Q_MEMORY_MANAGEMENT
+
+/* Largest memory map a checkpoint can hold, log entries store 16-bit sector numbers */
+#define W25Q_CHECKPOINT_MAX_SECTORS 65536
+
+/* Sectors changed by one log entry at most */
+#define W25Q_CHECKPOINT_MAX_RUN 32768
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Persistent copy of the flash memory map
+ * 
+ * The region holds two slots of slot_sectors sectors. A checkpoint writes the whole map to the slot not
+ * in use, with a sequence number and a CRC-32, and the slot with the highest valid sequence number
+ * wins at restore. Changes made between checkpoints are appended to a log after the map in the
+ * current slot, 8 bytes each, and a full checkpoint is written when the log runs out of space.
+*/
+struct w25q_checkpoint {
+    struct w25q_flash *flash;
+    unsigned first_sector;
+    unsigned slot_sectors;
+    unsigned char slot;                 // Slot holding the current checkpoint
+    unsigned long seq;                  // Sequence number of the current checkpoint, 0 before the first one
+    unsigned log_start;                 // Offset of the log in a slot
+    unsigned log_next;                  // Offset of the next log entry in the current slot
+    unsigned long checkpoints;          // Full checkpoints written
+    unsigned long entries;              // Log entries written
+};
+
+/**
+ * @brief Sectors needed by one slot for a chip
+*/
+unsigned w25q_checkpoint_slot_sectors(unsigned sectors);
+
+/**
+ * @brief Set up a checkpoint region and mark it used in the memory map
+ * 
+ * @param[out] checkpoint Checkpoint instance
+ * @param[in] flash Mounted flash instance with a memory map attached (w25q_mem_attach)
+ * @param[in] first_sector First sector of the region, 2 * slot_sectors sectors long
+ * @param[in] slot_sectors Sectors per slot, at least w25q_checkpoint_slot_sectors(sectors), the
+ *                         rest of the slot holds the log
+ * 
+ * @return 1 on success, 0 on invalid parameters
+*/
+unsigned char w25q_checkpoint_init(struct w25q_checkpoint *checkpoint, struct w25q_flash *flash,
+                                   unsigned first_sector, unsigned slot_sectors);
+
+/**
+ * @brief Restore the memory map from the newest valid checkpoint and replay its log
+ * 
+ * Reads the two slot headers, the map and the log pages. When neither slot holds a valid checkpoint
+ * the map is left with only the region marked used: rebuild it by scanning, then call
+ * w25q_checkpoint_write.
+ * 
+ * @return 1 when the map was restored, 0 otherwise
+*/
+unsigned char w25q_checkpoint_restore(struct w25q_checkpoint *checkpoint);
+
+/**
+ * @brief Write the whole memory map to the other slot
+ * 
+ * Erases the slot, programs the map and then the header, so an interrupted checkpoint leaves the
+ * previous one in place.
+ * 
+ * @return 1 on success, 0 on flash failure
+*/
+unsigned char w25q_checkpoint_write(struct w25q_checkpoint *checkpoint);
+
+/**
+ * @brief Mark a range of sectors in the memory map and log the change
+ * 
+ * @return 1 on success, 0 on invalid range or flash failure
+*/
+unsigned char w25q_checkpoint_mark(struct w25q_checkpoint *checkpoint, unsigned first, unsigned count,
+                                   unsigned char used);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
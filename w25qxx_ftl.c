@@ -0,0 +1,482 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "w25qxx_ftl.h"
+#include "string.h"
+
+/*
+ * Sector layout: page 0 is the header, pages 1-15 hold logical pages.
+ * 
+ *   0   magic
+ *   4   erase count, written right after the erase
+ *   8   sequence number, written when the sector is opened (0xffffffff: free)
+ *   16  per page: logical page number and its complement, written after the page data
+*/
+#define W25Q_FTL_MAGIC 0x4c544657UL
+#define W25Q_FTL_TAG_OFFSET 16
+#define W25Q_FTL_HEADER_SIZE (W25Q_FTL_TAG_OFFSET + 8 * W25Q_FTL_PAGES_PER_SECTOR)
+
+/* erase_result while the background erase runs */
+#define W25Q_FTL_ERASE_PENDING 2
+
+/* Helper functions */
+
+/**
+ * @brief Flash address of a byte of a sector of the range
+*/
+static unsigned w25q_ftl_address(const struct w25q_ftl *ftl, unsigned sector, unsigned offset) {
+    return (ftl->first_sector + sector) * 4096 + offset;
+}
+
+/**
+ * @brief Mirror a sector state into the flash memory map
+*/
+static void w25q_ftl_mark(struct w25q_ftl *ftl, unsigned sector, unsigned char used) {
+
+#ifdef W25Q_MEMORY_MANAGEMENT
+    if (ftl->flash->mem_map != NULL) {
+        w25q_mem_mark_sector(ftl->flash, ftl->first_sector + sector, used);
+    }
+#else
+    (void)ftl;
+    (void)sector;
+    (void)used;
+#endif
+
+}
+
+/**
+ * @brief Write the header of an erased sector and hand it to the free pool
+*/
+static unsigned char w25q_ftl_format(struct w25q_ftl *ftl, unsigned sector) {
+
+    struct w25q_ftl_sector *info = &ftl->info[sector];
+    unsigned char header[8];
+
+    info->erase_count++;
+    w25q_put_le32(header, W25Q_FTL_MAGIC);
+    w25q_put_le32(&header[4], info->erase_count);
+    if (!w25q_write(ftl->flash, w25q_ftl_address(ftl, sector, 0), header, sizeof(header))) {
+        info->state = W25Q_FTL_DIRTY;
+        return 0;
+    }
+    info->state = W25Q_FTL_FREE;
+    info->seq = W25Q_FTL_NONE;
+    info->valid = 0;
+    ftl->free_count++;
+    ftl->erases++;
+    w25q_ftl_mark(ftl, sector, 0);
+    return 1;
+
+}
+
+static void w25q_ftl_erase_done(struct w25q_flash *flash, unsigned char result, void *context) {
+
+    (void)flash;
+    ((struct w25q_ftl *)context)->erase_result = result;
+
+}
+
+/**
+ * @brief Finish a background erase once it has completed
+*/
+static void w25q_ftl_settle(struct w25q_ftl *ftl) {
+
+    unsigned sector = ftl->erasing;
+
+    if (sector == W25Q_FTL_NONE || ftl->erase_result == W25Q_FTL_ERASE_PENDING) {
+        return;
+    }
+    ftl->erasing = W25Q_FTL_NONE;
+    if (ftl->erase_result) {
+        w25q_ftl_format(ftl, sector);
+    } else {
+        ftl->info[sector].state = W25Q_FTL_DIRTY;
+    }
+
+}
+
+/**
+ * @brief Sector for garbage collection: unknown contents first, then the fewest mapped pages
+ * 
+ * @param[in] min_stale Pages a sector must free to be worth collecting
+ * 
+ * @return W25Q_FTL_NONE when no sector would free enough space
+*/
+static unsigned w25q_ftl_gc_victim(const struct w25q_ftl *ftl, unsigned min_stale) {
+
+    unsigned victim = W25Q_FTL_NONE;
+
+    for (unsigned i = 0; i < ftl->sectors; i++) {
+        const struct w25q_ftl_sector *info = &ftl->info[i];
+
+        if (info->state == W25Q_FTL_DIRTY) {
+            return i;
+        }
+        if (info->state != W25Q_FTL_DATA || i == ftl->active || info->valid + min_stale > W25Q_FTL_PAGES_PER_SECTOR) {
+            continue;
+        }
+        if (victim == W25Q_FTL_NONE || info->valid < ftl->info[victim].valid ||
+            (info->valid == ftl->info[victim].valid && info->erase_count < ftl->info[victim].erase_count)) {
+            victim = i;
+        }
+    }
+    return victim;
+
+}
+
+/**
+ * @brief Least worn closed sector, when the wear gap calls for moving its data
+*/
+static unsigned w25q_ftl_wl_victim(const struct w25q_ftl *ftl) {
+
+    unsigned coldest = W25Q_FTL_NONE;
+    unsigned long most = 0;
+
+    if (ftl->wl_threshold == 0) {
+        return W25Q_FTL_NONE;
+    }
+    for (unsigned i = 0; i < ftl->sectors; i++) {
+        const struct w25q_ftl_sector *info = &ftl->info[i];
+
+        if (info->erase_count > most) {
+            most = info->erase_count;
+        }
+        if (info->state == W25Q_FTL_DATA && i != ftl->active &&
+            (coldest == W25Q_FTL_NONE || info->erase_count < ftl->info[coldest].erase_count)) {
+            coldest = i;
+        }
+    }
+    if (coldest == W25Q_FTL_NONE || most - ftl->info[coldest].erase_count < ftl->wl_threshold) {
+        return W25Q_FTL_NONE;
+    }
+    return coldest;
+
+}
+
+static unsigned char w25q_ftl_collect(struct w25q_ftl *ftl);
+
+/**
+ * @brief Open the least worn free sector for appending
+ * 
+ * @param[in] gc 1 when called for garbage collection, which may take the last free sector
+*/
+static unsigned char w25q_ftl_open(struct w25q_ftl *ftl, unsigned char gc) {
+
+    unsigned sector = W25Q_FTL_NONE;
+    unsigned char seq[4];
+
+    // Writes leave one free sector to garbage collection
+    for (unsigned i = 0; !gc && ftl->free_count <= 1 && i < ftl->sectors; i++) {
+        if (ftl->erasing != W25Q_FTL_NONE) {
+            w25q_finish(ftl->flash);
+            w25q_ftl_settle(ftl);
+            continue;
+        }
+        if (!w25q_ftl_collect(ftl)) {
+            break;
+        }
+    }
+    // Garbage collection may have opened one
+    if (ftl->active != W25Q_FTL_NONE) {
+        return 1;
+    }
+    if (ftl->free_count == 0 || (!gc && ftl->free_count <= 1)) {
+        return 0;
+    }
+
+    for (unsigned i = 0; i < ftl->sectors; i++) {
+        if (ftl->info[i].state == W25Q_FTL_FREE &&
+            (sector == W25Q_FTL_NONE || ftl->info[i].erase_count < ftl->info[sector].erase_count)) {
+            sector = i;
+        }
+    }
+    ftl->free_count--;
+    ftl->info[sector].state = W25Q_FTL_DATA;
+    ftl->info[sector].seq = ++ftl->seq;
+    ftl->info[sector].valid = 0;
+    w25q_ftl_mark(ftl, sector, 1);
+    w25q_put_le32(seq, ftl->seq);
+    if (!w25q_write(ftl->flash, w25q_ftl_address(ftl, sector, 8), seq, sizeof(seq))) {
+        ftl->info[sector].state = W25Q_FTL_DIRTY;
+        return 0;
+    }
+    ftl->active = sector;
+    ftl->next_slot = 0;
+    return 1;
+
+}
+
+/**
+ * @brief Append a logical page to the open sector and map it there
+*/
+static unsigned char w25q_ftl_append(struct w25q_ftl *ftl, unsigned page, const void *buffer, unsigned char gc) {
+
+    unsigned char tag[8];
+    unsigned sector, slot, old;
+
+    if (ftl->active == W25Q_FTL_NONE && !w25q_ftl_open(ftl, gc)) {
+        return 0;
+    }
+    sector = ftl->active;
+    slot = ftl->next_slot++;
+    if (ftl->next_slot == W25Q_FTL_PAGES_PER_SECTOR) {
+        ftl->active = W25Q_FTL_NONE;
+    }
+
+    // The tag commits the page, a page without one is ignored at mount
+    w25q_put_le32(tag, page);
+    w25q_put_le32(&tag[4], ~(unsigned long)page);
+    if (!w25q_write(ftl->flash, w25q_ftl_address(ftl, sector, (slot + 1) * 256), (void *)buffer, 256) ||
+        !w25q_write(ftl->flash, w25q_ftl_address(ftl, sector, W25Q_FTL_TAG_OFFSET + slot * 8), tag, sizeof(tag))) {
+        return 0;
+    }
+
+    old = ftl->map[page];
+    if (old != W25Q_FTL_NONE) {
+        ftl->info[old / 16].valid--;
+    }
+    ftl->map[page] = sector * 16 + slot;
+    ftl->info[sector].valid++;
+    return 1;
+
+}
+
+/**
+ * @brief Copy the pages still mapped out of a sector
+*/
+static unsigned char w25q_ftl_relocate(struct w25q_ftl *ftl, unsigned sector) {
+
+    unsigned char header[W25Q_FTL_HEADER_SIZE];
+    unsigned char data[256];
+
+    if (ftl->info[sector].valid == 0) {
+        return 1;
+    }
+    if (!w25q_read(ftl->flash, w25q_ftl_address(ftl, sector, 0), header, sizeof(header))) {
+        return 0;
+    }
+    for (unsigned slot = 0; slot < W25Q_FTL_PAGES_PER_SECTOR; slot++) {
+        unsigned long page = w25q_get_le32(&header[W25Q_FTL_TAG_OFFSET + slot * 8]);
+
+        if (page >= ftl->pages || ftl->map[page] != sector * 16 + slot) {
+            continue;
+        }
+        if (!w25q_read(ftl->flash, w25q_ftl_address(ftl, sector, (slot + 1) * 256), data, sizeof(data)) ||
+            !w25q_ftl_append(ftl, (unsigned)page, data, 1)) {
+            return 0;
+        }
+        ftl->relocations++;
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Free one sector now: copy its mapped pages away and erase it
+*/
+static unsigned char w25q_ftl_collect(struct w25q_ftl *ftl) {
+
+    unsigned victim = w25q_ftl_gc_victim(ftl, 1);
+    unsigned address;
+
+    if (victim == W25Q_FTL_NONE || !w25q_ftl_relocate(ftl, victim)) {
+        return 0;
+    }
+    address = w25q_ftl_address(ftl, victim, 0);
+    ftl->info[victim].state = W25Q_FTL_DIRTY;
+    if (!w25q_erase(ftl->flash, address, address + 4096)) {
+        return 0;
+    }
+    return w25q_ftl_format(ftl, victim);
+
+}
+
+/* FTL functions */
+
+unsigned w25q_ftl_arena_size(unsigned sectors, unsigned spare_sectors) {
+
+    unsigned map_size = sectors > spare_sectors ?
+                        (sectors - spare_sectors) * W25Q_FTL_PAGES_PER_SECTOR * sizeof(unsigned) : 0;
+
+    // The sector table follows the map, aligned for unsigned long
+    map_size = (map_size + sizeof(unsigned long) - 1) & ~(unsigned)(sizeof(unsigned long) - 1);
+    return map_size + sectors * sizeof(struct w25q_ftl_sector);
+
+}
+
+unsigned char w25q_ftl_mount(struct w25q_ftl *ftl, struct w25q_flash *flash, unsigned first_sector,
+                             unsigned sectors, unsigned spare_sectors, void *arena, unsigned arena_size) {
+
+    unsigned char header[W25Q_FTL_HEADER_SIZE];
+    unsigned long most = 0;
+    unsigned map_size;
+
+    if (ftl == NULL || flash == NULL || arena == NULL || spare_sectors < W25Q_FTL_MIN_SPARE_SECTORS ||
+        sectors <= spare_sectors + 1 || (unsigned long)(first_sector + sectors) * 16 > flash->size ||
+        arena_size < w25q_ftl_arena_size(sectors, spare_sectors)) {
+        return 0;
+    }
+
+    memset(ftl, 0, sizeof(*ftl));
+    ftl->flash = flash;
+    ftl->first_sector = first_sector;
+    ftl->sectors = sectors;
+    ftl->pages = (sectors - spare_sectors) * W25Q_FTL_PAGES_PER_SECTOR;
+    ftl->active = W25Q_FTL_NONE;
+    ftl->erasing = W25Q_FTL_NONE;
+    ftl->gc_free_target = W25Q_FTL_GC_FREE_TARGET;
+    ftl->gc_min_stale = W25Q_FTL_GC_MIN_STALE;
+    ftl->wl_threshold = W25Q_FTL_WL_THRESHOLD;
+    map_size = w25q_ftl_arena_size(sectors, spare_sectors) - sectors * sizeof(struct w25q_ftl_sector);
+    ftl->map = (unsigned *)arena;
+    ftl->info = (struct w25q_ftl_sector *)((unsigned char *)arena + map_size);
+    memset(ftl->map, 0xff, ftl->pages * sizeof(unsigned));
+
+    for (unsigned sector = 0; sector < sectors; sector++) {
+        struct w25q_ftl_sector *info = &ftl->info[sector];
+
+        if (!w25q_read(flash, w25q_ftl_address(ftl, sector, 0), header, sizeof(header))) {
+            return 0;
+        }
+        info->seq = w25q_get_le32(&header[8]);
+        info->erase_count = w25q_get_le32(&header[4]);
+        info->valid = 0;
+        if (w25q_get_le32(header) != W25Q_FTL_MAGIC || info->erase_count == W25Q_FTL_NONE) {
+            // Erase count lost with the header, set below
+            info->state = W25Q_FTL_DIRTY;
+            info->erase_count = W25Q_FTL_NONE;
+            w25q_ftl_mark(ftl, sector, 1);
+            continue;
+        }
+        if (info->erase_count > most) {
+            most = info->erase_count;
+        }
+        if (info->seq == W25Q_FTL_NONE) {
+            info->state = W25Q_FTL_FREE;
+            ftl->free_count++;
+            w25q_ftl_mark(ftl, sector, 0);
+            continue;
+        }
+        info->state = W25Q_FTL_DATA;
+        w25q_ftl_mark(ftl, sector, 1);
+        if (info->seq > ftl->seq) {
+            ftl->seq = info->seq;
+        }
+
+        // Newer sectors win, and later pages within a sector
+        for (unsigned slot = 0; slot < W25Q_FTL_PAGES_PER_SECTOR; slot++) {
+            const unsigned char *tag = &header[W25Q_FTL_TAG_OFFSET + slot * 8];
+            unsigned long page = w25q_get_le32(tag);
+            unsigned old;
+
+            if (page >= ftl->pages || ((page ^ w25q_get_le32(&tag[4])) & 0xffffffffUL) != 0xffffffffUL) {
+                continue;
+            }
+            old = ftl->map[page];
+            if (old != W25Q_FTL_NONE) {
+                if (old / 16 != sector && ftl->info[old / 16].seq > info->seq) {
+                    continue;
+                }
+                ftl->info[old / 16].valid--;
+            }
+            ftl->map[page] = sector * 16 + slot;
+            info->valid++;
+        }
+    }
+
+    // Sectors whose header was lost count as the most worn ones
+    for (unsigned sector = 0; sector < sectors; sector++) {
+        if (ftl->info[sector].erase_count == W25Q_FTL_NONE) {
+            ftl->info[sector].erase_count = most;
+        }
+    }
+    return 1;
+
+}
+
+unsigned char w25q_ftl_read(struct w25q_ftl *ftl, unsigned page, void *buffer) {
+
+    unsigned physical;
+
+    if (page >= ftl->pages || buffer == NULL) {
+        return 0;
+    }
+    physical = ftl->map[page];
+    if (physical == W25Q_FTL_NONE) {
+        memset(buffer, 0xff, 256);
+        return 1;
+    }
+    return w25q_read(ftl->flash, w25q_ftl_address(ftl, physical / 16, (physical % 16 + 1) * 256), buffer, 256);
+
+}
+
+unsigned char w25q_ftl_write(struct w25q_ftl *ftl, unsigned page, const void *buffer) {
+
+    unsigned char result;
+
+    if (page >= ftl->pages || buffer == NULL) {
+        return 0;
+    }
+    w25q_ftl_settle(ftl);
+    result = w25q_ftl_append(ftl, page, buffer, 0);
+    // The page program waited for a background erase
+    w25q_ftl_settle(ftl);
+    return result;
+
+}
+
+unsigned char w25q_ftl_service(struct w25q_ftl *ftl) {
+
+    unsigned victim = W25Q_FTL_NONE;
+    unsigned address;
+
+    if (ftl->erasing != W25Q_FTL_NONE) {
+        w25q_poll(ftl->flash);
+        w25q_ftl_settle(ftl);
+        return 1;
+    }
+
+    if (ftl->free_count < ftl->gc_free_target) {
+        victim = w25q_ftl_gc_victim(ftl, ftl->gc_min_stale);
+    }
+    if (victim == W25Q_FTL_NONE) {
+        victim = w25q_ftl_wl_victim(ftl);
+    }
+    if (victim == W25Q_FTL_NONE || !w25q_ftl_relocate(ftl, victim)) {
+        return 0;
+    }
+
+    address = w25q_ftl_address(ftl, victim, 0);
+    ftl->info[victim].state = W25Q_FTL_ERASING;
+    ftl->erasing = victim;
+    ftl->erase_result = W25Q_FTL_ERASE_PENDING;
+    if (!w25q_submit_erase(ftl->flash, address, address + 4096, w25q_ftl_erase_done, ftl)) {
+        ftl->info[victim].state = W25Q_FTL_DIRTY;
+        ftl->erasing = W25Q_FTL_NONE;
+        return 0;
+    }
+    return 1;
+
+}
@@ -0,0 +1,161 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _W25QXX_FTL_H_
+#define _W25QXX_FTL_H_
+
+#include "w25qxx.h"
+
+/* Logical pages stored in a 4 KB sector, the first page holds the sector header */
+#define W25Q_FTL_PAGES_PER_SECTOR 15
+
+/* Fewest sectors kept out of the logical capacity: the one being written and a spare for garbage collection */
+#define W25Q_FTL_MIN_SPARE_SECTORS 2
+
+/* Default free sectors w25q_ftl_service keeps available, the one a write may open besides the spare */
+#define W25Q_FTL_GC_FREE_TARGET 1
+
+/* Default stale pages a sector must hold before w25q_ftl_service collects it, about half the sector */
+#define W25Q_FTL_GC_MIN_STALE 8
+
+/* Default erase count gap between the most and least worn sectors that triggers static wear leveling */
+#define W25Q_FTL_WL_THRESHOLD 64
+
+/* Unmapped logical page, or no sector */
+#define W25Q_FTL_NONE 0xffffffffu
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sector states */
+enum w25q_ftl_state_t {
+    W25Q_FTL_FREE = 0,                  // Erased, header written, ready to be opened
+    W25Q_FTL_DATA,                      // Open or closed sector holding pages
+    W25Q_FTL_DIRTY,                     // Contents unknown, must be erased before use
+    W25Q_FTL_ERASING                    // Background erase in progress
+};
+
+/**
+ * @brief RAM state of one physical sector
+*/
+struct w25q_ftl_sector {
+    unsigned long erase_count;
+    unsigned long seq;                  // Order in which data sectors were opened
+    unsigned short valid;               // Pages still mapped
+    unsigned char state;                // enum w25q_ftl_state_t
+};
+
+/**
+ * @brief Log-structured flash translation layer over a range of sectors
+ * 
+ * Logical pages of 256 bytes are written out of place: each write appends the page to the open
+ * sector and records its logical number in the sector header, so overwrites never erase. Garbage
+ * collection copies the pages still mapped out of the sector with the fewest of them and erases it.
+ * New sectors are taken from the least worn free ones (dynamic wear leveling), and sectors holding
+ * cold data are moved once the erase count gap reaches wl_threshold (static wear leveling).
+*/
+struct w25q_ftl {
+    struct w25q_flash *flash;
+    unsigned first_sector;
+    unsigned sectors;
+    unsigned pages;                     // Logical capacity, in pages
+    unsigned *map;                      // Logical page to physical page (sector * 16 + slot), W25Q_FTL_NONE when unmapped
+    struct w25q_ftl_sector *info;       // One per sector of the range
+    unsigned active;                    // Open sector, W25Q_FTL_NONE when there is none
+    unsigned char next_slot;            // Next page of the open sector
+    unsigned free_count;                // Sectors in W25Q_FTL_FREE
+    unsigned long seq;                  // Last sequence number given to a sector
+    unsigned erasing;                   // Sector of the background erase, W25Q_FTL_NONE when idle
+    unsigned char erase_result;
+    unsigned gc_free_target;            // Free sectors w25q_ftl_service keeps available
+    unsigned gc_min_stale;              // Stale pages below which w25q_ftl_service leaves a sector alone
+    unsigned wl_threshold;              // Erase count gap for static wear leveling, 0 disables it
+    unsigned long relocations;          // Pages copied by garbage collection and wear leveling
+    unsigned long erases;
+};
+
+/**
+ * @brief RAM needed by w25q_ftl_mount for a range of sectors
+*/
+unsigned w25q_ftl_arena_size(unsigned sectors, unsigned spare_sectors);
+
+/**
+ * @brief Mount the translation layer, rebuilding the page map from the sector headers
+ * 
+ * Reads one header per sector. Sectors without a valid header (a blank or foreign range) are erased
+ * on demand, so a new range needs no formatting.
+ * 
+ * @param[out] ftl FTL instance
+ * @param[in] flash Mounted flash instance
+ * @param[in] first_sector First sector of the range
+ * @param[in] sectors Number of sectors, more than spare_sectors + 1
+ * @param[in] spare_sectors Sectors kept out of the logical capacity, at least W25Q_FTL_MIN_SPARE_SECTORS.
+ *                          More spares mean less copying per collected sector
+ * @param[in] arena Memory for the page map and sector table, at least
+ *                  w25q_ftl_arena_size(sectors, spare_sectors) bytes, aligned for unsigned long
+ * @param[in] arena_size Arena size in bytes
+ * 
+ * @return 1 on success, 0 on invalid parameters
+*/
+unsigned char w25q_ftl_mount(struct w25q_ftl *ftl, struct w25q_flash *flash, unsigned first_sector,
+                             unsigned sectors, unsigned spare_sectors, void *arena, unsigned arena_size);
+
+/**
+ * @brief Read a logical page, unwritten pages read as 0xff
+ * 
+ * @param[in] buffer 256 bytes
+ * 
+ * @return 1 on success, 0 on invalid page
+*/
+unsigned char w25q_ftl_read(struct w25q_ftl *ftl, unsigned page, void *buffer);
+
+/**
+ * @brief Write a logical page
+ * 
+ * Costs two page programs (data, then its entry in the sector header). It only collects and erases
+ * a sector itself when opening a new one would take the last free sector, the one kept for garbage
+ * collection. With more than W25Q_FTL_MIN_SPARE_SECTORS spares, raise gc_free_target so that
+ * w25q_ftl_service does this work in idle time instead.
+ * 
+ * @param[in] buffer 256 bytes
+ * 
+ * @return 1 on success, 0 on invalid page or flash failure
+*/
+unsigned char w25q_ftl_write(struct w25q_ftl *ftl, unsigned page, const void *buffer);
+
+/**
+ * @brief Run one step of garbage collection or wear leveling, call it when the application is idle
+ * 
+ * Erases run asynchronously (w25q_submit_erase): a call starts one, later calls poll it.
+ * 
+ * @return 1 while there is work left, 0 when idle
+*/
+unsigned char w25q_ftl_service(struct w25q_ftl *ftl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,643 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "w25qxx_kv.h"
+#include "string.h"
+
+/*
+ * Sector layout:
+ * 
+ *   0   magic
+ *   4   sequence number, written when the sector is opened (0xffffffff: free)
+ *   16  records
+ * 
+ * Record: key length, 0xff, value length (16 bits, 0xffff: deleted), CRC-32 of the first 4 bytes, the
+ * key and the value, then the key and the value. Records never cross a page: a 0xff where a record
+ * would start means the rest of the page is unused, and a page starting that way ends the sector.
+*/
+#define W25Q_KV_MAGIC 0x4b353257UL
+#define W25Q_KV_FIRST_RECORD 16
+#define W25Q_KV_HEADER_SIZE 8
+#define W25Q_KV_DELETED 0xffff
+
+/**
+ * @brief Position in the records of a sector
+*/
+struct w25q_kv_cursor {
+    unsigned sector;
+    unsigned offset;                    // Next record, or the end of the records once w25q_kv_next returns 0
+    unsigned end;                       // Unused tail of the last page, 0 when none
+    unsigned page;                      // Offset of the page in buffer
+    unsigned char torn;                 // Stopped at a damaged record
+    unsigned char failed;               // Stopped on a read failure
+    unsigned char buffer[256];
+};
+
+/* Helper functions */
+
+static unsigned w25q_kv_address(const struct w25q_kv *kv, unsigned sector, unsigned offset) {
+    return (kv->first_sector + sector) * 4096 + offset;
+}
+
+static unsigned w25q_kv_sector_of(const struct w25q_kv *kv, unsigned address) {
+    return address / 4096 - kv->first_sector;
+}
+
+/**
+ * @brief FNV-1a hash of a key
+*/
+static unsigned long w25q_kv_hash(const void *key, unsigned key_len) {
+
+    const unsigned char *p = (const unsigned char *)key;
+    unsigned long hash = 2166136261UL;
+
+    for (unsigned i = 0; i < key_len; i++) {
+        hash = ((hash ^ p[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+
+}
+
+/**
+ * @brief Size of a record from its header
+*/
+static unsigned w25q_kv_record_size(const unsigned char *record) {
+
+    unsigned value_len = record[2] | (record[3] << 8);
+
+    return W25Q_KV_HEADER_SIZE + record[0] + (value_len == W25Q_KV_DELETED ? 0 : value_len);
+
+}
+
+/**
+ * @brief Build a record
+ * 
+ * @param[in] deleted Build a deletion, value is ignored
+ * 
+ * @return Record size
+*/
+static unsigned w25q_kv_record(unsigned char *record, const void *key, unsigned key_len, const void *value,
+                               unsigned value_len, unsigned char deleted) {
+
+    unsigned size;
+
+    if (deleted) {
+        value_len = 0;
+    }
+    record[0] = (unsigned char)key_len;
+    record[1] = 0xff;
+    record[2] = deleted ? 0xff : value_len & 0xff;
+    record[3] = deleted ? 0xff : (value_len >> 8) & 0xff;
+    memcpy(&record[W25Q_KV_HEADER_SIZE], key, key_len);
+    if (value_len != 0) {
+        memcpy(&record[W25Q_KV_HEADER_SIZE + key_len], value, value_len);
+    }
+    size = W25Q_KV_HEADER_SIZE + key_len + value_len;
+    w25q_put_le32(&record[4], w25q_crc32_update(w25q_crc32_update(0, record, 4), &record[W25Q_KV_HEADER_SIZE],
+                                                size - W25Q_KV_HEADER_SIZE));
+    return size;
+
+}
+
+/**
+ * @brief Read the next record of a sector
+ * 
+ * @param[out] record Points to the record in the cursor buffer
+ * 
+ * @return Record size, 0 at the end of the records
+*/
+static unsigned w25q_kv_next(struct w25q_kv *kv, struct w25q_kv_cursor *cursor, const unsigned char **record) {
+
+    while (cursor->offset < 4096) {
+        unsigned page = cursor->offset & ~255u;
+        unsigned offset = cursor->offset & 255;
+        const unsigned char *p = &cursor->buffer[offset];
+        unsigned size;
+
+        if (page != cursor->page) {
+            if (!w25q_read(kv->flash, w25q_kv_address(kv, cursor->sector, page), cursor->buffer,
+                           sizeof(cursor->buffer))) {
+                cursor->failed = 1;
+                return 0;
+            }
+            cursor->page = page;
+        }
+        if (p[0] == 0xff) {
+            if (cursor->offset == (page == 0 ? W25Q_KV_FIRST_RECORD : page)) {
+                break;
+            }
+            cursor->end = cursor->offset;
+            cursor->offset = page + 256;
+            continue;
+        }
+        if (offset + W25Q_KV_HEADER_SIZE > 256) {
+            cursor->torn = 1;
+            return 0;
+        }
+        size = w25q_kv_record_size(p);
+        if (p[0] == 0 || p[0] > W25Q_KV_MAX_KEY || p[1] != 0xff || size > W25Q_KV_MAX_RECORD ||
+            offset + size > 256 ||
+            w25q_get_le32(&p[4]) != w25q_crc32_update(w25q_crc32_update(0, p, 4), &p[W25Q_KV_HEADER_SIZE],
+                                                      size - W25Q_KV_HEADER_SIZE)) {
+            cursor->torn = 1;
+            return 0;
+        }
+        *record = p;
+        cursor->end = 0;
+        cursor->offset += size;
+        return size;
+    }
+    if (cursor->end != 0) {
+        cursor->offset = cursor->end;
+    }
+    return 0;
+
+}
+
+static void w25q_kv_cursor_init(struct w25q_kv_cursor *cursor, unsigned sector) {
+
+    cursor->sector = sector;
+    cursor->offset = W25Q_KV_FIRST_RECORD;
+    cursor->end = 0;
+    cursor->page = W25Q_KV_NONE;
+    cursor->torn = 0;
+    cursor->failed = 0;
+
+}
+
+/**
+ * @brief Find the index slot of a key
+ * 
+ * @param[out] record Current record of the key, W25Q_KV_MAX_RECORD bytes
+ * 
+ * @return Slot, W25Q_KV_NONE when the key is not stored or on read failure
+*/
+static unsigned w25q_kv_find(struct w25q_kv *kv, const void *key, unsigned key_len, unsigned long hash,
+                             unsigned char *record) {
+
+    for (unsigned i = hash & (kv->slots - 1); kv->index[i].address != W25Q_KV_NONE; i = (i + 1) & (kv->slots - 1)) {
+        struct w25q_kv_entry *entry = &kv->index[i];
+
+        if (entry->hash != hash) {
+            continue;
+        }
+        if (!w25q_read(kv->flash, entry->address, record, entry->size)) {
+            return W25Q_KV_NONE;
+        }
+        if (record[0] == key_len && memcmp(&record[W25Q_KV_HEADER_SIZE], key, key_len) == 0) {
+            return i;
+        }
+    }
+    return W25Q_KV_NONE;
+
+}
+
+/**
+ * @brief Find the index slot pointing at a record
+*/
+static unsigned w25q_kv_find_address(struct w25q_kv *kv, unsigned long hash, unsigned address) {
+
+    for (unsigned i = hash & (kv->slots - 1); kv->index[i].address != W25Q_KV_NONE; i = (i + 1) & (kv->slots - 1)) {
+        if (kv->index[i].address == address) {
+            return i;
+        }
+    }
+    return W25Q_KV_NONE;
+
+}
+
+static void w25q_kv_insert(struct w25q_kv *kv, unsigned long hash, unsigned address, unsigned size) {
+
+    unsigned i = hash & (kv->slots - 1);
+
+    while (kv->index[i].address != W25Q_KV_NONE) {
+        i = (i + 1) & (kv->slots - 1);
+    }
+    kv->index[i].hash = hash;
+    kv->index[i].address = address;
+    kv->index[i].size = (unsigned short)size;
+    kv->info[w25q_kv_sector_of(kv, address)].live += (unsigned short)size;
+    kv->count++;
+
+}
+
+/**
+ * @brief Drop an index slot, shifting back the entries probed past it
+*/
+static void w25q_kv_remove(struct w25q_kv *kv, unsigned slot) {
+
+    unsigned mask = kv->slots - 1;
+    unsigned i = slot;
+
+    kv->info[w25q_kv_sector_of(kv, kv->index[slot].address)].live -= kv->index[slot].size;
+    kv->count--;
+    while (1) {
+        unsigned j = i;
+
+        kv->index[i].address = W25Q_KV_NONE;
+        while (1) {
+            unsigned home;
+
+            j = (j + 1) & mask;
+            if (kv->index[j].address == W25Q_KV_NONE) {
+                return;
+            }
+            // Entries whose home is cyclically in (i, j] stay where they are
+            home = kv->index[j].hash & mask;
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue;
+            }
+            kv->index[i] = kv->index[j];
+            i = j;
+            break;
+        }
+    }
+
+}
+
+/**
+ * @brief Erase a sector and write a free header
+*/
+static unsigned char w25q_kv_format(struct w25q_kv *kv, unsigned sector) {
+
+    unsigned char header[8];
+    unsigned address = w25q_kv_address(kv, sector, 0);
+
+    kv->info[sector].state = W25Q_KV_DIRTY;
+    if (!w25q_erase(kv->flash, address, address + 4096)) {
+        return 0;
+    }
+    w25q_put_le32(header, W25Q_KV_MAGIC);
+    w25q_put_le32(&header[4], 0xffffffffUL);
+    if (!w25q_write(kv->flash, address, header, sizeof(header))) {
+        return 0;
+    }
+    kv->info[sector].state = W25Q_KV_FREE;
+    kv->info[sector].used = 0;
+    kv->info[sector].live = 0;
+    return 1;
+
+}
+
+/**
+ * @brief Make a free sector the head, the one after the current head first
+*/
+static unsigned char w25q_kv_open(struct w25q_kv *kv) {
+
+    unsigned start = kv->head == W25Q_KV_NONE ? 0 : kv->head + 1;
+    unsigned char seq[4];
+
+    for (unsigned i = 0; i < kv->sectors; i++) {
+        unsigned sector = (start + i) % kv->sectors;
+        struct w25q_kv_sector *info = &kv->info[sector];
+
+        if (info->state == W25Q_KV_DATA) {
+            continue;
+        }
+        if (info->state == W25Q_KV_DIRTY && !w25q_kv_format(kv, sector)) {
+            return 0;
+        }
+        w25q_put_le32(seq, kv->seq + 1);
+        if (!w25q_write(kv->flash, w25q_kv_address(kv, sector, 4), seq, sizeof(seq))) {
+            return 0;
+        }
+        info->state = W25Q_KV_DATA;
+        info->seq = ++kv->seq;
+        info->used = W25Q_KV_FIRST_RECORD;
+        info->live = 0;
+        kv->free_count--;
+        kv->head = sector;
+        return 1;
+    }
+    return 0;
+
+}
+
+/**
+ * @brief Bytes compaction can win back, in the sectors other than the head
+*/
+static unsigned long w25q_kv_garbage(const struct w25q_kv *kv) {
+
+    unsigned long garbage = 0;
+
+    for (unsigned sector = 0; sector < kv->sectors; sector++) {
+        const struct w25q_kv_sector *info = &kv->info[sector];
+
+        if (info->state == W25Q_KV_DATA && sector != kv->head) {
+            garbage += info->used - W25Q_KV_FIRST_RECORD - info->live;
+        }
+    }
+    return garbage;
+
+}
+
+static unsigned char w25q_kv_compact(struct w25q_kv *kv);
+
+/**
+ * @brief Append a record to the head, opening a sector when it does not fit
+ * 
+ * @param[in] compacting Called by compaction, which may take the last free sector
+ * 
+ * @return Record address, W25Q_KV_NONE when the store is full or on flash failure
+*/
+static unsigned w25q_kv_append(struct w25q_kv *kv, unsigned char *record, unsigned size, unsigned char compacting) {
+
+    for (unsigned i = 0; i <= 2 * kv->sectors; i++) {
+        if (kv->head != W25Q_KV_NONE) {
+            struct w25q_kv_sector *info = &kv->info[kv->head];
+            unsigned offset = info->used;
+
+            if ((offset & 255) + size > 256) {
+                offset = (offset | 255) + 1;
+            }
+            if (offset + size <= 4096) {
+                unsigned address = w25q_kv_address(kv, kv->head, offset);
+
+                if (!w25q_write(kv->flash, address, record, size)) {
+                    return W25Q_KV_NONE;
+                }
+                info->used = (unsigned short)(offset + size);
+                return address;
+            }
+        }
+        // One free sector stays spare for compaction
+        if (!compacting && kv->free_count < 2) {
+            if (w25q_kv_garbage(kv) == 0 || !w25q_kv_compact(kv)) {
+                return W25Q_KV_NONE;
+            }
+            continue;
+        }
+        if (kv->free_count == 0 || !w25q_kv_open(kv)) {
+            return W25Q_KV_NONE;
+        }
+    }
+    return W25Q_KV_NONE;
+
+}
+
+/**
+ * @brief Copy the indexed records out of the oldest sector and erase it
+*/
+static unsigned char w25q_kv_compact(struct w25q_kv *kv) {
+
+    struct w25q_kv_cursor cursor;
+    unsigned char copy[W25Q_KV_MAX_RECORD];
+    const unsigned char *record;
+    unsigned victim = W25Q_KV_NONE;
+    unsigned size;
+
+    for (unsigned sector = 0; sector < kv->sectors; sector++) {
+        if (kv->info[sector].state == W25Q_KV_DATA && sector != kv->head &&
+            (victim == W25Q_KV_NONE || kv->info[sector].seq < kv->info[victim].seq)) {
+            victim = sector;
+        }
+    }
+    if (victim == W25Q_KV_NONE) {
+        return 0;
+    }
+
+    w25q_kv_cursor_init(&cursor, victim);
+    while ((size = w25q_kv_next(kv, &cursor, &record)) != 0) {
+        unsigned address = w25q_kv_address(kv, victim, cursor.offset - size);
+        unsigned slot = w25q_kv_find_address(kv, w25q_kv_hash(&record[W25Q_KV_HEADER_SIZE], record[0]), address);
+        unsigned moved;
+
+        // Older values and deletions are dropped, nothing older than this sector is left
+        if (slot == W25Q_KV_NONE) {
+            continue;
+        }
+        memcpy(copy, record, size);
+        moved = w25q_kv_append(kv, copy, size, 1);
+        if (moved == W25Q_KV_NONE) {
+            return 0;
+        }
+        kv->index[slot].address = moved;
+        kv->info[victim].live -= (unsigned short)size;
+        kv->info[kv->head].live += (unsigned short)size;
+        kv->relocated++;
+    }
+    if (cursor.failed) {
+        return 0;
+    }
+    if (!w25q_kv_format(kv, victim)) {
+        kv->free_count++;
+        return 0;
+    }
+    kv->free_count++;
+    kv->compactions++;
+    return 1;
+
+}
+
+/* Store functions */
+
+unsigned w25q_kv_arena_size(unsigned sectors, unsigned keys) {
+
+    unsigned slots = 4;
+
+    while (slots * 3 / 4 < keys) {
+        slots *= 2;
+    }
+    return sectors * sizeof(struct w25q_kv_sector) + slots * sizeof(struct w25q_kv_entry);
+
+}
+
+unsigned char w25q_kv_mount(struct w25q_kv *kv, struct w25q_flash *flash, unsigned first_sector,
+                            unsigned sectors, void *arena, unsigned arena_size) {
+
+    struct w25q_kv_cursor cursor;
+    unsigned char old[W25Q_KV_MAX_RECORD];
+    unsigned long last = 0;
+    unsigned table_size = sectors * sizeof(struct w25q_kv_sector);
+    unsigned slots = 4;
+
+    if (kv == NULL || flash == NULL || arena == NULL || sectors < 3 ||
+        (unsigned long)(first_sector + sectors) * 16 > flash->size ||
+        arena_size < table_size + slots * sizeof(struct w25q_kv_entry)) {
+        return 0;
+    }
+    while (table_size + 2 * slots * sizeof(struct w25q_kv_entry) <= arena_size) {
+        slots *= 2;
+    }
+
+    memset(kv, 0, sizeof(*kv));
+    kv->flash = flash;
+    kv->first_sector = first_sector;
+    kv->sectors = sectors;
+    kv->info = (struct w25q_kv_sector *)arena;
+    kv->index = (struct w25q_kv_entry *)((unsigned char *)arena + table_size);
+    kv->slots = slots;
+    kv->head = W25Q_KV_NONE;
+    kv->free_target = W25Q_KV_FREE_TARGET;
+    memset(kv->info, 0, table_size);
+    for (unsigned i = 0; i < slots; i++) {
+        kv->index[i].address = W25Q_KV_NONE;
+    }
+
+    for (unsigned sector = 0; sector < sectors; sector++) {
+        unsigned char header[8];
+        struct w25q_kv_sector *info = &kv->info[sector];
+
+        if (!w25q_read(flash, w25q_kv_address(kv, sector, 0), header, sizeof(header))) {
+            return 0;
+        }
+        info->seq = w25q_get_le32(&header[4]);
+        if (w25q_get_le32(header) != W25Q_KV_MAGIC) {
+            info->state = W25Q_KV_DIRTY;
+            kv->free_count++;
+        } else if (info->seq == 0xffffffffUL) {
+            info->state = W25Q_KV_FREE;
+            kv->free_count++;
+        } else {
+            info->state = W25Q_KV_DATA;
+            if (info->seq > kv->seq) {
+                kv->seq = info->seq;
+            }
+        }
+    }
+
+    // Replay the sectors oldest first, later records replace earlier ones
+    while (1) {
+        unsigned sector = W25Q_KV_NONE;
+        const unsigned char *record;
+        unsigned size;
+
+        for (unsigned i = 0; i < sectors; i++) {
+            if (kv->info[i].state == W25Q_KV_DATA && kv->info[i].seq > last &&
+                (sector == W25Q_KV_NONE || kv->info[i].seq < kv->info[sector].seq)) {
+                sector = i;
+            }
+        }
+        if (sector == W25Q_KV_NONE) {
+            break;
+        }
+        last = kv->info[sector].seq;
+        kv->head = sector;
+
+        w25q_kv_cursor_init(&cursor, sector);
+        while ((size = w25q_kv_next(kv, &cursor, &record)) != 0) {
+            unsigned long hash = w25q_kv_hash(&record[W25Q_KV_HEADER_SIZE], record[0]);
+            unsigned slot = w25q_kv_find(kv, &record[W25Q_KV_HEADER_SIZE], record[0], hash, old);
+            unsigned address = w25q_kv_address(kv, sector, cursor.offset - size);
+
+            if (slot != W25Q_KV_NONE) {
+                w25q_kv_remove(kv, slot);
+            }
+            if (record[2] != 0xff || record[3] != 0xff) {
+                if (kv->count + 1 > kv->slots * 3 / 4) {
+                    return 0;
+                }
+                w25q_kv_insert(kv, hash, address, size);
+            }
+        }
+        // Nothing is appended after a damaged record
+        kv->info[sector].used = (unsigned short)(cursor.torn ? 4096 : cursor.offset);
+    }
+    return 1;
+
+}
+
+unsigned char w25q_kv_get(struct w25q_kv *kv, const void *key, unsigned key_len, void *value,
+                          unsigned value_size, unsigned *value_len) {
+
+    unsigned char record[W25Q_KV_MAX_RECORD];
+    unsigned length;
+
+    if (key_len == 0 || key_len > W25Q_KV_MAX_KEY ||
+        w25q_kv_find(kv, key, key_len, w25q_kv_hash(key, key_len), record) == W25Q_KV_NONE) {
+        return 0;
+    }
+    length = record[2] | (record[3] << 8);
+    if (value_len != NULL) {
+        *value_len = length;
+    }
+    memcpy(value, &record[W25Q_KV_HEADER_SIZE + key_len], length < value_size ? length : value_size);
+    return 1;
+
+}
+
+unsigned char w25q_kv_set(struct w25q_kv *kv, const void *key, unsigned key_len, const void *value,
+                          unsigned value_len) {
+
+    unsigned char record[W25Q_KV_MAX_RECORD];
+    unsigned long hash = w25q_kv_hash(key, key_len);
+    unsigned slot, size, address;
+
+    if (key_len == 0 || key_len > W25Q_KV_MAX_KEY || W25Q_KV_HEADER_SIZE + key_len + value_len > W25Q_KV_MAX_RECORD) {
+        return 0;
+    }
+    slot = w25q_kv_find(kv, key, key_len, hash, record);
+    if (slot != W25Q_KV_NONE) {
+        if ((unsigned)(record[2] | (record[3] << 8)) == value_len &&
+            (value_len == 0 || memcmp(&record[W25Q_KV_HEADER_SIZE + key_len], value, value_len) == 0)) {
+            return 1;
+        }
+    } else if (kv->count + 1 > kv->slots * 3 / 4) {
+        return 0;
+    }
+
+    // Compaction in w25q_kv_append moves records but never index slots
+    size = w25q_kv_record(record, key, key_len, value, value_len, 0);
+    address = w25q_kv_append(kv, record, size, 0);
+    if (address == W25Q_KV_NONE) {
+        return 0;
+    }
+    if (slot != W25Q_KV_NONE) {
+        w25q_kv_remove(kv, slot);
+    }
+    w25q_kv_insert(kv, hash, address, size);
+    return 1;
+
+}
+
+unsigned char w25q_kv_delete(struct w25q_kv *kv, const void *key, unsigned key_len) {
+
+    unsigned char record[W25Q_KV_MAX_RECORD];
+    unsigned long hash = w25q_kv_hash(key, key_len);
+    unsigned slot;
+
+    if (key_len == 0 || key_len > W25Q_KV_MAX_KEY) {
+        return 0;
+    }
+    slot = w25q_kv_find(kv, key, key_len, hash, record);
+    if (slot == W25Q_KV_NONE) {
+        return 0;
+    }
+    if (w25q_kv_append(kv, record, w25q_kv_record(record, key, key_len, NULL, 0, 1), 0) == W25Q_KV_NONE) {
+        return 0;
+    }
+    w25q_kv_remove(kv, slot);
+    return 1;
+
+}
+
+unsigned char w25q_kv_service(struct w25q_kv *kv) {
+
+    // Compacting without a sector's worth of garbage would only move live records around
+    if (kv->free_count >= kv->free_target || w25q_kv_garbage(kv) < 4096 - W25Q_KV_FIRST_RECORD) {
+        return 0;
+    }
+    return w25q_kv_compact(kv);
+
+}
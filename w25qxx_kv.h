@@ -0,0 +1,166 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _W25QXX_KV_H_
+#define _W25QXX_KV_H_
+
+#include "w25qxx.h"
+
+/* Largest record: 8-byte header, key and value. A record never crosses a page */
+#define W25Q_KV_MAX_RECORD 240
+
+/* Longest key */
+#define W25Q_KV_MAX_KEY 64
+
+/* Free sectors w25q_kv_service keeps ready by default, one of them is the compaction spare */
+#define W25Q_KV_FREE_TARGET 2
+
+/* Empty index slot, or no sector */
+#define W25Q_KV_NONE 0xffffffffu
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Index slot: where the current record of a key is
+*/
+struct w25q_kv_entry {
+    unsigned long hash;
+    unsigned address;                   // Record address, W25Q_KV_NONE when the slot is empty
+    unsigned short size;                // Record size
+};
+
+/**
+ * @brief RAM state of one sector
+*/
+struct w25q_kv_sector {
+    unsigned long seq;                  // Order in which the sector was opened
+    unsigned short used;                // Bytes up to the end of the last record
+    unsigned short live;                // Bytes of records still indexed
+    unsigned char state;                // W25Q_KV_FREE, W25Q_KV_DATA or W25Q_KV_DIRTY
+};
+
+/* Sector states */
+enum w25q_kv_state_t {
+    W25Q_KV_FREE = 0,                   // Erased with a free header
+    W25Q_KV_DATA,                       // Holds records
+    W25Q_KV_DIRTY                       // Contents unknown, erased before use
+};
+
+/**
+ * @brief Append-only key-value store over a range of sectors
+ * 
+ * Records are appended to the open sector, an update appends a new record and the index forgets
+ * the old one. The index is an open-addressing hash table (linear probing) in the caller's arena,
+ * so a lookup is one read of the record. Compaction copies the records still indexed out of the
+ * oldest sector and erases it, one sector per call.
+*/
+struct w25q_kv {
+    struct w25q_flash *flash;
+    unsigned first_sector;
+    unsigned sectors;
+    struct w25q_kv_entry *index;
+    unsigned slots;                     // Index slots, a power of two
+    unsigned count;                     // Keys stored
+    struct w25q_kv_sector *info;        // One per sector of the range
+    unsigned head;                      // Sector records are appended to, W25Q_KV_NONE when there is none
+    unsigned free_count;                // Sectors in W25Q_KV_FREE or W25Q_KV_DIRTY
+    unsigned long seq;                  // Last sequence number given to a sector
+    unsigned free_target;               // Free sectors w25q_kv_service keeps ready
+    unsigned long compactions;          // Sectors compacted
+    unsigned long relocated;            // Records copied by compaction
+};
+
+/**
+ * @brief RAM needed by w25q_kv_mount
+ * 
+ * @param[in] sectors Sectors of the range
+ * @param[in] keys Keys to hold, the index is kept at most 3/4 full
+*/
+unsigned w25q_kv_arena_size(unsigned sectors, unsigned keys);
+
+/**
+ * @brief Mount the store, rebuilding the index from the records
+ * 
+ * Walks the records of every sector, a later record of a key replacing an earlier one. A sector
+ * that does not start with the store's magic is only marked for reuse and gets formatted the first
+ * time a record needs it, so mounting a blank range is enough to start a new store.
+ * 
+ * @param[out] kv Store instance
+ * @param[in] flash Mounted flash instance
+ * @param[in] first_sector First sector of the range
+ * @param[in] sectors Number of sectors, at least 3
+ * @param[in] arena Memory for the sector table and the index, aligned for unsigned long
+ * @param[in] arena_size Arena size in bytes, see w25q_kv_arena_size
+ * 
+ * @return 1 on success, 0 on invalid parameters or when the keys do not fit in the index
+*/
+unsigned char w25q_kv_mount(struct w25q_kv *kv, struct w25q_flash *flash, unsigned first_sector,
+                            unsigned sectors, void *arena, unsigned arena_size);
+
+/**
+ * @brief Read the value of a key
+ * 
+ * @param[out] value Buffer for the value
+ * @param[in] value_size Buffer size, the value is truncated to it
+ * @param[out] value_len Value length, may be NULL
+ * 
+ * @return 1 when the key exists, 0 otherwise
+*/
+unsigned char w25q_kv_get(struct w25q_kv *kv, const void *key, unsigned key_len, void *value,
+                          unsigned value_size, unsigned *value_len);
+
+/**
+ * @brief Store a value, one page program unless a sector has to be opened or compacted
+ * 
+ * Storing the value a key already has writes nothing.
+ * 
+ * @return 1 on success, 0 on invalid size, full store or flash failure
+*/
+unsigned char w25q_kv_set(struct w25q_kv *kv, const void *key, unsigned key_len, const void *value,
+                          unsigned value_len);
+
+/**
+ * @brief Delete a key
+ * 
+ * @return 1 on success, 0 when the key does not exist or on flash failure
+*/
+unsigned char w25q_kv_delete(struct w25q_kv *kv, const void *key, unsigned key_len);
+
+/**
+ * @brief Compact the oldest sector when fewer than free_target sectors are free
+ * 
+ * Call it when the application is idle so that w25q_kv_set does not have to compact.
+ * 
+ * @return 1 when a sector was compacted, 0 when there was nothing to do or on flash failure
+*/
+unsigned char w25q_kv_service(struct w25q_kv *kv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
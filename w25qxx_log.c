@@ -0,0 +1,588 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "w25qxx_log.h"
+#include "string.h"
+
+/*
+ * Sector layout:
+ * 
+ *   0   magic, written after the erase
+ *   4   sequence number, programmed with the first page of records
+ *   16  records
+ * 
+ * Record: size (16 bits, 0xffff where no record starts), low 16 bits of the CRC-32 of the size and
+ * the data, then the data. Records never cross a page: a page whose first record is blank ends the
+ * sector, a blank record elsewhere means the rest of the page is unused.
+*/
+#define W25Q_LOG_MAGIC 0x4c353257UL
+#define W25Q_LOG_FIRST_RECORD 16
+#define W25Q_LOG_RECORD_HEADER 4
+
+/* erase_result while the background erase runs */
+#define W25Q_LOG_ERASE_PENDING 2
+
+/* Helper functions */
+
+static unsigned w25q_log_address(const struct w25q_log *log, unsigned sector, unsigned offset) {
+    return (log->first_sector + sector) * 4096 + offset;
+}
+
+/**
+ * @brief Offset of the first record of a page
+*/
+static unsigned w25q_log_page_start(unsigned page) {
+    return page == 0 ? W25Q_LOG_FIRST_RECORD : page;
+}
+
+static unsigned w25q_log_crc(const unsigned char *record, unsigned size) {
+    return (unsigned)(w25q_crc32_update(w25q_crc32_update(0, record, 2), &record[W25Q_LOG_RECORD_HEADER], size) & 0xffff);
+}
+
+/**
+ * @brief Check the record at an offset of a page
+ * 
+ * @return Record size with its header, 0 when blank or damaged
+*/
+static unsigned w25q_log_check(const unsigned char *page, unsigned offset) {
+
+    const unsigned char *p = &page[offset];
+    unsigned size;
+
+    if (offset + W25Q_LOG_RECORD_HEADER > 256) {
+        return 0;
+    }
+    size = p[0] | (p[1] << 8);
+    if (size == 0 || size > W25Q_LOG_MAX_RECORD || offset + W25Q_LOG_RECORD_HEADER + size > 256 ||
+        (unsigned)(p[2] | (p[3] << 8)) != w25q_log_crc(p, size)) {
+        return 0;
+    }
+    return W25Q_LOG_RECORD_HEADER + size;
+
+}
+
+/**
+ * @brief Sequence number of a sector holding records, 0 otherwise
+ * 
+ * @param[out] formatted Set when the sector is erased with a header and holds no records
+*/
+static unsigned long w25q_log_key(struct w25q_log *log, unsigned sector, unsigned char *formatted) {
+
+    unsigned char header[8];
+    unsigned long seq;
+
+    if (!w25q_read(log->flash, w25q_log_address(log, sector, 0), header, sizeof(header))) {
+        return 0;
+    }
+    seq = w25q_get_le32(&header[4]);
+    if (formatted != NULL) {
+        *formatted = w25q_get_le32(header) == W25Q_LOG_MAGIC && seq == 0xffffffffUL;
+    }
+    if (w25q_get_le32(header) != W25Q_LOG_MAGIC || seq == 0xffffffffUL) {
+        return 0;
+    }
+    return seq;
+
+}
+
+/**
+ * @brief Last sector of [first, last] whose key is at least the key of first
+*/
+static unsigned w25q_log_search(struct w25q_log *log, unsigned first, unsigned last) {
+
+    unsigned long key = w25q_log_key(log, first, NULL);
+
+    while (first < last) {
+        unsigned middle = first + (last - first + 1) / 2;
+
+        if (w25q_log_key(log, middle, NULL) >= key) {
+            first = middle;
+        } else {
+            last = middle - 1;
+        }
+    }
+    return first;
+
+}
+
+/**
+ * @brief Read a page, from the staging ring when it is there
+*/
+static unsigned char w25q_log_read_page(struct w25q_log *log, unsigned address, unsigned char *buffer) {
+
+    for (unsigned i = 0; i < log->stage_count; i++) {
+        unsigned slot = (log->stage_first + i) % log->stage_pages;
+
+        if (log->stage[slot].address == address) {
+            memcpy(buffer, &log->stage_data[slot * 256], 256);
+            return 1;
+        }
+    }
+    return w25q_read(log->flash, address, buffer, 256);
+
+}
+
+static void w25q_log_erase_done(struct w25q_flash *flash, unsigned char result, void *context) {
+
+    (void)flash;
+    ((struct w25q_log *)context)->erase_result = result;
+
+}
+
+/**
+ * @brief Write the header of a finished background erase
+*/
+static void w25q_log_settle(struct w25q_log *log) {
+
+    unsigned char magic[4];
+
+    if (log->erasing == W25Q_LOG_NONE || log->erase_result == W25Q_LOG_ERASE_PENDING) {
+        return;
+    }
+    w25q_put_le32(magic, W25Q_LOG_MAGIC);
+    if (log->erase_result && w25q_write(log->flash, w25q_log_address(log, log->erasing, 0), magic, sizeof(magic))) {
+        log->ready++;
+    }
+    log->erasing = W25Q_LOG_NONE;
+
+}
+
+/**
+ * @brief Start erasing the next sector past the ready ones
+*/
+static void w25q_log_erase_ahead(struct w25q_log *log) {
+
+    unsigned sector = (log->head + log->ready + 1) % log->sectors;
+    unsigned address = w25q_log_address(log, sector, 0);
+
+    w25q_log_settle(log);
+    if (log->erasing != W25Q_LOG_NONE || log->ready >= log->erase_ahead || sector == log->head) {
+        return;
+    }
+    // The oldest records go first
+    if (sector == log->tail) {
+        log->tail = (sector + 1) % log->sectors;
+    }
+    log->erase_result = W25Q_LOG_ERASE_PENDING;
+    log->erasing = sector;
+    if (!w25q_submit_erase(log->flash, address, address + 4096, w25q_log_erase_done, log)) {
+        log->erasing = W25Q_LOG_NONE;
+    }
+
+}
+
+/**
+ * @brief Program the oldest staged page and drop it unless it is the last, partial one
+ * 
+ * @param[in] retire Drop it in any case, the head has moved to another page
+*/
+static unsigned char w25q_log_program(struct w25q_log *log, unsigned char retire) {
+
+    struct w25q_log_stage *stage = &log->stage[log->stage_first];
+    unsigned char *data = &log->stage_data[log->stage_first * 256];
+
+    if (stage->fill > stage->programmed) {
+        if (!w25q_write(log->flash, stage->address + stage->programmed, &data[stage->programmed],
+                        stage->fill - stage->programmed)) {
+            return 0;
+        }
+        stage->programmed = stage->fill;
+    }
+    if (retire || log->stage_count > 1 || stage->fill == 256) {
+        log->stage_first = (log->stage_first + 1) % log->stage_pages;
+        log->stage_count--;
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Program the staged pages that are complete, while no erase runs
+*/
+static unsigned char w25q_log_pump(struct w25q_log *log) {
+
+    w25q_log_settle(log);
+    while (log->stage_count > 0 && log->erasing == W25Q_LOG_NONE &&
+           (log->stage_count > 1 || log->stage[log->stage_first].fill == 256)) {
+        if (!w25q_log_program(log, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+
+}
+
+/**
+ * @brief Move the head to the next erased sector
+*/
+static unsigned char w25q_log_advance(struct w25q_log *log) {
+
+    w25q_log_settle(log);
+    if (log->ready == 0) {
+        log->erase_waits++;
+        if (log->erasing == W25Q_LOG_NONE) {
+            w25q_log_erase_ahead(log);
+        }
+        if (log->erasing != W25Q_LOG_NONE) {
+            w25q_finish(log->flash);
+            w25q_log_settle(log);
+        }
+        if (log->ready == 0) {
+            return 0;
+        }
+    }
+    log->head = (log->head + 1) % log->sectors;
+    log->head_offset = W25Q_LOG_FIRST_RECORD;
+    log->head_seq++;
+    log->ready--;
+    if (log->tail == W25Q_LOG_NONE) {
+        log->tail = log->head;
+    }
+    w25q_log_erase_ahead(log);
+    return 1;
+
+}
+
+/* Log functions */
+
+unsigned w25q_log_arena_size(unsigned pages) {
+    return pages * (sizeof(struct w25q_log_stage) + 256);
+}
+
+unsigned char w25q_log_mount(struct w25q_log *log, struct w25q_flash *flash, unsigned first_sector,
+                             unsigned sectors, unsigned erase_ahead, void *arena, unsigned arena_size) {
+
+    unsigned char page[256];
+    unsigned long key;
+    unsigned first, last = 0, offset;
+
+    if (log == NULL || flash == NULL || arena == NULL || erase_ahead == 0 || sectors < erase_ahead + 2 ||
+        (unsigned long)(first_sector + sectors) * 16 > flash->size || arena_size < w25q_log_arena_size(1)) {
+        return 0;
+    }
+
+    memset(log, 0, sizeof(*log));
+    log->flash = flash;
+    log->first_sector = first_sector;
+    log->sectors = sectors;
+    log->erase_ahead = erase_ahead;
+    log->stage_pages = arena_size / (sizeof(struct w25q_log_stage) + 256);
+    log->stage = (struct w25q_log_stage *)arena;
+    log->stage_data = (unsigned char *)arena + log->stage_pages * sizeof(struct w25q_log_stage);
+    log->erasing = W25Q_LOG_NONE;
+    log->tail = W25Q_LOG_NONE;
+
+    // Sectors are used in order, so keys rise from the tail to the head and wrap once, with the
+    // erased sectors in between. When sector 0 holds records the head is the last sector keyed at
+    // least as high, otherwise the records start after the erased sectors around sector 0.
+    key = w25q_log_key(log, 0, NULL);
+    if (key != 0) {
+        last = w25q_log_search(log, 0, sectors - 1);
+        log->tail = 0;
+        for (unsigned i = last + 1; i < sectors && i <= last + erase_ahead + 2; i++) {
+            if (w25q_log_key(log, i, NULL) != 0) {
+                log->tail = i;
+                break;
+            }
+        }
+    } else {
+        for (first = 1; first < sectors && w25q_log_key(log, first, NULL) == 0; first++) {
+        }
+        if (first < sectors) {
+            last = w25q_log_search(log, first, sectors - 1);
+            log->tail = first;
+        }
+    }
+
+    if (log->tail == W25Q_LOG_NONE) {
+        // Empty, the first record opens sector 0
+        log->head = sectors - 1;
+        log->head_offset = 4096;
+    } else {
+        unsigned low = 0, high = 15;
+
+        log->head = last;
+        log->head_seq = w25q_log_key(log, last, NULL);
+        // Pages fill in order, find the last one holding records
+        while (low < high) {
+            unsigned middle = (low + high + 1) / 2;
+            unsigned char size[2];
+
+            if (!w25q_read(flash, w25q_log_address(log, last, middle * 256), size, sizeof(size))) {
+                return 0;
+            }
+            if (size[0] != 0xff || size[1] != 0xff) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+        if (!w25q_read(flash, w25q_log_address(log, last, low * 256), page, sizeof(page))) {
+            return 0;
+        }
+        offset = w25q_log_page_start(low * 256) - low * 256;
+        while (offset < 256) {
+            unsigned size = w25q_log_check(page, offset);
+
+            if (size == 0) {
+                break;
+            }
+            offset += size;
+        }
+        log->head_offset = low * 256 + offset;
+        if (offset + 2 <= 256 && (page[offset] != 0xff || page[offset + 1] != 0xff)) {
+            // Nothing is appended after a damaged record
+            log->head_offset = 4096;
+        }
+    }
+
+    for (unsigned i = 1; i <= erase_ahead; i++) {
+        unsigned sector = (log->head + i) % sectors;
+        unsigned char formatted = 0;
+
+        if (sector == log->tail) {
+            break;
+        }
+        w25q_log_key(log, sector, &formatted);
+        if (!formatted) {
+            break;
+        }
+        log->ready++;
+    }
+    return 1;
+
+}
+
+unsigned char w25q_log_append(struct w25q_log *log, const void *data, unsigned size) {
+
+    struct w25q_log_stage *stage = NULL;
+    unsigned char *record;
+    unsigned offset = log->head_offset;
+    unsigned address, crc;
+
+    if (size == 0 || size > W25Q_LOG_MAX_RECORD) {
+        return 0;
+    }
+    if ((offset & 255) + W25Q_LOG_RECORD_HEADER + size > 256) {
+        offset = (offset | 255) + 1;
+    }
+    if (offset + W25Q_LOG_RECORD_HEADER + size > 4096) {
+        if (!w25q_log_advance(log)) {
+            return 0;
+        }
+        offset = W25Q_LOG_FIRST_RECORD;
+    }
+
+    address = w25q_log_address(log, log->head, offset & ~255u);
+    if (log->stage_count > 0) {
+        stage = &log->stage[(log->stage_first + log->stage_count - 1) % log->stage_pages];
+        if (stage->address != address) {
+            stage = NULL;
+        }
+    }
+    if (stage == NULL) {
+        unsigned slot;
+
+        if (log->stage_count == log->stage_pages) {
+            // Ring full, this one may wait for the erase. The head is past the oldest page, even
+            // when it is the only one and partial
+            if (!w25q_log_program(log, 1)) {
+                return 0;
+            }
+        }
+        slot = (log->stage_first + log->stage_count) % log->stage_pages;
+        stage = &log->stage[slot];
+        stage->address = address;
+        stage->fill = (unsigned short)(offset & 255);
+        stage->programmed = 0;
+        memset(&log->stage_data[slot * 256], 0xff, 256);
+        if (offset != w25q_log_page_start(offset & ~255u)) {
+            // Reopened after a mount, the page already holds records
+            if (!w25q_read(log->flash, address, &log->stage_data[slot * 256], 256)) {
+                return 0;
+            }
+            stage->programmed = stage->fill;
+        } else if ((offset & ~255u) == 0) {
+            // The sequence number goes with the first records, the magic is already there
+            w25q_put_le32(&log->stage_data[slot * 256 + 4], log->head_seq);
+            stage->fill = W25Q_LOG_FIRST_RECORD;
+            stage->programmed = 4;
+        }
+        log->stage_count++;
+    }
+
+    record = &log->stage_data[(stage - log->stage) * 256 + (offset & 255)];
+    record[0] = size & 0xff;
+    record[1] = (size >> 8) & 0xff;
+    memcpy(&record[W25Q_LOG_RECORD_HEADER], data, size);
+    crc = w25q_log_crc(record, size);
+    record[2] = crc & 0xff;
+    record[3] = (crc >> 8) & 0xff;
+    stage->fill = (unsigned short)((offset & 255) + W25Q_LOG_RECORD_HEADER + size);
+    log->head_offset = offset + W25Q_LOG_RECORD_HEADER + size;
+    log->records++;
+    return w25q_log_pump(log);
+
+}
+
+unsigned char w25q_log_flush(struct w25q_log *log) {
+
+    while (log->stage_count > 0) {
+        unsigned count = log->stage_count;
+
+        if (!w25q_log_program(log, 0)) {
+            return 0;
+        }
+        if (log->stage_count == count) {
+            // Last page, partial and kept for the next records
+            break;
+        }
+    }
+    return 1;
+
+}
+
+unsigned char w25q_log_service(struct w25q_log *log) {
+
+    if (log->erasing != W25Q_LOG_NONE) {
+        w25q_poll(log->flash);
+    }
+    if (!w25q_log_pump(log)) {
+        return 0;
+    }
+    w25q_log_erase_ahead(log);
+    return log->erasing != W25Q_LOG_NONE ||
+           (log->stage_count > 0 && (log->stage_count > 1 || log->stage[log->stage_first].fill == 256));
+
+}
+
+void w25q_log_first(struct w25q_log *log, struct w25q_log_cursor *cursor) {
+
+    cursor->sector = log->tail;
+    cursor->offset = W25Q_LOG_FIRST_RECORD;
+    cursor->page = W25Q_LOG_NONE;
+    cursor->count = 0;
+    cursor->done = log->tail == W25Q_LOG_NONE;
+
+}
+
+void w25q_log_last(struct w25q_log *log, struct w25q_log_cursor *cursor) {
+
+    cursor->sector = log->head;
+    cursor->offset = ((log->head_offset - 1) & ~255u) + 256;
+    cursor->page = W25Q_LOG_NONE;
+    cursor->count = 0;
+    cursor->done = log->tail == W25Q_LOG_NONE;
+
+}
+
+unsigned char w25q_log_next(struct w25q_log *log, struct w25q_log_cursor *cursor, const void **data,
+                            unsigned *size) {
+
+    while (!cursor->done) {
+        unsigned page = cursor->offset & ~255u;
+        unsigned record = 0;
+
+        if (cursor->offset < 4096) {
+            if (page != cursor->page) {
+                if (!w25q_log_read_page(log, w25q_log_address(log, cursor->sector, page), cursor->buffer)) {
+                    cursor->done = 1;
+                    return 0;
+                }
+                cursor->page = page;
+            }
+            record = w25q_log_check(cursor->buffer, cursor->offset & 255);
+            if (record != 0) {
+                *data = &cursor->buffer[(cursor->offset & 255) + W25Q_LOG_RECORD_HEADER];
+                *size = record - W25Q_LOG_RECORD_HEADER;
+                cursor->offset += record;
+                return 1;
+            }
+            if (cursor->offset != w25q_log_page_start(page) && (cursor->offset & 255) + 2 <= 256 &&
+                cursor->buffer[cursor->offset & 255] == 0xff && cursor->buffer[(cursor->offset & 255) + 1] == 0xff) {
+                // Rest of the page unused
+                cursor->offset = page + 256;
+                continue;
+            }
+            if ((cursor->offset & 255) + 2 > 256) {
+                cursor->offset = page + 256;
+                continue;
+            }
+        }
+        // End of the sector, or a damaged record
+        if (cursor->sector == log->head) {
+            cursor->done = 1;
+            break;
+        }
+        cursor->sector = (cursor->sector + 1) % log->sectors;
+        cursor->offset = W25Q_LOG_FIRST_RECORD;
+        cursor->page = W25Q_LOG_NONE;
+    }
+    return 0;
+
+}
+
+unsigned char w25q_log_prev(struct w25q_log *log, struct w25q_log_cursor *cursor, const void **data,
+                            unsigned *size) {
+
+    while (!cursor->done) {
+        unsigned offset;
+
+        if (cursor->count > 0) {
+            unsigned record = cursor->offsets[--cursor->count];
+
+            *data = &cursor->buffer[record + W25Q_LOG_RECORD_HEADER];
+            *size = (cursor->buffer[record] | (cursor->buffer[record + 1] << 8));
+            return 1;
+        }
+        if (cursor->offset == 0) {
+            if (cursor->sector == log->tail) {
+                cursor->done = 1;
+                break;
+            }
+            cursor->sector = (cursor->sector + log->sectors - 1) % log->sectors;
+            cursor->offset = 4096;
+        }
+
+        // Load the previous page and list its records
+        cursor->offset -= 256;
+        cursor->page = cursor->offset;
+        if (!w25q_log_read_page(log, w25q_log_address(log, cursor->sector, cursor->page), cursor->buffer)) {
+            cursor->done = 1;
+            break;
+        }
+        offset = w25q_log_page_start(cursor->page) & 255;
+        while (cursor->count < sizeof(cursor->offsets)) {
+            unsigned record = w25q_log_check(cursor->buffer, offset);
+
+            if (record == 0) {
+                break;
+            }
+            cursor->offsets[cursor->count++] = (unsigned char)offset;
+            offset += record;
+        }
+    }
+    return 0;
+
+}
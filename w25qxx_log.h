@@ -0,0 +1,181 @@
+/*
+MIT License
+
+Copyright (c) 2024 Houchuan Dong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _W25QXX_LOG_H_
+#define _W25QXX_LOG_H_
+
+#include "w25qxx.h"
+
+/* Largest record, records never cross a page and the first page of a sector starts with the header */
+#define W25Q_LOG_MAX_RECORD 236
+
+/* Default number of erased sectors kept ahead of the head */
+#define W25Q_LOG_ERASE_AHEAD 1
+
+/* No sector */
+#define W25Q_LOG_NONE 0xffffffffu
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Page waiting in the staging buffer
+*/
+struct w25q_log_stage {
+    unsigned address;                   // Page address
+    unsigned short fill;                // Bytes of the page used
+    unsigned short programmed;          // Bytes of the page already programmed
+};
+
+/**
+ * @brief Circular record log over a range of sectors
+ * 
+ * Records are appended to page images in a staging ring and programmed a page at a time. Sectors
+ * are used in order and wrap around, each one carries the sequence number it was opened with. An
+ * asynchronous erase keeps erase_ahead sectors ready past the head, dropping the oldest sector of
+ * the log when it wraps, so appends do not wait for erases as long as the staging ring holds the
+ * records written while an erase runs.
+*/
+struct w25q_log {
+    struct w25q_flash *flash;
+    unsigned first_sector;
+    unsigned sectors;
+    unsigned erase_ahead;
+    struct w25q_log_stage *stage;       // Staging ring
+    unsigned char *stage_data;          // 256 bytes per staged page
+    unsigned stage_pages;
+    unsigned stage_first;
+    unsigned stage_count;
+    unsigned head;                      // Sector records are appended to
+    unsigned head_offset;               // Offset of the next record in the head sector
+    unsigned long head_seq;             // Sequence number of the head sector
+    unsigned tail;                      // Oldest sector holding records, W25Q_LOG_NONE when the log is empty
+    unsigned ready;                     // Erased sectors with a header right after the head
+    unsigned erasing;                   // Sector of the background erase, W25Q_LOG_NONE when idle
+    unsigned char erase_result;
+    unsigned long records;              // Records appended since mounting
+    unsigned long erase_waits;          // Appends that had to wait for an erase
+};
+
+/**
+ * @brief Position in the log, for w25q_log_next and w25q_log_prev
+ * 
+ * A cursor reads one page at a time into its own buffer.
+*/
+struct w25q_log_cursor {
+    unsigned sector;
+    unsigned offset;                    // Next record (forward), next page to load (reverse)
+    unsigned page;                      // Offset of the page in buffer, W25Q_LOG_NONE when none
+    unsigned char done;
+    unsigned char count;                // Records of the page not returned yet (reverse)
+    unsigned char offsets[52];          // Records of the page (reverse)
+    unsigned char buffer[256];
+};
+
+/**
+ * @brief RAM needed by w25q_log_mount for a staging ring of the given number of pages
+*/
+unsigned w25q_log_arena_size(unsigned pages);
+
+/**
+ * @brief Mount the log, finding the head and the tail by binary search over the sector headers
+ * 
+ * Reads O(log sectors) sector headers and O(log 16) pages of the head sector. A blank or foreign range
+ * mounts as an empty log and is erased as it fills.
+ * 
+ * @param[out] log Log instance
+ * @param[in] flash Mounted flash instance
+ * @param[in] first_sector First sector of the range
+ * @param[in] sectors Number of sectors, at least erase_ahead + 2
+ * @param[in] erase_ahead Erased sectors kept ahead of the head, at least 1
+ * @param[in] arena Memory for the staging ring, aligned for unsigned
+ * @param[in] arena_size Arena size in bytes, w25q_log_arena_size(pages) for at least 1 page
+ * 
+ * @return 1 on success, 0 on invalid parameters or read failure
+*/
+unsigned char w25q_log_mount(struct w25q_log *log, struct w25q_flash *flash, unsigned first_sector,
+                             unsigned sectors, unsigned erase_ahead, void *arena, unsigned arena_size);
+
+/**
+ * @brief Append a record
+ * 
+ * The record goes to the staging ring; full pages are programmed while no erase is running. It
+ * only blocks when the staging ring is full or no erased sector is ready.
+ * 
+ * @return 1 on success, 0 on invalid size or flash failure
+*/
+unsigned char w25q_log_append(struct w25q_log *log, const void *data, unsigned size);
+
+/**
+ * @brief Program every staged record, the last page included
+ * 
+ * @return 1 on success, 0 on flash failure
+*/
+unsigned char w25q_log_flush(struct w25q_log *log);
+
+/**
+ * @brief Program full staged pages and keep the erase ahead running, call it from the main loop
+ * 
+ * Never waits for an erase.
+ * 
+ * @return 1 while there is work left, 0 when idle
+*/
+unsigned char w25q_log_service(struct w25q_log *log);
+
+/**
+ * @brief Start a cursor at the oldest record
+*/
+void w25q_log_first(struct w25q_log *log, struct w25q_log_cursor *cursor);
+
+/**
+ * @brief Start a cursor at the newest record
+*/
+void w25q_log_last(struct w25q_log *log, struct w25q_log_cursor *cursor);
+
+/**
+ * @brief Next record, oldest to newest
+ * 
+ * @param[out] data Points to the record in the cursor buffer, valid until the next call
+ * @param[out] size Record size
+ * 
+ * @return 1 when a record was returned, 0 at the end of the log
+*/
+unsigned char w25q_log_next(struct w25q_log *log, struct w25q_log_cursor *cursor, const void **data,
+                            unsigned *size);
+
+/**
+ * @brief Previous record, newest to oldest
+ * 
+ * @return 1 when a record was returned, 0 at the start of the log
+*/
+unsigned char w25q_log_prev(struct w25q_log *log, struct w25q_log_cursor *cursor, const void **data,
+                            unsigned *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif